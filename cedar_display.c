@@ -100,6 +100,7 @@ vdpauSurfaceCedar glVDPAURegisterVideoSurfaceCedar (const void *vdpSurface)
    assert(vs->vdpNvState == VdpauNVState_Unregistered);
 
    vs->vdpNvState = VdpauNVState_Registered;
+   video_surface_touch(vs);
 
    nv->surface 		= (uint32_t)vdpSurface;
    nv->vdpNvState 	= VdpauNVState_Registered;
@@ -268,7 +269,8 @@ VdpStatus glVDPAUGetVideoFrameConfig(vdpauSurfaceCedar surface, struct videoFram
   config->addr[1] = (void*)cedarv_virt2phys(vs->dataU);
   config->align[0] = 32;
   config->align[1] = 16;
-  if( cedarv_isValid(vs->dataV))
+  /* dataV always points into the allocation, only YV12 content has a V plane */
+  if(vs->source_format == VDP_YCBCR_FORMAT_YV12)
   {
     config->addr[2] = (void*)cedarv_virt2phys(vs->dataV);
     config->align[2] = 16;
@@ -322,109 +324,29 @@ VdpStatus glVDPAUCreateSurfaceCedar(VdpChromaType chroma_type, VdpYCbCrFormat fo
   vs->chroma_type = chroma_type;
   vs->source_format = format;
   
-  vs->stride_width 	= (width + 63) & ~63;
-  vs->stride_height 	= (height + 63) & ~63;
-  vs->plane_size 	= vs->stride_width * vs->stride_height;
-  cedarv_setBufferInvalid(vs->dataY);
-  cedarv_setBufferInvalid(vs->dataU);
-  cedarv_setBufferInvalid(vs->dataV);
-  
-  switch (format)
+  switch (chroma_type)
   {
-    case VDP_YCBCR_FORMAT_NV12:
-      switch (chroma_type)
-      {
-        case VDP_CHROMA_TYPE_444:
-          //vs->data = cedarv_malloc(vs->plane_size * 3);
-          vs->dataY = cedarv_malloc(vs->plane_size);
-          vs->dataU = cedarv_malloc(vs->plane_size);
-          vs->dataV = cedarv_malloc(vs->plane_size);
-          if (! cedarv_isValid(vs->dataY) || ! cedarv_isValid(vs->dataU) || ! cedarv_isValid(vs->dataV))
-          {
-            printf("vdpau video surface=%d create, failure\n", *surface);
-    
-            handle_destroy(*surface);
-            return VDP_STATUS_RESOURCES;
-          }
-          break;
-        case VDP_CHROMA_TYPE_422:
-          //vs->data = cedarv_malloc(vs->plane_size * 2);
-          vs->dataY = cedarv_malloc(vs->plane_size);
-          vs->dataU = cedarv_malloc(vs->plane_size/2);
-          vs->dataV = cedarv_malloc(vs->plane_size/2);
-          if (! cedarv_isValid(vs->dataY) || ! cedarv_isValid(vs->dataU) || ! cedarv_isValid(vs->dataV))
-          {
-            printf("vdpau video surface=%d create, failure\n", *surface);
-    
-            handle_destroy(*surface);
-            return VDP_STATUS_RESOURCES;
-          }
-          break;
-        case VDP_CHROMA_TYPE_420:
-          //vs->data = cedarv_malloc(vs->plane_size + (vs->plane_size / 2));
-          vs->dataY = cedarv_malloc(vs->plane_size);
-          vs->dataU = cedarv_malloc(vs->plane_size/2);
-          if (! cedarv_isValid(vs->dataY) || ! cedarv_isValid(vs->dataU))
-          {
-            printf("vdpau video surface=%d create, failure\n", *surface);
-    
-            handle_destroy(*surface);
-            return VDP_STATUS_RESOURCES;
-          }
-          
-          break;
-        default:
-          free(vs);
-          return VDP_STATUS_INVALID_CHROMA_TYPE;
-      }
+    case VDP_CHROMA_TYPE_444:
+    case VDP_CHROMA_TYPE_422:
+    case VDP_CHROMA_TYPE_420:
       break;
-    case VDP_YCBCR_FORMAT_YV12:
-      switch (chroma_type)
-      {
-        case VDP_CHROMA_TYPE_444:
-          //vs->data = cedarv_malloc(vs->plane_size * 3);
-          vs->dataY = cedarv_malloc(vs->plane_size);
-          vs->dataU = cedarv_malloc(vs->plane_size);
-          vs->dataV = cedarv_malloc(vs->plane_size);
-          if (! cedarv_isValid(vs->dataY) || ! cedarv_isValid(vs->dataU) || ! cedarv_isValid(vs->dataV))
-          {
-            printf("vdpau video surface=%d create, failure\n", *surface);
-        
-            handle_destroy(*surface);
-            return VDP_STATUS_RESOURCES;
-          }
-          break;
-        case VDP_CHROMA_TYPE_422:
-              //vs->data = cedarv_malloc(vs->plane_size * 2);
-          vs->dataY = cedarv_malloc(vs->plane_size);
-          vs->dataU = cedarv_malloc(vs->plane_size/2);
-          vs->dataV = cedarv_malloc(vs->plane_size/2);
-          if (! cedarv_isValid(vs->dataY) || ! cedarv_isValid(vs->dataU) || ! cedarv_isValid(vs->dataV))
-          {
-            printf("vdpau video surface=%d create, failure\n", *surface);
-        
-            handle_destroy(*surface);
-            return VDP_STATUS_RESOURCES;
-          }
-          break;
-        case VDP_CHROMA_TYPE_420:
-              //vs->data = cedarv_malloc(vs->plane_size + (vs->plane_size / 2));
-          vs->dataY = cedarv_malloc(vs->plane_size);
-          vs->dataU = cedarv_malloc(vs->plane_size/2);
-          vs->dataV = cedarv_malloc(vs->plane_size/2);
-          if (! cedarv_isValid(vs->dataY) || ! cedarv_isValid(vs->dataU) || ! cedarv_isValid(vs->dataV))
-          {
-            printf("vdpau video surface=%d create, failure\n", *surface);
-        
-            handle_destroy(*surface);
-            return VDP_STATUS_RESOURCES;
-          }
-              
-          break;
-        default:
-          free(vs);
-          return VDP_STATUS_INVALID_CHROMA_TYPE;
-      }
+    default:
+      handle_destroy(*surface);
+      return VDP_STATUS_INVALID_CHROMA_TYPE;
+  }
+
+  if (format == VDP_YCBCR_FORMAT_NV12 || format == VDP_YCBCR_FORMAT_YV12)
+  {
+    /* the application writes through the plane pointers, so allocate now and keep it */
+    if (!video_surface_memory_init(vs) || !video_surface_touch(vs))
+    {
+      printf("vdpau video surface=%d create, failure\n", *surface);
+
+      video_surface_memory_free(vs);
+      handle_destroy(*surface);
+      return VDP_STATUS_RESOURCES;
+    }
+    video_surface_ref(vs);
   }
   return VDP_STATUS_OK;
 }
@@ -439,16 +361,7 @@ VdpStatus glVDPAUDestroySurfaceCedar(vdpauSurfaceCedar surface)
 
   if (vs->decoder_private_free)
     vs->decoder_private_free(vs);
-  if( cedarv_isValid(vs->dataY) )
-    cedarv_free(vs->dataY);
-  if( cedarv_isValid(vs->dataU) )
-    cedarv_free(vs->dataU);
-  if (cedarv_isValid(vs->dataV) )
-    cedarv_free(vs->dataV);
-
-  cedarv_setBufferInvalid(vs->dataY);
-  cedarv_setBufferInvalid(vs->dataU);
-  cedarv_setBufferInvalid(vs->dataV);
+  video_surface_memory_free(vs);
         
   VDPAU_DBG("vdpau video surface=%d destroyed", surface);
         
@@ -485,7 +398,7 @@ VdpStatus glVDPAUGetMappedMemoryCedar(vdpauSurfaceCedar surface, void** addrY, v
 
   *addrY = (void*)cedarv_getPointer(vs->dataY);
   *addrU = (void*)cedarv_getPointer(vs->dataU);
-  if( cedarv_isValid(vs->dataV))
+  if(vs->source_format == VDP_YCBCR_FORMAT_YV12)
     *addrV = (void*)cedarv_getPointer(vs->dataV);
   else
     *addrV = NULL;
@@ -496,6 +409,135 @@ VdpStatus glVDPAUGetMappedMemoryCedar(vdpauSurfaceCedar surface, void** addrY, v
   return VDP_STATUS_OK;
 }
 
+#define FOURCC(a, b, c, d) ((uint32_t)(a) | ((uint32_t)(b) << 8) | ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+
+VdpStatus glVDPAUExportSurfaceCedar(vdpauSurfaceCedar surface, struct videoFrameDmaBuf *frame)
+{
+  VdpStatus status = VDP_STATUS_OK;
+  vdpauSurfaceCedar videoSurface = surface;
+  uint32_t base;
+  int i;
+
+  if(! frame)
+    return VDP_STATUS_INVALID_POINTER;
+
+  if(handle_get_type(surface) == htype_display_vdpau)
+  {
+    surface_display_ctx_t *nv = handle_get(surface);
+    if(! nv)
+      return VDP_STATUS_INVALID_HANDLE;
+    videoSurface = nv->surface;
+    handle_release(surface);
+  }
+
+  if(handle_get_type(videoSurface) != htype_video)
+    return VDP_STATUS_INVALID_HANDLE;
+
+  video_surface_ctx_t *vs = handle_get(videoSurface);
+  if(! vs)
+    return VDP_STATUS_INVALID_HANDLE;
+
+  /* the importer reads the frame as soon as it gets the fd */
+  video_surface_wait_decode(vs);
+  if(! video_surface_touch(vs))
+  {
+    handle_release(videoSurface);
+    return VDP_STATUS_RESOURCES;
+  }
+  cedarv_flush_cache(vs->data, vs->memory_size);
+
+  memset(frame, 0, sizeof(*frame));
+  frame->fd = -1;
+  frame->width = vs->width;
+  frame->height = vs->height;
+  frame->modifier = CEDAR_FORMAT_MOD_LINEAR;
+
+  switch(vs->source_format)
+  {
+    case INTERNAL_YCBCR_FORMAT:
+      if(vs->chroma_type != VDP_CHROMA_TYPE_420)
+      {
+        status = VDP_STATUS_INVALID_CHROMA_TYPE;
+        goto out;
+      }
+      frame->fourcc = FOURCC('N', 'V', '1', '2');
+      frame->modifier = CEDAR_FORMAT_MOD_ALLWINNER_TILED;
+      frame->numPlanes = 2;
+      frame->offset[1] = vs->offset_u;
+      break;
+    case VDP_YCBCR_FORMAT_NV12:
+      frame->fourcc = FOURCC('N', 'V', '1', '2');
+      frame->numPlanes = 2;
+      frame->offset[1] = vs->offset_u;
+      break;
+    case VDP_YCBCR_FORMAT_YV12:
+      /* Y, V, U like the VDPAU plane order */
+      frame->fourcc = FOURCC('Y', 'V', '1', '2');
+      frame->numPlanes = 3;
+      frame->offset[1] = vs->offset_v;
+      frame->offset[2] = vs->offset_u;
+      break;
+    case VDP_YCBCR_FORMAT_YUYV:
+    case VDP_YCBCR_FORMAT_UYVY:
+      if(vs->source_format == VDP_YCBCR_FORMAT_YUYV)
+        frame->fourcc = FOURCC('Y', 'U', 'Y', 'V');
+      else
+        frame->fourcc = FOURCC('U', 'Y', 'V', 'Y');
+      frame->numPlanes = 1;
+      break;
+    default:
+      status = VDP_STATUS_INVALID_Y_CB_CR_FORMAT;
+      goto out;
+  }
+
+  /* the pitches the frame was written with, see video_surface_pitch() */
+  frame->pitch[0] = video_surface_pitch(vs, vs->source_format, 0);
+  frame->pitch[1] = video_surface_pitch(vs, vs->source_format, 1);
+  frame->pitch[2] = video_surface_pitch(vs, vs->source_format, 2);
+
+  frame->fd = cedarv_export_dmabuf(vs->data, &base);
+  if(frame->fd < 0)
+  {
+    status = VDP_STATUS_ERROR;
+    goto out;
+  }
+
+  for(i = 0; i < frame->numPlanes; i++)
+    frame->offset[i] += base;
+
+  video_surface_hold_export(vs);
+
+out:
+  handle_release(videoSurface);
+  return status;
+}
+
+VdpStatus glVDPAUReleaseExportCedar(vdpauSurfaceCedar surface)
+{
+  vdpauSurfaceCedar videoSurface = surface;
+
+  if(handle_get_type(surface) == htype_display_vdpau)
+  {
+    surface_display_ctx_t *nv = handle_get(surface);
+    if(! nv)
+      return VDP_STATUS_INVALID_HANDLE;
+    videoSurface = nv->surface;
+    handle_release(surface);
+  }
+
+  if(handle_get_type(videoSurface) != htype_video)
+    return VDP_STATUS_INVALID_HANDLE;
+
+  video_surface_ctx_t *vs = handle_get(videoSurface);
+  if(! vs)
+    return VDP_STATUS_INVALID_HANDLE;
+
+  video_surface_release_export(vs);
+
+  handle_release(videoSurface);
+  return VDP_STATUS_OK;
+}
+
 #if DEBUG_IMAGE_DATA == 1
 static void writeBuffers(void* dataY, size_t szDataY, void* dataU, size_t szDataU, int h, int w)
 {
@@ -137,6 +137,7 @@ VdpStatus vdp_decoder_destroy(VdpDecoder decoder)
     if (dec->private_free)
         dec->private_free(dec);
 
+    video_surface_forget_decoder(dec);
     cedarv_free(dec->data);
     cedarv_freeEngine();
 
@@ -166,6 +167,21 @@ VdpStatus vdp_decoder_get_parameters(VdpDecoder decoder, VdpDecoderProfile *prof
     return VDP_STATUS_OK;
 }
 
+/* allocates the memory of a reference frame, 0 if that failed */
+int decoder_touch_reference(VdpVideoSurface surface)
+{
+    if (surface == VDP_INVALID_HANDLE)
+        return 1;
+
+    video_surface_ctx_t *vs = handle_get(surface);
+    if (!vs)
+        return 1;
+
+    int ret = video_surface_touch(vs);
+    handle_release(surface);
+    return ret;
+}
+
 VdpStatus vdp_decoder_render(VdpDecoder decoder, VdpVideoSurface target, VdpPictureInfo const *picture_info, uint32_t bitstream_buffer_count, VdpBitstreamBuffer const *bitstream_buffers)
 {
     VdpStatus status = VDP_STATUS_INVALID_HANDLE;
@@ -180,7 +196,17 @@ VdpStatus vdp_decoder_render(VdpDecoder decoder, VdpVideoSurface target, VdpPict
         return VDP_STATUS_INVALID_HANDLE;
     }
 
+    video_surface_begin_decode(vid);
+    if (!video_surface_touch(vid))
+    {
+        video_surface_end_decode(vid);
+        handle_release(target);
+        handle_release(decoder);
+        return VDP_STATUS_RESOURCES;
+    }
     vid->source_format = INTERNAL_YCBCR_FORMAT;
+    vid->linear_valid = 0;
+    video_surface_set_decoder(vid, dec);
     unsigned int i, pos = 0;
 
     for (i = 0; i < bitstream_buffer_count; i++)
@@ -204,6 +230,7 @@ VdpStatus vdp_decoder_render(VdpDecoder decoder, VdpVideoSurface target, VdpPict
       printf("codec decode, longer than 10ms:%lld, pics=%ld, longs=%ld\n", tv2-tv, num_pics, ++num_longs);
     }
 #endif
+    video_surface_end_decode(vid);
 
     handle_release(target);
     handle_release(decoder);
@@ -0,0 +1,281 @@
+#include <stdlib.h>
+#include <string.h>
+#include "deinterlace.h"
+#include "detile.h"
+#include "threadpool.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
+
+#define TILE_SIZE 32
+#define TILE_BYTES (TILE_SIZE * TILE_SIZE)
+
+/* lines per job, a tile row for tiled frames */
+#define BAND_ROWS 32
+
+/* scratch lines are padded by replicating the edge pixels */
+#define PAD 16
+
+struct plane
+{
+	uint8_t *dst;
+	const uint8_t *cur, *prev, *next, *prev2;
+	int width;
+	/* line length of linear frames */
+	int pitch;
+	int lines;
+	/* distance between horizontally neighbouring samples, 2 for UV */
+	int ps;
+};
+
+struct deint_job
+{
+	struct plane plane[2];
+	int luma_bands;
+	int tiled;
+	int bottom;
+	int spatial;
+};
+
+static int tiled_offset(int width, int y)
+{
+	int row_bytes = ((width + TILE_SIZE - 1) / TILE_SIZE) * TILE_BYTES;
+	return (y / TILE_SIZE) * row_bytes + (y % TILE_SIZE) * TILE_SIZE;
+}
+
+static void load_line(uint8_t *row, const struct plane *p, const uint8_t *src, int y, int tiled)
+{
+	int i;
+
+	if (tiled)
+		cedarv_detile_line(row, src, p->width, y);
+	else
+		memcpy(row, src + y * p->pitch, p->width);
+
+	for (i = 1; i <= PAD; i++)
+	{
+		row[-i] = row[-i + p->ps];
+		row[p->width - 1 + i] = row[p->width - 1 + i - p->ps];
+	}
+}
+
+static void store_line(const struct plane *p, const uint8_t *row, int y, int tiled)
+{
+	int x;
+
+	if (!tiled)
+	{
+		memcpy(p->dst + y * p->pitch, row, p->width);
+		return;
+	}
+
+	uint8_t *dst = p->dst + tiled_offset(p->width, y);
+	for (x = 0; x < p->width; x += TILE_SIZE)
+		memcpy(dst + x * TILE_SIZE, row + x, p->width - x < TILE_SIZE ? p->width - x : TILE_SIZE);
+}
+
+static void copy_line(const struct plane *p, int y, int tiled)
+{
+	int x;
+
+	if (!tiled)
+	{
+		memcpy(p->dst + y * p->pitch, p->cur + y * p->pitch, p->width);
+		return;
+	}
+
+	int offset = tiled_offset(p->width, y);
+	for (x = 0; x < p->width; x += TILE_SIZE)
+		memcpy(p->dst + offset + x * TILE_SIZE, p->cur + offset + x * TILE_SIZE, TILE_SIZE);
+}
+
+static inline int absdiff(int a, int b)
+{
+	return a > b ? a - b : b - a;
+}
+
+/*
+ * One missing line. The spatial prediction picks the direction with the
+ * smallest difference between the line above and below, the result is
+ * limited to the temporal prediction +- the motion around the pixel.
+ * prev == NULL means there is no temporal information at all.
+ */
+static void deint_row(uint8_t *out, const uint8_t *up, const uint8_t *down, const uint8_t *prev, const uint8_t *next,
+                      const uint8_t *p2up, const uint8_t *p2down, int n, int ps, int spatial)
+{
+	int x = 0;
+
+#ifdef HAVE_NEON
+	for (; x + 16 <= n; x += 16)
+	{
+		uint8x16_t u = vld1q_u8(up + x), dn = vld1q_u8(down + x);
+		uint8x16_t best = vabdq_u8(u, dn), s = vrhaddq_u8(u, dn);
+
+		if (spatial)
+		{
+			uint8x16_t a = vld1q_u8(up + x - ps), b = vld1q_u8(down + x + ps);
+			uint8x16_t c = vabdq_u8(a, b);
+			uint8x16_t m = vcltq_u8(c, best);
+			best = vbslq_u8(m, c, best);
+			s = vbslq_u8(m, vrhaddq_u8(a, b), s);
+
+			a = vld1q_u8(up + x + ps);
+			b = vld1q_u8(down + x - ps);
+			m = vcltq_u8(vabdq_u8(a, b), best);
+			s = vbslq_u8(m, vrhaddq_u8(a, b), s);
+		}
+
+		if (prev)
+		{
+			uint8x16_t p = vld1q_u8(prev + x), nx = vld1q_u8(next + x);
+			uint8x16_t t = vrhaddq_u8(p, nx);
+			uint8x16_t d = vshrq_n_u8(vabdq_u8(p, nx), 1);
+			d = vmaxq_u8(d, vhaddq_u8(vabdq_u8(u, vld1q_u8(p2up + x)), vabdq_u8(dn, vld1q_u8(p2down + x))));
+			s = vminq_u8(vmaxq_u8(s, vqsubq_u8(t, d)), vqaddq_u8(t, d));
+		}
+
+		vst1q_u8(out + x, s);
+	}
+#endif
+
+	for (; x < n; x++)
+	{
+		int best = absdiff(up[x], down[x]);
+		int s = (up[x] + down[x] + 1) >> 1;
+
+		if (spatial)
+		{
+			int c = absdiff(up[x - ps], down[x + ps]);
+			if (c < best)
+			{
+				best = c;
+				s = (up[x - ps] + down[x + ps] + 1) >> 1;
+			}
+
+			if (absdiff(up[x + ps], down[x - ps]) < best)
+				s = (up[x + ps] + down[x - ps] + 1) >> 1;
+		}
+
+		if (prev)
+		{
+			int t = (prev[x] + next[x] + 1) >> 1;
+			int d = absdiff(prev[x], next[x]) >> 1;
+			int d1 = (absdiff(up[x], p2up[x]) + absdiff(down[x], p2down[x])) >> 1;
+			if (d1 > d)
+				d = d1;
+
+			int lo = t - d < 0 ? 0 : t - d;
+			int hi = t + d > 255 ? 255 : t + d;
+			s = s < lo ? lo : s > hi ? hi : s;
+		}
+
+		out[x] = s;
+	}
+}
+
+static void deint_band(void *arg, int job)
+{
+	struct deint_job *j = arg;
+	const struct plane *p = job < j->luma_bands ? &j->plane[0] : &j->plane[1];
+	int band = job < j->luma_bands ? job : job - j->luma_bands;
+	int y, y0 = band * BAND_ROWS, y1 = y0 + BAND_ROWS < p->lines ? y0 + BAND_ROWS : p->lines;
+	int stride = ((p->width + TILE_SIZE - 1) & ~(TILE_SIZE - 1)) + 2 * PAD;
+	int last = -BAND_ROWS;
+
+	uint8_t *buf = malloc(7 * stride);
+	if (!buf)
+		return;
+
+	uint8_t *up = buf + PAD, *down = up + stride, *prev = down + stride, *next = prev + stride;
+	uint8_t *p2up = next + stride, *p2down = p2up + stride, *out = p2down + stride;
+
+	for (y = y0; y < y1; y++)
+	{
+		int yu = y > 0 ? y - 1 : y + 1;
+		int yd = y + 1 < p->lines ? y + 1 : y - 1;
+
+		if ((y & 1) == j->bottom || yu >= p->lines || yd < 0)
+		{
+			copy_line(p, y, j->tiled);
+			continue;
+		}
+
+		/* the line below the last missing one is the line above this one */
+		if (last == y - 2 && yu == y - 1)
+		{
+			uint8_t *tmp = up;
+			up = down;
+			down = tmp;
+			tmp = p2up;
+			p2up = p2down;
+			p2down = tmp;
+		}
+		else
+		{
+			load_line(up, p, p->cur, yu, j->tiled);
+			if (p->prev2)
+				load_line(p2up, p, p->prev2, yu, j->tiled);
+		}
+		load_line(down, p, p->cur, yd, j->tiled);
+		if (p->prev2)
+			load_line(p2down, p, p->prev2, yd, j->tiled);
+		last = y;
+
+		if (p->prev)
+		{
+			load_line(prev, p, p->prev, y, j->tiled);
+			load_line(next, p, p->next, y, j->tiled);
+		}
+
+		uint8_t *dst = j->tiled ? out : p->dst + y * p->pitch;
+		deint_row(dst, up, down, p->prev ? prev : NULL, next, p->prev2 ? p2up : up, p->prev2 ? p2down : down,
+		          p->width, p->ps, j->spatial);
+
+		if (j->tiled)
+			store_line(p, out, y, j->tiled);
+	}
+
+	free(buf);
+}
+
+void cedarv_deinterlace(uint8_t *dst_y, uint8_t *dst_uv, const struct cedarv_deint_frame *cur,
+                        const struct cedarv_deint_frame *prev, const struct cedarv_deint_frame *next,
+                        const struct cedarv_deint_frame *prev2, int width, int height, int pitch, int tiled,
+                        int bottom_field, int spatial)
+{
+	struct deint_job job;
+	int i;
+
+	if (width <= 0 || height <= 0)
+		return;
+
+	/* a single neighbour serves as both */
+	if (!prev)
+		prev = next;
+	if (!next)
+		next = prev;
+
+	for (i = 0; i < 2; i++)
+	{
+		struct plane *p = &job.plane[i];
+
+		p->dst = i ? dst_uv : dst_y;
+		p->cur = i ? cur->uv : cur->y;
+		p->prev = prev ? (i ? prev->uv : prev->y) : NULL;
+		p->next = next ? (i ? next->uv : next->y) : NULL;
+		p->prev2 = prev2 ? (i ? prev2->uv : prev2->y) : NULL;
+		p->width = i ? (width + 1) & ~1 : width;
+		p->pitch = pitch;
+		p->lines = i ? (height + 1) / 2 : height;
+		p->ps = i ? 2 : 1;
+	}
+
+	job.luma_bands = (height + BAND_ROWS - 1) / BAND_ROWS;
+	job.tiled = tiled;
+	job.bottom = bottom_field ? 1 : 0;
+	job.spatial = spatial;
+
+	threadpool_run(deint_band, &job, job.luma_bands + (job.plane[1].lines + BAND_ROWS - 1) / BAND_ROWS);
+}
@@ -0,0 +1,38 @@
+#ifndef _DEINTERLACE_H_
+#define _DEINTERLACE_H_
+
+#include <stdint.h>
+
+/*
+ * Motion adaptive deinterlacing of 4:2:0 frames. Lines of the field being
+ * shown are copied, lines of the other field are interpolated. Where the
+ * picture is still, the interpolation is temporal, i.e. the average of
+ * the missing line in the previous and next frame. Where it moves, a
+ * spatial prediction from the lines above and below is used; it is
+ * clamped around the temporal one by the local amount of motion, like
+ * yadif does.
+ *
+ * Frames are MB32 tiled or NV12, chroma lines belong to the fields the
+ * same way luma lines do.
+ */
+struct cedarv_deint_frame
+{
+	const uint8_t *y;
+	const uint8_t *uv;
+};
+
+/*
+ * Writes the progressive frame for the field of cur with the given parity
+ * (0 top, 1 bottom) to dst_y/dst_uv. prev and next hold the opposite field
+ * right before and after it, prev2 the same field before that; each may
+ * be NULL. pitch is the line length in bytes of NV12 frames, of all of
+ * them and of both planes; it is ignored for tiled ones. spatial enables
+ * edge directed (ELA) instead of plain vertical interpolation for moving
+ * areas.
+ */
+void cedarv_deinterlace(uint8_t *dst_y, uint8_t *dst_uv, const struct cedarv_deint_frame *cur,
+                        const struct cedarv_deint_frame *prev, const struct cedarv_deint_frame *next,
+                        const struct cedarv_deint_frame *prev2, int width, int height, int pitch, int tiled,
+                        int bottom_field, int spatial);
+
+#endif
@@ -0,0 +1,437 @@
+#include <stddef.h>
+#include <string.h>
+#include "detile.h"
+#include "threadpool.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+#define TILE_SIZE 32
+#define TILE_BYTES (TILE_SIZE * TILE_SIZE)
+
+/*
+ * The row functions handle one line through `tiles` complete tiles:
+ * src advances by a whole tile (1024 bytes) while dst advances by 32.
+ */
+struct detile_impl
+{
+	const char *name;
+	int (*supported)(void);
+	void (*copy)(uint8_t *dst, const uint8_t *src, int tiles);
+	void (*swap)(uint8_t *dst, const uint8_t *src, int tiles);
+	void (*split)(uint8_t *u, uint8_t *v, const uint8_t *src, int tiles);
+};
+
+static int always_supported(void)
+{
+	return 1;
+}
+
+static void scalar_copy(uint8_t *dst, const uint8_t *src, int tiles)
+{
+	for (; tiles > 0; tiles--, src += TILE_BYTES, dst += TILE_SIZE)
+		memcpy(dst, src, TILE_SIZE);
+}
+
+static void scalar_swap(uint8_t *dst, const uint8_t *src, int tiles)
+{
+	int i;
+	for (; tiles > 0; tiles--, src += TILE_BYTES, dst += TILE_SIZE)
+		for (i = 0; i < TILE_SIZE; i += 2)
+		{
+			dst[i] = src[i + 1];
+			dst[i + 1] = src[i];
+		}
+}
+
+static void scalar_split(uint8_t *u, uint8_t *v, const uint8_t *src, int tiles)
+{
+	int i;
+	for (; tiles > 0; tiles--, src += TILE_BYTES, u += TILE_SIZE / 2, v += TILE_SIZE / 2)
+		for (i = 0; i < TILE_SIZE / 2; i++)
+		{
+			u[i] = src[2 * i];
+			v[i] = src[2 * i + 1];
+		}
+}
+
+#ifdef HAVE_NEON
+static void neon_copy(uint8_t *dst, const uint8_t *src, int tiles)
+{
+	for (; tiles > 0; tiles--, src += TILE_BYTES, dst += TILE_SIZE)
+	{
+		uint8x16_t a = vld1q_u8(src);
+		uint8x16_t b = vld1q_u8(src + 16);
+		vst1q_u8(dst, a);
+		vst1q_u8(dst + 16, b);
+	}
+}
+
+static void neon_swap(uint8_t *dst, const uint8_t *src, int tiles)
+{
+	for (; tiles > 0; tiles--, src += TILE_BYTES, dst += TILE_SIZE)
+	{
+		uint8x16x2_t uv = vld2q_u8(src);
+		uint8x16x2_t vu = { { uv.val[1], uv.val[0] } };
+		vst2q_u8(dst, vu);
+	}
+}
+
+static void neon_split(uint8_t *u, uint8_t *v, const uint8_t *src, int tiles)
+{
+	for (; tiles > 0; tiles--, src += TILE_BYTES, u += TILE_SIZE / 2, v += TILE_SIZE / 2)
+	{
+		uint8x16x2_t uv = vld2q_u8(src);
+		vst1q_u8(u, uv.val[0]);
+		vst1q_u8(v, uv.val[1]);
+	}
+}
+#endif
+
+#ifdef HAVE_X86
+__attribute__((target("sse2")))
+static void sse2_copy(uint8_t *dst, const uint8_t *src, int tiles)
+{
+	for (; tiles > 0; tiles--, src += TILE_BYTES, dst += TILE_SIZE)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i *)src);
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+		_mm_storeu_si128((__m128i *)dst, a);
+		_mm_storeu_si128((__m128i *)(dst + 16), b);
+	}
+}
+
+__attribute__((target("sse2")))
+static void sse2_swap(uint8_t *dst, const uint8_t *src, int tiles)
+{
+	for (; tiles > 0; tiles--, src += TILE_BYTES, dst += TILE_SIZE)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i *)src);
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+		a = _mm_or_si128(_mm_slli_epi16(a, 8), _mm_srli_epi16(a, 8));
+		b = _mm_or_si128(_mm_slli_epi16(b, 8), _mm_srli_epi16(b, 8));
+		_mm_storeu_si128((__m128i *)dst, a);
+		_mm_storeu_si128((__m128i *)(dst + 16), b);
+	}
+}
+
+__attribute__((target("sse2")))
+static void sse2_split(uint8_t *u, uint8_t *v, const uint8_t *src, int tiles)
+{
+	const __m128i mask = _mm_set1_epi16(0x00ff);
+	for (; tiles > 0; tiles--, src += TILE_BYTES, u += TILE_SIZE / 2, v += TILE_SIZE / 2)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i *)src);
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+		_mm_storeu_si128((__m128i *)u, _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask)));
+		_mm_storeu_si128((__m128i *)v, _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+	}
+}
+
+static int sse2_supported(void)
+{
+	return __builtin_cpu_supports("sse2");
+}
+
+__attribute__((target("avx2")))
+static void avx2_copy(uint8_t *dst, const uint8_t *src, int tiles)
+{
+	for (; tiles > 0; tiles--, src += TILE_BYTES, dst += TILE_SIZE)
+		_mm256_storeu_si256((__m256i *)dst, _mm256_loadu_si256((const __m256i *)src));
+}
+
+__attribute__((target("avx2")))
+static void avx2_swap(uint8_t *dst, const uint8_t *src, int tiles)
+{
+	const __m256i shuf = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+	                                      1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	for (; tiles > 0; tiles--, src += TILE_BYTES, dst += TILE_SIZE)
+		_mm256_storeu_si256((__m256i *)dst, _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)src), shuf));
+}
+
+__attribute__((target("avx2")))
+static void avx2_split(uint8_t *u, uint8_t *v, const uint8_t *src, int tiles)
+{
+	const __m256i shuf = _mm256_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15,
+	                                      0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15);
+	for (; tiles > 0; tiles--, src += TILE_BYTES, u += TILE_SIZE / 2, v += TILE_SIZE / 2)
+	{
+		__m256i a = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)src), shuf);
+		a = _mm256_permute4x64_epi64(a, 0xd8);
+		_mm_storeu_si128((__m128i *)u, _mm256_castsi256_si128(a));
+		_mm_storeu_si128((__m128i *)v, _mm256_extracti128_si256(a, 1));
+	}
+}
+
+static int avx2_supported(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+#endif
+
+static const struct detile_impl impls[] =
+{
+#ifdef HAVE_X86
+	{ "avx2", avx2_supported, avx2_copy, avx2_swap, avx2_split },
+	{ "sse2", sse2_supported, sse2_copy, sse2_swap, sse2_split },
+#endif
+#ifdef HAVE_NEON
+	{ "neon", always_supported, neon_copy, neon_swap, neon_split },
+#endif
+	{ "scalar", always_supported, scalar_copy, scalar_swap, scalar_split },
+};
+
+#define NUM_IMPLS (int)(sizeof(impls) / sizeof(impls[0]))
+
+static const struct detile_impl *impl;
+
+int cedarv_detile_select(const char *name)
+{
+	int i;
+
+	for (i = 0; i < NUM_IMPLS; i++)
+	{
+		if (name && strcmp(name, impls[i].name))
+			continue;
+		if (!impls[i].supported())
+			continue;
+
+		impl = &impls[i];
+		return 1;
+	}
+
+	return 0;
+}
+
+const char *cedarv_detile_get_name(int index)
+{
+	if (index < 0 || index >= NUM_IMPLS)
+		return NULL;
+
+	return impls[index].name;
+}
+
+int cedarv_detile_is_supported(int index)
+{
+	if (index < 0 || index >= NUM_IMPLS)
+		return 0;
+
+	return impls[index].supported();
+}
+
+static const struct detile_impl *get_impl(void)
+{
+	if (!impl)
+		cedarv_detile_select(NULL);
+
+	return impl;
+}
+
+/* one line of a plane, including the partial tile at the right edge */
+static void detile_line(const struct detile_impl *f, enum cedarv_detile_format format,
+                        uint8_t *dst0, uint8_t *dst1, const uint8_t *src, int width)
+{
+	int tiles = width / TILE_SIZE;
+	int rest = width % TILE_SIZE;
+	const uint8_t *tail = src + tiles * TILE_BYTES;
+	int i;
+
+	switch (format)
+	{
+	case CEDARV_DETILE_NV12:
+		f->copy(dst0, src, tiles);
+		memcpy(dst0 + tiles * TILE_SIZE, tail, rest);
+		break;
+
+	case CEDARV_DETILE_NV21:
+		f->swap(dst0, src, tiles);
+		dst0 += tiles * TILE_SIZE;
+		for (i = 0; i + 1 < rest; i += 2)
+		{
+			dst0[i] = tail[i + 1];
+			dst0[i + 1] = tail[i];
+		}
+		break;
+
+	case CEDARV_DETILE_I420:
+	case CEDARV_DETILE_YV12:
+		f->split(dst0, dst1, src, tiles);
+		dst0 += tiles * TILE_SIZE / 2;
+		dst1 += tiles * TILE_SIZE / 2;
+		for (i = 0; i < rest / 2; i++)
+		{
+			dst0[i] = tail[2 * i];
+			dst1[i] = tail[2 * i + 1];
+		}
+		break;
+	}
+}
+
+struct detile_job
+{
+	const struct detile_impl *f;
+	enum cedarv_detile_format format;
+	uint8_t *dst[3];
+	int dst_pitch[3];
+	const uint8_t *src_y;
+	const uint8_t *src_c;
+	int width;
+	int height;
+	int chroma_width;
+	int chroma_height;
+	int chroma422;
+	int luma_rows;
+};
+
+/* job n < luma_rows is tile row n of the luma plane, the rest are chroma tile rows */
+static void detile_row(void *arg, int n)
+{
+	struct detile_job *job = arg;
+	int row_bytes = ((job->width + TILE_SIZE - 1) / TILE_SIZE) * TILE_BYTES;
+	int m;
+
+	if (n < job->luma_rows)
+	{
+		const uint8_t *src = job->src_y + n * row_bytes;
+		uint8_t *dst = job->dst[0] + n * TILE_SIZE * job->dst_pitch[0];
+
+		for (m = 0; m < TILE_SIZE && n * TILE_SIZE + m < job->height; m++)
+			detile_line(job->f, CEDARV_DETILE_NV12, dst + m * job->dst_pitch[0], NULL, src + m * TILE_SIZE, job->width);
+		return;
+	}
+
+	n -= job->luma_rows;
+
+	/* 422 chroma has full height, only every other line is used */
+	int step = job->chroma422 ? 2 : 1;
+	int lines = TILE_SIZE / step;
+	const uint8_t *src = job->src_c + n * row_bytes;
+	uint8_t *u, *v;
+
+	switch (job->format)
+	{
+	case CEDARV_DETILE_I420:
+		u = job->dst[1];
+		v = job->dst[2];
+		break;
+	case CEDARV_DETILE_YV12:
+		u = job->dst[2];
+		v = job->dst[1];
+		break;
+	default:
+		u = job->dst[1];
+		v = NULL;
+		break;
+	}
+
+	for (m = 0; m < lines && n * lines + m < job->chroma_height; m++)
+	{
+		int line = n * lines + m;
+		if (v)
+			detile_line(job->f, job->format, u + line * job->dst_pitch[1], v + line * job->dst_pitch[2],
+			            src + m * step * TILE_SIZE, job->chroma_width);
+		else
+			detile_line(job->f, job->format, u + line * job->dst_pitch[1], NULL,
+			            src + m * step * TILE_SIZE, job->chroma_width);
+	}
+}
+
+void cedarv_detile_frame(enum cedarv_detile_format format, uint8_t *const dst[3], const int dst_pitch[3],
+                         const uint8_t *src_y, const uint8_t *src_c, int width, int height, int chroma422)
+{
+	struct detile_job job;
+	int chroma_rows;
+
+	job.f = get_impl();
+	job.format = format;
+	job.dst[0] = dst[0];
+	job.dst[1] = dst[1];
+	job.dst[2] = (format == CEDARV_DETILE_I420 || format == CEDARV_DETILE_YV12) ? dst[2] : NULL;
+	job.dst_pitch[0] = dst_pitch[0];
+	job.dst_pitch[1] = dst_pitch[1];
+	job.dst_pitch[2] = job.dst[2] ? dst_pitch[2] : 0;
+	job.src_y = src_y;
+	job.src_c = src_c;
+	job.width = width;
+	job.height = height;
+	/* bytes of interleaved UV per line */
+	job.chroma_width = ((width + 1) / 2) * 2;
+	job.chroma_height = (height + 1) / 2;
+	job.chroma422 = chroma422;
+	job.luma_rows = src_y ? (height + TILE_SIZE - 1) / TILE_SIZE : 0;
+
+	if (chroma422)
+		chroma_rows = (job.chroma_height + TILE_SIZE / 2 - 1) / (TILE_SIZE / 2);
+	else
+		chroma_rows = (job.chroma_height + TILE_SIZE - 1) / TILE_SIZE;
+
+	threadpool_run(detile_row, &job, job.luma_rows + (src_c ? chroma_rows : 0));
+}
+
+void cedarv_detile_line(uint8_t *dst, const uint8_t *src, int width, int y)
+{
+	int row_bytes = ((width + TILE_SIZE - 1) / TILE_SIZE) * TILE_BYTES;
+
+	detile_line(get_impl(), CEDARV_DETILE_NV12, dst, NULL,
+	            src + (y / TILE_SIZE) * row_bytes + (y % TILE_SIZE) * TILE_SIZE, width);
+}
+
+/*
+ * Rows are copied in 64 byte blocks, which the write buffer turns into
+ * full bursts on uncached memory. The source is prefetched ahead and the
+ * stores bypass the cache where the architecture allows it.
+ */
+static void copy_row(uint8_t *dst, const uint8_t *src, int width)
+{
+#ifdef HAVE_NEON
+	for (; width >= 64; width -= 64, src += 64, dst += 64)
+	{
+		__builtin_prefetch(src + 256);
+#ifdef __aarch64__
+		uint8x16_t a = vld1q_u8(src);
+		uint8x16_t b = vld1q_u8(src + 16);
+		uint8x16_t c = vld1q_u8(src + 32);
+		uint8x16_t d = vld1q_u8(src + 48);
+		__asm__ volatile ("stnp %q1, %q2, [%0]\n\t"
+		                  "stnp %q3, %q4, [%0, #32]"
+		                  : : "r" (dst), "w" (a), "w" (b), "w" (c), "w" (d) : "memory");
+#else
+		uint8x16x4_t v = vld4q_u8(src);
+		vst4q_u8(dst, v);
+#endif
+	}
+#endif
+	memcpy(dst, src, width);
+}
+
+void cedarv_copy_plane(uint8_t *dst, int dst_pitch, const uint8_t *src, int src_pitch, int width, int height)
+{
+	int y;
+
+	if (dst_pitch == width && src_pitch == width)
+	{
+		memcpy(dst, src, width * height);
+		return;
+	}
+
+	for (y = 0; y < height; y++)
+		copy_row(dst + y * dst_pitch, src + y * src_pitch, width);
+}
+
+void cedarv_detile_plane(uint8_t *dst, int dst_pitch, const uint8_t *src, int width, int height)
+{
+	const struct detile_impl *f = get_impl();
+	int row_bytes = ((width + TILE_SIZE - 1) / TILE_SIZE) * TILE_BYTES;
+	int y;
+
+	for (y = 0; y < height; y++)
+		detile_line(f, CEDARV_DETILE_NV12, dst + y * dst_pitch, NULL,
+		            src + (y / TILE_SIZE) * row_bytes + (y % TILE_SIZE) * TILE_SIZE, width);
+}
@@ -0,0 +1,44 @@
+#ifndef _DETILE_H_
+#define _DETILE_H_
+
+#include <stdint.h>
+
+/*
+ * Conversion of the VE's 32x32 macroblock tiled (MB32) frames to linear
+ * layouts. Tiles are stored row by row, each tile is 32 lines of 32 bytes
+ * and a tile row spans ALIGN(width, 32) / 32 tiles. The chroma plane holds
+ * interleaved UV pairs and is tiled the same way.
+ *
+ * Plane order of dst[] follows VDPAU: NV12/NV21 use Y, UV; I420 uses
+ * Y, U, V and YV12 uses Y, V, U.
+ */
+enum cedarv_detile_format
+{
+	CEDARV_DETILE_NV12,
+	CEDARV_DETILE_NV21,
+	CEDARV_DETILE_YV12,
+	CEDARV_DETILE_I420,
+};
+
+/*
+ * width and height are the luma dimensions, 422 chroma is downsampled to 420.
+ * Either src_y or src_c may be NULL to convert only one plane.
+ */
+void cedarv_detile_frame(enum cedarv_detile_format format, uint8_t *const dst[3], const int dst_pitch[3],
+                         const uint8_t *src_y, const uint8_t *src_c, int width, int height, int chroma422);
+
+/* single plane, no worker threads; width is in bytes */
+void cedarv_detile_plane(uint8_t *dst, int dst_pitch, const uint8_t *src, int width, int height);
+
+/* line y of a tiled plane which is width bytes wide */
+void cedarv_detile_line(uint8_t *dst, const uint8_t *src, int width, int y);
+
+/* linear plane copy, a single memcpy if both pitches equal width */
+void cedarv_copy_plane(uint8_t *dst, int dst_pitch, const uint8_t *src, int src_pitch, int width, int height);
+
+/* select an implementation by name ("scalar", "neon", "sse2", "avx2"), NULL picks the fastest */
+int cedarv_detile_select(const char *name);
+const char *cedarv_detile_get_name(int index);
+int cedarv_detile_is_supported(int index);
+
+#endif
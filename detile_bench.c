@@ -0,0 +1,164 @@
+/*
+ * Throughput benchmark for the MB32 detilers.
+ *
+ *   detile_bench [width] [height] [iterations]
+ *
+ * Every implementation is first checked against a naive per-pixel
+ * conversion, then timed single-threaded and on the worker pool.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "detile.h"
+#include "threadpool.h"
+
+#define ALIGN(x, a) (((x) + ((a) - 1)) & ~((a) - 1))
+
+static const char *format_names[] = { "NV12", "NV21", "YV12", "I420" };
+
+static uint64_t get_time(void)
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (uint64_t)tp.tv_sec * 1000000000ULL + (uint64_t)tp.tv_nsec;
+}
+
+static int tiled_offset(int x, int y, int width)
+{
+	return ((y / 32) * (ALIGN(width, 32) / 32) + x / 32) * 1024 + (y % 32) * 32 + x % 32;
+}
+
+static void reference(enum cedarv_detile_format format, uint8_t *const dst[3], const int pitch[3],
+                      const uint8_t *src_y, const uint8_t *src_c, int width, int height)
+{
+	int x, y;
+
+	for (y = 0; y < height; y++)
+		for (x = 0; x < width; x++)
+			dst[0][y * pitch[0] + x] = src_y[tiled_offset(x, y, width)];
+
+	for (y = 0; y < (height + 1) / 2; y++)
+		for (x = 0; x < (width + 1) / 2; x++)
+		{
+			uint8_t u = src_c[tiled_offset(2 * x, y, width)];
+			uint8_t v = src_c[tiled_offset(2 * x + 1, y, width)];
+
+			switch (format)
+			{
+			case CEDARV_DETILE_NV12:
+				dst[1][y * pitch[1] + 2 * x] = u;
+				dst[1][y * pitch[1] + 2 * x + 1] = v;
+				break;
+			case CEDARV_DETILE_NV21:
+				dst[1][y * pitch[1] + 2 * x] = v;
+				dst[1][y * pitch[1] + 2 * x + 1] = u;
+				break;
+			case CEDARV_DETILE_YV12:
+				dst[2][y * pitch[2] + x] = u;
+				dst[1][y * pitch[1] + x] = v;
+				break;
+			case CEDARV_DETILE_I420:
+				dst[1][y * pitch[1] + x] = u;
+				dst[2][y * pitch[2] + x] = v;
+				break;
+			}
+		}
+}
+
+static void setup_pitch(enum cedarv_detile_format format, int width, int pitch[3])
+{
+	pitch[0] = ALIGN(width, 16);
+	if (format == CEDARV_DETILE_NV12 || format == CEDARV_DETILE_NV21)
+	{
+		pitch[1] = pitch[0];
+		pitch[2] = 0;
+	}
+	else
+	{
+		pitch[1] = ALIGN((width + 1) / 2, 16);
+		pitch[2] = pitch[1];
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int width = argc > 1 ? atoi(argv[1]) : 1920;
+	int height = argc > 2 ? atoi(argv[2]) : 1080;
+	int iterations = argc > 3 ? atoi(argv[3]) : 100;
+	int tiled_size = ALIGN(width, 32) * ALIGN(height, 32);
+	int frame_size = width * height + 2 * ((width + 1) / 2) * ((height + 1) / 2);
+	int threads = threadpool_get_threads();
+	int i, j, f, t, failed = 0;
+
+	uint8_t *src_y = aligned_alloc(64, tiled_size);
+	uint8_t *src_c = aligned_alloc(64, tiled_size);
+	uint8_t *out[3], *ref[3];
+
+	for (i = 0; i < 3; i++)
+	{
+		out[i] = aligned_alloc(64, ALIGN(width, 16) * ALIGN(height, 16));
+		ref[i] = aligned_alloc(64, ALIGN(width, 16) * ALIGN(height, 16));
+	}
+
+	srand(1);
+	for (i = 0; i < tiled_size; i++)
+	{
+		src_y[i] = rand();
+		src_c[i] = rand();
+	}
+
+	printf("%dx%d, %d iterations, %d threads\n", width, height, iterations, threads);
+
+	for (i = 0; cedarv_detile_get_name(i); i++)
+	{
+		if (!cedarv_detile_is_supported(i))
+		{
+			printf("%-8s not supported\n", cedarv_detile_get_name(i));
+			continue;
+		}
+		cedarv_detile_select(cedarv_detile_get_name(i));
+
+		for (f = CEDARV_DETILE_NV12; f <= CEDARV_DETILE_I420; f++)
+		{
+			int pitch[3];
+			setup_pitch(f, width, pitch);
+
+			for (j = 0; j < 3; j++)
+			{
+				memset(out[j], 0, ALIGN(width, 16) * ALIGN(height, 16));
+				memset(ref[j], 0, ALIGN(width, 16) * ALIGN(height, 16));
+			}
+
+			reference(f, ref, pitch, src_y, src_c, width, height);
+			cedarv_detile_frame(f, out, pitch, src_y, src_c, width, height, 0);
+
+			int ok = 1;
+			for (j = 0; j < 3; j++)
+				if (memcmp(out[j], ref[j], ALIGN(width, 16) * ALIGN(height, 16)))
+					ok = 0;
+			failed |= !ok;
+
+			printf("%-8s %s %s", cedarv_detile_get_name(i), format_names[f], ok ? "ok  " : "FAIL");
+
+			for (t = 1; t <= threads; t = (t == threads) ? t + 1 : threads)
+			{
+				threadpool_set_threads(t);
+
+				uint64_t start = get_time();
+				for (j = 0; j < iterations; j++)
+					cedarv_detile_frame(f, out, pitch, src_y, src_c, width, height, 0);
+				uint64_t ns = get_time() - start;
+
+				printf("  %d thread%s %6.2f GB/s", t, t > 1 ? "s" : " ",
+				       (double)frame_size * iterations / ns);
+			}
+			printf("\n");
+		}
+	}
+
+	return failed;
+}
@@ -19,6 +19,7 @@
 
 #include "vdpau_private.h"
 #include "ve.h"
+#include "rgba.h"
 #include <vdpau/vdpau_x11.h>
 #include <string.h>
 #include <sys/types.h>
@@ -40,9 +41,20 @@ VdpStatus vdp_imp_device_create_x11(Display *display, int screen, VdpDevice *dev
 	dev->display = display;
 	dev->screen = screen;
 
+	char *env_vdpau_osd = getenv("VDPAU_OSD");
+	if (env_vdpau_osd && strncmp(env_vdpau_osd, "1", 1) == 0)
+		dev->osd_enabled = 1;
+
+	if (!rgba_batch_init(dev))
+	{
+		handle_destroy(*device);
+		return VDP_STATUS_RESOURCES;
+	}
+
 	if (!cedarv_open())
 	{
 		VDPAU_DBG_ONCE("cedarv_open failed");
+		rgba_batch_free(dev);
 		handle_destroy(*device);
 		return VDP_STATUS_ERROR;
 	}
@@ -59,6 +71,7 @@ VdpStatus vdp_device_destroy(VdpDevice device)
 	if (!dev)
 		return VDP_STATUS_INVALID_HANDLE;
 
+	rgba_batch_free(dev);
 	cedarv_close();
 	//XCloseDisplay(dev->display);
 
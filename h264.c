@@ -788,6 +788,11 @@ static VdpStatus h264_decode(decoder_ctx_t *decoder, VdpPictureInfo const *_info
     h264_video_private_t *output_p;
 
         output->source_format = INTERNAL_YCBCR_FORMAT;
+
+	int i;
+	for (i = 0; i < 16; i++)
+		if (!decoder_touch_reference(info->referenceFrames[i].surface))
+			return VDP_STATUS_RESOURCES;
     
 	h264_context_t *c = calloc(1, sizeof(h264_context_t));
 	c->picture_width_in_mbs_minus1 = (decoder->width - 1) / 16;
@@ -860,7 +865,7 @@ static VdpStatus h264_decode(decoder_ctx_t *decoder, VdpPictureInfo const *_info
 
 	// sdctrl
 	writel(0x00000000, cedarv_regs + CEDARV_H264_SDROT_CTRL);
-    if (cedarv_get_version() >= 0x1680)
+    if (cedarv_has_linear_output())
 	{
 		writel(OUTPUT_FORMAT_NV12, cedarv_regs + CEDARV_OUTPUT_FORMAT);
 		output->source_format = VDP_YCBCR_FORMAT_NV12;
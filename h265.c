@@ -729,6 +729,11 @@ static VdpStatus h265_decode(decoder_ctx_t *decoder,
 	p->output = output;
 	memset(&p->slice, 0, sizeof(p->slice));
 
+	int i;
+	for (i = 0; i < 16; i++)
+		if (!decoder_touch_reference(p->info->RefPics[i]))
+			return VDP_STATUS_RESOURCES;
+
         p->regs = cedarv_get(CEDARV_ENGINE_HEVC, 0x0);
         output->source_format = VDP_YCBCR_FORMAT_NV12;
 
@@ -94,8 +94,9 @@ void *handle_get(VdpHandle handle)
         if (index >= 0 && index < ht.size && ht.data[index].refCnt > 0)
         {
 		data = ht.data[index].data;
+                /* only a read lock is held, other threads may get the handle too */
                 if(data)
-                    ht.data[index].refCnt++;
+                    __atomic_add_fetch(&ht.data[index].refCnt, 1, __ATOMIC_RELAXED);
         }
 
 	pthread_rwlock_unlock(&ht.lock);
@@ -38,6 +38,28 @@ extern "C"
     uint8_t   srcFormat;
   };
 
+  /* format modifiers, same values as the DRM ones */
+#define CEDAR_FORMAT_MOD_LINEAR           0ULL
+#define CEDAR_FORMAT_MOD_ALLWINNER_TILED  ((0x09ULL << 56) | 1)  /* 32x32 tiles */
+
+  /*
+   * All planes live in one dma-buf. fourcc is a DRM fourcc (NV12, YV12, YUYV
+   * or UYVY); decoded frames of older VEs are NV12 with the tiled modifier.
+   * The fd has to be closed by the caller. The surface memory stays in
+   * place until glVDPAUReleaseExportCedar() or the surface is destroyed.
+   */
+  struct videoFrameDmaBuf
+  {
+    uint32_t  width;
+    uint32_t  height;
+    uint32_t  fourcc;
+    uint64_t  modifier;
+    int       fd;
+    int       numPlanes;
+    uint32_t  offset[3];
+    uint32_t  pitch[3];
+  };
+
   void glVDPAUUnmapSurfacesCedar(GLsizei numSurfaces, const vdpauSurfaceCedar *surfaces);
   void glVDPAUInitCedar(const void *vdpDevice, const void *getProcAddress, void (*_Log)(int loglevel, const char *format, ...));
   void glVDPAUFiniCedar(void);
@@ -49,6 +71,8 @@ extern "C"
   void glVDPAUMapSurfacesCedar(GLsizei numSurfaces, const vdpauSurfaceCedar *surfaces);
   void glVDPAUUnmapSurfacesCedar(GLsizei numSurfaces, const vdpauSurfaceCedar *surfaces);
   VdpStatus glVDPAUGetVideoFrameConfig(vdpauSurfaceCedar surface, struct videoFrameConfig *config);
+  VdpStatus glVDPAUExportSurfaceCedar(vdpauSurfaceCedar surface, struct videoFrameDmaBuf *frame);
+  VdpStatus glVDPAUReleaseExportCedar(vdpauSurfaceCedar surface);
   VdpStatus glVDPAUCreateSurfaceCedar(VdpChromaType chroma_type, VdpYCbCrFormat format, uint32_t width, uint32_t height, vdpauSurfaceCedar *surface);
   VdpStatus glVDPAUDestroySurfaceCedar(vdpauSurfaceCedar surface);
 #ifdef __cplusplus
@@ -76,6 +76,10 @@ static VdpStatus mpeg12_decode(decoder_ctx_t *decoder, VdpPictureInfo const *_in
 
 	int i;
 
+	if (!decoder_touch_reference(info->forward_reference) ||
+	    !decoder_touch_reference(info->backward_reference))
+		return VDP_STATUS_RESOURCES;
+
 	// activate MPEG engine
 	void *cedarv_regs = cedarv_get(CEDARV_ENGINE_MPEG, 0);
 
@@ -115,8 +119,8 @@ static VdpStatus mpeg12_decode(decoder_ctx_t *decoder, VdpPictureInfo const *_in
 	writel(pic_header, cedarv_regs + CEDARV_MPEG_PIC_HDR);
 
 	// ??
-	writel(0x80000138 | ((cedarv_get_version() < 0x1680) << 7), cedarv_regs + CEDARV_MPEG_CTRL);
-        if (cedarv_get_version() >= 0x1680)
+	writel(0x80000138 | ((!cedarv_has_linear_output()) << 7), cedarv_regs + CEDARV_MPEG_CTRL);
+        if (cedarv_has_linear_output())
                 writel((0x1 << 30) | (0x1 << 28) , cedarv_regs + CEDARV_EXTRA_OUT_FMT_OFFSET);
 
 	// set forward/backward predicion buffers
@@ -147,7 +151,7 @@ static VdpStatus mpeg12_decode(decoder_ctx_t *decoder, VdpPictureInfo const *_in
 	writel(cedarv_virt2phys(output->dataY), cedarv_regs + CEDARV_MPEG_ROT_LUMA);
 	writel(cedarv_virt2phys(output->dataU)/* + output->plane_size*/, cedarv_regs + CEDARV_MPEG_ROT_CHROMA);
 
-        if(cedarv_get_version() >= 0x1680)
+        if(cedarv_has_linear_output())
         {
             writel(OUTPUT_FORMAT_NV12 | EXTRA_OUTPUT_FORMAT_NV12, cedarv_regs + CEDARV_OUTPUT_FORMAT);
             output->source_format = VDP_YCBCR_FORMAT_NV12;
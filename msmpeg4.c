@@ -308,6 +308,10 @@ int msmpeg4_decode(decoder_ctx_t *decoder, VdpPictureInfoMPEG4Part2 const *_info
     bitstream bs = { .data = cedarv_getPointer(decoder->data), .length = len, .bitpos = 0 };
 
     output->source_format = INTERNAL_YCBCR_FORMAT;
+
+    if (!decoder_touch_reference(info->forward_reference) ||
+        !decoder_touch_reference(info->backward_reference))
+            return VDP_STATUS_RESOURCES;
 		
     if (!decode_vop_header(&bs, info, decoder_p))
             return 0;
@@ -394,7 +398,7 @@ int msmpeg4_decode(decoder_ctx_t *decoder, VdpPictureInfoMPEG4Part2 const *_info
     writel(cedarv_virt2phys(output->dataY), cedarv_regs + CEDARV_MPEG_ROT_LUMA);
     writel(cedarv_virt2phys(output->dataU), cedarv_regs + CEDARV_MPEG_ROT_CHROMA);
 
-    if(cedarv_get_version() >= 0x1680)
+    if(cedarv_has_linear_output())
     {
        writel(OUTPUT_FORMAT_NV12 | EXTRA_OUTPUT_FORMAT_NV12, cedarv_regs + CEDARV_OUTPUT_FORMAT);
        writel((0x1 << 30) | (0x1 << 28), cedarv_regs + CEDARV_EXTRA_OUT_FMT_OFFSET);
@@ -435,7 +439,7 @@ int msmpeg4_decode(decoder_ctx_t *decoder, VdpPictureInfoMPEG4Part2 const *_info
     cedarv_control |= CEDARV_MPEG_CTRL_MVCS_FLD_HM(1);
     cedarv_control |= CEDARV_MPEG_CTRL_MC_CACHE_EN(1);
     cedarv_control |= CEDARV_MPEG_CTRL_WRITE_ROTATE_PIC(1);
-    cedarv_control |= CEDARV_MPEG_CTRL_NOT_WRITE_RECONS_FLAG((cedarv_get_version() < 0x1680));
+    cedarv_control |= CEDARV_MPEG_CTRL_NOT_WRITE_RECONS_FLAG(!cedarv_has_linear_output());
     cedarv_control |= CEDARV_MPEG_CTRL_OUTLOOP_DBLK_EN(1);
             
     if(info->quarter_sample)
@@ -60,8 +60,8 @@ enum col_plane
   uv_plane
 };
 
-static void createTexture2D(fbdev_pixmap *pm, surface_nv_ctx_t *nv, video_surface_ctx_t *vs, enum col_plane cp);
-static void createTextureRGB2D(fbdev_pixmap *pm, surface_nv_ctx_t *nv, output_surface_ctx_t *vs);
+static void initPixmap(fbdev_pixmap *pm, surface_nv_ctx_t *nv, video_surface_ctx_t *vs, enum col_plane cp);
+static void initPixmapRGB(fbdev_pixmap *pm, surface_nv_ctx_t *nv);
 
 void glVDPAUUnmapSurfacesNV(GLsizei numSurfaces, const vdpauSurfaceNV *surfaces);
 
@@ -168,6 +168,135 @@ void glVDPAUFiniNV(void)
    cedarv_disp_close();
 }
 
+static enum col_plane texturePlane(const surface_nv_ctx_t *nv, int i)
+{
+  if (i == 0 || i == 1)
+    return y_plane;
+  if (i == 2 || i == 3)
+    return nv->numTextureNames == 6 ? u_plane : uv_plane;
+  return v_plane;
+}
+
+static void destroyImages(surface_nv_ctx_t *nv)
+{
+  int i;
+
+  for(i = 0; i < nv->numTextureNames; i++)
+  {
+    if(nv->eglImage[i] == EGL_NO_IMAGE_KHR)
+      continue;
+    peglDestroyImageKHR(eglDisplay, nv->eglImage[i]);
+    nv->eglImage[i] = EGL_NO_IMAGE_KHR;
+    ump_reference_release(nv->cMemPixmap[i].data);
+  }
+}
+
+/*
+ * One EGLImage per texture on the conversion buffers. They stay bound to
+ * the textures until unregister or resize, mapping only refills the
+ * buffers.
+ */
+static int createImages(surface_nv_ctx_t *nv, video_surface_ctx_t *vs)
+{
+  const EGLint renderImageAttrs[] = {
+    EGL_IMAGE_PRESERVED_KHR, EGL_FALSE,
+    EGL_NONE
+  };
+  int i;
+
+  for(i = 0; i < nv->numTextureNames; i++)
+  {
+    if (nv->surfaceType == htype_video)
+      initPixmap(&nv->cMemPixmap[i], nv, vs, texturePlane(nv, i));
+    else
+      initPixmapRGB(&nv->cMemPixmap[i], nv);
+
+    nv->eglImage[i] = peglCreateImageKHR(eglDisplay,
+                                         EGL_NO_CONTEXT,
+                                         EGL_NATIVE_PIXMAP_KHR,
+                                         &nv->cMemPixmap[i],
+                                         renderImageAttrs);
+    if (nv->eglImage[i] == EGL_NO_IMAGE_KHR)
+    {
+      TestEGLError("eglCreateImageKHR");
+      ump_reference_release(nv->cMemPixmap[i].data);
+      destroyImages(nv);
+      return 0;
+    }
+
+    glBindTexture(GL_TEXTURE_2D, nv->textureNames[i]);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    pglEGLImageTargetTexture2DOES(GL_TEXTURE_2D, (GLeglImageOES)nv->eglImage[i]);
+  }
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  return 1;
+}
+
+static void freeConversion(surface_nv_ctx_t *nv)
+{
+  destroyImages(nv);
+
+  /* waits for a pending conversion */
+  cedarv_scaler_close(nv->scaler);
+  nv->scaler = NULL;
+  nv->conversion_pending = 0;
+  if( cedarv_isValid(nv->convY) )
+    cedarv_free(nv->convY);
+  if (cedarv_isValid(nv->convU) )
+    cedarv_free(nv->convU);
+  if (cedarv_isValid(nv->convV) )
+    cedarv_free(nv->convV);
+
+  cedarv_setBufferInvalid(&nv->convY);
+  cedarv_setBufferInvalid(&nv->convU);
+  cedarv_setBufferInvalid(&nv->convV);
+  nv->conv_width = 0;
+  nv->conv_height = 0;
+}
+
+/*
+ * Conversion buffers, scaler and images for a width x height source. Kept
+ * as they are while the size doesn't change, so this is cheap on map.
+ */
+static int setupConversion(surface_nv_ctx_t *nv, video_surface_ctx_t *vs, uint32_t width, uint32_t height)
+{
+  uint32_t conv_width = (width + 15) & ~15;
+  uint32_t conv_height = (height + 15) & ~15;
+  uint32_t size = conv_width * conv_height;
+
+  if (nv->conv_width == conv_width && nv->conv_height == conv_height)
+    return 1;
+
+  freeConversion(nv);
+
+  nv->conv_width = conv_width;
+  nv->conv_height = conv_height;
+  if (nv->surfaceType == htype_video)
+  {
+    nv->convY = cedarv_malloc(size);
+    nv->convU = cedarv_malloc(size / 4);
+    nv->convV = cedarv_malloc(size / 4);
+    nv->scaler = cedarv_scaler_open(CEDARV_SCALER_MB2YUV420, conv_width, conv_height);
+  }
+  else
+  {
+    nv->convY = cedarv_malloc(size * 3);
+    nv->scaler = cedarv_scaler_open(CEDARV_SCALER_MB2RGB, conv_width, conv_height);
+  }
+
+  if (! cedarv_isValid(nv->convY) ||
+      (nv->surfaceType == htype_video && (! cedarv_isValid(nv->convU) || ! cedarv_isValid(nv->convV))) ||
+      ! createImages(nv, vs))
+  {
+    freeConversion(nv);
+    return 0;
+  }
+
+  return 1;
+}
+
 vdpauSurfaceNV glVDPAURegisterVideoSurfaceNV (const void *vdpSurface, uint32_t target, 
 					    GLsizei numTextureNames, const uint *textureNames)
 {
@@ -191,27 +320,23 @@ vdpauSurfaceNV glVDPAURegisterVideoSurfaceNV (const void *vdpSurface, uint32_t t
    assert(vs->vdpNvState == VdpauNVState_Unregistered);
 
    vs->vdpNvState = VdpauNVState_Registered;
+   video_surface_touch(vs);
 
    nv->surface 		= (uint32_t)vdpSurface;
+   nv->surfaceType	= type;
    nv->vdpNvState 	= VdpauNVState_Registered;
    nv->target		= target;
    nv->numTextureNames 	= numTextureNames;
    memset(nv->textureNames, 0, sizeof(nv->textureNames));
    memcpy(nv->textureNames, textureNames, sizeof(uint) * numTextureNames);
 
-   nv->convY = cedarv_malloc(vs->plane_size);
-   nv->convU = cedarv_malloc(vs->plane_size/4);
-   nv->convV = cedarv_malloc(vs->plane_size/4);
-   nv->conv_width 	= (vs->width + 15) & ~15;
-   nv->conv_height	= (vs->height + 15) & ~15;
-
-   if (! cedarv_isValid(nv->convY) || ! cedarv_isValid(nv->convU) || ! cedarv_isValid(nv->convV))
+   if (! setupConversion(nv, vs, vs->width, vs->height))
    {
+      vs->vdpNvState = VdpauNVState_Unregistered;
       handle_release(nv->surface);
       handle_destroy(surfaceNV);
       return 0;
    }
-   nv->surfaceType = type;
    //handle_release(vdpSurface);
  
    return surfaceNV;
@@ -241,23 +366,20 @@ vdpauSurfaceNV glVDPAURegisterOutputSurfaceNV (const void *vdpSurface, uint32_t
   vs->vdpNvState = VdpauNVState_Registered;
 
   nv->surface 		= (uint32_t)vdpSurface;
+  nv->surfaceType	= type;
   nv->vdpNvState 	= VdpauNVState_Registered;
   nv->target		= target;
   nv->numTextureNames 	= numTextureNames;
   memset(nv->textureNames, 0, sizeof(nv->textureNames));
   memcpy(nv->textureNames, textureNames, sizeof(uint) * numTextureNames);
 
-  nv->convY = cedarv_malloc(vs->vs->plane_size * 3);
-  nv->conv_width 	= (vs->width + 15) & ~15;
-  nv->conv_height	= (vs->height + 15) & ~15;
-
-  if (! cedarv_isValid(nv->convY) )
+  if (! setupConversion(nv, NULL, vs->width, vs->height))
   {
+    vs->vdpNvState = VdpauNVState_Unregistered;
     handle_release(nv->surface);
     handle_destroy(surfaceNV);
     return 0;
   }
-  nv->surfaceType = type;
    //handle_release(vdpSurface);
  
   return surfaceNV;
@@ -288,16 +410,7 @@ void glVDPAUUnregisterSurfaceNV (vdpauSurfaceNV surface)
       handle_destroy(nv->surface);
       nv->surface = 0;
    }
-   if( cedarv_isValid(nv->convY) )
-      cedarv_free(nv->convY);
-   if (cedarv_isValid(nv->convU) )
-      cedarv_free(nv->convU);
-   if (cedarv_isValid(nv->convV) )
-      cedarv_free(nv->convV);
-
-   cedarv_setBufferInvalid(nv->convY);
-   cedarv_setBufferInvalid(nv->convU);
-   cedarv_setBufferInvalid(nv->convV);
+   freeConversion(nv);
 
    handle_release(surface);
    handle_destroy(surface); 
@@ -312,131 +425,104 @@ void glVDPAUSurfaceAccessNV(vdpauSurfaceNV surface, uint32_t access)
 {
 }
 
+/* the images already point at the conversion buffers, they only need to be bound again */
+static void bindImages(surface_nv_ctx_t *nv)
+{
+  int i;
+
+  for(i = 0; i < nv->numTextureNames; i++)
+  {
+    glActiveTexture(GL_TEXTURE0 + nv->textureNames[i]);
+    glBindTexture(GL_TEXTURE_2D, nv->textureNames[i]);
+    pglEGLImageTargetTexture2DOES(GL_TEXTURE_2D, (GLeglImageOES)nv->eglImage[i]);
+  }
+}
+
+/*
+ * Map only queues the scaler job, it runs while the caller goes on. The
+ * next map, unmap or unregister of the surface waits for it.
+ */
+static void waitConversion(surface_nv_ctx_t *nv)
+{
+  if (!nv->conversion_pending)
+    return;
+
+  cedarv_scaler_wait(nv->scaler);
+  nv->conversion_pending = 0;
+}
+
 static void mapVideoTextures(GLsizei numSurfaces, const vdpauSurfaceNV *surfaces)
 {
-  int i, j;
+  int j;
+
   for(j = 0; j < numSurfaces; j++)
   {
     surface_nv_ctx_t *nv = handle_get(surfaces[j]);
     assert(nv);
-    const EGLint renderImageAttrs[] = {
-      EGL_IMAGE_PRESERVED_KHR, EGL_FALSE, 
-      EGL_NONE
-    };
-
     video_surface_ctx_t *vs = handle_get(nv->surface);
     assert(vs);
 
-    //Log(0, "glVDPAUMapSurfacesNV: starting MB2Yuv planar convert");
-    cedarv_disp_convertMb2Yuv420(nv->conv_width, nv->conv_height,
-                                 vs->dataY, vs->dataU, nv->convY, nv->convU, nv->convV);
-    //Log(0, "glVDPAUMapSurfacesNV: finished MB2Yuv planar convert");
-
-    for(i = 0; (nv->vdpNvState == VdpauNVState_Registered) && (i < nv->numTextureNames); i++)
+    waitConversion(nv);
+    if (setupConversion(nv, vs, vs->width, vs->height))
     {
-
-      glActiveTexture(GL_TEXTURE0 + nv->textureNames[i]);
-      EGLint iErr = eglGetError();
-      assert (iErr == EGL_SUCCESS);
-      
-      glBindTexture(GL_TEXTURE_2D, nv->textureNames[i]);
-      iErr = eglGetError();
-      assert (iErr == EGL_SUCCESS);
-      glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-      iErr = eglGetError();
-      assert (iErr == EGL_SUCCESS);
-      glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-      if (i == 0 || i == 1 )
+      if (nv->scaler)
       {
-        createTexture2D(&nv->cMemPixmap[i], nv, vs, y_plane);
-      }
-      else if(i == 2 || i == 3) 
-      {
-        if(nv->numTextureNames == 6)
-          createTexture2D(&nv->cMemPixmap[i], nv, vs, u_plane);
-        else
-          createTexture2D(&nv->cMemPixmap[i], nv, vs, uv_plane);
+        cedarv_scaler_queue(nv->scaler, vs->dataY, vs->dataU, nv->convY, nv->convU, nv->convV);
+        nv->conversion_pending = 1;
       }
       else
-      {
-        createTexture2D(&nv->cMemPixmap[i], nv, vs, v_plane);
-      }
+        cedarv_disp_convertMb2Yuv420(nv->conv_width, nv->conv_height,
+                                     vs->dataY, vs->dataU, nv->convY, nv->convU, nv->convV);
+
+      if (nv->vdpNvState == VdpauNVState_Registered)
+        bindImages(nv);
       vs->vdpNvState = VdpauNVState_Mapped;
-      //create the chrominance egl image
-      nv->eglImage[i] = peglCreateImageKHR(eglDisplay,
-                                           EGL_NO_CONTEXT,  
-                                           EGL_NATIVE_PIXMAP_KHR,
-                                           &nv->cMemPixmap[i],
-                                           renderImageAttrs);
-      iErr = eglGetError();
-      assert (iErr == EGL_SUCCESS);
-      pglEGLImageTargetTexture2DOES(GL_TEXTURE_2D, (GLeglImageOES)nv->eglImage[i]);
-      iErr = glGetError();
-      //assert (iErr == GL_NO_ERROR);
+      nv->vdpNvState = VdpauNVState_Mapped;
     }
+
     handle_release(nv->surface);
-    nv->vdpNvState = VdpauNVState_Mapped;
     handle_release(surfaces[j]);
   }
 }
 
 static void mapOutputTextures(GLsizei numSurfaces, const vdpauSurfaceNV *surfaces)
 {
-  int i, j;
+  int j;
+  CEDARV_MEMORY none;
+
+  memset(&none, 0, sizeof(none));
   for(j = 0; j < numSurfaces; j++)
   {
     surface_nv_ctx_t *nv = handle_get(surfaces[j]);
     assert(nv);
-    const EGLint renderImageAttrs[] = {
-      EGL_IMAGE_PRESERVED_KHR, EGL_FALSE, 
-      EGL_NONE
-    };
-
     output_surface_ctx_t *vs = handle_get(nv->surface);
     assert(vs);
 
-    //Log(0, "glVDPAUMapSurfacesNV: starting MB2Yuv planar convert");
-    cedarv_disp_convertMb2RGB(nv->conv_width, nv->conv_height,
-                                 vs->vs->dataY, vs->vs->dataU, nv->convY);
-    //Log(0, "glVDPAUMapSurfacesNV: finished MB2Yuv planar convert");
-
-    for(i = 0; (nv->vdpNvState == VdpauNVState_Registered) && (i < nv->numTextureNames); i++)
+    waitConversion(nv);
+    if (setupConversion(nv, NULL, vs->width, vs->height))
     {
+      if (nv->scaler)
+      {
+        cedarv_scaler_queue(nv->scaler, vs->vs->dataY, vs->vs->dataU, nv->convY, none, none);
+        nv->conversion_pending = 1;
+      }
+      else
+        cedarv_disp_convertMb2RGB(nv->conv_width, nv->conv_height,
+                                  vs->vs->dataY, vs->vs->dataU, nv->convY);
 
-      glActiveTexture(GL_TEXTURE0 + nv->textureNames[i]);
-      EGLint iErr = eglGetError();
-      assert (iErr == EGL_SUCCESS);
-      
-      glBindTexture(GL_TEXTURE_2D, nv->textureNames[i]);
-      iErr = eglGetError();
-      assert (iErr == EGL_SUCCESS);
-      glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-      iErr = eglGetError();
-      assert (iErr == EGL_SUCCESS);
-      glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-      createTextureRGB2D(&nv->cMemPixmap[i], nv, vs);
+      if (nv->vdpNvState == VdpauNVState_Registered)
+        bindImages(nv);
       vs->vdpNvState = VdpauNVState_Mapped;
-      //create the chrominance egl image
-      nv->eglImage[i] = peglCreateImageKHR(eglDisplay,
-                                           EGL_NO_CONTEXT,  
-                                           EGL_NATIVE_PIXMAP_KHR,
-                                           &nv->cMemPixmap[i],
-                                           renderImageAttrs);
-      iErr = eglGetError();
-      assert (iErr == EGL_SUCCESS);
-      pglEGLImageTargetTexture2DOES(GL_TEXTURE_2D, (GLeglImageOES)nv->eglImage[i]);
-      iErr = glGetError();
-      assert (iErr == GL_NO_ERROR);
+      nv->vdpNvState = VdpauNVState_Mapped;
     }
+
     handle_release(nv->surface);
-    nv->vdpNvState = VdpauNVState_Mapped;
     handle_release(surfaces[j]);
   }
 }
 
-static void createTexture2D(fbdev_pixmap *pm, surface_nv_ctx_t *nv, video_surface_ctx_t *vs, enum col_plane cp)
+static void initPixmap(fbdev_pixmap *pm, surface_nv_ctx_t *nv, video_surface_ctx_t *vs, enum col_plane cp)
 {
-   GLenum format = GL_LUMINANCE;
    int buf_size = 8;
    int lum_size = 8;
    int alpha_size = 0;
@@ -484,7 +570,6 @@ static void createTexture2D(fbdev_pixmap *pm, surface_nv_ctx_t *nv, video_surfac
          buf_size = 16;
          lum_size = 8;
          alpha_size = 8;
-         format = GL_LUMINANCE_ALPHA;
 #if USE_TILE
          mem = vs->dataU;
          width = (vs->width + 1) / 2;
@@ -508,15 +593,10 @@ static void createTexture2D(fbdev_pixmap *pm, surface_nv_ctx_t *nv, video_surfac
    ump_reference_add(mem.mem_id);
    pm->data 		= (short unsigned int*)mem.mem_id;
    //cedarv_flush_cache(mem, cedarv_getSize(mem));
-   
-   glTexImage2D(GL_TEXTURE_2D, 0, format, pm->width, 
-                 pm->height, 0, format, GL_UNSIGNED_BYTE, NULL);
-   TestEGLError("createTexture2D");
 }
 
-static void createTextureRGB2D(fbdev_pixmap *pm, surface_nv_ctx_t *nv, output_surface_ctx_t *vs)
+static void initPixmapRGB(fbdev_pixmap *pm, surface_nv_ctx_t *nv)
 {
-  GLenum format = GL_RGB;
   int buf_size = 24;
   CEDARV_MEMORY mem;
   int width = 0;
@@ -540,10 +620,6 @@ static void createTextureRGB2D(fbdev_pixmap *pm, surface_nv_ctx_t *nv, output_su
   ump_reference_add(mem.mem_id);
   pm->data 		= (short unsigned int*)mem.mem_id;
    //cedarv_flush_cache(mem, cedarv_getSize(mem));
-   
-  glTexImage2D(GL_TEXTURE_2D, 0, format, pm->width, 
-               pm->height, 0, format, GL_UNSIGNED_BYTE, NULL);
-  TestEGLError("createTextureRGB2D");
 }
 
 void glVDPAUMapSurfacesNV(GLsizei numSurfaces, const vdpauSurfaceNV *surfaces)
@@ -569,24 +645,21 @@ void glVDPAUUnmapSurfacesNV(GLsizei numSurfaces, const vdpauSurfaceNV *surfaces)
     surface_nv_ctx_t *nv  = handle_get(surfaces[j]);
     assert(nv);
     
-    for(i = 0; (nv->vdpNvState == VdpauNVState_Mapped) && (i < nv->numTextureNames); i++)
+    waitConversion(nv);
+    if(nv->vdpNvState == VdpauNVState_Mapped)
     {
       video_surface_ctx_t *vs = handle_get(nv->surface);
       assert(vs);
       vs->vdpNvState = VdpauNVState_Registered;
-      glActiveTexture(GL_TEXTURE0 + nv->textureNames[i]);
-      glBindTexture(GL_TEXTURE_2D, 0);
-      if(nv->eglImage[i])
+      // the images stay attached for the next map, see createImages()
+      for(i = 0; i < nv->numTextureNames; i++)
       {
-         peglDestroyImageKHR(eglDisplay, nv->eglImage[i]);
-         nv->eglImage[i] = 0;
+        glActiveTexture(GL_TEXTURE0 + nv->textureNames[i]);
+        glBindTexture(GL_TEXTURE_2D, 0);
       }
-      ump_reference_release(nv->cMemPixmap[i].data);
-      //cedarv_setBufferInvalid((CEDARV_MEMORY)nv->cMemPixmap[i].data);
       handle_release(nv->surface);
     }
     nv->vdpNvState = VdpauNVState_Registered;
     handle_release(surfaces[j]);
   }
 }
-
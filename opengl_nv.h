@@ -2,6 +2,7 @@
 #define _OPENGL_NV_H_
 
 #include "vdpau_private.h"
+#include "veisp.h"
 #include <EGL/eglplatform_fb.h>
 #include "EGL/fbdev_window.h"
 
@@ -26,6 +27,9 @@ typedef struct surface_nv_ctx_struct
   CEDARV_MEMORY         convV;
   uint32_t              conv_width;
   uint32_t              conv_height;
+  struct cedarv_scaler  *scaler;
+  /* the scaler may still write the conversion buffers, see waitConversion() */
+  int                   conversion_pending;
 } surface_nv_ctx_t;
 
 #endif
@@ -30,7 +30,42 @@
 #include "ve.h"
 #include <errno.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include "sunxi_disp.h"
+#include "rgba.h"
+
+struct flip_task
+{
+	VdpOutputSurface surface;
+	output_surface_ctx_t *os;
+	int x, y;
+	uint32_t clip_width, clip_height;
+	VdpTime earliest_presentation_time;
+	struct flip_task *next;
+};
+
+/*
+ * Surfaces are shown in the order they were queued, each not before its
+ * earliest_presentation_time. Every queued and the visible surface hold a
+ * handle reference, dropped once the surface is idle again.
+ */
+struct flip_queue
+{
+	pthread_t thread;
+	pthread_mutex_t lock;
+	/* a surface was queued, or the thread has to quit */
+	pthread_cond_t wakeup;
+	/* a surface changed its status */
+	pthread_cond_t status;
+	struct flip_task *head, *tail;
+	VdpOutputSurface visible;
+	output_surface_ctx_t *visible_os;
+	int quit;
+};
+
+static int flip_queue_start(queue_ctx_t *q);
+static void flip_queue_stop(queue_ctx_t *q);
 
 uint64_t get_time(void)
 {
@@ -42,6 +77,66 @@ uint64_t get_time(void)
 	return (uint64_t)tp.tv_sec * 1000000000ULL + (uint64_t)tp.tv_nsec;
 }
 
+/*
+ * The drawable's position on screen changes when it or any of its
+ * ancestors is moved or reparented. StructureNotify on all of them tells
+ * about that, the events go to a connection of our own so the
+ * application's event queue stays untouched.
+ */
+static void watch_geometry(queue_target_ctx_t *qt)
+{
+	Window w = qt->drawable, root, parent, *children;
+	unsigned int n;
+
+	while (w)
+	{
+		XSelectInput(qt->event_display, w, StructureNotifyMask);
+		if (!XQueryTree(qt->event_display, w, &root, &parent, &children, &n))
+			break;
+		if (children)
+			XFree(children);
+		if (parent == root)
+			break;
+		w = parent;
+	}
+}
+
+static void update_geometry(queue_target_ctx_t *qt, device_ctx_t *dev)
+{
+	Display *display = qt->event_display ? qt->event_display : dev->display;
+	Window c;
+
+	if (!qt->drawable)
+		return;
+
+	if (qt->event_display)
+	{
+		while (XPending(qt->event_display))
+		{
+			XEvent ev;
+			XNextEvent(qt->event_display, &ev);
+			if (ev.type == DestroyNotify && ev.xdestroywindow.window == qt->drawable)
+			{
+				/* keep the last position, the window can't be queried anymore */
+				XCloseDisplay(qt->event_display);
+				qt->event_display = NULL;
+				qt->drawable = 0;
+				return;
+			}
+			if (ev.type == ConfigureNotify || ev.type == ReparentNotify)
+				qt->geometry_valid = 0;
+		}
+
+		if (qt->geometry_valid)
+			return;
+
+		watch_geometry(qt);
+	}
+
+	XTranslateCoordinates(display, qt->drawable, RootWindow(display, dev->screen), 0, 0, &qt->x, &qt->y, &c);
+	qt->geometry_valid = qt->event_display != NULL;
+}
+
 VdpStatus vdp_presentation_queue_target_create_x11(VdpDevice device, Drawable drawable, VdpPresentationQueueTarget *target)
 {
     if (!target /* || !drawable */)
@@ -51,7 +146,6 @@ VdpStatus vdp_presentation_queue_target_create_x11(VdpDevice device, Drawable dr
     if (!dev)
         return VDP_STATUS_INVALID_HANDLE;
 
-    fprintf(stderr, "%s: %d\n", __func__, __LINE__);
     queue_target_ctx_t *qt = handle_create(sizeof(*qt), target, htype_presentation_target);
     if (!qt)
     {
@@ -59,21 +153,40 @@ VdpStatus vdp_presentation_queue_target_create_x11(VdpDevice device, Drawable dr
         return VDP_STATUS_RESOURCES;
     }
 
-    fprintf(stderr, "%s: %d\n", __func__, __LINE__);
     qt->drawable = drawable;
-#ifndef DEF_LEGACYDISP
-#ifdef DEF_RENDERX11 
-    qt->disp = sunxi_dispx11_open(dev->display, qt->drawable);
-#endif /*DEF_RENDERX11*/
-#else /*DEF_LEGACYDISP*/
-    qt->disp = sunxi_disp2_open();
-    if (!qt->disp) qt->disp = sunxi_disp0_open();
+    /* benchmarks and tests replace the display with a sink */
+    const char *sink = getenv("VDPAU_DISP");
+    if (sink) qt->disp = sunxi_sink_open(sink);
+#ifdef DEF_LEGACYDISP
+#ifdef DEF_LEGACYDISP2
+    if (!qt->disp) qt->disp = sunxi_disp2_open(dev->osd_enabled);
+#endif /*DEF_LEGACYDISP2*/
+    if (!qt->disp) qt->disp = sunxi_disp0_open(dev->osd_enabled);
+    /* same driver, without the framebuffer layer disp0 insists on */
+    if (!qt->disp) qt->disp = sunxi_disp_open(dev->osd_enabled);
 #endif /*DEF_LEGACYDISP*/
+#ifdef DEF_DRM
+    /* mainline kernels have no /dev/disp, only KMS */
+    if (!qt->disp) qt->disp = sunxi_drm_open(dev->osd_enabled);
+#endif /*DEF_DRM*/
+#ifdef DEF_RENDERXV
+    /* the X server owns the display layers, leave conversion and scaling to one of its ports */
+    if (!qt->disp && qt->drawable) qt->disp = sunxi_dispxv_open(dev->display, qt->drawable);
+#endif /*DEF_RENDERXV*/
+#ifdef DEF_RENDERX11
+    /* the last resort, whatever else was built in */
+    if (!qt->disp) qt->disp = sunxi_dispx11_open(dev->display, qt->drawable);
+#endif /*DEF_RENDERX11*/
     if (!qt->disp) {
         handle_release(device);
         handle_destroy(*target);
         return VDP_STATUS_ERROR;
     }
+    dev->hw_layers = qt->disp->layer_count;
+
+    if (qt->drawable)
+        qt->event_display = XOpenDisplay(DisplayString(dev->display));
+    update_geometry(qt, dev);
     printf("vdpau presentation target queue=%d created\n", *target);
 
     handle_release(device);
@@ -87,6 +200,8 @@ VdpStatus vdp_presentation_queue_target_destroy(VdpPresentationQueueTarget prese
 		return VDP_STATUS_INVALID_HANDLE;
 
         qt->disp->close(qt->disp);
+        if (qt->event_display)
+            XCloseDisplay(qt->event_display);
 
         handle_release(presentation_queue_target);
 	handle_destroy(presentation_queue_target);
@@ -124,6 +239,14 @@ VdpStatus vdp_presentation_queue_create(VdpDevice device, VdpPresentationQueueTa
 	q->device = dev;
         q->target_hdl = presentation_queue_target;
         q->device_hdl = device;
+
+	if (!flip_queue_start(q))
+	{
+		handle_release(device);
+		handle_release(presentation_queue_target);
+		handle_destroy(*presentation_queue);
+		return VDP_STATUS_RESOURCES;
+	}
         
         printf("vdpau presentation queue=%d created\n", *presentation_queue);
 
@@ -136,6 +259,8 @@ VdpStatus vdp_presentation_queue_destroy(VdpPresentationQueue presentation_queue
 	if (!q)
 		return VDP_STATUS_INVALID_HANDLE;
 
+	flip_queue_stop(q);
+
         handle_release(q->target_hdl);
         handle_release(q->device_hdl);
         handle_release(presentation_queue);
@@ -192,43 +317,45 @@ VdpStatus vdp_presentation_queue_get_time(VdpPresentationQueue presentation_queu
 	return VDP_STATUS_OK;
 }
 
-VdpStatus vdp_presentation_queue_display(VdpPresentationQueue presentation_queue, VdpOutputSurface surface, uint32_t clip_width, uint32_t clip_height, VdpTime earliest_presentation_time)
+/* mixer layers go to the overlay planes, planes without one are turned off */
+static void show_layers(struct sunxi_disp *disp, int x, int y, output_surface_ctx_t *os)
 {
-	int x=0,y=0;
-	queue_ctx_t *q = handle_get(presentation_queue);
-	if (!q)
-		return VDP_STATUS_INVALID_HANDLE;
+	int i;
 
-	output_surface_ctx_t *os = handle_get(surface);
-	if (!os)
-        {
-                handle_release(presentation_queue);
-		return VDP_STATUS_INVALID_HANDLE;
-        }
-
-	if (!(os->vs))
+	for (i = 0; i < disp->layer_count; i++)
 	{
-		printf("trying to display empty surface\n");
-		VDPAU_DBG("trying to display empty surface");
-                handle_release(presentation_queue);
-                handle_release(surface);
-		return VDP_STATUS_OK;
+		output_surface_ctx_t *layer = i < os->layer_count ? handle_get(os->layers[i].surface) : NULL;
+		int shown = 0;
+
+		if (layer)
+		{
+			if (layer->rgba.flags & RGBA_FLAG_NEEDS_CLEAR)
+				rgba_clear(&layer->rgba);
+
+			if (layer->rgba.flags & RGBA_FLAG_DIRTY)
+			{
+				rgba_flush(&layer->rgba);
+				shown = disp->set_layer(disp, i, x, y, layer, &os->layers[i].src, &os->layers[i].dst) == 0;
+			}
+			handle_release(os->layers[i].surface);
+		}
+
+		if (!shown)
+			disp->close_layer(disp, i);
 	}
+}
 
-	if (earliest_presentation_time != 0)
-		VDPAU_DBG_ONCE("Presentation time not supported");
-
-	Window c;
-	XTranslateCoordinates(q->device->display, q->target->drawable, RootWindow(q->device->display, q->device->screen), 0, 0, &x, &y, &c);
-	//XClearWindow(q->device->display, q->target->drawable);
-	fprintf(stderr, "%s: %d - %d %d - %d %d\n", __func__, __LINE__, x, y, clip_width, clip_height);
+static void show_surface(queue_ctx_t *q, struct flip_task *task)
+{
+	output_surface_ctx_t *os = task->os;
 
 	if (os->vs)
-		q->target->disp->set_video_layer(q->target->disp, x, y, clip_width, clip_height, os);
+		q->target->disp->set_video_layer(q->target->disp, task->x, task->y, task->clip_width, task->clip_height, os);
 	else
 		q->target->disp->close_video_layer(q->target->disp);
 
-#if 0
+	show_layers(q->target->disp, task->x, task->y, os);
+
 	if (q->device->osd_enabled) {
 	  if (os->rgba.flags & RGBA_FLAG_NEEDS_CLEAR)
 	    rgba_clear(&os->rgba);
@@ -237,26 +364,211 @@ VdpStatus vdp_presentation_queue_display(VdpPresentationQueue presentation_queue
 	    {
 	      rgba_flush(&os->rgba);
 
-	      q->target->disp->set_osd_layer(q->target->disp, x, y, clip_width, clip_height, os);
+	      q->target->disp->set_osd_layer(q->target->disp, task->x, task->y, task->clip_width, task->clip_height, os);
 	    }
 	  else
 	    {
 	      q->target->disp->close_osd_layer(q->target->disp);
 	    }
 	}
-#endif /*0*/
 
+	if (q->target->disp->commit)
+		q->target->disp->commit(q->target->disp);
+}
 
-	//printf("%s: p_q=%d,o_s=%d\n", __FUNCTION__, presentation_queue, surface);
+/* called with the lock held, drops the reference the surface was queued or shown with */
+static void surface_done(VdpOutputSurface surface, output_surface_ctx_t *os)
+{
+	os->status = os->queued ? VDP_PRESENTATION_QUEUE_STATUS_QUEUED : VDP_PRESENTATION_QUEUE_STATUS_IDLE;
+	handle_release(surface);
+}
+
+/*
+ * The display engine latches new layer settings at the vertical blank, so
+ * that is when the surface goes on screen. Waiting for it also keeps the
+ * thread from flipping more than once per refresh.
+ */
+static VdpTime flip_time(struct sunxi_disp *disp)
+{
+	if (disp->wait_vsync && disp->wait_vsync(disp) == 0)
+		return disp->get_vblank_time(disp);
+
+	return get_time();
+}
+
+static void *flip_thread(void *arg)
+{
+	queue_ctx_t *q = arg;
+	struct flip_queue *f = q->flip;
+
+	pthread_mutex_lock(&f->lock);
+	while (!f->quit)
+	{
+		struct flip_task *task = f->head;
+		if (!task)
+		{
+			pthread_cond_wait(&f->wakeup, &f->lock);
+			continue;
+		}
+
+		if (task->earliest_presentation_time > get_time())
+		{
+			struct timespec ts = { .tv_sec = task->earliest_presentation_time / 1000000000ULL,
+			                       .tv_nsec = task->earliest_presentation_time % 1000000000ULL };
+			pthread_cond_timedwait(&f->wakeup, &f->lock, &ts);
+			continue;
+		}
+
+		f->head = task->next;
+		if (!f->head)
+			f->tail = NULL;
+
+		/* the application doesn't touch the surface until it is idle again */
+		pthread_mutex_unlock(&f->lock);
+		show_surface(q, task);
+		VdpTime now = flip_time(q->target->disp);
+		pthread_mutex_lock(&f->lock);
+
+		task->os->queued--;
+		if (f->visible_os)
+			surface_done(f->visible, f->visible_os);
+		task->os->status = VDP_PRESENTATION_QUEUE_STATUS_VISIBLE;
+		task->os->first_presentation_time = now;
+		f->visible = task->surface;
+		f->visible_os = task->os;
+		pthread_cond_broadcast(&f->status);
+
+		free(task);
+	}
+	pthread_mutex_unlock(&f->lock);
+
+	return NULL;
+}
+
+static int flip_queue_start(queue_ctx_t *q)
+{
+	pthread_condattr_t attr;
+	struct flip_queue *f = calloc(1, sizeof(*f));
+	if (!f)
+		return 0;
+
+	/* presentation times are CLOCK_MONOTONIC, see get_time() */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_mutex_init(&f->lock, NULL);
+	pthread_cond_init(&f->wakeup, &attr);
+	pthread_cond_init(&f->status, NULL);
+	pthread_condattr_destroy(&attr);
+
+	q->flip = f;
+	if (pthread_create(&f->thread, NULL, flip_thread, q))
+	{
+		pthread_cond_destroy(&f->status);
+		pthread_cond_destroy(&f->wakeup);
+		pthread_mutex_destroy(&f->lock);
+		free(f);
+		q->flip = NULL;
+		return 0;
+	}
+
+	return 1;
+}
+
+static void flip_queue_stop(queue_ctx_t *q)
+{
+	struct flip_queue *f = q->flip;
+
+	pthread_mutex_lock(&f->lock);
+	f->quit = 1;
+	pthread_cond_broadcast(&f->wakeup);
+	pthread_cond_broadcast(&f->status);
+	pthread_mutex_unlock(&f->lock);
+
+	pthread_join(f->thread, NULL);
+
+	/* surfaces that never made it to the screen */
+	while (f->head)
+	{
+		struct flip_task *task = f->head;
+		f->head = task->next;
+		task->os->queued--;
+		surface_done(task->surface, task->os);
+		free(task);
+	}
+
+	if (f->visible_os)
+		surface_done(f->visible, f->visible_os);
+
+	pthread_cond_destroy(&f->status);
+	pthread_cond_destroy(&f->wakeup);
+	pthread_mutex_destroy(&f->lock);
+	free(f);
+	q->flip = NULL;
+}
+
+VdpStatus vdp_presentation_queue_display(VdpPresentationQueue presentation_queue, VdpOutputSurface surface, uint32_t clip_width, uint32_t clip_height, VdpTime earliest_presentation_time)
+{
+	queue_ctx_t *q = handle_get(presentation_queue);
+	if (!q)
+		return VDP_STATUS_INVALID_HANDLE;
+
+	output_surface_ctx_t *os = handle_get(surface);
+	if (!os)
+        {
+                handle_release(presentation_queue);
+		return VDP_STATUS_INVALID_HANDLE;
+        }
+
+	if (!(os->vs))
+	{
+		VDPAU_DBG("trying to display empty surface");
+                handle_release(presentation_queue);
+                handle_release(surface);
+		return VDP_STATUS_OK;
+	}
+
+	struct flip_task *task = calloc(1, sizeof(*task));
+	if (!task)
+	{
+		handle_release(presentation_queue);
+		handle_release(surface);
+		return VDP_STATUS_RESOURCES;
+	}
+
+	/* Xlib stays on the application's thread */
+	update_geometry(q->target, q->device);
+
+	/* the reference on surface is kept until it is idle again */
+	task->surface = surface;
+	task->os = os;
+	task->x = q->target->x;
+	task->y = q->target->y;
+	task->clip_width = clip_width;
+	task->clip_height = clip_height;
+	task->earliest_presentation_time = earliest_presentation_time;
+
+	struct flip_queue *f = q->flip;
+	pthread_mutex_lock(&f->lock);
+	os->queued++;
+	if (os->status != VDP_PRESENTATION_QUEUE_STATUS_VISIBLE)
+		os->status = VDP_PRESENTATION_QUEUE_STATUS_QUEUED;
+	if (f->tail)
+		f->tail->next = task;
+	else
+		f->head = task;
+	f->tail = task;
+	pthread_cond_signal(&f->wakeup);
+	pthread_mutex_unlock(&f->lock);
 
-	//Window c;
         handle_release(presentation_queue);
-        handle_release(surface);
 	return VDP_STATUS_OK;
 }
 
 VdpStatus vdp_presentation_queue_block_until_surface_idle(VdpPresentationQueue presentation_queue, VdpOutputSurface surface, VdpTime *first_presentation_time)
 {
+	if (!first_presentation_time)
+		return VDP_STATUS_INVALID_POINTER;
+
 	queue_ctx_t *q = handle_get(presentation_queue);
 	if (!q)
 		return VDP_STATUS_INVALID_HANDLE;
@@ -268,7 +580,12 @@ VdpStatus vdp_presentation_queue_block_until_surface_idle(VdpPresentationQueue p
 		return VDP_STATUS_INVALID_HANDLE;
         }
 
-	*first_presentation_time = get_time();
+	struct flip_queue *f = q->flip;
+	pthread_mutex_lock(&f->lock);
+	while (out->status != VDP_PRESENTATION_QUEUE_STATUS_IDLE && !f->quit)
+		pthread_cond_wait(&f->status, &f->lock);
+	*first_presentation_time = out->first_presentation_time;
+	pthread_mutex_unlock(&f->lock);
 
         handle_release(presentation_queue);
         handle_release(surface);
@@ -277,6 +594,9 @@ VdpStatus vdp_presentation_queue_block_until_surface_idle(VdpPresentationQueue p
 
 VdpStatus vdp_presentation_queue_query_surface_status(VdpPresentationQueue presentation_queue, VdpOutputSurface surface, VdpPresentationQueueStatus *status, VdpTime *first_presentation_time)
 {
+	if (!status || !first_presentation_time)
+		return VDP_STATUS_INVALID_POINTER;
+
 	queue_ctx_t *q = handle_get(presentation_queue);
 	if (!q)
 		return VDP_STATUS_INVALID_HANDLE;
@@ -288,8 +608,11 @@ VdpStatus vdp_presentation_queue_query_surface_status(VdpPresentationQueue prese
 		return VDP_STATUS_INVALID_HANDLE;
         }
 
-	*status = VDP_PRESENTATION_QUEUE_STATUS_VISIBLE;
-	*first_presentation_time = get_time();
+	struct flip_queue *f = q->flip;
+	pthread_mutex_lock(&f->lock);
+	*status = out->status;
+	*first_presentation_time = out->status == VDP_PRESENTATION_QUEUE_STATUS_QUEUED ? 0 : out->first_presentation_time;
+	pthread_mutex_unlock(&f->lock);
 
         handle_release(presentation_queue);
         handle_release(surface);
@@ -0,0 +1,958 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vdpau_private.h"
+#include "detile.h"
+#include "rgba.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+/*
+ * Software compositor for output surfaces. Pixels live in CEDARV memory,
+ * so the display engine can scan a surface out directly as OSD layer.
+ *
+ * dirty is the area holding content since the last clear, it is what the
+ * OSD layer shows. damage is the area changed since the last flush, only
+ * that part is written back from the cpu caches. Both are empty if
+ * x0 >= x1. Memory is allocated when a surface is drawn to the first time,
+ * most output surfaces never carry an OSD. Frequently accessed bitmap
+ * surfaces are never scanned out and live in plain cached memory, which
+ * doesn't eat into the contiguous pool and needs no cache flushes.
+ *
+ * Both VDPAU formats have alpha in the last byte, they only differ in the
+ * order of red and blue. Source pixels are converted to the destination
+ * order before blending, so blending itself doesn't care about the format.
+ */
+
+enum blend_mode
+{
+	BLEND_COPY,
+	BLEND_PREMULT_OVER,	/* ONE, ONE_MINUS_SRC_ALPHA */
+	BLEND_OVER,		/* SRC_ALPHA, ONE_MINUS_SRC_ALPHA for color, ONE, ONE_MINUS_SRC_ALPHA for alpha */
+	BLEND_GENERIC,
+};
+
+static void rect_reset(rgba_surface_t *rgba, VdpRect *r)
+{
+	r->x0 = rgba->width;
+	r->y0 = rgba->height;
+	r->x1 = 0;
+	r->y1 = 0;
+}
+
+static int rect_empty(const VdpRect *r)
+{
+	return r->x0 >= r->x1 || r->y0 >= r->y1;
+}
+
+static void rect_add(VdpRect *r, const VdpRect *a)
+{
+	r->x0 = min(r->x0, a->x0);
+	r->y0 = min(r->y0, a->y0);
+	r->x1 = max(r->x1, a->x1);
+	r->y1 = max(r->y1, a->y1);
+}
+
+static int rect_inside(const VdpRect *inner, const VdpRect *outer)
+{
+	return inner->x0 >= outer->x0 && inner->y0 >= outer->y0 &&
+	       inner->x1 <= outer->x1 && inner->y1 <= outer->y1;
+}
+
+static void rect_clip(VdpRect *r, uint32_t width, uint32_t height)
+{
+	r->x1 = min(r->x1, width);
+	r->y1 = min(r->y1, height);
+	r->x0 = min(r->x0, r->x1);
+	r->y0 = min(r->y0, r->y1);
+}
+
+static int rgba_allocated(rgba_surface_t *rgba)
+{
+	return rgba->cpu_data || cedarv_isValid(rgba->data);
+}
+
+static uint32_t *rgba_line(rgba_surface_t *rgba, uint32_t y)
+{
+	uint32_t *pixels = rgba->cpu_data ? rgba->cpu_data : cedarv_getPointer(rgba->data);
+	return pixels + y * rgba->width;
+}
+
+static int rgba_alloc(rgba_surface_t *rgba)
+{
+	if (rgba_allocated(rgba))
+		return 1;
+
+	if (rgba->frequently_accessed)
+	{
+		rgba->cpu_data = calloc(rgba->width * rgba->height, 4);
+		if (!rgba->cpu_data)
+			return 0;
+	}
+	else
+	{
+		rgba->data = cedarv_malloc(rgba->width * rgba->height * 4);
+		if (!cedarv_isValid(rgba->data))
+		{
+			cedarv_setBufferInvalid(&rgba->data);
+			return 0;
+		}
+
+		memset(cedarv_getPointer(rgba->data), 0, rgba->width * rgba->height * 4);
+		cedarv_flush_cache(rgba->data, rgba->width * rgba->height * 4);
+	}
+
+	rect_reset(rgba, &rgba->dirty);
+	rect_reset(rgba, &rgba->damage);
+
+	return 1;
+}
+
+static void rgba_changed(rgba_surface_t *rgba, const VdpRect *rect)
+{
+	rect_add(&rgba->dirty, rect);
+	rect_add(&rgba->damage, rect);
+	rgba->flags &= ~RGBA_FLAG_NEEDS_CLEAR;
+	rgba->flags |= RGBA_FLAG_DIRTY | RGBA_FLAG_NEEDS_FLUSH;
+}
+
+static void rgba_fill_transparent(rgba_surface_t *rgba, const VdpRect *rect)
+{
+	uint32_t y;
+
+	for (y = rect->y0; y < rect->y1; y++)
+		memset(rgba_line(rgba, y) + rect->x0, 0, (rect->x1 - rect->x0) * 4);
+}
+
+VdpStatus rgba_create(rgba_surface_t *rgba, device_ctx_t *device, uint32_t width, uint32_t height, VdpRGBAFormat format, VdpBool frequently_accessed)
+{
+	if (format != VDP_RGBA_FORMAT_B8G8R8A8 && format != VDP_RGBA_FORMAT_R8G8B8A8)
+		return VDP_STATUS_INVALID_RGBA_FORMAT;
+
+	if (width < 1 || width > 8192 || height < 1 || height > 8192)
+		return VDP_STATUS_INVALID_SIZE;
+
+	rgba->device = device;
+	rgba->width = width;
+	rgba->height = height;
+	rgba->format = format;
+	rgba->flags = 0;
+	rgba->frequently_accessed = frequently_accessed;
+	rgba->cpu_data = NULL;
+	cedarv_setBufferInvalid(&rgba->data);
+	rect_reset(rgba, &rgba->dirty);
+	rect_reset(rgba, &rgba->damage);
+
+	return VDP_STATUS_OK;
+}
+
+void rgba_destroy(rgba_surface_t *rgba)
+{
+	rgba_batch_flush(rgba->device);
+
+	if (cedarv_isValid(rgba->data))
+		cedarv_free(rgba->data);
+	cedarv_setBufferInvalid(&rgba->data);
+	free(rgba->cpu_data);
+	rgba->cpu_data = NULL;
+	rgba->flags = 0;
+}
+
+VdpStatus rgba_put_bits_native(rgba_surface_t *rgba, void const *const *source_data, uint32_t const *source_pitches, VdpRect const *destination_rect)
+{
+	VdpRect d_rect = { 0, 0, rgba->width, rgba->height };
+
+	if (!source_data || !source_pitches)
+		return VDP_STATUS_INVALID_POINTER;
+
+	if (destination_rect)
+		d_rect = *destination_rect;
+	rect_clip(&d_rect, rgba->width, rgba->height);
+	if (rect_empty(&d_rect))
+		return VDP_STATUS_OK;
+
+	rgba_batch_flush(rgba->device);
+	if (!rgba_alloc(rgba))
+		return VDP_STATUS_RESOURCES;
+
+	/* stale content outside of the new bits has to go */
+	if ((rgba->flags & RGBA_FLAG_NEEDS_CLEAR) && !rect_inside(&rgba->dirty, &d_rect))
+		rgba_clear(rgba);
+
+	cedarv_copy_plane((uint8_t *)rgba_line(rgba, d_rect.y0) + d_rect.x0 * 4, rgba->width * 4,
+	                  source_data[0], source_pitches[0],
+	                  (d_rect.x1 - d_rect.x0) * 4, d_rect.y1 - d_rect.y0);
+
+	rgba_changed(rgba, &d_rect);
+
+	return VDP_STATUS_OK;
+}
+
+VdpStatus rgba_get_bits_native(rgba_surface_t *rgba, VdpRect const *source_rect, void *const *destination_data, uint32_t const *destination_pitches)
+{
+	VdpRect s_rect = { 0, 0, rgba->width, rgba->height };
+	uint32_t y;
+
+	if (!destination_data || !destination_pitches)
+		return VDP_STATUS_INVALID_POINTER;
+
+	if (source_rect)
+		s_rect = *source_rect;
+	rect_clip(&s_rect, rgba->width, rgba->height);
+
+	rgba_batch_flush(rgba->device);
+
+	for (y = s_rect.y0; y < s_rect.y1; y++)
+	{
+		uint8_t *dst = (uint8_t *)destination_data[0] + (y - s_rect.y0) * destination_pitches[0];
+
+		if (!rgba_allocated(rgba) || (rgba->flags & RGBA_FLAG_NEEDS_CLEAR))
+			memset(dst, 0, (s_rect.x1 - s_rect.x0) * 4);
+		else
+			memcpy(dst, rgba_line(rgba, y) + s_rect.x0, (s_rect.x1 - s_rect.x0) * 4);
+	}
+
+	return VDP_STATUS_OK;
+}
+
+static inline uint32_t div255(uint32_t t)
+{
+	return (t + ((t + 128) >> 8) + 128) >> 8;
+}
+
+static inline uint32_t swap_rb(uint32_t v)
+{
+	return (v & 0xff00ff00) | ((v >> 16) & 0xff) | ((v & 0xff) << 16);
+}
+
+/* 0.0 .. 1.0 color to a pixel in the byte order of format */
+static uint32_t color_to_pixel(const VdpColor *c, VdpRGBAFormat format)
+{
+	uint32_t r = clamp(c->red, 0.0f, 1.0f) * 255.0f + 0.5f;
+	uint32_t g = clamp(c->green, 0.0f, 1.0f) * 255.0f + 0.5f;
+	uint32_t b = clamp(c->blue, 0.0f, 1.0f) * 255.0f + 0.5f;
+	uint32_t a = clamp(c->alpha, 0.0f, 1.0f) * 255.0f + 0.5f;
+
+	if (format == VDP_RGBA_FORMAT_R8G8B8A8)
+		return r | (g << 8) | (b << 16) | (a << 24);
+	else
+		return b | (g << 8) | (r << 16) | (a << 24);
+}
+
+static enum blend_mode get_blend_mode(VdpOutputSurfaceRenderBlendState const *bs)
+{
+	if (!bs)
+		return BLEND_COPY;
+
+	if (bs->blend_equation_color != VDP_OUTPUT_SURFACE_RENDER_BLEND_EQUATION_ADD ||
+	    bs->blend_equation_alpha != VDP_OUTPUT_SURFACE_RENDER_BLEND_EQUATION_ADD)
+		return BLEND_GENERIC;
+
+	if (bs->blend_factor_source_color == VDP_OUTPUT_SURFACE_RENDER_BLEND_FACTOR_ONE &&
+	    bs->blend_factor_source_alpha == VDP_OUTPUT_SURFACE_RENDER_BLEND_FACTOR_ONE &&
+	    bs->blend_factor_destination_color == VDP_OUTPUT_SURFACE_RENDER_BLEND_FACTOR_ZERO &&
+	    bs->blend_factor_destination_alpha == VDP_OUTPUT_SURFACE_RENDER_BLEND_FACTOR_ZERO)
+		return BLEND_COPY;
+
+	if (bs->blend_factor_source_alpha != VDP_OUTPUT_SURFACE_RENDER_BLEND_FACTOR_ONE ||
+	    bs->blend_factor_destination_color != VDP_OUTPUT_SURFACE_RENDER_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA ||
+	    bs->blend_factor_destination_alpha != VDP_OUTPUT_SURFACE_RENDER_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA)
+		return BLEND_GENERIC;
+
+	if (bs->blend_factor_source_color == VDP_OUTPUT_SURFACE_RENDER_BLEND_FACTOR_ONE)
+		return BLEND_PREMULT_OVER;
+	if (bs->blend_factor_source_color == VDP_OUTPUT_SURFACE_RENDER_BLEND_FACTOR_SRC_ALPHA)
+		return BLEND_OVER;
+
+	return BLEND_GENERIC;
+}
+
+#ifdef HAVE_NEON
+static inline uint8x8_t div255_neon(uint16x8_t t)
+{
+	return vraddhn_u16(t, vrshrq_n_u16(t, 8));
+}
+
+/* returns the number of pixels done, the rest is left to the scalar code */
+static int blend_row_neon(uint8_t *dst, const uint8_t *src, int n, enum blend_mode mode)
+{
+	int i, c;
+
+	for (i = 0; i + 8 <= n; i += 8)
+	{
+		uint32x4_t s0 = vld1q_u32((const uint32_t *)(src + 4 * i));
+		uint32x4_t s1 = vld1q_u32((const uint32_t *)(src + 4 * i + 16));
+
+		/* transparent runs are common in subtitles, leave dst alone there */
+		uint32x4_t any = vorrq_u32(s0, s1);
+		if (mode == BLEND_OVER)
+			any = vandq_u32(any, vdupq_n_u32(0xff000000));
+		uint32x2_t any2 = vorr_u32(vget_low_u32(any), vget_high_u32(any));
+		if ((vget_lane_u32(any2, 0) | vget_lane_u32(any2, 1)) == 0)
+			continue;
+
+		uint8x8x4_t s = vld4_u8(src + 4 * i);
+		uint8x8x4_t d = vld4_u8(dst + 4 * i);
+		uint8x8_t ia = vmvn_u8(s.val[3]);
+
+		if (mode == BLEND_PREMULT_OVER)
+		{
+			for (c = 0; c < 4; c++)
+				d.val[c] = vqadd_u8(s.val[c], div255_neon(vmull_u8(d.val[c], ia)));
+		}
+		else
+		{
+			for (c = 0; c < 3; c++)
+				d.val[c] = div255_neon(vmlal_u8(vmull_u8(s.val[c], s.val[3]), d.val[c], ia));
+			d.val[3] = vqadd_u8(s.val[3], div255_neon(vmull_u8(d.val[3], ia)));
+		}
+
+		vst4_u8(dst + 4 * i, d);
+	}
+
+	return i;
+}
+#endif
+
+static uint32_t blend_factor(VdpOutputSurfaceRenderBlendFactor f, const uint8_t *s, const uint8_t *d, const uint8_t *k, int c)
+{
+	switch (f)
+	{
+	case VDP_OUTPUT_SURFACE_RENDER_BLEND_FACTOR_ZERO:
+		return 0;
+	case VDP_OUTPUT_SURFACE_RENDER_BLEND_FACTOR_ONE:
+		return 255;
+	case VDP_OUTPUT_SURFACE_RENDER_BLEND_FACTOR_SRC_COLOR:
+		return s[c];
+	case VDP_OUTPUT_SURFACE_RENDER_BLEND_FACTOR_ONE_MINUS_SRC_COLOR:
+		return 255 - s[c];
+	case VDP_OUTPUT_SURFACE_RENDER_BLEND_FACTOR_SRC_ALPHA:
+		return s[3];
+	case VDP_OUTPUT_SURFACE_RENDER_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA:
+		return 255 - s[3];
+	case VDP_OUTPUT_SURFACE_RENDER_BLEND_FACTOR_DST_ALPHA:
+		return d[3];
+	case VDP_OUTPUT_SURFACE_RENDER_BLEND_FACTOR_ONE_MINUS_DST_ALPHA:
+		return 255 - d[3];
+	case VDP_OUTPUT_SURFACE_RENDER_BLEND_FACTOR_DST_COLOR:
+		return d[c];
+	case VDP_OUTPUT_SURFACE_RENDER_BLEND_FACTOR_ONE_MINUS_DST_COLOR:
+		return 255 - d[c];
+	case VDP_OUTPUT_SURFACE_RENDER_BLEND_FACTOR_SRC_ALPHA_SATURATE:
+		return c == 3 ? 255 : min(s[3], 255 - d[3]);
+	case VDP_OUTPUT_SURFACE_RENDER_BLEND_FACTOR_CONSTANT_COLOR:
+		return k[c];
+	case VDP_OUTPUT_SURFACE_RENDER_BLEND_FACTOR_ONE_MINUS_CONSTANT_COLOR:
+		return 255 - k[c];
+	case VDP_OUTPUT_SURFACE_RENDER_BLEND_FACTOR_CONSTANT_ALPHA:
+		return k[3];
+	case VDP_OUTPUT_SURFACE_RENDER_BLEND_FACTOR_ONE_MINUS_CONSTANT_ALPHA:
+		return 255 - k[3];
+	default:
+		return 0;
+	}
+}
+
+static uint32_t blend_equation(VdpOutputSurfaceRenderBlendEquation eq, uint32_t s, uint32_t d, uint32_t fs, uint32_t fd)
+{
+	int a = div255(s * fs), b = div255(d * fd);
+
+	switch (eq)
+	{
+	case VDP_OUTPUT_SURFACE_RENDER_BLEND_EQUATION_SUBTRACT:
+		return max(a - b, 0);
+	case VDP_OUTPUT_SURFACE_RENDER_BLEND_EQUATION_REVERSE_SUBTRACT:
+		return max(b - a, 0);
+	case VDP_OUTPUT_SURFACE_RENDER_BLEND_EQUATION_MIN:
+		return min(s, d);
+	case VDP_OUTPUT_SURFACE_RENDER_BLEND_EQUATION_MAX:
+		return max(s, d);
+	case VDP_OUTPUT_SURFACE_RENDER_BLEND_EQUATION_ADD:
+	default:
+		return min(a + b, 255);
+	}
+}
+
+static void blend_row(uint8_t *dst, const uint8_t *src, int n, enum blend_mode mode,
+                      VdpOutputSurfaceRenderBlendState const *bs, const uint8_t *k)
+{
+	int i = 0, c;
+
+	if (mode == BLEND_COPY)
+	{
+		memcpy(dst, src, n * 4);
+		return;
+	}
+
+#ifdef HAVE_NEON
+	if (mode != BLEND_GENERIC)
+		i = blend_row_neon(dst, src, n, mode);
+#endif
+
+	for (; i < n; i++)
+	{
+		const uint8_t *s = src + 4 * i;
+		uint8_t *d = dst + 4 * i;
+		uint32_t ia = 255 - s[3];
+
+		switch (mode)
+		{
+		case BLEND_PREMULT_OVER:
+			for (c = 0; c < 4; c++)
+				d[c] = min(s[c] + div255(d[c] * ia), 255);
+			break;
+
+		case BLEND_OVER:
+			if (s[3] == 0)
+				break;
+			for (c = 0; c < 3; c++)
+				d[c] = div255(s[c] * s[3] + d[c] * ia);
+			d[3] = min(s[3] + div255(d[3] * ia), 255);
+			break;
+
+		default:
+		{
+			uint8_t r[4];
+			for (c = 0; c < 3; c++)
+				r[c] = blend_equation(bs->blend_equation_color, s[c], d[c],
+				                      blend_factor(bs->blend_factor_source_color, s, d, k, c),
+				                      blend_factor(bs->blend_factor_destination_color, s, d, k, c));
+			r[3] = blend_equation(bs->blend_equation_alpha, s[3], d[3],
+			                      blend_factor(bs->blend_factor_source_alpha, s, d, k, 3),
+			                      blend_factor(bs->blend_factor_destination_alpha, s, d, k, 3));
+			memcpy(d, r, 4);
+			break;
+		}
+		}
+	}
+}
+
+static void modulate_row(uint8_t *row, int n, const uint8_t *left, const uint8_t *right)
+{
+	int i, c;
+
+	for (i = 0; i < n; i++)
+		for (c = 0; c < 4; c++)
+		{
+			uint32_t k = left[c];
+			if (left != right)
+				k = (left[c] * (2 * (n - i) - 1) + right[c] * (2 * i + 1)) / (2 * n);
+			row[4 * i + c] = div255(row[4 * i + c] * k);
+		}
+}
+
+/* 16.16 position of sample i of n, spread over len pixels starting at base */
+static int32_t sample_pos(int32_t base, int32_t len, int i, int n)
+{
+	return (base << 16) + (int32_t)((int64_t)len * 65536 * (2 * i + 1) / (2 * n));
+}
+
+/*
+ * Text OSDs are drawn as one render_bitmap_surface call per glyph. Such
+ * unscaled blits into the same surface are queued and drawn row by row
+ * in one pass over the destination. Every other operation on any surface
+ * of the device draws the queue first, so sources can't change while
+ * queued. Within a row the blits keep their order, so overlaps blend the
+ * same as they would one after another.
+ */
+#define BATCH_SIZE 512
+#define BATCH_MAX_WIDTH 8192
+
+struct rgba_batch
+{
+	pthread_mutex_t lock;
+	rgba_surface_t *dest;
+	enum blend_mode mode;
+	int count;
+	struct
+	{
+		rgba_surface_t *src;
+		VdpRect rect;
+		uint32_t sx, sy;
+		uint8_t color[4];
+		uint8_t modulate;
+		uint8_t has_src;
+	} blits[BATCH_SIZE];
+	uint32_t row[BATCH_MAX_WIDTH];
+};
+
+static void batch_run(struct rgba_batch *b)
+{
+	rgba_surface_t *dest = b->dest;
+	uint32_t y, y0 = dest->height, y1 = 0;
+	int i;
+
+	for (i = 0; i < b->count; i++)
+	{
+		y0 = min(y0, b->blits[i].rect.y0);
+		y1 = max(y1, b->blits[i].rect.y1);
+	}
+
+	for (y = y0; y < y1; y++)
+	{
+		uint32_t *line = rgba_line(dest, y);
+
+		for (i = 0; i < b->count; i++)
+		{
+			const VdpRect *r = &b->blits[i].rect;
+			rgba_surface_t *src = b->blits[i].src;
+			int n = r->x1 - r->x0;
+
+			if (y < r->y0 || y >= r->y1)
+				continue;
+
+			if (!b->blits[i].has_src)
+			{
+				if (b->mode == BLEND_COPY)
+					memset(line + r->x0, 0, n * 4);
+				continue;
+			}
+
+			const uint32_t *s = rgba_line(src, b->blits[i].sy + y - r->y0) + b->blits[i].sx;
+			if (src->format != dest->format || b->blits[i].modulate)
+			{
+				int x;
+				for (x = 0; x < n; x++)
+					b->row[x] = src->format != dest->format ? swap_rb(s[x]) : s[x];
+				if (b->blits[i].modulate)
+					modulate_row((uint8_t *)b->row, n, b->blits[i].color, b->blits[i].color);
+				s = b->row;
+			}
+
+			blend_row((uint8_t *)(line + r->x0), (const uint8_t *)s, n, b->mode, NULL, NULL);
+		}
+	}
+
+	b->count = 0;
+	b->dest = NULL;
+}
+
+static int batch_add(struct rgba_batch *b, rgba_surface_t *dest, enum blend_mode mode, const VdpRect *rect,
+                     rgba_surface_t *src, int has_src, uint32_t sx, uint32_t sy, const uint8_t *color)
+{
+	if (!b)
+		return 0;
+
+	pthread_mutex_lock(&b->lock);
+	if (b->count && (b->dest != dest || b->mode != mode || b->count == BATCH_SIZE))
+		batch_run(b);
+
+	b->dest = dest;
+	b->mode = mode;
+	b->blits[b->count].src = src;
+	b->blits[b->count].rect = *rect;
+	b->blits[b->count].sx = sx;
+	b->blits[b->count].sy = sy;
+	b->blits[b->count].has_src = has_src;
+	b->blits[b->count].modulate = color != NULL;
+	if (color)
+		memcpy(b->blits[b->count].color, color, 4);
+	b->count++;
+	pthread_mutex_unlock(&b->lock);
+
+	return 1;
+}
+
+void rgba_batch_flush(device_ctx_t *device)
+{
+	struct rgba_batch *b = device ? device->rgba_batch : NULL;
+
+	if (!b)
+		return;
+
+	pthread_mutex_lock(&b->lock);
+	if (b->count)
+		batch_run(b);
+	pthread_mutex_unlock(&b->lock);
+}
+
+int rgba_batch_init(device_ctx_t *device)
+{
+	device->rgba_batch = calloc(1, sizeof(*device->rgba_batch));
+	if (!device->rgba_batch)
+		return 0;
+
+	pthread_mutex_init(&device->rgba_batch->lock, NULL);
+	return 1;
+}
+
+void rgba_batch_free(device_ctx_t *device)
+{
+	if (!device->rgba_batch)
+		return;
+
+	pthread_mutex_destroy(&device->rgba_batch->lock);
+	free(device->rgba_batch);
+	device->rgba_batch = NULL;
+}
+
+VdpStatus rgba_render_surface(rgba_surface_t *dest, VdpRect const *destination_rect, rgba_surface_t *src, VdpRect const *source_rect, VdpColor const *colors, VdpOutputSurfaceRenderBlendState const *blend_state, uint32_t flags)
+{
+	VdpRect d_rect = { 0, 0, dest->width, dest->height };
+	VdpRect s_rect = { 0, 0, 1, 1 };
+	uint8_t k[4] = { 0, 0, 0, 0 }, vc[4][4];
+	int x, y, i;
+
+	if (blend_state && blend_state->struct_version != VDP_OUTPUT_SURFACE_RENDER_BLEND_STATE_VERSION)
+		return VDP_STATUS_INVALID_STRUCT_VERSION;
+
+	if (destination_rect)
+		d_rect = *destination_rect;
+	if (src)
+	{
+		s_rect.x1 = src->width;
+		s_rect.y1 = src->height;
+		if (source_rect)
+			s_rect = *source_rect;
+		rect_clip(&s_rect, src->width, src->height);
+	}
+
+	int dw = d_rect.x1 - d_rect.x0, dh = d_rect.y1 - d_rect.y0;
+	VdpRect c_rect = d_rect;
+	rect_clip(&c_rect, dest->width, dest->height);
+	if (rect_empty(&c_rect) || rect_empty(&s_rect))
+		return VDP_STATUS_OK;
+
+	if (!rgba_alloc(dest))
+		return VDP_STATUS_RESOURCES;
+
+	enum blend_mode mode = get_blend_mode(blend_state);
+	if ((dest->flags & RGBA_FLAG_NEEDS_CLEAR) && (mode != BLEND_COPY || !rect_inside(&dest->dirty, &c_rect)))
+		rgba_clear(dest);
+
+	if (blend_state)
+	{
+		uint32_t kp = color_to_pixel(&blend_state->blend_constant, dest->format);
+		memcpy(k, &kp, 4);
+	}
+
+	/* upper left, upper right, lower right, lower left */
+	int ncolors = !colors ? 0 : (flags & VDP_OUTPUT_SURFACE_RENDER_COLOR_PER_VERTEX) ? 4 : 1;
+	for (i = 0; i < 4; i++)
+	{
+		uint32_t p = ncolors ? color_to_pixel(&colors[ncolors == 4 ? i : 0], dest->format) : 0xffffffff;
+		memcpy(vc[i], &p, 4);
+	}
+	if (ncolors == 1 && *(uint32_t *)vc[0] == 0xffffffff)
+		ncolors = 0;
+
+	int cw = c_rect.x1 - c_rect.x0;
+	int swap = src && src->format != dest->format;
+	int has_src = src && rgba_allocated(src) && !(src->flags & RGBA_FLAG_NEEDS_CLEAR);
+	int sw = s_rect.x1 - s_rect.x0, sh = s_rect.y1 - s_rect.y0;
+	int rotation = flags & 3;
+	uint32_t *row;
+
+	/* unscaled glyph blits are collected and drawn together */
+	if (src && src != dest && rotation == VDP_OUTPUT_SURFACE_RENDER_ROTATE_0 && sw == dw && sh == dh &&
+	    mode != BLEND_GENERIC && ncolors <= 1 && dest->device &&
+	    batch_add(dest->device->rgba_batch, dest, mode, &c_rect, src, has_src,
+	              s_rect.x0 + c_rect.x0 - d_rect.x0, s_rect.y0 + c_rect.y0 - d_rect.y0, ncolors ? vc[0] : NULL))
+	{
+		rgba_changed(dest, &c_rect);
+		return VDP_STATUS_OK;
+	}
+
+	rgba_batch_flush(dest->device);
+
+	row = malloc(cw * 4);
+	if (!row)
+		return VDP_STATUS_RESOURCES;
+
+	for (y = c_rect.y0; y < c_rect.y1; y++)
+	{
+		/* source position of the first pixel and step per destination pixel */
+		int xi = c_rect.x0 - d_rect.x0, yi = y - d_rect.y0;
+		int32_t fx, fy, dx = 0, dy = 0;
+
+		switch (rotation)
+		{
+		case VDP_OUTPUT_SURFACE_RENDER_ROTATE_90:
+			fx = sample_pos(s_rect.x0, sw, yi, dh);
+			fy = sample_pos(s_rect.y1, -sh, xi, dw);
+			dy = -((int64_t)sh * 65536 / dw);
+			break;
+		case VDP_OUTPUT_SURFACE_RENDER_ROTATE_180:
+			fx = sample_pos(s_rect.x1, -sw, xi, dw);
+			fy = sample_pos(s_rect.y1, -sh, yi, dh);
+			dx = -((int64_t)sw * 65536 / dw);
+			break;
+		case VDP_OUTPUT_SURFACE_RENDER_ROTATE_270:
+			fx = sample_pos(s_rect.x1, -sw, yi, dh);
+			fy = sample_pos(s_rect.y0, sh, xi, dw);
+			dy = (int64_t)sh * 65536 / dw;
+			break;
+		default:
+			fx = sample_pos(s_rect.x0, sw, xi, dw);
+			fy = sample_pos(s_rect.y0, sh, yi, dh);
+			dx = (int64_t)sw * 65536 / dw;
+			break;
+		}
+
+		if (!src)
+			for (x = 0; x < cw; x++)
+				row[x] = 0xffffffff;
+		else if (!has_src)
+			memset(row, 0, cw * 4);
+		else if (rotation == VDP_OUTPUT_SURFACE_RENDER_ROTATE_0 && sw == dw && !swap)
+			memcpy(row, rgba_line(src, fy >> 16) + (fx >> 16), cw * 4);
+		else
+		{
+			for (x = 0; x < cw; x++, fx += dx, fy += dy)
+			{
+				int sx = clamp(fx >> 16, (int)s_rect.x0, (int)s_rect.x1 - 1);
+				int sy = clamp(fy >> 16, (int)s_rect.y0, (int)s_rect.y1 - 1);
+				uint32_t p = rgba_line(src, sy)[sx];
+				row[x] = swap ? swap_rb(p) : p;
+			}
+		}
+
+		if (ncolors == 1)
+			modulate_row((uint8_t *)row, cw, vc[0], vc[0]);
+		else if (ncolors == 4)
+		{
+			uint8_t left[4], right[4];
+			for (i = 0; i < 4; i++)
+			{
+				left[i] = (vc[0][i] * (2 * (dh - yi) - 1) + vc[3][i] * (2 * yi + 1)) / (2 * dh);
+				right[i] = (vc[1][i] * (2 * (dh - yi) - 1) + vc[2][i] * (2 * yi + 1)) / (2 * dh);
+			}
+			modulate_row((uint8_t *)row, cw, left, right);
+		}
+
+		blend_row((uint8_t *)(rgba_line(dest, y) + c_rect.x0), (const uint8_t *)row, cw, mode, blend_state, k);
+	}
+
+	free(row);
+	rgba_changed(dest, &c_rect);
+
+	return VDP_STATUS_OK;
+}
+
+/*
+ * Indexed bitmaps are expanded through a palette that is converted to the
+ * surface's byte order beforehand, so a pixel is one table lookup plus
+ * its alpha. The 16 entries of the 4 bit formats fit into byte shuffles,
+ * 8 bit indices exceed what vtbl can address and use plain lookups.
+ */
+static void indexed_row_4(uint32_t *dst, const uint8_t *src, int n, const uint32_t *pal, int ishift)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		uint32_t a = (src[i] >> (4 - ishift)) & 0xf;
+		dst[i] = pal[(src[i] >> ishift) & 0xf] | (a * 0x11) << 24;
+	}
+}
+
+static void indexed_row_8(uint32_t *dst, const uint8_t *src, int n, const uint32_t *pal, int ioff)
+{
+	int i;
+
+	for (i = 0; i < n; i++, src += 2)
+		dst[i] = pal[src[ioff]] | (uint32_t)src[1 - ioff] << 24;
+}
+
+#ifdef HAVE_NEON
+static int indexed_row_4_neon(uint32_t *dst, const uint8_t *src, int n, const uint32_t *pal, int ishift)
+{
+	uint8x8x2_t tbl[3];
+	int i, c;
+
+	for (c = 0; c < 3; c++)
+	{
+		uint8_t t[16];
+		for (i = 0; i < 16; i++)
+			t[i] = pal[i] >> (8 * c);
+		tbl[c].val[0] = vld1_u8(t);
+		tbl[c].val[1] = vld1_u8(t + 8);
+	}
+
+	for (i = 0; i + 8 <= n; i += 8)
+	{
+		uint8x8_t v = vld1_u8(src + i), idx, a;
+		uint8x8x4_t p;
+
+		if (ishift)
+		{
+			idx = vshr_n_u8(v, 4);
+			a = vand_u8(v, vdup_n_u8(0xf));
+		}
+		else
+		{
+			idx = vand_u8(v, vdup_n_u8(0xf));
+			a = vshr_n_u8(v, 4);
+		}
+
+		for (c = 0; c < 3; c++)
+			p.val[c] = vtbl2_u8(tbl[c], idx);
+		p.val[3] = vorr_u8(a, vshl_n_u8(a, 4));
+
+		vst4_u8((uint8_t *)(dst + i), p);
+	}
+
+	return i;
+}
+#endif
+
+#ifdef HAVE_X86
+__attribute__((target("ssse3")))
+static int indexed_row_4_ssse3(uint32_t *dst, const uint8_t *src, int n, const uint32_t *pal, int ishift)
+{
+	const __m128i mask = _mm_set1_epi8(0xf);
+	__m128i tbl[3];
+	int i, c;
+
+	for (c = 0; c < 3; c++)
+	{
+		uint8_t t[16];
+		for (i = 0; i < 16; i++)
+			t[i] = pal[i] >> (8 * c);
+		tbl[c] = _mm_loadu_si128((const __m128i *)t);
+	}
+
+	for (i = 0; i + 16 <= n; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i lo = _mm_and_si128(v, mask);
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+		__m128i idx = ishift ? hi : lo;
+		__m128i a = ishift ? lo : hi;
+
+		a = _mm_or_si128(a, _mm_slli_epi16(a, 4));
+		__m128i c0 = _mm_shuffle_epi8(tbl[0], idx);
+		__m128i c1 = _mm_shuffle_epi8(tbl[1], idx);
+		__m128i c2 = _mm_shuffle_epi8(tbl[2], idx);
+
+		__m128i c01l = _mm_unpacklo_epi8(c0, c1), c01h = _mm_unpackhi_epi8(c0, c1);
+		__m128i c23l = _mm_unpacklo_epi8(c2, a), c23h = _mm_unpackhi_epi8(c2, a);
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi16(c01l, c23l));
+		_mm_storeu_si128((__m128i *)(dst + i + 4), _mm_unpackhi_epi16(c01l, c23l));
+		_mm_storeu_si128((__m128i *)(dst + i + 8), _mm_unpacklo_epi16(c01h, c23h));
+		_mm_storeu_si128((__m128i *)(dst + i + 12), _mm_unpackhi_epi16(c01h, c23h));
+	}
+
+	return i;
+}
+#endif
+
+VdpStatus rgba_put_bits_indexed(rgba_surface_t *rgba, VdpIndexedFormat source_indexed_format, void const *const *source_data, uint32_t const *source_pitch, VdpRect const *destination_rect, VdpColorTableFormat color_table_format, void const *color_table)
+{
+	VdpRect d_rect = { 0, 0, rgba->width, rgba->height };
+	uint32_t pal[256];
+	int entries, bits, y, i;
+
+	if (!source_data || !source_pitch || !color_table)
+		return VDP_STATUS_INVALID_POINTER;
+
+	if (color_table_format != VDP_COLOR_TABLE_FORMAT_B8G8R8X8)
+		return VDP_STATUS_INVALID_COLOR_TABLE_FORMAT;
+
+	switch (source_indexed_format)
+	{
+	case VDP_INDEXED_FORMAT_A4I4:
+	case VDP_INDEXED_FORMAT_I4A4:
+		entries = 16;
+		bits = 4;
+		break;
+	case VDP_INDEXED_FORMAT_A8I8:
+	case VDP_INDEXED_FORMAT_I8A8:
+		entries = 256;
+		bits = 8;
+		break;
+	default:
+		return VDP_STATUS_INVALID_INDEXED_FORMAT;
+	}
+
+	if (destination_rect)
+		d_rect = *destination_rect;
+	rect_clip(&d_rect, rgba->width, rgba->height);
+	if (rect_empty(&d_rect))
+		return VDP_STATUS_OK;
+
+	rgba_batch_flush(rgba->device);
+	if (!rgba_alloc(rgba))
+		return VDP_STATUS_RESOURCES;
+
+	if ((rgba->flags & RGBA_FLAG_NEEDS_CLEAR) && !rect_inside(&rgba->dirty, &d_rect))
+		rgba_clear(rgba);
+
+	/* B8G8R8X8 entries already are B8G8R8A8 pixels without alpha */
+	const uint32_t *table = color_table;
+	for (i = 0; i < entries; i++)
+		pal[i] = (rgba->format == VDP_RGBA_FORMAT_R8G8B8A8 ? swap_rb(table[i]) : table[i]) & 0x00ffffff;
+
+	/* position of the index, alpha is the other nibble or byte */
+	int ishift = source_indexed_format == VDP_INDEXED_FORMAT_I4A4 ? 4 : 0;
+	int ioff = source_indexed_format == VDP_INDEXED_FORMAT_A8I8 ? 1 : 0;
+	int n = d_rect.x1 - d_rect.x0;
+
+#ifdef HAVE_X86
+	int ssse3 = __builtin_cpu_supports("ssse3");
+#endif
+
+	for (y = d_rect.y0; y < d_rect.y1; y++)
+	{
+		const uint8_t *src = (const uint8_t *)source_data[0] + (y - d_rect.y0) * source_pitch[0];
+		uint32_t *dst = rgba_line(rgba, y) + d_rect.x0;
+
+		if (bits == 8)
+		{
+			indexed_row_8(dst, src, n, pal, ioff);
+			continue;
+		}
+
+		i = 0;
+#ifdef HAVE_NEON
+		i = indexed_row_4_neon(dst, src, n, pal, ishift);
+#endif
+#ifdef HAVE_X86
+		if (ssse3)
+			i = indexed_row_4_ssse3(dst, src, n, pal, ishift);
+#endif
+		indexed_row_4(dst + i, src + i, n - i, pal, ishift);
+	}
+
+	rgba_changed(rgba, &d_rect);
+
+	return VDP_STATUS_OK;
+}
+
+void rgba_clear(rgba_surface_t *rgba)
+{
+	rgba_batch_flush(rgba->device);
+
+	if (rgba->flags & RGBA_FLAG_DIRTY)
+	{
+		rgba_fill_transparent(rgba, &rgba->dirty);
+		rect_add(&rgba->damage, &rgba->dirty);
+		rect_reset(rgba, &rgba->dirty);
+		rgba->flags |= RGBA_FLAG_NEEDS_FLUSH;
+	}
+
+	rgba->flags &= ~(RGBA_FLAG_DIRTY | RGBA_FLAG_NEEDS_CLEAR);
+}
+
+void rgba_flush(rgba_surface_t *rgba)
+{
+	rgba_batch_flush(rgba->device);
+
+	if (!(rgba->flags & RGBA_FLAG_NEEDS_FLUSH))
+		return;
+
+	if (!rect_empty(&rgba->damage) && !rgba->cpu_data)
+		cedarv_flush_cache(cedarv_subBuffer(rgba->data, rgba->damage.y0 * rgba->width * 4),
+		                   (rgba->damage.y1 - rgba->damage.y0) * rgba->width * 4);
+
+	rect_reset(rgba, &rgba->damage);
+	rgba->flags &= ~RGBA_FLAG_NEEDS_FLUSH;
+}
@@ -0,0 +1,22 @@
+#ifndef _RGBA_H_
+#define _RGBA_H_
+
+#include "vdpau_private.h"
+
+VdpStatus rgba_create(rgba_surface_t *rgba, device_ctx_t *device, uint32_t width, uint32_t height, VdpRGBAFormat format, VdpBool frequently_accessed);
+void rgba_destroy(rgba_surface_t *rgba);
+
+VdpStatus rgba_put_bits_native(rgba_surface_t *rgba, void const *const *source_data, uint32_t const *source_pitches, VdpRect const *destination_rect);
+VdpStatus rgba_put_bits_indexed(rgba_surface_t *rgba, VdpIndexedFormat source_indexed_format, void const *const *source_data, uint32_t const *source_pitch, VdpRect const *destination_rect, VdpColorTableFormat color_table_format, void const *color_table);
+VdpStatus rgba_get_bits_native(rgba_surface_t *rgba, VdpRect const *source_rect, void *const *destination_data, uint32_t const *destination_pitches);
+
+VdpStatus rgba_render_surface(rgba_surface_t *dest, VdpRect const *destination_rect, rgba_surface_t *src, VdpRect const *source_rect, VdpColor const *colors, VdpOutputSurfaceRenderBlendState const *blend_state, uint32_t flags);
+
+void rgba_clear(rgba_surface_t *rgba);
+void rgba_flush(rgba_surface_t *rgba);
+
+int rgba_batch_init(device_ctx_t *device);
+void rgba_batch_flush(device_ctx_t *device);
+void rgba_batch_free(device_ctx_t *device);
+
+#endif
@@ -17,24 +17,41 @@
  *
  */
 
+#include <errno.h>
 #include <fcntl.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <linux/fb.h>
 #include "kernel-headers/sunxi_disp_ioctl.h"
 #include "vdpau_private.h"
 #include "sunxi_disp.h"
 
+/* mixer layers are normal mode layers on pipe 0, blended by pixel alpha */
+#define DISP_LAYERS 2
+
 struct sunxi_disp_private
 {
 	struct sunxi_disp pub;
 
 	int fd;
+	int fb_fd;
+	uint64_t vblank_time;
 	int video_layer;
 	int osd_layer;
 	__disp_layer_info_t video_info;
 	__disp_layer_info_t osd_info;
+	/* what the driver was last given for each layer */
+	__disp_layer_info_t video_committed;
+	__disp_layer_info_t osd_committed;
+	int video_open;
+	int osd_open;
+	int layers[DISP_LAYERS];
+	__disp_layer_info_t layer_committed[DISP_LAYERS];
+	int layer_open[DISP_LAYERS];
 };
 
 static void sunxi_disp_close(struct sunxi_disp *sunxi_disp);
@@ -42,11 +59,102 @@ static int sunxi_disp_set_video_layer(struct sunxi_disp *sunxi_disp, int x, int
 static void sunxi_disp_close_video_layer(struct sunxi_disp *sunxi_disp);
 static int sunxi_disp_set_osd_layer(struct sunxi_disp *sunxi_disp, int x, int y, int width, int height, output_surface_ctx_t *surface);
 static void sunxi_disp_close_osd_layer(struct sunxi_disp *sunxi_disp);
+static int sunxi_disp_set_layer(struct sunxi_disp *sunxi_disp, int index, int x, int y, output_surface_ctx_t *surface, VdpRect const *src_rect, VdpRect const *dst_rect);
+static void sunxi_disp_close_layer(struct sunxi_disp *sunxi_disp, int index);
+static int sunxi_disp_wait_vsync(struct sunxi_disp *sunxi_disp);
+static uint64_t sunxi_disp_get_vblank_time(struct sunxi_disp *sunxi_disp);
+
+/*
+ * The disp drivers have no vsync wait, their framebuffer driver has. This
+ * returns the framebuffer device shown on screen, or -1. Asking for the
+ * fb's layer on a screen fails if it isn't shown there.
+ */
+int sunxi_disp_open_fb(int screen)
+{
+	char path[16];
+	uint32_t layer;
+	int i, fd;
+
+	for (i = 0; i < 8; i++)
+	{
+		snprintf(path, sizeof(path), "/dev/fb%d", i);
+		fd = open(path, O_RDWR);
+		if (fd == -1)
+			continue;
+
+		if (ioctl(fd, screen ? FBIOGET_LAYER_HDL_1 : FBIOGET_LAYER_HDL_0, &layer) == 0)
+			return fd;
+		close(fd);
+	}
+
+	return -1;
+}
 
-struct sunxi_disp *sunxi_disp_open(void)
+/*
+ * The driver doesn't report when the vertical blank was, the time is
+ * taken when the wait returns. It's late by the wakeup latency, which is
+ * good enough to pace frames by.
+ */
+int sunxi_disp_wait_fb_vsync(int fb_fd, uint64_t *vblank_time)
+{
+	uint32_t crtc = 0;
+
+	if (fb_fd == -1 || ioctl(fb_fd, FBIO_WAITFORVSYNC, &crtc))
+		return -ENODEV;
+
+	*vblank_time = get_time();
+	return 0;
+}
+
+/*
+ * For the disp 1.x backends. DISP_CMD_LAYER_SET_PARA makes the driver
+ * recompute the whole layer. A new frame with otherwise unchanged
+ * parameters only needs the buffer addresses changed by
+ * DISP_CMD_LAYER_SET_FB, and nothing at all is sent when the frame is the
+ * same. committed and open follow what the driver accepted.
+ */
+int sunxi_disp_commit_layer(int fd, uint32_t screen, uint32_t layer, __disp_layer_info_t *info, __disp_layer_info_t *committed, int *open)
+{
+	uint32_t args[4] = { screen, layer, (unsigned long)info, 0 };
+	__disp_layer_info_t tmp = *committed;
+
+	memcpy(tmp.fb.addr, info->fb.addr, sizeof(tmp.fb.addr));
+	if (!*open || memcmp(&tmp, info, sizeof(tmp)) != 0)
+	{
+		if (ioctl(fd, DISP_CMD_LAYER_SET_PARA, args) < 0)
+		{
+			VDPAU_DBG("setting parameters of layer %u failed, errno=%d", layer, errno);
+			return -EINVAL;
+		}
+	}
+	else if (memcmp(committed->fb.addr, info->fb.addr, sizeof(info->fb.addr)) != 0)
+	{
+		args[2] = (unsigned long)(&info->fb);
+		if (ioctl(fd, DISP_CMD_LAYER_SET_FB, args) < 0)
+		{
+			VDPAU_DBG("setting buffer of layer %u failed, errno=%d", layer, errno);
+			return -EINVAL;
+		}
+	}
+	*committed = *info;
+
+	if (!*open)
+	{
+		if (ioctl(fd, DISP_CMD_LAYER_OPEN, args) < 0)
+		{
+			VDPAU_DBG("opening layer %u failed, errno=%d", layer, errno);
+			return -EINVAL;
+		}
+		*open = 1;
+	}
+
+	return 0;
+}
+
+struct sunxi_disp *sunxi_disp_open(int osd_enabled)
 {
-        const int osd_enabled = 0;
 	struct sunxi_disp_private *disp = calloc(1, sizeof(*disp));
+	int i;
 
 	disp->fd = open("/dev/disp", O_RDWR);
 	if (disp->fd == -1)
@@ -66,6 +174,19 @@ struct sunxi_disp *sunxi_disp_open(void)
 
 	if (osd_enabled)
 	{
+		/* between video and OSD, in the order they are requested */
+		for (i = 0; i < DISP_LAYERS; i++)
+		{
+			args[1] = DISP_LAYER_WORK_MODE_NORMAL;
+			disp->layers[i] = ioctl(disp->fd, DISP_CMD_LAYER_REQUEST, args);
+			if (disp->layers[i] == 0)
+				break;
+
+			args[1] = disp->layers[i];
+			ioctl(disp->fd, DISP_CMD_LAYER_TOP, args);
+		}
+		disp->pub.layer_count = i;
+
 		args[1] = DISP_LAYER_WORK_MODE_NORMAL;
 		disp->osd_layer = ioctl(disp->fd, DISP_CMD_LAYER_REQUEST, args);
 		if (disp->osd_layer == 0)
@@ -107,11 +228,22 @@ struct sunxi_disp *sunxi_disp_open(void)
 	disp->pub.close_video_layer = sunxi_disp_close_video_layer;
 	disp->pub.set_osd_layer = sunxi_disp_set_osd_layer;
 	disp->pub.close_osd_layer = sunxi_disp_close_osd_layer;
+	disp->pub.set_layer = sunxi_disp_set_layer;
+	disp->pub.close_layer = sunxi_disp_close_layer;
+	disp->pub.wait_vsync = sunxi_disp_wait_vsync;
+	disp->pub.get_vblank_time = sunxi_disp_get_vblank_time;
+
+	disp->fb_fd = sunxi_disp_open_fb(0);
 
 	return (struct sunxi_disp *)disp;
 
 err_osd_layer:
-	args[1] = disp->osd_layer;
+	for (i = 0; i < disp->pub.layer_count; i++)
+	{
+		args[1] = disp->layers[i];
+		ioctl(disp->fd, DISP_CMD_LAYER_RELEASE, args);
+	}
+	args[1] = disp->video_layer;
 	ioctl(disp->fd, DISP_CMD_LAYER_RELEASE, args);
 err_video_layer:
 err_version:
@@ -136,6 +268,16 @@ static void sunxi_disp_close(struct sunxi_disp *sunxi_disp)
 		ioctl(disp->fd, DISP_CMD_LAYER_RELEASE, args);
 	}
 
+	int i;
+	for (i = 0; i < disp->pub.layer_count; i++)
+	{
+		args[1] = disp->layers[i];
+		ioctl(disp->fd, DISP_CMD_LAYER_CLOSE, args);
+		ioctl(disp->fd, DISP_CMD_LAYER_RELEASE, args);
+	}
+
+	if (disp->fb_fd != -1)
+		close(disp->fb_fd);
 	close(disp->fd);
 	free(sunxi_disp);
 }
@@ -143,8 +285,11 @@ static void sunxi_disp_close(struct sunxi_disp *sunxi_disp)
 static int sunxi_disp_set_video_layer(struct sunxi_disp *sunxi_disp, int x, int y, int width, int height, output_surface_ctx_t *surface)
 {
 	struct sunxi_disp_private *disp = (struct sunxi_disp_private *)sunxi_disp;
+	video_scanout_t scanout;
 
-	switch (surface->vs->source_format) {
+	video_surface_get_scanout(surface->vs, surface->video_field, &scanout);
+
+	switch (scanout.format) {
 	case VDP_YCBCR_FORMAT_YUYV:
 		disp->video_info.fb.mode = DISP_MOD_INTERLEAVED;
 		disp->video_info.fb.format = DISP_FORMAT_YUV422;
@@ -173,16 +318,31 @@ static int sunxi_disp_set_video_layer(struct sunxi_disp *sunxi_disp, int x, int
 		break;
 	}
 
-	disp->video_info.fb.addr[0] = cedarv_virt2phys(surface->vs->dataY);
-	disp->video_info.fb.addr[1] = cedarv_virt2phys(surface->vs->dataU) /*+ surface->vs->luma_size*/;
-	disp->video_info.fb.addr[2] = cedarv_virt2phys(surface->vs->dataV) /*+ surface->vs->luma_size + surface->vs->chroma_size / 2*/;
+	disp->video_info.fb.addr[0] = cedarv_virt2phys(scanout.plane[0]) + scanout.offset[0];
+	disp->video_info.fb.addr[1] = cedarv_virt2phys(scanout.plane[1]) + scanout.offset[1] /*+ surface->vs->luma_size*/;
+	disp->video_info.fb.addr[2] = cedarv_virt2phys(scanout.plane[2]) + scanout.offset[2] /*+ surface->vs->luma_size + surface->vs->chroma_size / 2*/;
 
-	disp->video_info.fb.size.width = surface->vs->width;
+	/* the fb width is the line pitch in pixels, the tiled layout has its own */
+	if (scanout.format == INTERNAL_YCBCR_FORMAT)
+		disp->video_info.fb.size.width = surface->vs->width;
+	else if (disp->video_info.fb.mode == DISP_MOD_INTERLEAVED)
+		disp->video_info.fb.size.width = scanout.pitch[0] / 2;
+	else
+		disp->video_info.fb.size.width = scanout.pitch[0];
 	disp->video_info.fb.size.height = surface->vs->height;
 	disp->video_info.src_win.x = surface->video_src_rect.x0;
 	disp->video_info.src_win.y = surface->video_src_rect.y0;
 	disp->video_info.src_win.width = surface->video_src_rect.x1 - surface->video_src_rect.x0;
 	disp->video_info.src_win.height = surface->video_src_rect.y1 - surface->video_src_rect.y0;
+
+	if (scanout.field)
+	{
+		/* the fb width is its pitch, every other line belongs to the other field */
+		disp->video_info.fb.size.width *= 2;
+		disp->video_info.fb.size.height /= 2;
+		disp->video_info.src_win.y /= 2;
+		disp->video_info.src_win.height /= 2;
+	}
 	disp->video_info.scn_win.x = x + surface->video_dst_rect.x0;
 	disp->video_info.scn_win.y = y + surface->video_dst_rect.y0;
 	disp->video_info.scn_win.width = surface->video_dst_rect.x1 - surface->video_dst_rect.x0;
@@ -198,10 +358,9 @@ static int sunxi_disp_set_video_layer(struct sunxi_disp *sunxi_disp, int x, int
 		disp->video_info.scn_win.height -= scn_clip;
 	}
 
-	uint32_t args[4] = { 0, disp->video_layer, (unsigned long)(&disp->video_info), 0 };
-	ioctl(disp->fd, DISP_CMD_LAYER_SET_PARA, args);
+	sunxi_disp_commit_layer(disp->fd, 0, disp->video_layer, &disp->video_info, &disp->video_committed, &disp->video_open);
 
-	ioctl(disp->fd, DISP_CMD_LAYER_OPEN, args);
+	uint32_t args[4] = { 0, disp->video_layer, 0, 0 };
 
 	// Note: might be more reliable (but slower and problematic when there
 	// are driver issues and the GET functions return wrong values) to query the
@@ -233,6 +392,7 @@ static void sunxi_disp_close_video_layer(struct sunxi_disp *sunxi_disp)
 
 	uint32_t args[4] = { 0, disp->video_layer, 0, 0 };
 	ioctl(disp->fd, DISP_CMD_LAYER_CLOSE, args);
+	disp->video_open = 0;
 }
 
 static int sunxi_disp_set_osd_layer(struct sunxi_disp *sunxi_disp, int x, int y, int width, int height, output_surface_ctx_t *surface)
@@ -262,12 +422,7 @@ static int sunxi_disp_set_osd_layer(struct sunxi_disp *sunxi_disp, int x, int y,
 	disp->osd_info.scn_win.width = min_nz(width, surface->rgba.dirty.x1) - surface->rgba.dirty.x0;
 	disp->osd_info.scn_win.height = min_nz(height, surface->rgba.dirty.y1) - surface->rgba.dirty.y0;
 
-	uint32_t args[4] = { 0, disp->osd_layer, (unsigned long)(&disp->osd_info), 0 };
-	ioctl(disp->fd, DISP_CMD_LAYER_SET_PARA, args);
-
-	ioctl(disp->fd, DISP_CMD_LAYER_OPEN, args);
-
-	return 0;
+	return sunxi_disp_commit_layer(disp->fd, 0, disp->osd_layer, &disp->osd_info, &disp->osd_committed, &disp->osd_open);
 }
 
 static void sunxi_disp_close_osd_layer(struct sunxi_disp *sunxi_disp)
@@ -276,4 +431,73 @@ static void sunxi_disp_close_osd_layer(struct sunxi_disp *sunxi_disp)
 
 	uint32_t args[4] = { 0, disp->osd_layer, 0, 0 };
 	ioctl(disp->fd, DISP_CMD_LAYER_CLOSE, args);
+	disp->osd_open = 0;
+}
+
+static int sunxi_disp_set_layer(struct sunxi_disp *sunxi_disp, int index, int x, int y, output_surface_ctx_t *surface, VdpRect const *src_rect, VdpRect const *dst_rect)
+{
+	struct sunxi_disp_private *disp = (struct sunxi_disp_private *)sunxi_disp;
+	__disp_layer_info_t info;
+
+	if (index < 0 || index >= disp->pub.layer_count)
+		return -ENODEV;
+
+	memset(&info, 0, sizeof(info));
+	info.pipe = 0;
+	info.mode = DISP_LAYER_WORK_MODE_NORMAL;
+	/* no global alpha, the pixels' own alpha blends the layer */
+	info.alpha_en = 0;
+	info.fb.mode = DISP_MOD_INTERLEAVED;
+	info.fb.format = DISP_FORMAT_ARGB8888;
+	info.fb.seq = DISP_SEQ_ARGB;
+	info.fb.br_swap = surface->rgba.format == VDP_RGBA_FORMAT_R8G8B8A8;
+	info.fb.cs_mode = DISP_BT601;
+	info.fb.addr[0] = cedarv_virt2phys(surface->rgba.data);
+	info.fb.size.width = surface->rgba.width;
+	info.fb.size.height = surface->rgba.height;
+	info.src_win.x = src_rect->x0;
+	info.src_win.y = src_rect->y0;
+	info.src_win.width = src_rect->x1 - src_rect->x0;
+	info.src_win.height = src_rect->y1 - src_rect->y0;
+	info.scn_win.x = x + dst_rect->x0;
+	info.scn_win.y = y + dst_rect->y0;
+	info.scn_win.width = dst_rect->x1 - dst_rect->x0;
+	info.scn_win.height = dst_rect->y1 - dst_rect->y0;
+
+	if (info.scn_win.y < 0)
+	{
+		int scn_clip = -(info.scn_win.y);
+		info.src_win.y += scn_clip;
+		info.src_win.height -= scn_clip;
+		info.scn_win.y = 0;
+		info.scn_win.height -= scn_clip;
+	}
+
+	return sunxi_disp_commit_layer(disp->fd, 0, disp->layers[index], &info, &disp->layer_committed[index], &disp->layer_open[index]);
+}
+
+static void sunxi_disp_close_layer(struct sunxi_disp *sunxi_disp, int index)
+{
+	struct sunxi_disp_private *disp = (struct sunxi_disp_private *)sunxi_disp;
+
+	if (index < 0 || index >= disp->pub.layer_count || !disp->layer_open[index])
+		return;
+
+	uint32_t args[4] = { 0, disp->layers[index], 0, 0 };
+	ioctl(disp->fd, DISP_CMD_LAYER_CLOSE, args);
+	disp->layer_open[index] = 0;
+}
+
+static int sunxi_disp_wait_vsync(struct sunxi_disp *sunxi_disp)
+{
+	struct sunxi_disp_private *disp = (struct sunxi_disp_private *)sunxi_disp;
+
+	return sunxi_disp_wait_fb_vsync(disp->fb_fd, &disp->vblank_time);
+}
+
+static uint64_t sunxi_disp_get_vblank_time(struct sunxi_disp *sunxi_disp)
+{
+	struct sunxi_disp_private *disp = (struct sunxi_disp_private *)sunxi_disp;
+
+	return disp->vblank_time;
 }
@@ -29,14 +29,43 @@ struct sunxi_disp
 	void (*close_video_layer)(struct sunxi_disp *sunxi_disp);
 	int (*set_osd_layer)(struct sunxi_disp *sunxi_disp, int x, int y, int width, int height, output_surface_ctx_t *surface);
 	void (*close_osd_layer)(struct sunxi_disp *sunxi_disp);
+	/* overlay planes between video and OSD, showing the rect src of surface at dst */
+	int layer_count;
+	int (*set_layer)(struct sunxi_disp *sunxi_disp, int index, int x, int y, output_surface_ctx_t *surface, VdpRect const *src, VdpRect const *dst);
+	void (*close_layer)(struct sunxi_disp *sunxi_disp, int index);
+	/* applies everything set since the last call at once, NULL if the calls above take effect on their own */
+	int (*commit)(struct sunxi_disp *sunxi_disp);
+	/* blocks until the next vertical blank, layers set before take effect there */
+	int (*wait_vsync)(struct sunxi_disp *sunxi_disp);
+	/* CLOCK_MONOTONIC time of the vertical blank wait_vsync last returned on, estimated by some backends */
+	uint64_t (*get_vblank_time)(struct sunxi_disp *sunxi_disp);
 };
 
-struct sunxi_disp *sunxi_disp_open(void);
-struct sunxi_disp *sunxi_disp2_open(void);
+/* vsync of the legacy disp drivers, see sunxi_disp.c */
+int sunxi_disp_open_fb(int screen);
+int sunxi_disp_wait_fb_vsync(int fb_fd, uint64_t *vblank_time);
+#ifdef __SUNXI_DISP_IOCTL_H__
+int sunxi_disp_commit_layer(int fd, uint32_t screen, uint32_t layer, __disp_layer_info_t *info, __disp_layer_info_t *committed, int *open);
+#endif
+
+struct cedarv_yuv_frame;
+struct cedarv_csc;
+/* for backends converting the video in software, see surface_output.c */
+void output_surface_get_video_frame(output_surface_ctx_t *os, struct cedarv_yuv_frame *frame, VdpRect *src, struct cedarv_csc *csc);
+
+struct sunxi_disp *sunxi_disp_open(int osd_enabled);
+struct sunxi_disp *sunxi_disp2_open(int osd_enabled);
 struct sunxi_disp *sunxi_disp1_5_open(void);
-struct sunxi_disp *sunxi_disp0_open(void);
+struct sunxi_disp *sunxi_disp0_open(int osd_enabled);
+struct sunxi_disp *sunxi_sink_open(const char *spec);
+#ifdef DEF_DRM
+struct sunxi_disp *sunxi_drm_open(int osd_enabled);
+#endif /*DEF_DRM*/
 #ifdef DEF_RENDERX11
 struct sunxi_disp *sunxi_dispx11_open(Display *display, Drawable drawable);
 #endif /*DEF_RENDERX11*/
+#ifdef DEF_RENDERXV
+struct sunxi_disp *sunxi_dispxv_open(Display *display, Drawable drawable);
+#endif /*DEF_RENDERXV*/
 
 #endif
@@ -21,32 +21,48 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <linux/fb.h>
 #include "kernel-headers/sunxi_display2.h"
 #include "vdpau_private.h"
 #include "sunxi_disp.h"
 #include <stdio.h>
 
+/* mixer layers use channel 2 layers 1 to 3, under the OSD on layer 0 */
+#define DISP2_LAYERS 3
+
 struct sunxi_disp2_private
 {
 	struct sunxi_disp pub;
 
 	int fd;
+	int fb_fd;
+	uint64_t vblank_time;
 	disp_layer_config video_config;
 	unsigned int screen_width;
 	disp_layer_config osd_config;
+	disp_layer_config layer_config[DISP2_LAYERS];
+	/* what the driver was last given for each of the above */
+	disp_layer_config video_committed;
+	disp_layer_config osd_committed;
+	disp_layer_config layer_committed[DISP2_LAYERS];
 };
 
 static void sunxi_disp2_close(struct sunxi_disp *sunxi_disp);
+static int commit_config(struct sunxi_disp2_private *disp, disp_layer_config *config, disp_layer_config *committed);
 static int sunxi_disp2_set_video_layer(struct sunxi_disp *sunxi_disp, int x, int y, int width, int height, output_surface_ctx_t *surface);
 static void sunxi_disp2_close_video_layer(struct sunxi_disp *sunxi_disp);
 static int sunxi_disp2_set_osd_layer(struct sunxi_disp *sunxi_disp, int x, int y, int width, int height, output_surface_ctx_t *surface);
 static void sunxi_disp2_close_osd_layer(struct sunxi_disp *sunxi_disp);
+static int sunxi_disp2_set_layer(struct sunxi_disp *sunxi_disp, int index, int x, int y, output_surface_ctx_t *surface, VdpRect const *src_rect, VdpRect const *dst_rect);
+static void sunxi_disp2_close_layer(struct sunxi_disp *sunxi_disp, int index);
+static int sunxi_disp2_wait_vsync(struct sunxi_disp *sunxi_disp);
+static uint64_t sunxi_disp2_get_vblank_time(struct sunxi_disp *sunxi_disp);
 
-struct sunxi_disp *sunxi_disp2_open(void)
+struct sunxi_disp *sunxi_disp2_open(int osd_enabled)
 {
-        const int osd_enabled = 0;
 	struct sunxi_disp2_private *disp = calloc(1, sizeof(*disp));
 
 	disp->fd = open("/dev/disp", O_RDWR);
@@ -54,7 +70,6 @@ struct sunxi_disp *sunxi_disp2_open(void)
 		goto err_open;
 
 	fprintf(stderr, "%s:%d\n", __func__, __LINE__);
-	unsigned long args[4] = { 0, (unsigned long)(&disp->video_config), 1, 0 };
 
 	disp->video_config.info.mode = LAYER_MODE_BUFFER;
 	disp->video_config.info.alpha_mode = 1;
@@ -65,7 +80,7 @@ struct sunxi_disp *sunxi_disp2_open(void)
 	disp->video_config.layer_id = 0;
 	disp->video_config.info.zorder = 1;
 
-	if (ioctl(disp->fd, DISP_LAYER_SET_CONFIG, args))
+	if (commit_config(disp, &disp->video_config, &disp->video_committed))
 		goto err_video_layer;
 
 	if (osd_enabled)
@@ -77,13 +92,28 @@ struct sunxi_disp *sunxi_disp2_open(void)
 		disp->osd_config.enable = 0;
 		disp->osd_config.channel = 2;
 		disp->osd_config.layer_id = 0;
-		disp->osd_config.info.zorder = 2;
+		disp->osd_config.info.zorder = 2 + DISP2_LAYERS;
 
-		args[1] = (unsigned long)(&disp->osd_config);
-		if (ioctl(disp->fd, DISP_LAYER_SET_CONFIG, args))
+		if (commit_config(disp, &disp->osd_config, &disp->osd_committed))
 			goto err_video_layer;
+
+		int i;
+		for (i = 0; i < DISP2_LAYERS; i++)
+		{
+			disp_layer_config *config = &disp->layer_config[i];
+
+			config->info.mode = LAYER_MODE_BUFFER;
+			config->info.alpha_mode = 0;
+			config->info.alpha_value = 255;
+			config->enable = 0;
+			config->channel = 2;
+			config->layer_id = i + 1;
+			config->info.zorder = 2 + i;
+		}
+		disp->pub.layer_count = DISP2_LAYERS;
 	}
 
+	unsigned long args[4] = { 0, 0, 0, 0 };
 	disp->screen_width = ioctl(disp->fd, DISP_GET_SCN_WIDTH, args);
 
 	disp->pub.close = sunxi_disp2_close;
@@ -91,6 +121,12 @@ struct sunxi_disp *sunxi_disp2_open(void)
 	disp->pub.close_video_layer = sunxi_disp2_close_video_layer;
 	disp->pub.set_osd_layer = sunxi_disp2_set_osd_layer;
 	disp->pub.close_osd_layer = sunxi_disp2_close_osd_layer;
+	disp->pub.set_layer = sunxi_disp2_set_layer;
+	disp->pub.close_layer = sunxi_disp2_close_layer;
+	disp->pub.wait_vsync = sunxi_disp2_wait_vsync;
+	disp->pub.get_vblank_time = sunxi_disp2_get_vblank_time;
+
+	disp->fb_fd = sunxi_disp_open_fb(0);
 
 	fprintf(stderr, "%s:%d - screen_width=%d disp=%p (OK)\n", __func__, __LINE__, disp->screen_width, disp);
 	return (struct sunxi_disp *)disp;
@@ -108,22 +144,45 @@ static void sunxi_disp2_close(struct sunxi_disp *sunxi_disp)
 {
 	struct sunxi_disp2_private *disp = (struct sunxi_disp2_private *)sunxi_disp;
 
-	unsigned long args[4] = { 0, (unsigned long)(&disp->video_config), 1, 0 };
-
 	disp->video_config.enable = 0;
-	ioctl(disp->fd, DISP_LAYER_SET_CONFIG, args);
+	commit_config(disp, &disp->video_config, &disp->video_committed);
 
-	if (disp->osd_config.enable)
-	{
-		disp->osd_config.enable = 0;
-		args[1] = (unsigned long)(&disp->osd_config);
-		ioctl(disp->fd, DISP_LAYER_SET_CONFIG, args);
-	}
+	sunxi_disp2_close_osd_layer(sunxi_disp);
+
+	int i;
+	for (i = 0; i < disp->pub.layer_count; i++)
+		sunxi_disp2_close_layer(sunxi_disp, i);
 
+	if (disp->fb_fd != -1)
+		close(disp->fb_fd);
 	close(disp->fd);
 	free(sunxi_disp);
 }
 
+/*
+ * Every DISP_LAYER_SET_CONFIG makes the driver recompute the layer setup,
+ * a config equal to the one committed last isn't sent again. Showing the
+ * next frame with unchanged geometry still needs one call, the driver has
+ * no cheaper way to change just the buffer addresses.
+ */
+static int commit_config(struct sunxi_disp2_private *disp, disp_layer_config *config, disp_layer_config *committed)
+{
+	unsigned long args[4] = { 0, (unsigned long)config, 1, 0 };
+
+	if (memcmp(config, committed, sizeof(*config)) == 0)
+		return 0;
+
+	if (ioctl(disp->fd, DISP_LAYER_SET_CONFIG, args))
+	{
+		/* unknown what the driver kept, send everything next time */
+		memset(committed, 0, sizeof(*committed));
+		return -EINVAL;
+	}
+
+	*committed = *config;
+	return 0;
+}
+
 static void clip(disp_rect *src, disp_rect *scn, unsigned int screen_width)
 {
 	if (scn->y < 0)
@@ -166,8 +225,10 @@ static int sunxi_disp2_set_video_layer(struct sunxi_disp *sunxi_disp, int x, int
 
 	clip (&src, &scn, disp->screen_width);
 
-	unsigned long args[4] = { 0, (unsigned long)(&disp->video_config), 1, 0 };
-	switch (surface->vs->source_format)
+	video_scanout_t scanout;
+	video_surface_get_scanout(surface->vs, surface->video_field, &scanout);
+
+	switch (scanout.format)
 	{
 	case VDP_YCBCR_FORMAT_YUYV:
 		disp->video_config.info.fb.format = DISP_FORMAT_YUV422_I_YUYV;
@@ -176,7 +237,6 @@ static int sunxi_disp2_set_video_layer(struct sunxi_disp *sunxi_disp, int x, int
 		disp->video_config.info.fb.format = DISP_FORMAT_YUV422_I_UYVY;
 		break;
 	case VDP_YCBCR_FORMAT_NV12:
-	  fprintf(stderr, "%s:%d VDP_YCBCR_FORMAT_NV12\n", __func__, __LINE__);
 		disp->video_config.info.fb.format = DISP_FORMAT_YUV420_SP_UVUV;
 		break;
 	case VDP_YCBCR_FORMAT_YV12:
@@ -186,20 +246,51 @@ static int sunxi_disp2_set_video_layer(struct sunxi_disp *sunxi_disp, int x, int
 		break;
 	}
 
-	disp->video_config.info.fb.addr[0] = cedarv_virt2phys(surface->vs->dataY);
-	disp->video_config.info.fb.addr[1] = cedarv_virt2phys(surface->vs->dataU) /*+ surface->vs->luma_size*/;
-        if( cedarv_isValid(surface->vs->dataV))
-	  disp->video_config.info.fb.addr[2] = cedarv_virt2phys(surface->vs->dataV) /*+ surface->vs->luma_size + surface->vs->chroma_size / 2*/;
+	disp->video_config.info.fb.addr[0] = cedarv_virt2phys(scanout.plane[0]) + scanout.offset[0];
+	disp->video_config.info.fb.addr[1] = cedarv_virt2phys(scanout.plane[1]) + scanout.offset[1] /*+ surface->vs->luma_size*/;
+        if( cedarv_isValid(scanout.plane[2]))
+	  disp->video_config.info.fb.addr[2] = cedarv_virt2phys(scanout.plane[2]) + scanout.offset[2] /*+ surface->vs->luma_size + surface->vs->chroma_size / 2*/;
 
-	disp->video_config.info.fb.size[0].width = surface->vs->width;
+	/* widths are the line pitches in pixels, 2 bytes for packed and interleaved samples */
+	switch (scanout.format)
+	{
+	case VDP_YCBCR_FORMAT_YUYV:
+	case VDP_YCBCR_FORMAT_UYVY:
+		disp->video_config.info.fb.size[0].width = scanout.pitch[0] / 2;
+		break;
+	case VDP_YCBCR_FORMAT_NV12:
+		disp->video_config.info.fb.size[0].width = scanout.pitch[0];
+		disp->video_config.info.fb.size[1].width = scanout.pitch[1] / 2;
+		break;
+	case VDP_YCBCR_FORMAT_YV12:
+		disp->video_config.info.fb.size[0].width = scanout.pitch[0];
+		disp->video_config.info.fb.size[1].width = scanout.pitch[1];
+		disp->video_config.info.fb.size[2].width = scanout.pitch[2];
+		break;
+	default:
+		disp->video_config.info.fb.size[0].width = surface->vs->width;
+		disp->video_config.info.fb.size[1].width = surface->vs->width / 2;
+		disp->video_config.info.fb.size[2].width = surface->vs->width / 2;
+		break;
+	}
 	disp->video_config.info.fb.size[0].height = surface->vs->height;
 	disp->video_config.info.fb.align[0] = 32;
-	disp->video_config.info.fb.size[1].width = surface->vs->width / 2;
 	disp->video_config.info.fb.size[1].height = surface->vs->height / 2;
 	disp->video_config.info.fb.align[1] = 16;
-	disp->video_config.info.fb.size[2].width = surface->vs->width / 2;
 	disp->video_config.info.fb.size[2].height = surface->vs->height / 2;
 	disp->video_config.info.fb.align[2] = 16;
+	if (scanout.field)
+	{
+		/* widths set the pitch, every other line belongs to the other field */
+		int i;
+		for (i = 0; i < 3; i++)
+		{
+			disp->video_config.info.fb.size[i].width *= 2;
+			disp->video_config.info.fb.size[i].height /= 2;
+		}
+		src.y /= 2;
+		src.height /= 2;
+	}
 	disp->video_config.info.fb.crop.x = (unsigned long long)(src.x) << 32;
 	disp->video_config.info.fb.crop.y = (unsigned long long)(src.y) << 32;
 	disp->video_config.info.fb.crop.width = (unsigned long long)(src.width) << 32;
@@ -207,30 +298,49 @@ static int sunxi_disp2_set_video_layer(struct sunxi_disp *sunxi_disp, int x, int
 	disp->video_config.info.screen_win = scn;
 	disp->video_config.enable = 1;
 
-	fprintf(stderr, "%s:%d DISP_LAYER_SET_CONFIG %08llx %08llx\n", __func__, __LINE__, disp->video_config.info.fb.addr[0], disp->video_config.info.fb.addr[1]);
-	if (ioctl(disp->fd, DISP_LAYER_SET_CONFIG, args))
-		return -EINVAL;
-
-	fprintf(stderr, "%s:%d OK\n", __func__, __LINE__);
-	return 0;
+	return commit_config(disp, &disp->video_config, &disp->video_committed);
 }
 
 static void sunxi_disp2_close_video_layer(struct sunxi_disp *sunxi_disp)
 {
 	struct sunxi_disp2_private *disp = (struct sunxi_disp2_private *)sunxi_disp;
 
-	unsigned long args[4] = { 0, (unsigned long)(&disp->video_config), 1, 0 };
-
 	disp->video_config.enable = 0;
+	commit_config(disp, &disp->video_config, &disp->video_committed);
+}
 
-	ioctl(disp->fd, DISP_LAYER_SET_CONFIG, args);
+static void set_rgba_config(disp_layer_config *config, rgba_surface_t *rgba, disp_rect const *src, disp_rect const *scn)
+{
+	switch (rgba->format)
+	{
+	case VDP_RGBA_FORMAT_R8G8B8A8:
+		config->info.fb.format = DISP_FORMAT_ABGR_8888;
+		break;
+	case VDP_RGBA_FORMAT_B8G8R8A8:
+	default:
+		config->info.fb.format = DISP_FORMAT_ARGB_8888;
+		break;
+	}
+
+	config->info.fb.addr[0] = cedarv_virt2phys(rgba->data);
+	config->info.fb.size[0].width = rgba->width;
+	config->info.fb.size[0].height = rgba->height;
+	config->info.fb.align[0] = 1;
+	config->info.fb.crop.x = (unsigned long long)(src->x) << 32;
+	config->info.fb.crop.y = (unsigned long long)(src->y) << 32;
+	config->info.fb.crop.width = (unsigned long long)(src->width) << 32;
+	config->info.fb.crop.height = (unsigned long long)(src->height) << 32;
+	config->info.screen_win = *scn;
+	config->enable = 1;
 }
 
 static int sunxi_disp2_set_osd_layer(struct sunxi_disp *sunxi_disp, int x, int y, int width, int height, output_surface_ctx_t *surface)
 {
 	struct sunxi_disp2_private *disp = (struct sunxi_disp2_private *)sunxi_disp;
 
-	unsigned long args[4] = { 0, (unsigned long)(&disp->osd_config), 1, 0 };
+	/* no OSD channel was set up, channel 0 belongs to the video layer */
+	if (!disp->osd_config.channel)
+		return -ENODEV;
 
 	disp_rect src = { .x = surface->rgba.dirty.x0, .y = surface->rgba.dirty.y0,
 			  .width = surface->rgba.dirty.x1 - surface->rgba.dirty.x0,
@@ -240,42 +350,65 @@ static int sunxi_disp2_set_osd_layer(struct sunxi_disp *sunxi_disp, int x, int y
 			  .height = min_nz(height, surface->rgba.dirty.y1) - surface->rgba.dirty.y0 };
 
 	clip (&src, &scn, disp->screen_width);
+	set_rgba_config(&disp->osd_config, &surface->rgba, &src, &scn);
 
-	switch (surface->rgba.format)
-	{
-	case VDP_RGBA_FORMAT_R8G8B8A8:
-		disp->osd_config.info.fb.format = DISP_FORMAT_ABGR_8888;
-		break;
-	case VDP_RGBA_FORMAT_B8G8R8A8:
-	default:
-		disp->osd_config.info.fb.format = DISP_FORMAT_ARGB_8888;
-		break;
-	}
+	return commit_config(disp, &disp->osd_config, &disp->osd_committed);
+}
 
-	disp->osd_config.info.fb.addr[0] = cedarv_virt2phys(surface->rgba.data);
-	disp->osd_config.info.fb.size[0].width = surface->rgba.width;
-	disp->osd_config.info.fb.size[0].height = surface->rgba.height;
-	disp->osd_config.info.fb.align[0] = 1;
-	disp->osd_config.info.fb.crop.x = (unsigned long long)(src.x) << 32;
-	disp->osd_config.info.fb.crop.y = (unsigned long long)(src.y) << 32;
-	disp->osd_config.info.fb.crop.width = (unsigned long long)(src.width) << 32;
-	disp->osd_config.info.fb.crop.height = (unsigned long long)(src.height) << 32;
-	disp->osd_config.info.screen_win = scn;
-	disp->osd_config.enable = 1;
+static void sunxi_disp2_close_osd_layer(struct sunxi_disp *sunxi_disp)
+{
+	struct sunxi_disp2_private *disp = (struct sunxi_disp2_private *)sunxi_disp;
 
-	if (ioctl(disp->fd, DISP_LAYER_SET_CONFIG, args))
-		return -EINVAL;
+	if (!disp->osd_config.channel || !disp->osd_config.enable)
+		return;
 
-	return 0;
+	disp->osd_config.enable = 0;
+	commit_config(disp, &disp->osd_config, &disp->osd_committed);
 }
 
-static void sunxi_disp2_close_osd_layer(struct sunxi_disp *sunxi_disp)
+static int sunxi_disp2_set_layer(struct sunxi_disp *sunxi_disp, int index, int x, int y, output_surface_ctx_t *surface, VdpRect const *src_rect, VdpRect const *dst_rect)
 {
 	struct sunxi_disp2_private *disp = (struct sunxi_disp2_private *)sunxi_disp;
 
-	unsigned long args[4] = { 0, (unsigned long)(&disp->osd_config), 1, 0 };
+	if (index < 0 || index >= disp->pub.layer_count)
+		return -ENODEV;
 
-	disp->osd_config.enable = 0;
+	disp_layer_config *config = &disp->layer_config[index];
+
+	disp_rect src = { .x = src_rect->x0, .y = src_rect->y0,
+			  .width = src_rect->x1 - src_rect->x0,
+			  .height = src_rect->y1 - src_rect->y0 };
+	disp_rect scn = { .x = x + dst_rect->x0, .y = y + dst_rect->y0,
+			  .width = dst_rect->x1 - dst_rect->x0,
+			  .height = dst_rect->y1 - dst_rect->y0 };
+
+	clip (&src, &scn, disp->screen_width);
+	set_rgba_config(config, &surface->rgba, &src, &scn);
+
+	return commit_config(disp, config, &disp->layer_committed[index]);
+}
+
+static void sunxi_disp2_close_layer(struct sunxi_disp *sunxi_disp, int index)
+{
+	struct sunxi_disp2_private *disp = (struct sunxi_disp2_private *)sunxi_disp;
+
+	if (index < 0 || index >= disp->pub.layer_count || !disp->layer_config[index].enable)
+		return;
+
+	disp->layer_config[index].enable = 0;
+	commit_config(disp, &disp->layer_config[index], &disp->layer_committed[index]);
+}
+
+static int sunxi_disp2_wait_vsync(struct sunxi_disp *sunxi_disp)
+{
+	struct sunxi_disp2_private *disp = (struct sunxi_disp2_private *)sunxi_disp;
+
+	return sunxi_disp_wait_fb_vsync(disp->fb_fd, &disp->vblank_time);
+}
+
+static uint64_t sunxi_disp2_get_vblank_time(struct sunxi_disp *sunxi_disp)
+{
+	struct sunxi_disp2_private *disp = (struct sunxi_disp2_private *)sunxi_disp;
 
-	ioctl(disp->fd, DISP_LAYER_SET_CONFIG, args);
+	return disp->vblank_time;
 }
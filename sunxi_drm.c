@@ -0,0 +1,1221 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+#include "vdpau_private.h"
+#include "sunxi_disp.h"
+#include "yuv2rgb.h"
+
+#ifndef DRM_FORMAT_MOD_ALLWINNER_TILED
+#define DRM_FORMAT_MOD_ALLWINNER_TILED ((0x09ULL << 56) | 1)
+#endif
+
+/* overlay planes for mixer layers, between the video and the OSD plane */
+#define DRM_LAYERS 3
+
+/*
+ * Imported framebuffers, enough for the video surfaces of a decoder and
+ * the output surfaces cycling through the queue. Each one holds a
+ * reference on its dma-buf, so they are dropped when the memory is
+ * freed, cedarv_free() runs fb_forget() for that.
+ */
+#define DRM_FB_CACHE 32
+
+/*
+ * Frames which can't be imported are copied into dumb buffers. Of three
+ * the one written is neither on screen nor waiting for the flip, since
+ * a commit waits for the previous one to complete.
+ */
+#define DRM_DUMB_BUFFERS 3
+
+enum plane_prop
+{
+	PROP_FB_ID,
+	PROP_CRTC_ID,
+	PROP_SRC_X,
+	PROP_SRC_Y,
+	PROP_SRC_W,
+	PROP_SRC_H,
+	PROP_CRTC_X,
+	PROP_CRTC_Y,
+	PROP_CRTC_W,
+	PROP_CRTC_H,
+	PROP_ZPOS,
+	PROP_COUNT
+};
+
+static const char *const plane_prop_names[PROP_COUNT] =
+{
+	"FB_ID", "CRTC_ID", "SRC_X", "SRC_Y", "SRC_W", "SRC_H",
+	"CRTC_X", "CRTC_Y", "CRTC_W", "CRTC_H", "zpos"
+};
+
+struct drm_plane
+{
+	uint32_t id;
+	/* 0 if the plane lacks the property (or zpos is immutable) */
+	uint32_t prop[PROP_COUNT];
+	/* values of the last commit and those to go out with the next one */
+	uint64_t committed[PROP_COUNT];
+	uint64_t pending[PROP_COUNT];
+};
+
+/* VdpRect is unsigned, windows can be partly off screen */
+struct rect
+{
+	int x0, y0, x1, y1;
+};
+
+struct fb_key
+{
+	uintptr_t addr[3];
+	uint32_t fourcc;
+	uint32_t width, height;
+	uint32_t pitch[3];
+	uint64_t modifier;
+};
+
+struct drm_fb
+{
+	struct fb_key key;
+	uint32_t id;
+	uint64_t last_use;
+};
+
+struct dumb_buffer
+{
+	uint32_t handle, fb_id;
+	uint32_t fourcc, width, height;
+	uint32_t pitch;
+	uint8_t *map;
+	uint64_t size;
+	/* where the video went in a screen sized frame, the rest is black */
+	struct rect drawn;
+};
+
+struct dumb_ring
+{
+	struct dumb_buffer buf[DRM_DUMB_BUFFERS];
+	int next;
+};
+
+struct sunxi_drm_private
+{
+	struct sunxi_disp pub;
+
+	int fd;
+	uint32_t crtc_id;
+	int crtc_index;
+	int screen_width, screen_height;
+
+	struct drm_plane video;
+	struct drm_plane osd;
+	struct drm_plane layer[DRM_LAYERS];
+	int osd_enabled;
+
+	/*
+	 * Without an NV12 overlay the video plane is an RGB one, the primary
+	 * plane as the last resort, which has to cover the whole screen.
+	 * video_rgb is also set if the plane can't scale NV12 (vkms).
+	 */
+	int video_rgb, video_has_rgb, video_primary;
+	struct rect video_tested;
+	struct dumb_ring video_dumb, osd_dumb, layer_dumb[DRM_LAYERS];
+
+	/* set if the CRTC was off, the first commit turns it on */
+	int modeset;
+	uint32_t connector_id, connector_crtc_prop;
+	uint32_t crtc_active_prop, crtc_mode_prop, mode_blob;
+
+	/* the cache is also changed by fb_forget(), from any thread freeing memory */
+	pthread_mutex_t fb_lock;
+	struct drm_fb fb[DRM_FB_CACHE];
+	uint64_t fb_clock;
+	/* set once the allocator turned out not to export dma-bufs */
+	int no_import;
+
+	int flip_pending;
+	uint64_t vblank_time;
+};
+
+static void sunxi_drm_close(struct sunxi_disp *sunxi_disp);
+static void fb_forget(void *arg, uintptr_t phys, size_t size);
+static int sunxi_drm_set_video_layer(struct sunxi_disp *sunxi_disp, int x, int y, int width, int height, output_surface_ctx_t *surface);
+static void sunxi_drm_close_video_layer(struct sunxi_disp *sunxi_disp);
+static int sunxi_drm_set_osd_layer(struct sunxi_disp *sunxi_disp, int x, int y, int width, int height, output_surface_ctx_t *surface);
+static void sunxi_drm_close_osd_layer(struct sunxi_disp *sunxi_disp);
+static int sunxi_drm_set_layer(struct sunxi_disp *sunxi_disp, int index, int x, int y, output_surface_ctx_t *surface, VdpRect const *src_rect, VdpRect const *dst_rect);
+static void sunxi_drm_close_layer(struct sunxi_disp *sunxi_disp, int index);
+static int sunxi_drm_commit(struct sunxi_disp *sunxi_disp);
+static int sunxi_drm_wait_vsync(struct sunxi_disp *sunxi_disp);
+static uint64_t sunxi_drm_get_vblank_time(struct sunxi_disp *sunxi_disp);
+
+static uint32_t find_prop(int fd, uint32_t object_id, uint32_t object_type, const char *name, int mutable_only)
+{
+	drmModeObjectPropertiesPtr props = drmModeObjectGetProperties(fd, object_id, object_type);
+	uint32_t id = 0;
+	uint32_t i;
+
+	if (!props)
+		return 0;
+
+	for (i = 0; i < props->count_props && !id; i++)
+	{
+		drmModePropertyPtr prop = drmModeGetProperty(fd, props->props[i]);
+		if (!prop)
+			continue;
+
+		if (strcmp(prop->name, name) == 0 && !(mutable_only && (prop->flags & DRM_MODE_PROP_IMMUTABLE)))
+			id = prop->prop_id;
+
+		drmModeFreeProperty(prop);
+	}
+
+	drmModeFreeObjectProperties(props);
+	return id;
+}
+
+static int plane_type(int fd, uint32_t plane_id)
+{
+	drmModeObjectPropertiesPtr props = drmModeObjectGetProperties(fd, plane_id, DRM_MODE_OBJECT_PLANE);
+	int type = -1;
+	uint32_t i;
+
+	if (!props)
+		return -1;
+
+	for (i = 0; i < props->count_props && type == -1; i++)
+	{
+		drmModePropertyPtr prop = drmModeGetProperty(fd, props->props[i]);
+		if (!prop)
+			continue;
+
+		if (strcmp(prop->name, "type") == 0)
+			type = props->prop_values[i];
+
+		drmModeFreeProperty(prop);
+	}
+
+	drmModeFreeObjectProperties(props);
+	return type;
+}
+
+static int plane_init(struct sunxi_drm_private *disp, struct drm_plane *plane, uint32_t id, uint64_t zpos)
+{
+	int i;
+
+	plane->id = id;
+	for (i = 0; i < PROP_COUNT; i++)
+	{
+		plane->prop[i] = find_prop(disp->fd, id, DRM_MODE_OBJECT_PLANE, plane_prop_names[i], i == PROP_ZPOS);
+		if (!plane->prop[i] && i != PROP_ZPOS)
+			return -1;
+	}
+
+	/* the plane might still show something from before, turn it off with the first commit */
+	memset(plane->committed, 0xff, sizeof(plane->committed));
+	memset(plane->pending, 0, sizeof(plane->pending));
+	plane->pending[PROP_ZPOS] = zpos;
+	return 0;
+}
+
+static int plane_has_format(drmModePlanePtr plane, uint32_t fourcc)
+{
+	uint32_t i;
+
+	for (i = 0; i < plane->count_formats; i++)
+		if (plane->formats[i] == fourcc)
+			return 1;
+
+	return 0;
+}
+
+/* NV12 overlays take the frames as they are, RGB planes get them converted */
+static int video_plane_rank(drmModePlanePtr plane, int type)
+{
+	if (type == DRM_PLANE_TYPE_OVERLAY && plane_has_format(plane, DRM_FORMAT_NV12))
+		return 3;
+	if (!plane_has_format(plane, DRM_FORMAT_XRGB8888))
+		return 0;
+
+	/* below everything, the overlays stay free for OSD and layers */
+	if (type == DRM_PLANE_TYPE_PRIMARY)
+		return 2;
+
+	return type == DRM_PLANE_TYPE_OVERLAY ? 1 : 0;
+}
+
+/*
+ * Video goes on the first overlay plane that can scan out NV12, or else
+ * the primary plane or an XRGB overlay. The OSD and mixer layers take
+ * the remaining ARGB overlays, stacked in that order where the driver
+ * lets zpos be changed.
+ */
+static int find_planes(struct sunxi_drm_private *disp)
+{
+	drmModePlaneResPtr res = drmModeGetPlaneResources(disp->fd);
+	uint32_t i, video_id = 0;
+	int layers = 0, osd = 0, rank = 0;
+
+	if (!res)
+		return -1;
+
+	for (i = 0; i < res->count_planes; i++)
+	{
+		drmModePlanePtr plane = drmModeGetPlane(disp->fd, res->planes[i]);
+		if (!plane)
+			continue;
+
+		if (plane->possible_crtcs & (1 << disp->crtc_index))
+		{
+			int r = video_plane_rank(plane, plane_type(disp->fd, plane->plane_id));
+			if (r > rank && plane_init(disp, &disp->video, plane->plane_id, r == 2 ? 0 : 1) == 0)
+			{
+				rank = r;
+				video_id = plane->plane_id;
+				disp->video_has_rgb = plane_has_format(plane, DRM_FORMAT_XRGB8888);
+			}
+		}
+
+		drmModeFreePlane(plane);
+	}
+
+	for (i = 0; i < res->count_planes && disp->osd_enabled && video_id; i++)
+	{
+		drmModePlanePtr plane = drmModeGetPlane(disp->fd, res->planes[i]);
+		if (!plane)
+			continue;
+
+		if ((plane->possible_crtcs & (1 << disp->crtc_index)) && plane->plane_id != video_id &&
+		    plane_type(disp->fd, plane->plane_id) == DRM_PLANE_TYPE_OVERLAY &&
+		    plane_has_format(plane, DRM_FORMAT_ARGB8888))
+		{
+			if (!osd)
+				osd = plane_init(disp, &disp->osd, plane->plane_id, 2 + DRM_LAYERS) == 0;
+			else if (layers < DRM_LAYERS && plane_init(disp, &disp->layer[layers], plane->plane_id, 2 + layers) == 0)
+				layers++;
+		}
+
+		drmModeFreePlane(plane);
+	}
+
+	drmModeFreePlaneResources(res);
+
+	disp->video_rgb = rank < 3;
+	disp->video_primary = rank == 2;
+	if (disp->video_rgb)
+		VDPAU_DBG("no NV12 overlay plane, video is converted to RGB");
+
+	/* only layers below the OSD, which has to sit on top */
+	disp->pub.layer_count = osd ? layers : 0;
+	if (!osd)
+		disp->osd.id = 0;
+
+	return video_id ? 0 : -1;
+}
+
+/*
+ * The CRTC of the first connected connector. If nothing lights it up yet
+ * (no console on it, or vkms) its preferred mode is set with the first
+ * commit.
+ */
+static int find_crtc(struct sunxi_drm_private *disp)
+{
+	drmModeResPtr res = drmModeGetResources(disp->fd);
+	int i, ret = -1;
+
+	if (!res)
+		return -1;
+
+	for (i = 0; i < res->count_connectors && ret; i++)
+	{
+		drmModeConnectorPtr conn = drmModeGetConnector(disp->fd, res->connectors[i]);
+		if (!conn)
+			continue;
+
+		if (conn->connection == DRM_MODE_CONNECTED && conn->count_modes > 0)
+		{
+			uint32_t crtc_id = 0;
+			drmModeEncoderPtr enc = conn->encoder_id ? drmModeGetEncoder(disp->fd, conn->encoder_id) : NULL;
+			if (enc)
+			{
+				crtc_id = enc->crtc_id;
+				drmModeFreeEncoder(enc);
+			}
+
+			/* unconnected so far, take any CRTC an encoder can drive */
+			int j, k;
+			for (j = 0; j < conn->count_encoders && !crtc_id; j++)
+			{
+				enc = drmModeGetEncoder(disp->fd, conn->encoders[j]);
+				if (!enc)
+					continue;
+				for (k = 0; k < res->count_crtcs && !crtc_id; k++)
+					if (enc->possible_crtcs & (1 << k))
+						crtc_id = res->crtcs[k];
+				drmModeFreeEncoder(enc);
+			}
+
+			drmModeCrtcPtr crtc = crtc_id ? drmModeGetCrtc(disp->fd, crtc_id) : NULL;
+			if (crtc)
+			{
+				drmModeModeInfo mode = crtc->mode_valid ? crtc->mode : conn->modes[0];
+				for (k = 0; k < conn->count_modes && !crtc->mode_valid; k++)
+					if (conn->modes[k].type & DRM_MODE_TYPE_PREFERRED)
+						mode = conn->modes[k];
+
+				disp->crtc_id = crtc_id;
+				for (k = 0; k < res->count_crtcs; k++)
+					if (res->crtcs[k] == crtc_id)
+						disp->crtc_index = k;
+				disp->screen_width = mode.hdisplay;
+				disp->screen_height = mode.vdisplay;
+
+				if (!crtc->mode_valid)
+				{
+					disp->modeset = 1;
+					disp->connector_id = conn->connector_id;
+					disp->connector_crtc_prop = find_prop(disp->fd, conn->connector_id, DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID", 0);
+					disp->crtc_active_prop = find_prop(disp->fd, crtc_id, DRM_MODE_OBJECT_CRTC, "ACTIVE", 0);
+					disp->crtc_mode_prop = find_prop(disp->fd, crtc_id, DRM_MODE_OBJECT_CRTC, "MODE_ID", 0);
+					if (drmModeCreatePropertyBlob(disp->fd, &mode, sizeof(mode), &disp->mode_blob))
+						disp->mode_blob = 0;
+				}
+
+				ret = disp->modeset && !(disp->connector_crtc_prop && disp->crtc_active_prop && disp->crtc_mode_prop && disp->mode_blob);
+				drmModeFreeCrtc(crtc);
+			}
+		}
+
+		drmModeFreeConnector(conn);
+	}
+
+	drmModeFreeResources(res);
+	return ret ? -1 : 0;
+}
+
+struct sunxi_disp *sunxi_drm_open(int osd_enabled)
+{
+	struct sunxi_drm_private *disp = calloc(1, sizeof(*disp));
+	const char *device = getenv("VDPAU_DRM_DEVICE");
+
+	if (!disp)
+		return NULL;
+
+	disp->fd = open(device ? device : "/dev/dri/card0", O_RDWR | O_CLOEXEC);
+	if (disp->fd == -1)
+		goto err_open;
+
+	if (drmSetClientCap(disp->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) ||
+	    drmSetClientCap(disp->fd, DRM_CLIENT_CAP_ATOMIC, 1))
+		goto err_caps;
+
+	disp->osd_enabled = osd_enabled;
+	if (find_crtc(disp) || find_planes(disp))
+		goto err_caps;
+
+	/* commits need DRM master, which a running X server keeps for itself */
+	drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+	if (!req)
+		goto err_caps;
+	drmModeAtomicAddProperty(req, disp->video.id, disp->video.prop[PROP_FB_ID], 0);
+	drmModeAtomicAddProperty(req, disp->video.id, disp->video.prop[PROP_CRTC_ID], 0);
+	int ret = drmModeAtomicCommit(disp->fd, req, DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+	drmModeAtomicFree(req);
+	if (ret)
+		goto err_caps;
+
+	pthread_mutex_init(&disp->fb_lock, NULL);
+	if (cedarv_add_free_hook(fb_forget, disp))
+	{
+		pthread_mutex_destroy(&disp->fb_lock);
+		goto err_caps;
+	}
+
+	disp->pub.close = sunxi_drm_close;
+	disp->pub.set_video_layer = sunxi_drm_set_video_layer;
+	disp->pub.close_video_layer = sunxi_drm_close_video_layer;
+	disp->pub.set_osd_layer = sunxi_drm_set_osd_layer;
+	disp->pub.close_osd_layer = sunxi_drm_close_osd_layer;
+	disp->pub.set_layer = sunxi_drm_set_layer;
+	disp->pub.close_layer = sunxi_drm_close_layer;
+	disp->pub.commit = sunxi_drm_commit;
+	disp->pub.wait_vsync = sunxi_drm_wait_vsync;
+	disp->pub.get_vblank_time = sunxi_drm_get_vblank_time;
+
+	return (struct sunxi_disp *)disp;
+
+err_caps:
+	VDPAU_DBG("no usable KMS plane on %s", device ? device : "/dev/dri/card0");
+	if (disp->mode_blob)
+		drmModeDestroyPropertyBlob(disp->fd, disp->mode_blob);
+	close(disp->fd);
+err_open:
+	free(disp);
+	return NULL;
+}
+
+static void fb_release(struct sunxi_drm_private *disp, struct drm_fb *fb)
+{
+	if (fb->id)
+		drmModeRmFB(disp->fd, fb->id);
+	memset(fb, 0, sizeof(*fb));
+}
+
+static void dumb_release(struct sunxi_drm_private *disp, struct dumb_buffer *b)
+{
+	if (b->fb_id)
+		drmModeRmFB(disp->fd, b->fb_id);
+	if (b->map)
+		munmap(b->map, b->size);
+	if (b->handle)
+	{
+		struct drm_mode_destroy_dumb destroy = { .handle = b->handle };
+		drmIoctl(disp->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+	}
+	memset(b, 0, sizeof(*b));
+}
+
+static void dumb_ring_release(struct sunxi_drm_private *disp, struct dumb_ring *ring)
+{
+	int i;
+
+	for (i = 0; i < DRM_DUMB_BUFFERS; i++)
+		dumb_release(disp, &ring->buf[i]);
+}
+
+/* the next buffer of ring, created again if format or size changed */
+static struct dumb_buffer *dumb_get(struct sunxi_drm_private *disp, struct dumb_ring *ring, uint32_t fourcc, uint32_t width, uint32_t height)
+{
+	struct dumb_buffer *b = &ring->buf[ring->next];
+
+	ring->next = (ring->next + 1) % DRM_DUMB_BUFFERS;
+	if (b->fb_id && b->fourcc == fourcc && b->width == width && b->height == height)
+		return b;
+	dumb_release(disp, b);
+
+	/* NV12 is one 8 bit buffer, the interleaved chroma lines below the luma */
+	int nv12 = fourcc == DRM_FORMAT_NV12;
+	struct drm_mode_create_dumb create = { .width = nv12 ? ALIGN(width, 2) : width,
+	                                       .height = nv12 ? height + (height + 1) / 2 : height,
+	                                       .bpp = nv12 ? 8 : 32 };
+	if (drmIoctl(disp->fd, DRM_IOCTL_MODE_CREATE_DUMB, &create))
+		return NULL;
+	b->handle = create.handle;
+	b->pitch = create.pitch;
+	b->size = create.size;
+
+	struct drm_mode_map_dumb map = { .handle = b->handle };
+	if (drmIoctl(disp->fd, DRM_IOCTL_MODE_MAP_DUMB, &map))
+		goto err;
+	b->map = mmap(NULL, b->size, PROT_READ | PROT_WRITE, MAP_SHARED, disp->fd, map.offset);
+	if (b->map == MAP_FAILED)
+	{
+		b->map = NULL;
+		goto err;
+	}
+
+	uint32_t handles[4] = { b->handle, nv12 ? b->handle : 0 };
+	uint32_t pitches[4] = { b->pitch, nv12 ? b->pitch : 0 };
+	uint32_t offsets[4] = { 0, nv12 ? b->pitch * height : 0 };
+	if (drmModeAddFB2(disp->fd, width, height, fourcc, handles, pitches, offsets, &b->fb_id, 0))
+	{
+		b->fb_id = 0;
+		goto err;
+	}
+
+	b->fourcc = fourcc;
+	b->width = width;
+	b->height = height;
+	return b;
+
+err:
+	dumb_release(disp, b);
+	return NULL;
+}
+
+static void sunxi_drm_close(struct sunxi_disp *sunxi_disp)
+{
+	struct sunxi_drm_private *disp = (struct sunxi_drm_private *)sunxi_disp;
+	int i;
+
+	sunxi_drm_close_video_layer(sunxi_disp);
+	sunxi_drm_close_osd_layer(sunxi_disp);
+	for (i = 0; i < disp->pub.layer_count; i++)
+		sunxi_drm_close_layer(sunxi_disp, i);
+
+	/* planes have to be off before their framebuffers go away */
+	if (sunxi_drm_commit(sunxi_disp) == 0)
+		sunxi_drm_wait_vsync(sunxi_disp);
+
+	cedarv_remove_free_hook(fb_forget, disp);
+	for (i = 0; i < DRM_FB_CACHE; i++)
+		fb_release(disp, &disp->fb[i]);
+	pthread_mutex_destroy(&disp->fb_lock);
+
+	dumb_ring_release(disp, &disp->video_dumb);
+	dumb_ring_release(disp, &disp->osd_dumb);
+	for (i = 0; i < DRM_LAYERS; i++)
+		dumb_ring_release(disp, &disp->layer_dumb[i]);
+
+	if (disp->mode_blob)
+		drmModeDestroyPropertyBlob(disp->fd, disp->mode_blob);
+	close(disp->fd);
+	free(sunxi_disp);
+}
+
+static int fb_in_use(struct sunxi_drm_private *disp, uint32_t id)
+{
+	int i;
+
+	if (disp->video.committed[PROP_FB_ID] == id || disp->video.pending[PROP_FB_ID] == id ||
+	    disp->osd.committed[PROP_FB_ID] == id || disp->osd.pending[PROP_FB_ID] == id)
+		return 1;
+
+	for (i = 0; i < disp->pub.layer_count; i++)
+		if (disp->layer[i].committed[PROP_FB_ID] == id || disp->layer[i].pending[PROP_FB_ID] == id)
+			return 1;
+
+	return 0;
+}
+
+/*
+ * Returns the framebuffer for the given planes, importing their dma-bufs
+ * on the first use. Adding a framebuffer is an ioctl round trip and an
+ * IOMMU mapping on most drivers, far too slow to repeat every frame.
+ */
+static uint32_t get_fb(struct sunxi_drm_private *disp, CEDARV_MEMORY const *mem, uint32_t const *offset, int planes, struct fb_key *key)
+{
+	struct drm_fb *fb = NULL;
+	uint32_t id;
+	int i;
+
+	if (disp->no_import)
+		return 0;
+
+	for (i = 0; i < planes; i++)
+		key->addr[i] = cedarv_virt2phys(mem[i]) + offset[i];
+
+	pthread_mutex_lock(&disp->fb_lock);
+	for (i = 0; i < DRM_FB_CACHE; i++)
+	{
+		if (disp->fb[i].id && memcmp(&disp->fb[i].key, key, sizeof(*key)) == 0)
+		{
+			disp->fb[i].last_use = ++disp->fb_clock;
+			id = disp->fb[i].id;
+			pthread_mutex_unlock(&disp->fb_lock);
+			return id;
+		}
+
+		/* an empty slot, or the least recently used one not on a plane */
+		if (!disp->fb[i].id)
+		{
+			if (!fb || fb->id)
+				fb = &disp->fb[i];
+		}
+		else if ((!fb || (fb->id && disp->fb[i].last_use < fb->last_use)) && !fb_in_use(disp, disp->fb[i].id))
+			fb = &disp->fb[i];
+	}
+
+	if (!fb)
+	{
+		pthread_mutex_unlock(&disp->fb_lock);
+		return 0;
+	}
+	fb_release(disp, fb);
+
+	uint32_t handles[4] = { 0 }, pitches[4] = { 0 }, offsets[4] = { 0 };
+	uint64_t modifiers[4] = { 0 };
+	for (i = 0; i < planes; i++)
+	{
+		int dmabuf = cedarv_export_dmabuf(mem[i], &offsets[i]);
+		if (dmabuf == -1)
+		{
+			/* UMP or the reserved memory of the cedar device, frames are copied */
+			if (errno == ENOSYS)
+				disp->no_import = 1;
+			break;
+		}
+
+		int ret = drmPrimeFDToHandle(disp->fd, dmabuf, &handles[i]);
+		close(dmabuf);
+		if (ret)
+			break;
+
+		offsets[i] += offset[i];
+		pitches[i] = key->pitch[i];
+		modifiers[i] = key->modifier;
+	}
+
+	if (i == planes)
+	{
+		if (drmModeAddFB2WithModifiers(disp->fd, key->width, key->height, key->fourcc, handles, pitches, offsets,
+		                               modifiers, &fb->id, key->modifier ? DRM_MODE_FB_MODIFIERS : 0))
+			fb->id = 0;
+	}
+
+	/* the framebuffer holds its own reference on the buffers */
+	int j;
+	for (i = 0; i < planes; i++)
+	{
+		for (j = 0; j < i && handles[j] != handles[i]; j++);
+		if (handles[i] && j == i)
+		{
+			struct drm_gem_close gem_close = { .handle = handles[i] };
+			drmIoctl(disp->fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+		}
+	}
+
+	if (fb->id)
+	{
+		fb->key = *key;
+		fb->last_use = ++disp->fb_clock;
+	}
+	id = fb->id;
+	pthread_mutex_unlock(&disp->fb_lock);
+	return id;
+}
+
+/*
+ * Memory at phys is freed, a later allocation there must not hit its
+ * framebuffers. One still on a plane can't be removed without blanking
+ * it, it only stops matching and goes first once it's replaced.
+ */
+static void fb_forget(void *arg, uintptr_t phys, size_t size)
+{
+	struct sunxi_drm_private *disp = arg;
+	int i, j;
+
+	pthread_mutex_lock(&disp->fb_lock);
+	for (i = 0; i < DRM_FB_CACHE; i++)
+	{
+		struct drm_fb *fb = &disp->fb[i];
+		for (j = 0; j < 3 && fb->id; j++)
+		{
+			if (fb->key.addr[j] && fb->key.addr[j] >= phys && fb->key.addr[j] < phys + size)
+			{
+				if (fb_in_use(disp, fb->id))
+				{
+					memset(&fb->key, 0, sizeof(fb->key));
+					fb->last_use = 0;
+				}
+				else
+					fb_release(disp, fb);
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&disp->fb_lock);
+}
+
+/* surfaces which can't be imported are copied into ring, only the part in src */
+static uint32_t get_rgba_fb(struct sunxi_drm_private *disp, struct dumb_ring *ring, rgba_surface_t *rgba, struct rect src)
+{
+	struct fb_key key;
+	uint32_t offset = 0, fb_id;
+
+	memset(&key, 0, sizeof(key));
+	key.fourcc = rgba->format == VDP_RGBA_FORMAT_R8G8B8A8 ? DRM_FORMAT_ABGR8888 : DRM_FORMAT_ARGB8888;
+	key.width = rgba->width;
+	key.height = rgba->height;
+	key.pitch[0] = rgba->width * 4;
+
+	fb_id = get_fb(disp, &rgba->data, &offset, 1, &key);
+	if (fb_id)
+		return fb_id;
+
+	struct dumb_buffer *b = dumb_get(disp, ring, key.fourcc, rgba->width, rgba->height);
+	if (!b)
+		return 0;
+
+	int x0 = max(src.x0, 0), x1 = min(src.x1, (int)rgba->width);
+	int y0 = max(src.y0, 0), y1 = min(src.y1, (int)rgba->height);
+	const uint8_t *in = cedarv_getPointer(rgba->data);
+	for (; y0 < y1 && x0 < x1; y0++)
+		memcpy(b->map + y0 * b->pitch + x0 * 4, in + y0 * key.pitch[0] + x0 * 4, (x1 - x0) * 4);
+
+	return b->fb_id;
+}
+
+/* src and dst are clipped to the screen, planes can't hang off its edges on every driver */
+static int plane_set(struct sunxi_drm_private *disp, struct drm_plane *plane, uint32_t fb_id, int fb_height,
+                     struct rect src, struct rect dst)
+{
+	int src_w = src.x1 - src.x0, src_h = src.y1 - src.y0;
+	int dst_w = dst.x1 - dst.x0, dst_h = dst.y1 - dst.y0;
+
+	if (!fb_id || src_w <= 0 || src_h <= 0 || dst_w <= 0 || dst_h <= 0)
+		return -EINVAL;
+
+	if (dst.x0 < 0)
+	{
+		src.x0 += (int64_t)-dst.x0 * src_w / dst_w;
+		dst.x0 = 0;
+	}
+	if (dst.y0 < 0)
+	{
+		src.y0 += (int64_t)-dst.y0 * src_h / dst_h;
+		dst.y0 = 0;
+	}
+	if (dst.x1 > disp->screen_width)
+	{
+		src.x1 -= (int64_t)(dst.x1 - disp->screen_width) * src_w / dst_w;
+		dst.x1 = disp->screen_width;
+	}
+	if (dst.y1 > disp->screen_height)
+	{
+		src.y1 -= (int64_t)(dst.y1 - disp->screen_height) * src_h / dst_h;
+		dst.y1 = disp->screen_height;
+	}
+	if (src.y1 > fb_height)
+		src.y1 = fb_height;
+
+	if (dst.x1 <= dst.x0 || dst.y1 <= dst.y0 || src.x1 <= src.x0 || src.y1 <= src.y0)
+		return -EINVAL;
+
+	/* the scaler is programmed from these, source coordinates are 16.16 fixed point */
+	plane->pending[PROP_FB_ID] = fb_id;
+	plane->pending[PROP_CRTC_ID] = disp->crtc_id;
+	plane->pending[PROP_SRC_X] = (uint64_t)src.x0 << 16;
+	plane->pending[PROP_SRC_Y] = (uint64_t)src.y0 << 16;
+	plane->pending[PROP_SRC_W] = (uint64_t)(src.x1 - src.x0) << 16;
+	plane->pending[PROP_SRC_H] = (uint64_t)(src.y1 - src.y0) << 16;
+	plane->pending[PROP_CRTC_X] = dst.x0;
+	plane->pending[PROP_CRTC_Y] = dst.y0;
+	plane->pending[PROP_CRTC_W] = dst.x1 - dst.x0;
+	plane->pending[PROP_CRTC_H] = dst.y1 - dst.y0;
+	return 0;
+}
+
+static void plane_disable(struct drm_plane *plane)
+{
+	plane->pending[PROP_FB_ID] = 0;
+	plane->pending[PROP_CRTC_ID] = 0;
+}
+
+/* turns the CRTC on with its mode, for the first commit if it was off */
+static int add_modeset(struct sunxi_drm_private *disp, drmModeAtomicReqPtr req)
+{
+	if (!disp->modeset)
+		return 0;
+
+	drmModeAtomicAddProperty(req, disp->connector_id, disp->connector_crtc_prop, disp->crtc_id);
+	drmModeAtomicAddProperty(req, disp->crtc_id, disp->crtc_mode_prop, disp->mode_blob);
+	drmModeAtomicAddProperty(req, disp->crtc_id, disp->crtc_active_prop, 1);
+	return 3;
+}
+
+/* whether the driver takes the pending state of plane, nothing is changed */
+static int plane_test(struct sunxi_drm_private *disp, struct drm_plane *plane)
+{
+	drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+	uint32_t flags = DRM_MODE_ATOMIC_TEST_ONLY;
+	int i, ret;
+
+	if (!req)
+		return -ENOMEM;
+
+	if (add_modeset(disp, req))
+		flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+	for (i = 0; i < PROP_COUNT; i++)
+		if (plane->prop[i])
+			drmModeAtomicAddProperty(req, plane->id, plane->prop[i], plane->pending[i]);
+
+	ret = drmModeAtomicCommit(disp->fd, req, flags, NULL);
+	drmModeAtomicFree(req);
+	return ret ? -errno : 0;
+}
+
+/*
+ * For planes which can't take the frame itself: the video is converted
+ * to XRGB at its final size, so it works without a scaler too. On the
+ * primary plane it's drawn into a screen sized frame with black borders,
+ * since that one has to cover the whole CRTC on many drivers.
+ */
+static int set_video_rgb(struct sunxi_drm_private *disp, int x, int y, output_surface_ctx_t *surface)
+{
+	struct cedarv_yuv_frame frame;
+	struct cedarv_csc csc;
+	VdpRect src;
+
+	output_surface_get_video_frame(surface, &frame, &src, &csc);
+	int src_w = src.x1 - src.x0, src_h = src.y1 - src.y0;
+
+	struct rect dst = { x + surface->video_dst_rect.x0, y + surface->video_dst_rect.y0,
+	                    x + surface->video_dst_rect.x1, y + surface->video_dst_rect.y1 };
+	int dst_w = dst.x1 - dst.x0, dst_h = dst.y1 - dst.y0;
+	if (src_w <= 0 || src_h <= 0 || dst_w <= 0 || dst_h <= 0)
+		return -EINVAL;
+
+	/* only the part on screen, the source cut by the same fraction */
+	struct rect vis = { max(dst.x0, 0), max(dst.y0, 0),
+	                    min(dst.x1, disp->screen_width), min(dst.y1, disp->screen_height) };
+	if (vis.x1 <= vis.x0 || vis.y1 <= vis.y0)
+		return -EINVAL;
+
+	int sx = src.x0 + (int64_t)(vis.x0 - dst.x0) * src_w / dst_w;
+	int sy = src.y0 + (int64_t)(vis.y0 - dst.y0) * src_h / dst_h;
+	int sw = max((int)((int64_t)(vis.x1 - vis.x0) * src_w / dst_w), 1);
+	int sh = max((int)((int64_t)(vis.y1 - vis.y0) * src_h / dst_h), 1);
+
+	struct rect out = vis;
+	if (disp->video_primary)
+		out = (struct rect){ 0, 0, disp->screen_width, disp->screen_height };
+
+	struct dumb_buffer *b = dumb_get(disp, &disp->video_dumb, DRM_FORMAT_XRGB8888, out.x1 - out.x0, out.y1 - out.y0);
+	if (!b)
+		return -ENOMEM;
+
+	/* new buffers are cleared, old ones only if the video moved */
+	if (memcmp(&b->drawn, &vis, sizeof(vis)) != 0)
+	{
+		if (b->drawn.x1)
+			memset(b->map, 0, b->size);
+		b->drawn = vis;
+	}
+
+	cedarv_yuv2rgb(&frame, sx, sy, sw, sh, b->map + (vis.y0 - out.y0) * b->pitch + (vis.x0 - out.x0) * 4, b->pitch,
+	               vis.x1 - vis.x0, vis.y1 - vis.y0, CEDARV_RGB_XRGB8888, CEDARV_SCALE_BILINEAR, &csc);
+
+	struct rect fb_rect = { 0, 0, b->width, b->height };
+	return plane_set(disp, &disp->video, b->fb_id, b->height, fb_rect, out);
+}
+
+/* frames which can't be imported are copied, a field shows as the whole frame then */
+static uint32_t copy_video_fb(struct sunxi_drm_private *disp, output_surface_ctx_t *surface)
+{
+	video_surface_ctx_t *vs = surface->vs;
+	struct dumb_buffer *b = dumb_get(disp, &disp->video_dumb, DRM_FORMAT_NV12, vs->width, vs->height);
+
+	if (!b)
+		return 0;
+
+	void *const planes[2] = { b->map, b->map + b->pitch * vs->height };
+	const uint32_t pitches[2] = { b->pitch, b->pitch };
+	if (vdp_video_surface_get_bits_y_cb_cr(surface->video_surface, VDP_YCBCR_FORMAT_NV12, planes, pitches) != VDP_STATUS_OK)
+		return 0;
+
+	return b->fb_id;
+}
+
+static int sunxi_drm_set_video_layer(struct sunxi_disp *sunxi_disp, int x, int y, int width, int height, output_surface_ctx_t *surface)
+{
+	struct sunxi_drm_private *disp = (struct sunxi_drm_private *)sunxi_disp;
+	video_surface_ctx_t *vs = surface->vs;
+	video_scanout_t scanout;
+	struct fb_key key;
+	CEDARV_MEMORY mem[3];
+	uint32_t offset[3];
+	int planes = 2;
+
+	if (disp->video_rgb)
+	{
+		if (set_video_rgb(disp, x, y, surface))
+		{
+			plane_disable(&disp->video);
+			return -EINVAL;
+		}
+		return 0;
+	}
+
+	video_surface_get_scanout(vs, surface->video_field, &scanout);
+
+	memset(&key, 0, sizeof(key));
+	key.width = vs->width;
+	key.height = vs->height;
+	mem[0] = scanout.plane[0];
+	mem[1] = scanout.plane[1];
+	offset[0] = scanout.offset[0];
+	offset[1] = scanout.offset[1];
+
+	switch (scanout.format)
+	{
+	case VDP_YCBCR_FORMAT_YUYV:
+	case VDP_YCBCR_FORMAT_UYVY:
+		key.fourcc = scanout.format == VDP_YCBCR_FORMAT_YUYV ? DRM_FORMAT_YUYV : DRM_FORMAT_UYVY;
+		key.pitch[0] = scanout.pitch[0];
+		planes = 1;
+		break;
+	case VDP_YCBCR_FORMAT_YV12:
+		/* YVU420 wants V before U */
+		key.fourcc = DRM_FORMAT_YVU420;
+		key.pitch[0] = scanout.pitch[0];
+		key.pitch[1] = scanout.pitch[2];
+		key.pitch[2] = scanout.pitch[1];
+		mem[1] = scanout.plane[2];
+		mem[2] = scanout.plane[1];
+		offset[1] = scanout.offset[2];
+		offset[2] = scanout.offset[1];
+		planes = 3;
+		break;
+	case VDP_YCBCR_FORMAT_NV12:
+		key.fourcc = DRM_FORMAT_NV12;
+		key.pitch[0] = scanout.pitch[0];
+		key.pitch[1] = scanout.pitch[1];
+		break;
+	case INTERNAL_YCBCR_FORMAT:
+	default:
+		key.fourcc = DRM_FORMAT_NV12;
+		key.modifier = DRM_FORMAT_MOD_ALLWINNER_TILED;
+		key.pitch[0] = scanout.pitch[0];
+		key.pitch[1] = scanout.pitch[1];
+		break;
+	}
+
+	struct rect src = { surface->video_src_rect.x0, surface->video_src_rect.y0,
+	                    surface->video_src_rect.x1, surface->video_src_rect.y1 };
+	if (scanout.field)
+	{
+		/* every other line belongs to the other field */
+		int i;
+		for (i = 0; i < planes; i++)
+			key.pitch[i] *= 2;
+		key.height /= 2;
+		src.y0 /= 2;
+		src.y1 /= 2;
+	}
+
+	struct rect dst = { x + surface->video_dst_rect.x0, y + surface->video_dst_rect.y0,
+	                    x + surface->video_dst_rect.x1, y + surface->video_dst_rect.y1 };
+
+	uint32_t fb_id = get_fb(disp, mem, offset, planes, &key);
+	int fb_height = key.height;
+	if (!fb_id)
+	{
+		fb_id = copy_video_fb(disp, surface);
+		fb_height = vs->height;
+		src = (struct rect){ surface->video_src_rect.x0, surface->video_src_rect.y0,
+		                     surface->video_src_rect.x1, surface->video_src_rect.y1 };
+	}
+
+	if (plane_set(disp, &disp->video, fb_id, fb_height, src, dst))
+	{
+		plane_disable(&disp->video);
+		return -EINVAL;
+	}
+
+	/*
+	 * Not every plane can scale NV12 (vkms can't scale at all), ask once
+	 * for every new size. Refused ones get converted frames from then on.
+	 */
+	struct rect size = { disp->video.pending[PROP_SRC_W] >> 16, disp->video.pending[PROP_SRC_H] >> 16,
+	                     disp->video.pending[PROP_CRTC_W], disp->video.pending[PROP_CRTC_H] };
+	if (memcmp(&size, &disp->video_tested, sizeof(size)) != 0)
+	{
+		if (plane_test(disp, &disp->video) == -EINVAL && disp->video_has_rgb)
+		{
+			VDPAU_DBG("KMS refused the NV12 video plane, converting to RGB");
+			disp->video_rgb = 1;
+			return sunxi_drm_set_video_layer(sunxi_disp, x, y, width, height, surface);
+		}
+		disp->video_tested = size;
+	}
+
+	return 0;
+}
+
+static void sunxi_drm_close_video_layer(struct sunxi_disp *sunxi_disp)
+{
+	struct sunxi_drm_private *disp = (struct sunxi_drm_private *)sunxi_disp;
+
+	plane_disable(&disp->video);
+}
+
+static int sunxi_drm_set_osd_layer(struct sunxi_disp *sunxi_disp, int x, int y, int width, int height, output_surface_ctx_t *surface)
+{
+	struct sunxi_drm_private *disp = (struct sunxi_drm_private *)sunxi_disp;
+
+	if (!disp->osd.id)
+		return -ENODEV;
+
+	struct rect src = { surface->rgba.dirty.x0, surface->rgba.dirty.y0,
+	                    min_nz(width, surface->rgba.dirty.x1), min_nz(height, surface->rgba.dirty.y1) };
+	struct rect dst = { x + src.x0, y + src.y0, x + src.x1, y + src.y1 };
+
+	if (plane_set(disp, &disp->osd, get_rgba_fb(disp, &disp->osd_dumb, &surface->rgba, src), surface->rgba.height, src, dst))
+	{
+		plane_disable(&disp->osd);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static void sunxi_drm_close_osd_layer(struct sunxi_disp *sunxi_disp)
+{
+	struct sunxi_drm_private *disp = (struct sunxi_drm_private *)sunxi_disp;
+
+	if (disp->osd.id)
+		plane_disable(&disp->osd);
+}
+
+static int sunxi_drm_set_layer(struct sunxi_disp *sunxi_disp, int index, int x, int y, output_surface_ctx_t *surface, VdpRect const *src_rect, VdpRect const *dst_rect)
+{
+	struct sunxi_drm_private *disp = (struct sunxi_drm_private *)sunxi_disp;
+
+	if (index < 0 || index >= disp->pub.layer_count)
+		return -ENODEV;
+
+	struct rect src = { src_rect->x0, src_rect->y0, src_rect->x1, src_rect->y1 };
+	struct rect dst = { x + dst_rect->x0, y + dst_rect->y0, x + dst_rect->x1, y + dst_rect->y1 };
+
+	if (plane_set(disp, &disp->layer[index], get_rgba_fb(disp, &disp->layer_dumb[index], &surface->rgba, src), surface->rgba.height, src, dst))
+	{
+		plane_disable(&disp->layer[index]);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static void sunxi_drm_close_layer(struct sunxi_disp *sunxi_disp, int index)
+{
+	struct sunxi_drm_private *disp = (struct sunxi_drm_private *)sunxi_disp;
+
+	if (index >= 0 && index < disp->pub.layer_count)
+		plane_disable(&disp->layer[index]);
+}
+
+static int add_plane(drmModeAtomicReqPtr req, struct drm_plane *plane)
+{
+	int i, count = 0;
+
+	if (!plane->id)
+		return 0;
+
+	for (i = 0; i < PROP_COUNT; i++)
+	{
+		/* a disabled plane keeps its old rects, they don't matter */
+		if (!plane->pending[PROP_FB_ID] && i != PROP_FB_ID && i != PROP_CRTC_ID)
+			continue;
+
+		if (plane->prop[i] && plane->pending[i] != plane->committed[i])
+		{
+			drmModeAtomicAddProperty(req, plane->id, plane->prop[i], plane->pending[i]);
+			count++;
+		}
+	}
+
+	return count;
+}
+
+static void plane_committed(struct drm_plane *plane)
+{
+	memcpy(plane->committed, plane->pending, sizeof(plane->committed));
+}
+
+static void page_flip_handler(int fd, unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec, void *user_data)
+{
+	struct sunxi_drm_private *disp = user_data;
+
+	disp->flip_pending = 0;
+	disp->vblank_time = (uint64_t)tv_sec * 1000000000ULL + (uint64_t)tv_usec * 1000ULL;
+}
+
+/* the event carries CLOCK_MONOTONIC time, unless the driver predates 3.8 */
+static int wait_flip(struct sunxi_drm_private *disp)
+{
+	drmEventContext ev = { .version = 2, .page_flip_handler = page_flip_handler };
+	struct pollfd pfd = { .fd = disp->fd, .events = POLLIN };
+
+	while (disp->flip_pending)
+	{
+		if (poll(&pfd, 1, 1000) <= 0 || drmHandleEvent(disp->fd, &ev))
+		{
+			disp->flip_pending = 0;
+			return -EIO;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * All planes change with one atomic commit, so video, layers and OSD of
+ * a surface always show up in the same refresh. It doesn't block, the
+ * page flip event is collected by wait_vsync.
+ */
+static int sunxi_drm_commit(struct sunxi_disp *sunxi_disp)
+{
+	struct sunxi_drm_private *disp = (struct sunxi_drm_private *)sunxi_disp;
+	drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+	uint32_t flags = DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT;
+	int i, count = 0, ret;
+
+	if (!req)
+		return -ENOMEM;
+
+	count += add_modeset(disp, req);
+	if (count)
+		flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+
+	count += add_plane(req, &disp->video);
+	count += add_plane(req, &disp->osd);
+	for (i = 0; i < disp->pub.layer_count; i++)
+		count += add_plane(req, &disp->layer[i]);
+
+	if (!count)
+	{
+		drmModeAtomicFree(req);
+		return 0;
+	}
+
+	/* only one commit can be in flight */
+	wait_flip(disp);
+
+	ret = drmModeAtomicCommit(disp->fd, req, flags, disp);
+	drmModeAtomicFree(req);
+
+	/* a failed commit changed nothing, the pending state is tried again next time */
+	if (ret)
+		return -errno;
+
+	disp->flip_pending = 1;
+	disp->modeset = 0;
+	plane_committed(&disp->video);
+	plane_committed(&disp->osd);
+	for (i = 0; i < disp->pub.layer_count; i++)
+		plane_committed(&disp->layer[i]);
+
+	return 0;
+}
+
+static int sunxi_drm_wait_vsync(struct sunxi_disp *sunxi_disp)
+{
+	struct sunxi_drm_private *disp = (struct sunxi_drm_private *)sunxi_disp;
+
+	if (disp->flip_pending)
+		return wait_flip(disp);
+
+	/* nothing changed this time, still keep the pace of the refresh */
+	drmVBlank vbl;
+	memset(&vbl, 0, sizeof(vbl));
+	vbl.request.type = DRM_VBLANK_RELATIVE;
+	if (disp->crtc_index == 1)
+		vbl.request.type |= DRM_VBLANK_SECONDARY;
+	else if (disp->crtc_index > 1)
+		vbl.request.type |= (disp->crtc_index << DRM_VBLANK_HIGH_CRTC_SHIFT) & DRM_VBLANK_HIGH_CRTC_MASK;
+	vbl.request.sequence = 1;
+
+	if (drmWaitVBlank(disp->fd, &vbl))
+		return -errno;
+
+	disp->vblank_time = (uint64_t)vbl.reply.tval_sec * 1000000000ULL + (uint64_t)vbl.reply.tval_usec * 1000ULL;
+	return 0;
+}
+
+static uint64_t sunxi_drm_get_vblank_time(struct sunxi_disp *sunxi_disp)
+{
+	struct sunxi_drm_private *disp = (struct sunxi_drm_private *)sunxi_disp;
+
+	return disp->vblank_time;
+}
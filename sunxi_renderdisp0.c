@@ -21,12 +21,17 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <linux/fb.h>
+#include "kernel-headers/sunxi_disp_ioctl.h"
 #include "vdpau_private.h"
 #include "sunxi_disp.h"
 #include <stdio.h>
-#include "kernel-headers/sunxi_disp_ioctl.h"
+
+/* mixer layers are normal mode layers on pipe 0, blended by pixel alpha */
+#define DISP0_LAYERS 2
 
 struct sunxi_disp0_private
 {
@@ -43,6 +48,13 @@ struct sunxi_disp0_private
         int fb_layer_id;
         int fb_fd;
         int fb_id;
+        uint64_t vblank_time;
+        int layers[DISP0_LAYERS];
+        int layer_open[DISP0_LAYERS];
+        /* what the driver was last given for the video and each mixer layer */
+        __disp_layer_info_t video_committed;
+        int video_open;
+        __disp_layer_info_t layer_committed[DISP0_LAYERS];
 };
 
 static void sunxi_disp0_close(struct sunxi_disp *sunxi_disp);
@@ -50,18 +62,20 @@ static int sunxi_disp0_set_video_layer(struct sunxi_disp *sunxi_disp, int x, int
 static void sunxi_disp0_close_video_layer(struct sunxi_disp *sunxi_disp);
 static int sunxi_disp0_set_osd_layer(struct sunxi_disp *sunxi_disp, int x, int y, int width, int height, output_surface_ctx_t *surface);
 static void sunxi_disp0_close_osd_layer(struct sunxi_disp *sunxi_disp);
+static int sunxi_disp0_set_layer(struct sunxi_disp *sunxi_disp, int index, int x, int y, output_surface_ctx_t *surface, VdpRect const *src_rect, VdpRect const *dst_rect);
+static void sunxi_disp0_close_layer(struct sunxi_disp *sunxi_disp, int index);
+static int sunxi_disp0_wait_vsync(struct sunxi_disp *sunxi_disp);
+static uint64_t sunxi_disp0_get_vblank_time(struct sunxi_disp *sunxi_disp);
 
-struct sunxi_disp *sunxi_disp0_open(void)
+struct sunxi_disp *sunxi_disp0_open(int osd_enabled)
 {
   struct sunxi_disp0_private *disp = calloc(1, sizeof(*disp));
   uint32_t tmp[4];
 
   if (disp) {
-    char *env_vdpau_osd = getenv("VDPAU_OSD");
-
     disp->fb_id = 0;
 
-    if (env_vdpau_osd && strncmp(env_vdpau_osd, "1", 1) == 0)
+    if (osd_enabled)
       {
 		disp->g2d_fd = open("/dev/g2d", O_RDWR);
 		if (disp->g2d_fd != -1)
@@ -77,7 +91,7 @@ struct sunxi_disp *sunxi_disp0_open(void)
         return NULL;
     }
     fprintf(stderr, "%s: %d\n", __func__, __LINE__);
-    disp->fb_fd = open("/dev/fb0", O_RDWR);
+    disp->fb_fd = sunxi_disp_open_fb(disp->fb_id);
     if (disp->fb_fd == -1)
     {
         close(disp->fd);
@@ -189,6 +203,24 @@ struct sunxi_disp *sunxi_disp0_open(void)
     {
         printf("layer bottom 2 failed\n");
     }
+
+    if (disp->osd_enabled)
+    {
+        for (i = 0; i < DISP0_LAYERS; i++)
+        {
+            args[0] = disp->fb_id;
+            args[1] = DISP_LAYER_WORK_MODE_NORMAL;
+            args[2] = 0;
+            args[3] = 0;
+            disp->layers[i] = ioctl(disp->fd, DISP_CMD_LAYER_REQUEST, args);
+            if (disp->layers[i] == 0)
+                break;
+
+            args[1] = disp->layers[i];
+            ioctl(disp->fd, DISP_CMD_LAYER_TOP, args);
+        }
+        disp->pub.layer_count = i;
+    }
 #if 0
     // but should be 1 when layering is fixed again.
     /* Set the overlay layer below the screen layer */
@@ -241,6 +273,10 @@ struct sunxi_disp *sunxi_disp0_open(void)
     disp->pub.close_video_layer = sunxi_disp0_close_video_layer;
     disp->pub.set_osd_layer = sunxi_disp0_set_osd_layer;
     disp->pub.close_osd_layer = sunxi_disp0_close_osd_layer;
+    disp->pub.set_layer = sunxi_disp0_set_layer;
+    disp->pub.close_layer = sunxi_disp0_close_layer;
+    disp->pub.wait_vsync = sunxi_disp0_wait_vsync;
+    disp->pub.get_vblank_time = sunxi_disp0_get_vblank_time;
     fprintf(stderr, "%s:%d\n", __func__, __LINE__);
     return (struct sunxi_disp *)disp;
   }
@@ -256,6 +292,15 @@ static void sunxi_disp0_close(struct sunxi_disp *sunxi_disp)
 	ioctl(disp->fd, DISP_CMD_LAYER_CLOSE, args);
 	ioctl(disp->fd, DISP_CMD_LAYER_RELEASE, args);
 
+	int i;
+	for (i = 0; i < disp->pub.layer_count; i++)
+	{
+		args[1] = disp->layers[i];
+		ioctl(disp->fd, DISP_CMD_LAYER_CLOSE, args);
+		ioctl(disp->fd, DISP_CMD_LAYER_RELEASE, args);
+	}
+
+	close(disp->fb_fd);
 	close(disp->fd);
 
 	free(sunxi_disp);
@@ -264,7 +309,6 @@ static void sunxi_disp0_close(struct sunxi_disp *sunxi_disp)
 static int sunxi_disp0_set_video_layer(struct sunxi_disp *sunxi_disp, int x, int y, int width, int height, output_surface_ctx_t *surface)
 {
 	struct sunxi_disp0_private *disp = (struct sunxi_disp0_private *)sunxi_disp;
-	int error;
 	//XTranslateCoordinates(q->device->display, disp->drawable, RootWindow(q->device->display, q->device->screen), 0, 0, &x, &y, &c);
 	//XClearWindow(q->device->display, disp->drawable);
 
@@ -278,7 +322,9 @@ static int sunxi_disp0_set_video_layer(struct sunxi_disp *sunxi_disp, int x, int
 	layer_info.mode = DISP_LAYER_WORK_MODE_SCALER;
 	layer_info.fb.format = DISP_FORMAT_YUV420;
 	layer_info.fb.seq = DISP_SEQ_UVUV;
-	switch (surface->vs->source_format) {
+	video_scanout_t scanout;
+	video_surface_get_scanout(surface->vs, surface->video_field, &scanout);
+	switch (scanout.format) {
 	case VDP_YCBCR_FORMAT_YUYV:
 		layer_info.fb.mode = DISP_MOD_INTERLEAVED;
 		layer_info.fb.format = DISP_FORMAT_YUV422;
@@ -303,14 +349,20 @@ static int sunxi_disp0_set_video_layer(struct sunxi_disp *sunxi_disp, int x, int
 	
 	layer_info.fb.br_swap = 0;
 	//recalc data to cpu kernel addresses (+ 0x40000000)
-	layer_info.fb.addr[0] = cedarv_virt2phys(surface->vs->dataY) + 0x40000000;
-	layer_info.fb.addr[1] = cedarv_virt2phys(surface->vs->dataU)/* + surface->vs->plane_size*/ + 0x40000000;
-	if( cedarv_isValid(surface->vs->dataV))
-	  layer_info.fb.addr[2] = cedarv_virt2phys(surface->vs->dataV)/* + surface->vs->plane_size + surface->vs->plane_size / 4*/ + 0x40000000;
+	layer_info.fb.addr[0] = cedarv_virt2phys(scanout.plane[0]) + scanout.offset[0] + 0x40000000;
+	layer_info.fb.addr[1] = cedarv_virt2phys(scanout.plane[1]) + scanout.offset[1]/* + surface->vs->plane_size*/ + 0x40000000;
+	if( cedarv_isValid(scanout.plane[2]))
+	  layer_info.fb.addr[2] = cedarv_virt2phys(scanout.plane[2]) + scanout.offset[2]/* + surface->vs->plane_size + surface->vs->plane_size / 4*/ + 0x40000000;
 
 	layer_info.fb.cs_mode = DISP_BT709;
-	layer_info.fb.size.width = surface->vs->width; //disp->screen_width;
-	layer_info.fb.size.height = surface->vs->width; //disp->screen_height;
+	/* the fb width is the line pitch in pixels, the tiled layout has its own */
+	if (scanout.format == INTERNAL_YCBCR_FORMAT)
+		layer_info.fb.size.width = surface->vs->width;
+	else if (layer_info.fb.mode == DISP_MOD_INTERLEAVED)
+		layer_info.fb.size.width = scanout.pitch[0] / 2;
+	else
+		layer_info.fb.size.width = scanout.pitch[0];
+	layer_info.fb.size.height = surface->vs->height;
 #if 0
        layer_info.src_win.x = 0;
        layer_info.src_win.y = 0;
@@ -338,20 +390,19 @@ static int sunxi_disp0_set_video_layer(struct sunxi_disp *sunxi_disp, int x, int
 		layer_info.scn_win.height -= cutoff;
 	}
 
-
-	uint32_t args[4] = { 0, disp->layer, (unsigned long)(&layer_info), 0 };
-	error = ioctl(disp->fd, DISP_CMD_LAYER_SET_PARA, args);
-	if(error < 0)
+	if (scanout.field)
 	{
-		printf("set para failed\n");
+		/* the fb width is its pitch, every other line belongs to the other field */
+		layer_info.fb.size.width *= 2;
+		layer_info.fb.size.height /= 2;
+		layer_info.src_win.y /= 2;
+		layer_info.src_win.height /= 2;
 	}
 
+	sunxi_disp_commit_layer(disp->fd, disp->fb_id, disp->layer, &layer_info, &disp->video_committed, &disp->video_open);
+
+	uint32_t args[4] = { 0, disp->layer, 0, 0 };
 #if 1
-	error = ioctl(disp->fd, DISP_CMD_LAYER_OPEN, args);
-	if(error < 0)
-	{
-		printf("layer open failed, fd=%d, errno=%d\n", disp->fd, errno);
-	}
 	// Note: might be more reliable (but slower and problematic when there
 	// are driver issues and the GET functions return wrong values) to query the
 	// old values instead of relying on our internal csc_change.
@@ -419,3 +470,71 @@ static void sunxi_disp0_close_osd_layer(struct sunxi_disp *sunxi_disp)
 {
   //struct sunxi_disp0_private *disp = (struct sunxi_disp0_private *)sunxi_disp;
 }
+
+static int sunxi_disp0_set_layer(struct sunxi_disp *sunxi_disp, int index, int x, int y, output_surface_ctx_t *surface, VdpRect const *src_rect, VdpRect const *dst_rect)
+{
+	struct sunxi_disp0_private *disp = (struct sunxi_disp0_private *)sunxi_disp;
+	__disp_layer_info_t layer_info;
+
+	if (index < 0 || index >= disp->pub.layer_count)
+		return -ENODEV;
+
+	memset(&layer_info, 0, sizeof(layer_info));
+	layer_info.pipe = 0;
+	layer_info.mode = DISP_LAYER_WORK_MODE_NORMAL;
+	/* no global alpha, the pixels' own alpha blends the layer */
+	layer_info.alpha_en = 0;
+	layer_info.fb.mode = DISP_MOD_INTERLEAVED;
+	layer_info.fb.format = DISP_FORMAT_ARGB8888;
+	layer_info.fb.seq = DISP_SEQ_ARGB;
+	layer_info.fb.br_swap = surface->rgba.format == VDP_RGBA_FORMAT_R8G8B8A8;
+	layer_info.fb.cs_mode = DISP_BT601;
+	layer_info.fb.addr[0] = cedarv_virt2phys(surface->rgba.data) + 0x40000000;
+	layer_info.fb.size.width = surface->rgba.width;
+	layer_info.fb.size.height = surface->rgba.height;
+	layer_info.src_win.x = src_rect->x0;
+	layer_info.src_win.y = src_rect->y0;
+	layer_info.src_win.width = src_rect->x1 - src_rect->x0;
+	layer_info.src_win.height = src_rect->y1 - src_rect->y0;
+	layer_info.scn_win.x = x + dst_rect->x0;
+	layer_info.scn_win.y = y + dst_rect->y0;
+	layer_info.scn_win.width = dst_rect->x1 - dst_rect->x0;
+	layer_info.scn_win.height = dst_rect->y1 - dst_rect->y0;
+
+	if (layer_info.scn_win.y < 0)
+	{
+		int cutoff = -(layer_info.scn_win.y);
+		layer_info.src_win.y += cutoff;
+		layer_info.src_win.height -= cutoff;
+		layer_info.scn_win.y = 0;
+		layer_info.scn_win.height -= cutoff;
+	}
+
+	return sunxi_disp_commit_layer(disp->fd, disp->fb_id, disp->layers[index], &layer_info, &disp->layer_committed[index], &disp->layer_open[index]);
+}
+
+static void sunxi_disp0_close_layer(struct sunxi_disp *sunxi_disp, int index)
+{
+	struct sunxi_disp0_private *disp = (struct sunxi_disp0_private *)sunxi_disp;
+
+	if (index < 0 || index >= disp->pub.layer_count || !disp->layer_open[index])
+		return;
+
+	uint32_t args[4] = { disp->fb_id, disp->layers[index], 0, 0 };
+	ioctl(disp->fd, DISP_CMD_LAYER_CLOSE, args);
+	disp->layer_open[index] = 0;
+}
+
+static int sunxi_disp0_wait_vsync(struct sunxi_disp *sunxi_disp)
+{
+	struct sunxi_disp0_private *disp = (struct sunxi_disp0_private *)sunxi_disp;
+
+	return sunxi_disp_wait_fb_vsync(disp->fb_fd, &disp->vblank_time);
+}
+
+static uint64_t sunxi_disp0_get_vblank_time(struct sunxi_disp *sunxi_disp)
+{
+	struct sunxi_disp0_private *disp = (struct sunxi_disp0_private *)sunxi_disp;
+
+	return disp->vblank_time;
+}
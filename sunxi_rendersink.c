@@ -0,0 +1,427 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "vdpau_private.h"
+#include "sunxi_disp.h"
+
+/*
+ * Display replacements for benchmarks and tests, selected with VDPAU_DISP:
+ *
+ *   null              frames are only counted
+ *   file:<name>.y4m   frames are written as YUV4MPEG2, 4:2:0 or 4:2:2
+ *                     as the first frame shown
+ *   file:<name>.nv12  raw NV12 frames
+ *   file:<name>.yuy2  raw YUY2 frames
+ *   file:<name>       raw I420 frames
+ *
+ * 4:2:2 surfaces lose every other chroma line in the 4:2:0 formats.
+ * Both print the number of frames and their pacing when closed. Files get
+ * whole frames, without cropping or field selection by the mixer.
+ */
+
+/* frames in flight to the writer, set_video_layer blocks when all are taken */
+#define SINK_BUFFERS 4
+
+enum sink_format
+{
+	SINK_I420,
+	SINK_NV12,
+	SINK_YUY2,
+	SINK_Y4M,
+};
+
+struct sink_buffer
+{
+	uint8_t *data;
+	size_t size;
+	uint32_t width, height;
+	int c422;
+	struct sink_buffer *next;
+};
+
+struct sunxi_sink_private
+{
+	struct sunxi_disp pub;
+
+	/* timing of the frames shown */
+	uint64_t frames;
+	uint64_t first, last;
+	uint64_t min_interval, max_interval;
+
+	/* file sink only */
+	FILE *file;
+	enum sink_format format;
+	uint32_t width, height;
+	int c422;
+	/* packed lines of 4:2:2 surfaces, before they are split into planes */
+	uint8_t *packed;
+	size_t packed_size;
+	pthread_t writer;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct sink_buffer buffers[SINK_BUFFERS];
+	struct sink_buffer *free, *head, *tail;
+	int quit;
+};
+
+static void sunxi_sink_close(struct sunxi_disp *sunxi_disp);
+static int sunxi_sink_set_video_layer(struct sunxi_disp *sunxi_disp, int x, int y, int width, int height, output_surface_ctx_t *surface);
+static void sunxi_sink_close_video_layer(struct sunxi_disp *sunxi_disp);
+static int sunxi_sink_set_osd_layer(struct sunxi_disp *sunxi_disp, int x, int y, int width, int height, output_surface_ctx_t *surface);
+static void sunxi_sink_close_osd_layer(struct sunxi_disp *sunxi_disp);
+static void *sink_writer(void *arg);
+
+static int has_suffix(const char *name, const char *suffix)
+{
+	size_t n = strlen(name), s = strlen(suffix);
+
+	return n >= s && strcmp(name + n - s, suffix) == 0;
+}
+
+static int file_open(struct sunxi_sink_private *disp, const char *name)
+{
+	int i;
+
+	disp->file = fopen(name, "wb");
+	if (!disp->file)
+		return -1;
+
+	if (has_suffix(name, ".y4m"))
+		disp->format = SINK_Y4M;
+	else if (has_suffix(name, ".nv12"))
+		disp->format = SINK_NV12;
+	else if (has_suffix(name, ".yuy2"))
+		disp->format = SINK_YUY2;
+	else
+		disp->format = SINK_I420;
+
+	pthread_mutex_init(&disp->lock, NULL);
+	pthread_cond_init(&disp->cond, NULL);
+	for (i = 0; i < SINK_BUFFERS; i++)
+	{
+		disp->buffers[i].next = disp->free;
+		disp->free = &disp->buffers[i];
+	}
+
+	if (pthread_create(&disp->writer, NULL, sink_writer, disp))
+	{
+		pthread_cond_destroy(&disp->cond);
+		pthread_mutex_destroy(&disp->lock);
+		fclose(disp->file);
+		disp->file = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+struct sunxi_disp *sunxi_sink_open(const char *spec)
+{
+	struct sunxi_sink_private *disp = calloc(1, sizeof(*disp));
+
+	if (!disp)
+		return NULL;
+
+	if (strncmp(spec, "file:", 5) == 0)
+	{
+		if (file_open(disp, spec + 5))
+		{
+			VDPAU_DBG("can't write frames to %s: %s", spec + 5, strerror(errno));
+			free(disp);
+			return NULL;
+		}
+	}
+	else if (strcmp(spec, "null") != 0)
+	{
+		VDPAU_DBG("unknown VDPAU_DISP \"%s\"", spec);
+		free(disp);
+		return NULL;
+	}
+
+	disp->min_interval = UINT64_MAX;
+	disp->pub.close = sunxi_sink_close;
+	disp->pub.set_video_layer = sunxi_sink_set_video_layer;
+	disp->pub.close_video_layer = sunxi_sink_close_video_layer;
+	disp->pub.set_osd_layer = sunxi_sink_set_osd_layer;
+	disp->pub.close_osd_layer = sunxi_sink_close_osd_layer;
+
+	return (struct sunxi_disp *)disp;
+}
+
+static void sunxi_sink_close(struct sunxi_disp *sunxi_disp)
+{
+	struct sunxi_sink_private *disp = (struct sunxi_sink_private *)sunxi_disp;
+	int i;
+
+	if (disp->file)
+	{
+		/* the writer empties the queue before it quits */
+		pthread_mutex_lock(&disp->lock);
+		disp->quit = 1;
+		pthread_cond_broadcast(&disp->cond);
+		pthread_mutex_unlock(&disp->lock);
+		pthread_join(disp->writer, NULL);
+
+		fclose(disp->file);
+		for (i = 0; i < SINK_BUFFERS; i++)
+			free(disp->buffers[i].data);
+		free(disp->packed);
+		pthread_cond_destroy(&disp->cond);
+		pthread_mutex_destroy(&disp->lock);
+	}
+
+	if (disp->frames > 1)
+	{
+		double seconds = (disp->last - disp->first) / 1e9;
+		fprintf(stderr, "[VDPAU SUNXI] %llu frames in %.3f s, %.2f fps, interval min %.3f / avg %.3f / max %.3f ms\n",
+		        (unsigned long long)disp->frames, seconds, (disp->frames - 1) / seconds,
+		        disp->min_interval / 1e6, seconds * 1e3 / (disp->frames - 1), disp->max_interval / 1e6);
+	}
+	else
+		fprintf(stderr, "[VDPAU SUNXI] %llu frames\n", (unsigned long long)disp->frames);
+
+	free(sunxi_disp);
+}
+
+static void record_frame(struct sunxi_sink_private *disp)
+{
+	uint64_t now = get_time();
+
+	if (disp->frames++)
+	{
+		uint64_t interval = now - disp->last;
+		if (interval < disp->min_interval)
+			disp->min_interval = interval;
+		if (interval > disp->max_interval)
+			disp->max_interval = interval;
+	}
+	else
+		disp->first = now;
+
+	disp->last = now;
+}
+
+static void *sink_writer(void *arg)
+{
+	struct sunxi_sink_private *disp = arg;
+
+	pthread_mutex_lock(&disp->lock);
+	while (disp->head || !disp->quit)
+	{
+		struct sink_buffer *b = disp->head;
+		if (!b)
+		{
+			pthread_cond_wait(&disp->cond, &disp->lock);
+			continue;
+		}
+
+		disp->head = b->next;
+		if (!disp->head)
+			disp->tail = NULL;
+		pthread_mutex_unlock(&disp->lock);
+
+		if (disp->format == SINK_Y4M)
+		{
+			/* the stream header follows the first frame, Y4M can't change size later */
+			if (!disp->width)
+			{
+				disp->width = b->width;
+				disp->height = b->height;
+				disp->c422 = b->c422;
+				fprintf(disp->file, "YUV4MPEG2 W%u H%u F25:1 Ip A1:1 %s\n", b->width, b->height,
+				        b->c422 ? "C422" : "C420jpeg");
+			}
+
+			if (b->width == disp->width && b->height == disp->height && b->c422 == disp->c422)
+			{
+				fputs("FRAME\n", disp->file);
+				fwrite(b->data, 1, b->size, disp->file);
+			}
+			else
+				VDPAU_DBG_ONCE("frame size or chroma changed, Y4M output skips the other frames");
+		}
+		else
+			fwrite(b->data, 1, b->size, disp->file);
+
+		pthread_mutex_lock(&disp->lock);
+		b->next = disp->free;
+		disp->free = b;
+		pthread_cond_broadcast(&disp->cond);
+	}
+	pthread_mutex_unlock(&disp->lock);
+
+	return NULL;
+}
+
+/*
+ * Splits YUYV lines into planes, for 4:2:0 (c420) chroma of line pairs is
+ * averaged. v == NULL stores interleaved CbCr in u, as NV12 has it.
+ */
+static void split_yuyv(const uint8_t *src, uint32_t pitch, uint32_t width, uint32_t height,
+                       uint8_t *y, uint8_t *u, uint8_t *v, int c420)
+{
+	uint32_t cw = (width + 1) / 2, ch = c420 ? (height + 1) / 2 : height;
+	uint32_t line, i;
+
+	for (line = 0; line < height; line++)
+		for (i = 0; i < width; i++)
+			y[line * width + i] = src[line * pitch + 2 * i];
+
+	for (line = 0; line < ch; line++)
+	{
+		const uint8_t *s0 = src + (c420 ? 2 * line : line) * pitch;
+		const uint8_t *s1 = c420 && 2 * line + 1 < height ? s0 + pitch : s0;
+
+		for (i = 0; i < cw; i++)
+		{
+			uint8_t cb = (s0[4 * i + 1] + s1[4 * i + 1] + 1) / 2;
+			uint8_t cr = (s0[4 * i + 3] + s1[4 * i + 3] + 1) / 2;
+			if (v)
+			{
+				u[line * cw + i] = cb;
+				v[line * cw + i] = cr;
+			}
+			else
+			{
+				u[line * 2 * cw + 2 * i] = cb;
+				u[line * 2 * cw + 2 * i + 1] = cr;
+			}
+		}
+	}
+}
+
+/*
+ * Reads the frame through get_bits, which flushes caches and detiles.
+ * 4:2:2 surfaces only come out packed, they are split here.
+ */
+static int fill_buffer(struct sunxi_sink_private *disp, struct sink_buffer *b, output_surface_ctx_t *surface)
+{
+	uint32_t width = surface->vs->width, height = surface->vs->height;
+	uint32_t cw = (width + 1) / 2, ch = (height + 1) / 2;
+	int c422 = surface->vs->chroma_type == VDP_CHROMA_TYPE_422;
+	size_t size;
+
+	if (disp->format == SINK_YUY2)
+		size = 4 * cw * height;
+	else if (disp->format == SINK_Y4M && c422)
+		size = width * height + 2 * cw * height;
+	else
+		size = width * height + 2 * cw * ch;
+
+	if (size > b->size)
+	{
+		uint8_t *data = realloc(b->data, size);
+		if (!data)
+			return -ENOMEM;
+		b->data = data;
+	}
+	b->size = size;
+	b->width = width;
+	b->height = height;
+	b->c422 = c422 && disp->format == SINK_Y4M;
+
+	uint8_t *y = b->data, *c = b->data + width * height;
+	if (disp->format == SINK_YUY2)
+	{
+		void *const planes[1] = { y };
+		const uint32_t pitches[1] = { 4 * cw };
+		if (vdp_video_surface_get_bits_y_cb_cr(surface->video_surface, VDP_YCBCR_FORMAT_YUYV, planes, pitches) != VDP_STATUS_OK)
+			return -EINVAL;
+	}
+	else if (c422)
+	{
+		size_t packed_size = 4 * cw * height;
+		if (packed_size > disp->packed_size)
+		{
+			uint8_t *packed = realloc(disp->packed, packed_size);
+			if (!packed)
+				return -ENOMEM;
+			disp->packed = packed;
+			disp->packed_size = packed_size;
+		}
+
+		void *const planes[1] = { disp->packed };
+		const uint32_t pitches[1] = { 4 * cw };
+		if (vdp_video_surface_get_bits_y_cb_cr(surface->video_surface, VDP_YCBCR_FORMAT_YUYV, planes, pitches) != VDP_STATUS_OK)
+			return -EINVAL;
+
+		if (disp->format == SINK_NV12)
+			split_yuyv(disp->packed, 4 * cw, width, height, y, c, NULL, 1);
+		else if (disp->format == SINK_Y4M)
+			split_yuyv(disp->packed, 4 * cw, width, height, y, c, c + cw * height, 0);
+		else
+			split_yuyv(disp->packed, 4 * cw, width, height, y, c, c + cw * ch, 1);
+	}
+	else if (disp->format == SINK_NV12)
+	{
+		void *const planes[2] = { y, c };
+		const uint32_t pitches[2] = { width, 2 * cw };
+		if (vdp_video_surface_get_bits_y_cb_cr(surface->video_surface, VDP_YCBCR_FORMAT_NV12, planes, pitches) != VDP_STATUS_OK)
+			return -EINVAL;
+	}
+	else
+	{
+		/* VDPAU's YV12 planes are Y, V, U, so this stores them as I420 */
+		void *const planes[3] = { y, c + cw * ch, c };
+		const uint32_t pitches[3] = { width, cw, cw };
+		if (vdp_video_surface_get_bits_y_cb_cr(surface->video_surface, VDP_YCBCR_FORMAT_YV12, planes, pitches) != VDP_STATUS_OK)
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int sunxi_sink_set_video_layer(struct sunxi_disp *sunxi_disp, int x, int y, int width, int height, output_surface_ctx_t *surface)
+{
+	struct sunxi_sink_private *disp = (struct sunxi_sink_private *)sunxi_disp;
+	int ret = 0;
+
+	if (disp->file)
+	{
+		pthread_mutex_lock(&disp->lock);
+		while (!disp->free)
+			pthread_cond_wait(&disp->cond, &disp->lock);
+		struct sink_buffer *b = disp->free;
+		disp->free = b->next;
+		pthread_mutex_unlock(&disp->lock);
+
+		ret = fill_buffer(disp, b, surface);
+
+		pthread_mutex_lock(&disp->lock);
+		if (ret)
+		{
+			b->next = disp->free;
+			disp->free = b;
+		}
+		else
+		{
+			b->next = NULL;
+			if (disp->tail)
+				disp->tail->next = b;
+			else
+				disp->head = b;
+			disp->tail = b;
+		}
+		pthread_cond_broadcast(&disp->cond);
+		pthread_mutex_unlock(&disp->lock);
+	}
+
+	record_frame(disp);
+	return ret;
+}
+
+static void sunxi_sink_close_video_layer(struct sunxi_disp *sunxi_disp)
+{
+}
+
+static int sunxi_sink_set_osd_layer(struct sunxi_disp *sunxi_disp, int x, int y, int width, int height, output_surface_ctx_t *surface)
+{
+	return 0;
+}
+
+static void sunxi_sink_close_osd_layer(struct sunxi_disp *sunxi_disp)
+{
+}
@@ -21,11 +21,14 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <math.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include "kernel-headers/sunxi_display2.h"
 #include "vdpau_private.h"
 #include "sunxi_disp.h"
+#include "yuv2rgb.h"
 #include <stdio.h>
 #include <X11/Intrinsic.h>
 #include <X11/Xutil.h>
@@ -35,23 +38,34 @@
 #include <sys/shm.h>
 #endif /*DEF_SHM*/
 
+/*
+ * The server reads an image some time after XShmPutImage returns, the
+ * next frame goes into another one until it reports completion.
+ */
+#define X11_IMAGES 3
+
+struct x11_image
+{
+	XImage *ximage;
+#ifdef DEF_SHM
+	XShmSegmentInfo shminfo;
+#endif /*DEF_SHM*/
+	int busy;
+};
+
 struct sunxi_dispx11_private
 {
 	struct sunxi_disp pub;
 
-  //int fd;
-  //	disp_layer_config video_config;
-  //	unsigned int screen_width;
-  //	disp_layer_config osd_config;
-  Display *display;
-  Drawable drawable;
-     int depth;
-    int shm;
-    char *data[3];
-    int bytes_per_line;
-    char *image;
-    void *ximage;
-    void *context;
+	Display *display;
+	Drawable drawable;
+	GC gc;
+	Visual *visual;
+	int depth;
+	int shm;
+	int shm_completion;
+	struct x11_image image[X11_IMAGES];
+	int next_image;
 };
 
 static void sunxi_dispx11_close(struct sunxi_disp *sunxi_disp);
@@ -60,193 +74,286 @@ static void sunxi_dispx11_close_video_layer(struct sunxi_disp *sunxi_disp);
 static int sunxi_dispx11_set_osd_layer(struct sunxi_disp *sunxi_disp, int x, int y, int width, int height, output_surface_ctx_t *surface);
 static void sunxi_dispx11_close_osd_layer(struct sunxi_disp *sunxi_disp);
 
+#ifdef DEF_SHM
+/* segments can only be attached by a server on the same machine */
+static int shm_usable(Display *display)
+{
+	const char *name = XDisplayString(display);
+
+	if (!XShmQueryExtension(display))
+		return 0;
+
+	return name[0] == ':' || strncmp(name, "unix:", 5) == 0;
+}
+#endif /*DEF_SHM*/
+
 struct sunxi_disp *sunxi_dispx11_open(Display *display, Drawable drawable)
 {
-  struct sunxi_dispx11_private *disp = calloc(1, sizeof(*disp));
-
-  if (disp) {
-    disp->display = XOpenDisplay(XDisplayString(display));
-    disp->drawable = drawable;
-    disp->pub.close = sunxi_dispx11_close;
-    disp->pub.set_video_layer = sunxi_dispx11_set_video_layer;
-    disp->pub.close_video_layer = sunxi_dispx11_close_video_layer;
-    disp->pub.set_osd_layer = sunxi_dispx11_set_osd_layer;
-    disp->pub.close_osd_layer = sunxi_dispx11_close_osd_layer;
-
-    fprintf(stderr, "%s:%d\n", __func__, __LINE__);
-    return (struct sunxi_disp *)disp;
-  }
-
-  return NULL;
+	XWindowAttributes attribs;
+	struct sunxi_dispx11_private *disp = calloc(1, sizeof(*disp));
+
+	if (!disp)
+		return NULL;
+
+	/* used from the flip thread only, separate from the application's connection */
+	disp->display = XOpenDisplay(XDisplayString(display));
+	if (!disp->display)
+		goto err_open;
+
+	if (!XGetWindowAttributes(disp->display, drawable, &attribs))
+		goto err_attribs;
+
+	disp->drawable = drawable;
+	disp->depth = attribs.depth;
+	disp->visual = attribs.visual;
+	disp->gc = XCreateGC(disp->display, drawable, 0, NULL);
+#ifdef DEF_SHM
+	disp->shm = shm_usable(disp->display);
+	if (disp->shm)
+		disp->shm_completion = XShmGetEventBase(disp->display) + ShmCompletion;
+#endif /*DEF_SHM*/
+
+	disp->pub.close = sunxi_dispx11_close;
+	disp->pub.set_video_layer = sunxi_dispx11_set_video_layer;
+	disp->pub.close_video_layer = sunxi_dispx11_close_video_layer;
+	disp->pub.set_osd_layer = sunxi_dispx11_set_osd_layer;
+	disp->pub.close_osd_layer = sunxi_dispx11_close_osd_layer;
+
+	VDPAU_DBG("X11 output, depth %d, %s", disp->depth, disp->shm ? "MIT-SHM" : "XPutImage");
+	return (struct sunxi_disp *)disp;
+
+err_attribs:
+	XCloseDisplay(disp->display);
+err_open:
+	free(disp);
+	return NULL;
 }
 
-static void sunxi_dispx11_close(struct sunxi_disp *sunxi_disp)
+static void image_destroy(struct sunxi_dispx11_private *disp, struct x11_image *img)
 {
-  //struct sunxi_dispx11_private *disp = (struct sunxi_dispx11_private *)sunxi_disp;
+	if (!img->ximage)
+		return;
 
-	free(sunxi_disp);
+#ifdef DEF_SHM
+	if (disp->shm)
+	{
+		XShmDetach(disp->display, &img->shminfo);
+		/* the segment isn't XDestroyImage()'s to free */
+		img->ximage->data = NULL;
+		XDestroyImage(img->ximage);
+		shmdt(img->shminfo.shmaddr);
+	}
+	else
+#endif /*DEF_SHM*/
+		XDestroyImage(img->ximage);
+
+	img->ximage = NULL;
+	img->busy = 0;
 }
 
-static int sunxi_dispx11_set_video_layer(struct sunxi_disp *sunxi_disp, int x, int y, int width, int height, output_surface_ctx_t *surface)
+static int image_create(struct sunxi_dispx11_private *disp, struct x11_image *img, int width, int height)
 {
-	struct sunxi_dispx11_private *disp = (struct sunxi_dispx11_private *)sunxi_disp;
+#ifdef DEF_SHM
+	if (disp->shm)
+	{
+		img->ximage = XShmCreateImage(disp->display, disp->visual, disp->depth, ZPixmap, NULL, &img->shminfo, width, height);
+		if (!img->ximage)
+			return -1;
 
-	switch (surface->vs->source_format) {
-	case VDP_YCBCR_FORMAT_YUYV:
-	        fprintf(stderr, "%s(%d): VDP_YCBCR_FORMAT_YUYV %dx%d\n", __func__, __LINE__, surface->vs->width, surface->vs->height);
-		break;
-	case VDP_YCBCR_FORMAT_UYVY:
-	        fprintf(stderr, "%s(%d): VDP_YCBCR_FORMAT_UYVY %dx%d\n", __func__, __LINE__, surface->vs->width, surface->vs->height);
-		break;
-	case VDP_YCBCR_FORMAT_NV12:
+		img->shminfo.shmid = shmget(IPC_PRIVATE, img->ximage->bytes_per_line * img->ximage->height, IPC_CREAT | 0600);
+		if (img->shminfo.shmid < 0)
+			goto err_shm;
+
+		img->shminfo.shmaddr = shmat(img->shminfo.shmid, NULL, 0);
+		/* marked for removal right away, it goes with the last detach */
+		shmctl(img->shminfo.shmid, IPC_RMID, NULL);
+		if (img->shminfo.shmaddr == (char *)-1)
+			goto err_shm;
+
+		img->ximage->data = img->shminfo.shmaddr;
+		img->shminfo.readOnly = True;
+		if (!XShmAttach(disp->display, &img->shminfo))
 		{
-		  static XShmSegmentInfo Shminfo;
-		  const int lwidth = surface->vs->width, lheight = surface->vs->height;
-
-		  if (disp->data[0] == NULL) {
-		    XWindowAttributes attribs;
-		    XImage *ximage;
-		    fprintf(stderr, "%s(%d): VDP_YCBCR_FORMAT_NV12 %dx%d\n", __func__, __LINE__, surface->vs->width, surface->vs->height);
-		    fprintf(stderr, "=NULL\n");
-		    disp->shm = 0*XShmQueryExtension(disp->display);
-		    XGetWindowAttributes(disp->display, disp->drawable, &attribs);
-		    disp->depth = attribs.depth;
-		    disp->context = XCreateGC (disp->display, disp->drawable, 0, NULL);
-		    if (disp->shm) {
-		      disp->ximage = ximage = XShmCreateImage(disp->display, NULL, disp->depth, ZPixmap, NULL, &Shminfo, lwidth, lheight);
-		      if (!disp->ximage) fprintf(stderr, "XShmCreateImage failed...\n");
-		      Shminfo.shmid = shmget(IPC_PRIVATE, ximage->bytes_per_line * ximage->height, IPC_CREAT | 0777);
-		      if (Shminfo.shmid < 0)	{ fprintf(stderr, "shmget failed...\n"); }
-		      Shminfo.shmaddr = (char *) shmat(Shminfo.shmid, 0, 0);
-		      if (Shminfo.shmaddr == ((char *) -1)) { fprintf(stderr, "shmat failed...\n"); }
-		      disp->image = ximage->data = Shminfo.shmaddr;
-		      Shminfo.readOnly = False;
-		      XShmAttach(disp->display, &Shminfo);
-		      XSync(disp->display, False);
-		      shmctl(Shminfo.shmid, IPC_RMID, 0);
-		      fprintf(stderr, "=SHM\n");
-		    } else {
-		      disp->ximage = ximage = XCreateImage (disp->display, NULL, disp->depth, ZPixmap, 0, NULL, lwidth, lheight, 8, 0);
-		      disp->bytes_per_line = ximage->bytes_per_line;
-		      disp->image = malloc(disp->bytes_per_line * surface->vs->height);
-		      ximage->data = disp->image;
-		    }
-
-		    fprintf(stderr, "mapping %p %p %p, shm=%d (%d, %d, %d) depth=%d\n", disp->data[0], disp->data[1], disp->data[2], disp->shm,
-			    cedarv_getSize(surface->vs->dataY), cedarv_getSize(surface->vs->dataU), cedarv_isValid(surface->vs->dataV) ? cedarv_getSize(surface->vs->dataV) : -1, disp->depth);
-		  }
-		  disp->data[0] = cedarv_getPointer(surface->vs->dataY);
-		  disp->data[1] = cedarv_getPointer(surface->vs->dataU);
-		  disp->data[2] = cedarv_isValid(surface->vs->dataV) ? cedarv_getPointer(surface->vs->dataV) : NULL;
-#if 0
-		  { // ffplay -f rawvideo -pix_fmt nv12 -video_size 1280x718 ""
-		    char filename[32]; static int n = 0; sprintf(filename, "%08d.raw", n++);
-		    if (!(n%50)) { FILE *video_dst_file = fopen(filename, "wb"); fwrite(disp->data[0], 1, surface->vs->width * surface->vs->height    , video_dst_file);
-		      fwrite(disp->data[1], 1, surface->vs->width * surface->vs->height / 2, video_dst_file); fclose(video_dst_file); }
-		  }
-#endif /*0*/
-
-		  { static int n = 0; fprintf(stderr, "%4d) %p %p\n", n++, (void *)cedarv_virt2phys(surface->vs->dataY), (void *)cedarv_virt2phys(surface->vs->dataU)); }
-#if 1
-		  {
-#if 0
-		    {
-		      int y;
-		      char *p, *w;
-		      for (y=0, p=disp->image, w=disp->data[0];y<surface->vs->height/2;y++,p+=disp->bytes_per_line) {
-			char *r = p;
-			for (int x=0;x<surface->vs->width;x+=4) {
-			  *r++=*w; *r++=*w; *r++=*w; w++;
-			  *r++=*w; *r++=*w; *r++=*w; w++;
-			  *r++=*w; *r++=*w; *r++=*w; w++;
-			  *r++=*w; *r++=*w; *r++=*w; w++;
-			}
-		      }
-		    }
-#else
-		    memcpy(disp->image, disp->data[0], surface->vs->width * surface->vs->height);
-#endif
-                    if (disp->shm) {
-		      XShmPutImage(disp->display, disp->drawable, disp->context, disp->ximage, 0, 0, 0, 0, lwidth, lheight, True);
-		    } else {
-		      XPutImage(disp->display, disp->drawable, disp->context, disp->ximage, 0, 0, 0, 0, lwidth, lheight);
-		    }
-		    //fprintf(stderr, "=T6\n");
-		    //(void) XCopyArea (disp->display, pixmap_id, q->target->drawable, context, 0,0,   lwidth, lheight, 0, 0);
-		  }
-#endif /*0*/
+			shmdt(img->shminfo.shmaddr);
+			goto err_shm;
 		}
-		break;
-	case VDP_YCBCR_FORMAT_YV12:
-	        fprintf(stderr, "%s(%d): VDP_YCBCR_FORMAT_YV12 %dx%d\n", __func__, __LINE__, surface->vs->width, surface->vs->height);
-		break;
-	default:
-	case INTERNAL_YCBCR_FORMAT:
-	        fprintf(stderr, "%s(%d): INTERNAL_YCBCR_FORMAT %dx%d\n", __func__, __LINE__, surface->vs->width, surface->vs->height);
-		break;
+		return 0;
+
+err_shm:
+		XDestroyImage(img->ximage);
+		img->ximage = NULL;
+		return -1;
 	}
+#endif /*DEF_SHM*/
+
+	img->ximage = XCreateImage(disp->display, disp->visual, disp->depth, ZPixmap, 0, NULL, width, height, 32, 0);
+	if (!img->ximage)
+		return -1;
+
+	img->ximage->data = malloc(img->ximage->bytes_per_line * height);
+	if (!img->ximage->data)
+	{
+		XDestroyImage(img->ximage);
+		img->ximage = NULL;
+		return -1;
+	}
+
+	return 0;
+}
 
-	/*-----------------*/
-#if 0
-	fprintf(stderr, "%s:%d\n", __func__, __LINE__);
-	disp_rect src = { .x = surface->video_src_rect.x0, .y = surface->video_src_rect.y0,
-			  .width = surface->video_src_rect.x1 - surface->video_src_rect.x0,
-			  .height = surface->video_src_rect.y1 - surface->video_src_rect.y0 };
-	disp_rect scn = { .x = x + surface->video_dst_rect.x0, .y = y + surface->video_dst_rect.y0,
-			  .width = surface->video_dst_rect.x1 - surface->video_dst_rect.x0,
-			  .height = surface->video_dst_rect.y1 - surface->video_dst_rect.y0 };
+#ifdef DEF_SHM
+static void handle_completion(struct sunxi_dispx11_private *disp, XEvent *ev)
+{
+	XShmCompletionEvent *c = (XShmCompletionEvent *)ev;
+	int i;
 
-	clip (&src, &scn, disp->screen_width);
+	for (i = 0; i < X11_IMAGES; i++)
+		if (disp->image[i].ximage && disp->image[i].shminfo.shmseg == c->shmseg)
+			disp->image[i].busy = 0;
+}
+#endif /*DEF_SHM*/
 
-	unsigned long args[4] = { 0, (unsigned long)(&disp->video_config), 1, 0 };
-	switch (surface->vs->source_format)
+/*
+ * The next image in turn, at the given size. Images are recreated when
+ * the size changes, e.g. after the window got resized.
+ */
+static struct x11_image *get_image(struct sunxi_dispx11_private *disp, int width, int height)
+{
+	struct x11_image *img = &disp->image[disp->next_image];
+
+#ifdef DEF_SHM
+	XEvent ev;
+
+	while (disp->shm && XCheckTypedEvent(disp->display, disp->shm_completion, &ev))
+		handle_completion(disp, &ev);
+
+	/* this connection selects no other events */
+	while (img->busy)
 	{
-	case VDP_YCBCR_FORMAT_YUYV:
-		disp->video_config.info.fb.format = DISP_FORMAT_YUV422_I_YUYV;
-		break;
-	case VDP_YCBCR_FORMAT_UYVY:
-		disp->video_config.info.fb.format = DISP_FORMAT_YUV422_I_UYVY;
-		break;
-	case VDP_YCBCR_FORMAT_NV12:
-	  fprintf(stderr, "%s:%d\n", __func__, __LINE__);
-		disp->video_config.info.fb.format = DISP_FORMAT_YUV420_SP_UVUV;
-		break;
-	case VDP_YCBCR_FORMAT_YV12:
-	default:
-	case INTERNAL_YCBCR_FORMAT:
-		disp->video_config.info.fb.format = DISP_FORMAT_YUV420_P;
-		break;
+		XNextEvent(disp->display, &ev);
+		if (ev.type == disp->shm_completion)
+			handle_completion(disp, &ev);
 	}
+#endif /*DEF_SHM*/
 
-	fprintf(stderr, "%s:%d\n", __func__, __LINE__);
-	disp->video_config.info.fb.addr[0] = cedarv_virt2phys(surface->vs->dataY);
-	disp->video_config.info.fb.addr[1] = cedarv_virt2phys(surface->vs->dataU) /*+ surface->vs->luma_size*/;
-        if( cedarv_isValid(surface->vs->dataV))
-	  disp->video_config.info.fb.addr[2] = cedarv_virt2phys(surface->vs->dataV) /*+ surface->vs->luma_size + surface->vs->chroma_size / 2*/;
-
-	fprintf(stderr, "%s:%d\n", __func__, __LINE__);
-	disp->video_config.info.fb.size[0].width = surface->vs->width;
-	disp->video_config.info.fb.size[0].height = surface->vs->height;
-	disp->video_config.info.fb.align[0] = 32;
-	disp->video_config.info.fb.size[1].width = surface->vs->width / 2;
-	disp->video_config.info.fb.size[1].height = surface->vs->height / 2;
-	disp->video_config.info.fb.align[1] = 16;
-	disp->video_config.info.fb.size[2].width = surface->vs->width / 2;
-	disp->video_config.info.fb.size[2].height = surface->vs->height / 2;
-	disp->video_config.info.fb.align[2] = 16;
-	disp->video_config.info.fb.crop.x = (unsigned long long)(src.x) << 32;
-	disp->video_config.info.fb.crop.y = (unsigned long long)(src.y) << 32;
-	disp->video_config.info.fb.crop.width = (unsigned long long)(src.width) << 32;
-	disp->video_config.info.fb.crop.height = (unsigned long long)(src.height) << 32;
-	disp->video_config.info.screen_win = scn;
-	disp->video_config.enable = 1;
-
-	fprintf(stderr, "%s:%d\n", __func__, __LINE__);
-	if (ioctl(disp->fd, DISP_LAYER_SET_CONFIG, args))
+	if (img->ximage && (img->ximage->width != width || img->ximage->height != height))
+		image_destroy(disp, img);
+
+	if (!img->ximage && image_create(disp, img, width, height))
+	{
+#ifdef DEF_SHM
+		if (!disp->shm)
+			return NULL;
+
+		/* e.g. out of segments, go on without */
+		VDPAU_DBG("MIT-SHM image failed, falling back to XPutImage");
+		int i;
+		XSync(disp->display, False);
+		for (i = 0; i < X11_IMAGES; i++)
+			image_destroy(disp, &disp->image[i]);
+		disp->shm = 0;
+		if (image_create(disp, img, width, height))
+#endif /*DEF_SHM*/
+			return NULL;
+	}
+
+	disp->next_image = (disp->next_image + 1) % X11_IMAGES;
+	return img;
+}
+
+static void put_image(struct sunxi_dispx11_private *disp, struct x11_image *img, int x, int y, int width, int height)
+{
+#ifdef DEF_SHM
+	if (disp->shm)
+	{
+		XShmPutImage(disp->display, disp->drawable, disp->gc, img->ximage, 0, 0, x, y, width, height, True);
+		img->busy = 1;
+	}
+	else
+#endif /*DEF_SHM*/
+		XPutImage(disp->display, disp->drawable, disp->gc, img->ximage, 0, 0, x, y, width, height);
+
+	XFlush(disp->display);
+}
+
+static void sunxi_dispx11_close(struct sunxi_disp *sunxi_disp)
+{
+	struct sunxi_dispx11_private *disp = (struct sunxi_dispx11_private *)sunxi_disp;
+	int i;
+
+	/* the server may still be reading from the segments */
+	XSync(disp->display, False);
+	for (i = 0; i < X11_IMAGES; i++)
+		image_destroy(disp, &disp->image[i]);
+
+	XFreeGC(disp->display, disp->gc);
+	XCloseDisplay(disp->display);
+	free(sunxi_disp);
+}
+
+static int rgb_format(XImage *ximage, enum cedarv_rgb_format *format)
+{
+	if (ximage->byte_order != LSBFirst)
+		return -1;
+
+	if (ximage->bits_per_pixel == 32 && ximage->red_mask == 0xff0000 && ximage->blue_mask == 0xff)
+		*format = CEDARV_RGB_XRGB8888;
+	else if (ximage->bits_per_pixel == 24 && ximage->red_mask == 0xff0000 && ximage->blue_mask == 0xff)
+		*format = CEDARV_RGB_RGB888;
+	else if (ximage->bits_per_pixel == 16 && ximage->red_mask == 0xf800 && ximage->blue_mask == 0x1f)
+		*format = CEDARV_RGB_RGB565;
+	else
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Converts and scales the video straight into the image, only the part
+ * of the destination rect inside the drawable.
+ */
+static int sunxi_dispx11_set_video_layer(struct sunxi_disp *sunxi_disp, int x, int y, int width, int height, output_surface_ctx_t *surface)
+{
+	struct sunxi_dispx11_private *disp = (struct sunxi_dispx11_private *)sunxi_disp;
+	struct cedarv_yuv_frame frame;
+	enum cedarv_rgb_format format;
+	struct cedarv_csc csc;
+	VdpRect src;
+
+	output_surface_get_video_frame(surface, &frame, &src, &csc);
+	int src_x = src.x0, src_y = src.y0;
+	int src_w = src.x1 - src.x0, src_h = src.y1 - src.y0;
+
+	int dst_x = surface->video_dst_rect.x0, dst_y = surface->video_dst_rect.y0;
+	int dst_w = surface->video_dst_rect.x1 - dst_x, dst_h = surface->video_dst_rect.y1 - dst_y;
+	if (src_w <= 0 || src_h <= 0 || dst_w <= 0 || dst_h <= 0)
+		return -EINVAL;
+
+	/* cut the rects down to the drawable, the source by the same fraction */
+	int cx0 = max(dst_x, 0), cy0 = max(dst_y, 0);
+	int cx1 = min_nz(dst_x + dst_w, width), cy1 = min_nz(dst_y + dst_h, height);
+	if (cx1 <= cx0 || cy1 <= cy0)
+		return 0;
+
+	int sx = src_x + (int64_t)(cx0 - dst_x) * src_w / dst_w;
+	int sy = src_y + (int64_t)(cy0 - dst_y) * src_h / dst_h;
+	int sw = max((int)((int64_t)(cx1 - cx0) * src_w / dst_w), 1);
+	int sh = max((int)((int64_t)(cy1 - cy0) * src_h / dst_h), 1);
+
+	struct x11_image *img = get_image(disp, cx1 - cx0, cy1 - cy0);
+	if (!img)
+		return -ENOMEM;
+
+	if (rgb_format(img->ximage, &format))
+	{
+		VDPAU_DBG_ONCE("X11 visual with %d bpp not supported", img->ximage->bits_per_pixel);
 		return -EINVAL;
+	}
+
+	cedarv_yuv2rgb(&frame, sx, sy, sw, sh, (uint8_t *)img->ximage->data, img->ximage->bytes_per_line,
+	               cx1 - cx0, cy1 - cy0, format, CEDARV_SCALE_BILINEAR, &csc);
 
-	fprintf(stderr, "%s:%d\n", __func__, __LINE__);
-#endif
+	put_image(disp, img, cx0, cy0, cx1 - cx0, cy1 - cy0);
 	return 0;
 }
 
@@ -0,0 +1,573 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/Xvlib.h>
+#ifdef DEF_SHM
+#include <X11/extensions/XShm.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#endif /*DEF_SHM*/
+#include "vdpau_private.h"
+#include "sunxi_disp.h"
+#include "detile.h"
+
+#define FOURCC(a, b, c, d) ((uint32_t)(a) | ((uint32_t)(b) << 8) | ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+#define FOURCC_NV12 FOURCC('N', 'V', '1', '2')
+#define FOURCC_YV12 FOURCC('Y', 'V', '1', '2')
+#define FOURCC_I420 FOURCC('I', '4', '2', '0')
+#define FOURCC_YUY2 FOURCC('Y', 'U', 'Y', '2')
+#define FOURCC_UYVY FOURCC('U', 'Y', 'V', 'Y')
+
+/* as in the X11 renderer, the next frame goes into another image while the server reads one */
+#define XV_IMAGES 3
+
+struct xv_image
+{
+	XvImage *image;
+#ifdef DEF_SHM
+	XShmSegmentInfo shminfo;
+#endif /*DEF_SHM*/
+	int busy;
+};
+
+struct sunxi_dispxv_private
+{
+	struct sunxi_disp pub;
+
+	Display *display;
+	Drawable drawable;
+	GC gc;
+	XvPortID port;
+	/* image formats of the port we can fill, in order of preference */
+	uint32_t formats[5];
+	int format_count;
+	int shm;
+	int shm_completion;
+	struct xv_image image[XV_IMAGES];
+	int next_image;
+	int video_shown;
+#ifdef DEF_RENDERX11
+	/* for surfaces no image format of the port can take, opened on the first one */
+	struct sunxi_disp *x11;
+#endif /*DEF_RENDERX11*/
+};
+
+static void sunxi_dispxv_close(struct sunxi_disp *sunxi_disp);
+static int sunxi_dispxv_set_video_layer(struct sunxi_disp *sunxi_disp, int x, int y, int width, int height, output_surface_ctx_t *surface);
+static void sunxi_dispxv_close_video_layer(struct sunxi_disp *sunxi_disp);
+static int sunxi_dispxv_set_osd_layer(struct sunxi_disp *sunxi_disp, int x, int y, int width, int height, output_surface_ctx_t *surface);
+static void sunxi_dispxv_close_osd_layer(struct sunxi_disp *sunxi_disp);
+
+static int port_formats(struct sunxi_dispxv_private *disp, XvPortID port)
+{
+	static const uint32_t wanted[] = { FOURCC_NV12, FOURCC_YV12, FOURCC_I420, FOURCC_YUY2, FOURCC_UYVY };
+	XvImageFormatValues *formats;
+	int i, j, count;
+
+	formats = XvListImageFormats(disp->display, port, &count);
+	if (!formats)
+		return 0;
+
+	disp->format_count = 0;
+	for (i = 0; i < ARRAY_SIZE(wanted); i++)
+		for (j = 0; j < count; j++)
+			if ((uint32_t)formats[j].id == wanted[i])
+			{
+				disp->formats[disp->format_count++] = wanted[i];
+				break;
+			}
+
+	XFree(formats);
+	return disp->format_count;
+}
+
+/* the first free port of an image adaptor that takes any of our formats */
+static int grab_port(struct sunxi_dispxv_private *disp)
+{
+	XvAdaptorInfo *adaptors;
+	unsigned int i, count;
+	unsigned long p;
+	int found = 0;
+
+	if (XvQueryAdaptors(disp->display, DefaultRootWindow(disp->display), &count, &adaptors) != Success)
+		return 0;
+
+	for (i = 0; i < count && !found; i++)
+	{
+		if (!(adaptors[i].type & XvInputMask) || !(adaptors[i].type & XvImageMask))
+			continue;
+
+		for (p = 0; p < adaptors[i].num_ports && !found; p++)
+		{
+			XvPortID port = adaptors[i].base_id + p;
+			if (port_formats(disp, port) && XvGrabPort(disp->display, port, CurrentTime) == Success)
+			{
+				VDPAU_DBG("Xv output on port %lu of \"%s\"", (unsigned long)port, adaptors[i].name);
+				disp->port = port;
+				found = 1;
+			}
+		}
+	}
+
+	XvFreeAdaptorInfo(adaptors);
+	return found;
+}
+
+/* overlay ports show the video where the colorkey is, let the server paint it */
+static void autopaint_colorkey(struct sunxi_dispxv_private *disp)
+{
+	XvAttribute *attributes;
+	int i, count;
+
+	attributes = XvQueryPortAttributes(disp->display, disp->port, &count);
+	if (!attributes)
+		return;
+
+	for (i = 0; i < count; i++)
+		if (strcmp(attributes[i].name, "XV_AUTOPAINT_COLORKEY") == 0 && (attributes[i].flags & XvSettable))
+			XvSetPortAttribute(disp->display, disp->port, XInternAtom(disp->display, "XV_AUTOPAINT_COLORKEY", False), 1);
+
+	XFree(attributes);
+}
+
+#ifdef DEF_SHM
+/* segments can only be attached by a server on the same machine */
+static int shm_usable(Display *display)
+{
+	const char *name = XDisplayString(display);
+
+	if (!XShmQueryExtension(display))
+		return 0;
+
+	return name[0] == ':' || strncmp(name, "unix:", 5) == 0;
+}
+#endif /*DEF_SHM*/
+
+struct sunxi_disp *sunxi_dispxv_open(Display *display, Drawable drawable)
+{
+	unsigned int version, release, request_base, event_base, error_base;
+	struct sunxi_dispxv_private *disp = calloc(1, sizeof(*disp));
+
+	if (!disp)
+		return NULL;
+
+	/* used from the flip thread only, separate from the application's connection */
+	disp->display = XOpenDisplay(XDisplayString(display));
+	if (!disp->display)
+		goto err_open;
+
+	if (XvQueryExtension(disp->display, &version, &release, &request_base, &event_base, &error_base) != Success ||
+	    !grab_port(disp))
+		goto err_port;
+
+	autopaint_colorkey(disp);
+
+	disp->drawable = drawable;
+	disp->gc = XCreateGC(disp->display, drawable, 0, NULL);
+#ifdef DEF_SHM
+	disp->shm = shm_usable(disp->display);
+	if (disp->shm)
+		disp->shm_completion = XShmGetEventBase(disp->display) + ShmCompletion;
+#endif /*DEF_SHM*/
+
+	disp->pub.close = sunxi_dispxv_close;
+	disp->pub.set_video_layer = sunxi_dispxv_set_video_layer;
+	disp->pub.close_video_layer = sunxi_dispxv_close_video_layer;
+	disp->pub.set_osd_layer = sunxi_dispxv_set_osd_layer;
+	disp->pub.close_osd_layer = sunxi_dispxv_close_osd_layer;
+
+	return (struct sunxi_disp *)disp;
+
+err_port:
+	XCloseDisplay(disp->display);
+err_open:
+	free(disp);
+	return NULL;
+}
+
+static void image_destroy(struct sunxi_dispxv_private *disp, struct xv_image *img)
+{
+	if (!img->image)
+		return;
+
+#ifdef DEF_SHM
+	if (disp->shm)
+	{
+		XShmDetach(disp->display, &img->shminfo);
+		shmdt(img->shminfo.shmaddr);
+	}
+	else
+#endif /*DEF_SHM*/
+		free(img->image->data);
+
+	XFree(img->image);
+	img->image = NULL;
+	img->busy = 0;
+}
+
+static int image_create(struct sunxi_dispxv_private *disp, struct xv_image *img, uint32_t fourcc, int width, int height)
+{
+#ifdef DEF_SHM
+	if (disp->shm)
+	{
+		img->image = XvShmCreateImage(disp->display, disp->port, fourcc, NULL, width, height, &img->shminfo);
+		if (!img->image)
+			return -1;
+
+		img->shminfo.shmid = shmget(IPC_PRIVATE, img->image->data_size, IPC_CREAT | 0600);
+		if (img->shminfo.shmid < 0)
+			goto err_shm;
+
+		img->shminfo.shmaddr = shmat(img->shminfo.shmid, NULL, 0);
+		/* marked for removal right away, it goes with the last detach */
+		shmctl(img->shminfo.shmid, IPC_RMID, NULL);
+		if (img->shminfo.shmaddr == (char *)-1)
+			goto err_shm;
+
+		img->image->data = img->shminfo.shmaddr;
+		img->shminfo.readOnly = True;
+		if (!XShmAttach(disp->display, &img->shminfo))
+		{
+			shmdt(img->shminfo.shmaddr);
+			goto err_shm;
+		}
+		return 0;
+
+err_shm:
+		XFree(img->image);
+		img->image = NULL;
+		return -1;
+	}
+#endif /*DEF_SHM*/
+
+	img->image = XvCreateImage(disp->display, disp->port, fourcc, NULL, width, height);
+	if (!img->image)
+		return -1;
+
+	img->image->data = malloc(img->image->data_size);
+	if (!img->image->data)
+	{
+		XFree(img->image);
+		img->image = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+#ifdef DEF_SHM
+static void handle_completion(struct sunxi_dispxv_private *disp, XEvent *ev)
+{
+	XShmCompletionEvent *c = (XShmCompletionEvent *)ev;
+	int i;
+
+	for (i = 0; i < XV_IMAGES; i++)
+		if (disp->image[i].image && disp->image[i].shminfo.shmseg == c->shmseg)
+			disp->image[i].busy = 0;
+}
+#endif /*DEF_SHM*/
+
+static struct xv_image *get_image(struct sunxi_dispxv_private *disp, uint32_t fourcc, int width, int height)
+{
+	struct xv_image *img = &disp->image[disp->next_image];
+
+#ifdef DEF_SHM
+	XEvent ev;
+
+	while (disp->shm && XCheckTypedEvent(disp->display, disp->shm_completion, &ev))
+		handle_completion(disp, &ev);
+
+	/* this connection selects no other events */
+	while (img->busy)
+	{
+		XNextEvent(disp->display, &ev);
+		if (ev.type == disp->shm_completion)
+			handle_completion(disp, &ev);
+	}
+#endif /*DEF_SHM*/
+
+	if (img->image && ((uint32_t)img->image->id != fourcc || img->image->width != width || img->image->height != height))
+		image_destroy(disp, img);
+
+	if (!img->image && image_create(disp, img, fourcc, width, height))
+	{
+#ifdef DEF_SHM
+		if (!disp->shm)
+			return NULL;
+
+		VDPAU_DBG("MIT-SHM image failed, falling back to XvPutImage");
+		int i;
+		XSync(disp->display, False);
+		for (i = 0; i < XV_IMAGES; i++)
+			image_destroy(disp, &disp->image[i]);
+		disp->shm = 0;
+		if (image_create(disp, img, fourcc, width, height))
+#endif /*DEF_SHM*/
+			return NULL;
+	}
+
+	disp->next_image = (disp->next_image + 1) % XV_IMAGES;
+	return img;
+}
+
+static void sunxi_dispxv_close(struct sunxi_disp *sunxi_disp)
+{
+	struct sunxi_dispxv_private *disp = (struct sunxi_dispxv_private *)sunxi_disp;
+	int i;
+
+#ifdef DEF_RENDERX11
+	if (disp->x11)
+		disp->x11->close(disp->x11);
+#endif /*DEF_RENDERX11*/
+
+	XvStopVideo(disp->display, disp->port, disp->drawable);
+	/* the server may still be reading from the segments */
+	XSync(disp->display, False);
+	for (i = 0; i < XV_IMAGES; i++)
+		image_destroy(disp, &disp->image[i]);
+
+	XvUngrabPort(disp->display, disp->port, CurrentTime);
+	XFreeGC(disp->display, disp->gc);
+	XCloseDisplay(disp->display);
+	free(sunxi_disp);
+}
+
+static int has_format(struct sunxi_dispxv_private *disp, uint32_t fourcc)
+{
+	int i;
+
+	for (i = 0; i < disp->format_count; i++)
+		if (disp->formats[i] == fourcc)
+			return 1;
+
+	return 0;
+}
+
+/* packed layouts only go out as they are, 4:2:0 ones in any of the 4:2:0 formats */
+static uint32_t image_format(struct sunxi_dispxv_private *disp, VdpYCbCrFormat format)
+{
+	int i;
+
+	if (format == VDP_YCBCR_FORMAT_YUYV)
+		return has_format(disp, FOURCC_YUY2) ? FOURCC_YUY2 : 0;
+	if (format == VDP_YCBCR_FORMAT_UYVY)
+		return has_format(disp, FOURCC_UYVY) ? FOURCC_UYVY : 0;
+
+	/* planar sources are copied best into a planar image */
+	if (format == VDP_YCBCR_FORMAT_YV12 && has_format(disp, FOURCC_YV12))
+		return FOURCC_YV12;
+
+	for (i = 0; i < disp->format_count; i++)
+		if (disp->formats[i] != FOURCC_YUY2 && disp->formats[i] != FOURCC_UYVY)
+			return disp->formats[i];
+
+	return 0;
+}
+
+/*
+ * Copies a linear 4:2:0 frame into the image. u and v are the chroma
+ * planes, or v is NULL and u holds interleaved CbCr.
+ */
+static void copy_420(XvImage *image, const uint8_t *y, const uint8_t *u, const uint8_t *v,
+                     int pitch_y, int pitch_c, int width, int height)
+{
+	uint8_t *dst = (uint8_t *)image->data;
+	int cw = (width + 1) / 2, ch = (height + 1) / 2;
+	int i, line;
+
+	cedarv_copy_plane(dst + image->offsets[0], image->pitches[0], y, pitch_y, width, height);
+
+	if (image->id == FOURCC_NV12)
+	{
+		uint8_t *uv = dst + image->offsets[1];
+		if (!v)
+		{
+			cedarv_copy_plane(uv, image->pitches[1], u, pitch_c, 2 * cw, ch);
+			return;
+		}
+
+		for (line = 0; line < ch; line++, uv += image->pitches[1])
+			for (i = 0; i < cw; i++)
+			{
+				uv[2 * i] = u[line * pitch_c + i];
+				uv[2 * i + 1] = v[line * pitch_c + i];
+			}
+		return;
+	}
+
+	/* YV12 is Y, V, U and I420 is Y, U, V */
+	int ui = image->id == FOURCC_YV12 ? 2 : 1, vi = 3 - ui;
+	uint8_t *du = dst + image->offsets[ui], *dv = dst + image->offsets[vi];
+	if (v)
+	{
+		cedarv_copy_plane(du, image->pitches[ui], u, pitch_c, cw, ch);
+		cedarv_copy_plane(dv, image->pitches[vi], v, pitch_c, cw, ch);
+		return;
+	}
+
+	for (line = 0; line < ch; line++, du += image->pitches[ui], dv += image->pitches[vi])
+		for (i = 0; i < cw; i++)
+		{
+			du[i] = u[line * pitch_c + 2 * i];
+			dv[i] = u[line * pitch_c + 2 * i + 1];
+		}
+}
+
+static void put_image(struct sunxi_dispxv_private *disp, struct xv_image *img, output_surface_ctx_t *surface, int fields)
+{
+	int src_x = surface->video_src_rect.x0, src_y = surface->video_src_rect.y0 / fields;
+	int src_w = surface->video_src_rect.x1 - surface->video_src_rect.x0;
+	int src_h = (surface->video_src_rect.y1 - surface->video_src_rect.y0) / fields;
+	int dst_w = surface->video_dst_rect.x1 - surface->video_dst_rect.x0;
+	int dst_h = surface->video_dst_rect.y1 - surface->video_dst_rect.y0;
+
+#ifdef DEF_SHM
+	if (disp->shm)
+	{
+		XvShmPutImage(disp->display, disp->port, disp->drawable, disp->gc, img->image,
+		              src_x, src_y, src_w, src_h, surface->video_dst_rect.x0, surface->video_dst_rect.y0, dst_w, dst_h, True);
+		img->busy = 1;
+	}
+	else
+#endif /*DEF_SHM*/
+		XvPutImage(disp->display, disp->port, disp->drawable, disp->gc, img->image,
+		           src_x, src_y, src_w, src_h, surface->video_dst_rect.x0, surface->video_dst_rect.y0, dst_w, dst_h);
+
+	XFlush(disp->display);
+	disp->video_shown = 1;
+}
+
+/*
+ * For surfaces the port has no image format for. get_bits packs any
+ * surface into YUY2 or UYVY, fields show as the whole frame then. Ports
+ * without packed formats get 4:2:2 surfaces converted to RGB by the X11
+ * renderer instead.
+ */
+static int convert_video(struct sunxi_dispxv_private *disp, int x, int y, int width, int height, output_surface_ctx_t *surface)
+{
+	video_surface_ctx_t *vs = surface->vs;
+	VdpYCbCrFormat format = VDP_YCBCR_FORMAT_YUYV;
+	uint32_t fourcc = FOURCC_YUY2;
+
+	if (!has_format(disp, FOURCC_YUY2))
+	{
+		format = VDP_YCBCR_FORMAT_UYVY;
+		fourcc = has_format(disp, FOURCC_UYVY) ? FOURCC_UYVY : 0;
+	}
+
+	if (!fourcc)
+	{
+#ifdef DEF_RENDERX11
+		if (!disp->x11)
+			disp->x11 = sunxi_dispx11_open(disp->display, disp->drawable);
+		if (disp->x11)
+		{
+			VDPAU_DBG_ONCE("Xv port has no image format for surface format %d, converting to RGB", vs->source_format);
+			sunxi_dispxv_close_video_layer(&disp->pub);
+			return disp->x11->set_video_layer(disp->x11, x, y, width, height, surface);
+		}
+#endif /*DEF_RENDERX11*/
+		VDPAU_DBG_ONCE("Xv port has no image format for surface format %d", vs->source_format);
+		return -EINVAL;
+	}
+
+	struct xv_image *img = get_image(disp, fourcc, vs->width, vs->height);
+	if (!img)
+		return -ENOMEM;
+
+	void *const planes[1] = { (uint8_t *)img->image->data + img->image->offsets[0] };
+	const uint32_t pitches[1] = { img->image->pitches[0] };
+	if (vdp_video_surface_get_bits_y_cb_cr(surface->video_surface, format, planes, pitches) != VDP_STATUS_OK)
+		return -EINVAL;
+
+	put_image(disp, img, surface, 1);
+	return 0;
+}
+
+/*
+ * The port does colour conversion and scaling, the frame only has to be
+ * brought into one of its image formats. Single fields (bob) are copied
+ * into a half height image.
+ */
+static int sunxi_dispxv_set_video_layer(struct sunxi_disp *sunxi_disp, int x, int y, int width, int height, output_surface_ctx_t *surface)
+{
+	struct sunxi_dispxv_private *disp = (struct sunxi_dispxv_private *)sunxi_disp;
+	video_surface_ctx_t *vs = surface->vs;
+	video_scanout_t scanout;
+
+	video_surface_get_scanout(vs, surface->video_field, &scanout);
+
+	uint32_t fourcc = image_format(disp, scanout.format);
+	if (!fourcc)
+		return convert_video(disp, x, y, width, height, surface);
+
+	video_surface_prepare_cpu_read(vs, &scanout);
+
+	int fields = scanout.field ? 2 : 1;
+	int frame_height = vs->height / fields;
+	struct xv_image *img = get_image(disp, fourcc, vs->width, frame_height);
+	if (!img)
+		return -ENOMEM;
+
+	const uint8_t *planes[3];
+	int i;
+	for (i = 0; i < 3; i++)
+		planes[i] = cedarv_isValid(scanout.plane[i]) ? (const uint8_t *)cedarv_getPointer(scanout.plane[i]) + scanout.offset[i] : NULL;
+
+	switch (scanout.format)
+	{
+	case VDP_YCBCR_FORMAT_YUYV:
+	case VDP_YCBCR_FORMAT_UYVY:
+		cedarv_copy_plane((uint8_t *)img->image->data + img->image->offsets[0], img->image->pitches[0],
+		                  planes[0], scanout.pitch[0] * fields, 2 * vs->width, frame_height);
+		break;
+	case VDP_YCBCR_FORMAT_YV12:
+		copy_420(img->image, planes[0], planes[1], planes[2], scanout.pitch[0] * fields, scanout.pitch[1] * fields, vs->width, frame_height);
+		break;
+	case VDP_YCBCR_FORMAT_NV12:
+		copy_420(img->image, planes[0], planes[1], NULL, scanout.pitch[0] * fields, scanout.pitch[1] * fields, vs->width, frame_height);
+		break;
+	case INTERNAL_YCBCR_FORMAT:
+	default:
+		{
+			/* the detiler writes the image planes directly, in their order */
+			uint8_t *data = (uint8_t *)img->image->data;
+			uint8_t *const dst[3] = { data + img->image->offsets[0], data + img->image->offsets[1],
+			                          img->image->num_planes > 2 ? data + img->image->offsets[2] : NULL };
+			const int dst_pitch[3] = { img->image->pitches[0], img->image->pitches[1],
+			                           img->image->num_planes > 2 ? img->image->pitches[2] : 0 };
+			enum cedarv_detile_format format = fourcc == FOURCC_NV12 ? CEDARV_DETILE_NV12 :
+			                                   fourcc == FOURCC_YV12 ? CEDARV_DETILE_YV12 : CEDARV_DETILE_I420;
+
+			cedarv_detile_frame(format, dst, dst_pitch, planes[0], planes[1], vs->width, vs->height, 0);
+		}
+		break;
+	}
+
+	put_image(disp, img, surface, fields);
+	return 0;
+}
+
+static void sunxi_dispxv_close_video_layer(struct sunxi_disp *sunxi_disp)
+{
+	struct sunxi_dispxv_private *disp = (struct sunxi_dispxv_private *)sunxi_disp;
+
+	if (!disp->video_shown)
+		return;
+
+	XvStopVideo(disp->display, disp->port, disp->drawable);
+	XFlush(disp->display);
+	disp->video_shown = 0;
+}
+
+static int sunxi_dispxv_set_osd_layer(struct sunxi_disp *sunxi_disp, int x, int y, int width, int height, output_surface_ctx_t *surface)
+{
+	return 0;
+}
+
+static void sunxi_dispxv_close_osd_layer(struct sunxi_disp *sunxi_disp)
+{
+}
@@ -0,0 +1,331 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "vdpau_private.h"
+
+/*
+ * The VE writes MB32 tiled frames, so luma and chroma planes are padded
+ * to whole 32x32 tiles. Linear output uses the same 32 byte aligned
+ * lines. All planes share one allocation: Y, then U (interleaved UV for
+ * decoded frames) and V.
+ *
+ * 32 covers every decoder here, so the alignment doesn't depend on the
+ * profile. MPEG-1/2/4 and H.264 write whole 16 line macroblock rows;
+ * interlaced H.264 (frame_mbs_only_flag == 0) codes its height in
+ * macroblock pairs, i.e. multiples of 32 lines. HEVC pictures are a
+ * multiple of the 8 pixel minimum coding block. Tiled output has lines of
+ * whole 32 byte tiles, HEVC and MPEG-4 program ALIGN(width, 32) as the
+ * linear output stride. So the VE never writes past ALIGN(height, 32)
+ * lines of ALIGN(width, 32) bytes, the old blanket 64 line padding only
+ * wasted memory.
+ *
+ * The allocation is deferred until the surface is first used, players
+ * tend to create more surfaces than a stream ever decodes into. If
+ * VDPAU_SURFACE_IDLE is set to a number of seconds, memory of surfaces
+ * which haven't been used for that long and aren't shown or mapped is
+ * given back; their content is lost then. Frames of a decoder that still
+ * exists are kept, they may be references once a paused stream resumes.
+ */
+#define PLANE_ALIGN 32
+
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t decode_done;
+	video_surface_ctx_t *surfaces;
+	pthread_t reaper;
+	int reaper_running;
+	int idle_ms;
+} mem = { .lock = PTHREAD_MUTEX_INITIALIZER,
+          .wake = PTHREAD_COND_INITIALIZER,
+          .decode_done = PTHREAD_COND_INITIALIZER,
+          .idle_ms = -1,
+};
+
+static uint64_t get_time_ms(void)
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (uint64_t)tp.tv_sec * 1000 + tp.tv_nsec / 1000000;
+}
+
+static void release_memory(video_surface_ctx_t *vs)
+{
+	if (cedarv_isValid(vs->data))
+		cedarv_free(vs->data);
+	if (cedarv_isValid(vs->linearY))
+		cedarv_free(vs->linearY);
+	if (cedarv_isValid(vs->linearUV))
+		cedarv_free(vs->linearUV);
+
+	cedarv_setBufferInvalid(&vs->data);
+	cedarv_setBufferInvalid(&vs->dataY);
+	cedarv_setBufferInvalid(&vs->dataU);
+	cedarv_setBufferInvalid(&vs->dataV);
+	cedarv_setBufferInvalid(&vs->linearY);
+	cedarv_setBufferInvalid(&vs->linearUV);
+	vs->linear_valid = 0;
+}
+
+static void *reaper_thread(void *unused)
+{
+	pthread_mutex_lock(&mem.lock);
+	while (mem.surfaces)
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += mem.idle_ms / 2000 + 1;
+		pthread_cond_timedwait(&mem.wake, &mem.lock, &ts);
+
+		uint64_t now = get_time_ms();
+		video_surface_ctx_t *vs;
+		for (vs = mem.surfaces; vs; vs = vs->next)
+		{
+			if (!cedarv_isValid(vs->data) || vs->refs || vs->decoding || vs->decoder ||
+			    vs->vdpNvState != VdpauNVState_Unregistered)
+				continue;
+
+			if (now - vs->last_use >= (uint64_t)mem.idle_ms)
+			{
+				VDPAU_DBG("releasing memory of idle video surface %p", vs);
+				release_memory(vs);
+			}
+		}
+	}
+	mem.reaper_running = 0;
+	pthread_mutex_unlock(&mem.lock);
+
+	return NULL;
+}
+
+/* sets up the plane layout, memory is allocated by the first video_surface_touch() */
+int video_surface_memory_init(video_surface_ctx_t *vs)
+{
+	vs->stride_width = ALIGN(vs->width, PLANE_ALIGN);
+	vs->stride_height = ALIGN(vs->height, PLANE_ALIGN);
+	vs->plane_size = vs->stride_width * vs->stride_height;
+
+	switch (vs->chroma_type)
+	{
+	case VDP_CHROMA_TYPE_420:
+		vs->offset_u = vs->plane_size;
+		vs->offset_v = vs->offset_u + vs->stride_width * ALIGN((vs->height + 1) / 2, PLANE_ALIGN) / 2;
+		vs->memory_size = vs->offset_v + (vs->offset_v - vs->offset_u);
+		break;
+	case VDP_CHROMA_TYPE_422:
+		vs->offset_u = vs->plane_size;
+		vs->offset_v = vs->offset_u + vs->plane_size / 2;
+		vs->memory_size = 2 * vs->plane_size;
+		break;
+	case VDP_CHROMA_TYPE_444:
+		vs->offset_u = vs->plane_size;
+		vs->offset_v = 2 * vs->plane_size;
+		vs->memory_size = 3 * vs->plane_size;
+		break;
+	default:
+		return 0;
+	}
+
+	pthread_mutex_lock(&mem.lock);
+	if (mem.idle_ms < 0)
+	{
+		char *env = getenv("VDPAU_SURFACE_IDLE");
+		mem.idle_ms = env ? atoi(env) * 1000 : 0;
+	}
+
+	vs->next = mem.surfaces;
+	mem.surfaces = vs;
+
+	if (mem.idle_ms > 0 && !mem.reaper_running &&
+	    pthread_create(&mem.reaper, NULL, reaper_thread, NULL) == 0)
+	{
+		pthread_detach(mem.reaper);
+		mem.reaper_running = 1;
+	}
+	pthread_mutex_unlock(&mem.lock);
+
+	return 1;
+}
+
+/*
+ * Bytes per line of plane 0..2 of a linear frame in format. The VE's
+ * linear output has lines of stride_width bytes, put_bits and the
+ * deinterlacer store their frames the same way, so every linear frame of
+ * the surface shares one layout.
+ */
+uint32_t video_surface_pitch(const video_surface_ctx_t *vs, VdpYCbCrFormat format, int plane)
+{
+	switch (format)
+	{
+	case VDP_YCBCR_FORMAT_YUYV:
+	case VDP_YCBCR_FORMAT_UYVY:
+		return plane ? 0 : 2 * vs->stride_width;
+	case VDP_YCBCR_FORMAT_YV12:
+		return plane ? vs->stride_width / 2 : vs->stride_width;
+	default:
+		/* NV12, the tiled layout has the same line length */
+		return plane < 2 ? vs->stride_width : 0;
+	}
+}
+
+void video_surface_memory_free(video_surface_ctx_t *vs)
+{
+	video_surface_ctx_t **p;
+
+	pthread_mutex_lock(&mem.lock);
+	for (p = &mem.surfaces; *p; p = &(*p)->next)
+		if (*p == vs)
+		{
+			*p = vs->next;
+			break;
+		}
+
+	release_memory(vs);
+	pthread_cond_signal(&mem.wake);
+	pthread_mutex_unlock(&mem.lock);
+}
+
+/* marks the surface as used and allocates its memory if necessary */
+int video_surface_touch(video_surface_ctx_t *vs)
+{
+	int ret = 1;
+
+	pthread_mutex_lock(&mem.lock);
+	if (!cedarv_isValid(vs->data))
+	{
+		vs->data = cedarv_malloc(vs->memory_size);
+		if (cedarv_isValid(vs->data))
+		{
+			vs->dataY = vs->data;
+			vs->dataU = cedarv_subBuffer(vs->data, vs->offset_u);
+			vs->dataV = cedarv_subBuffer(vs->data, vs->offset_v);
+		}
+		else
+		{
+			cedarv_setBufferInvalid(&vs->data);
+			ret = 0;
+		}
+	}
+	vs->last_use = get_time_ms();
+	pthread_mutex_unlock(&mem.lock);
+
+	return ret;
+}
+
+/* surfaces which are referenced (e.g. shown by an output surface) are never released */
+void video_surface_ref(video_surface_ctx_t *vs)
+{
+	pthread_mutex_lock(&mem.lock);
+	vs->refs++;
+	pthread_mutex_unlock(&mem.lock);
+}
+
+/* returns 1 if vs was orphaned and this was its last reference, the caller destroys it then */
+int video_surface_unref(video_surface_ctx_t *vs)
+{
+	int destroy;
+
+	pthread_mutex_lock(&mem.lock);
+	if (vs->refs > 0)
+		vs->refs--;
+	vs->last_use = get_time_ms();
+	destroy = vs->orphaned && vs->refs == 0;
+	pthread_mutex_unlock(&mem.lock);
+
+	return destroy;
+}
+
+/*
+ * For owners which go away while others may still show vs. Returns 1 if
+ * nothing references it and the caller can destroy it right away,
+ * otherwise the last video_surface_unref() asks for that.
+ */
+int video_surface_orphan(video_surface_ctx_t *vs)
+{
+	int destroy;
+
+	pthread_mutex_lock(&mem.lock);
+	destroy = vs->refs == 0;
+	vs->orphaned = !destroy;
+	pthread_mutex_unlock(&mem.lock);
+
+	return destroy;
+}
+
+/*
+ * The importer of a dma-buf keeps using the memory, so an export holds a
+ * reference until it's released or the surface is destroyed. Exporting
+ * again reuses it.
+ */
+void video_surface_hold_export(video_surface_ctx_t *vs)
+{
+	pthread_mutex_lock(&mem.lock);
+	if (!vs->exported)
+	{
+		vs->exported = 1;
+		vs->refs++;
+	}
+	pthread_mutex_unlock(&mem.lock);
+}
+
+void video_surface_release_export(video_surface_ctx_t *vs)
+{
+	pthread_mutex_lock(&mem.lock);
+	if (vs->exported)
+	{
+		vs->exported = 0;
+		if (vs->refs > 0)
+			vs->refs--;
+		vs->last_use = get_time_ms();
+	}
+	pthread_mutex_unlock(&mem.lock);
+}
+
+/* decoder == NULL when the content comes from somewhere else, e.g. put_bits */
+void video_surface_set_decoder(video_surface_ctx_t *vs, struct decoder_ctx_struct *decoder)
+{
+	pthread_mutex_lock(&mem.lock);
+	vs->decoder = decoder;
+	pthread_mutex_unlock(&mem.lock);
+}
+
+/* called when decoder is destroyed, its frames can't be references anymore */
+void video_surface_forget_decoder(struct decoder_ctx_struct *decoder)
+{
+	video_surface_ctx_t *vs;
+
+	pthread_mutex_lock(&mem.lock);
+	for (vs = mem.surfaces; vs; vs = vs->next)
+		if (vs->decoder == decoder)
+			vs->decoder = NULL;
+	pthread_mutex_unlock(&mem.lock);
+}
+
+void video_surface_begin_decode(video_surface_ctx_t *vs)
+{
+	pthread_mutex_lock(&mem.lock);
+	while (vs->decoding)
+		pthread_cond_wait(&mem.decode_done, &mem.lock);
+	vs->decoding = 1;
+	pthread_mutex_unlock(&mem.lock);
+}
+
+void video_surface_end_decode(video_surface_ctx_t *vs)
+{
+	pthread_mutex_lock(&mem.lock);
+	vs->decoding = 0;
+	pthread_cond_broadcast(&mem.decode_done);
+	pthread_mutex_unlock(&mem.lock);
+}
+
+/* for everything reading the frame outside the decoder, e.g. get_bits or exports */
+void video_surface_wait_decode(video_surface_ctx_t *vs)
+{
+	pthread_mutex_lock(&mem.lock);
+	while (vs->decoding)
+		pthread_cond_wait(&mem.decode_done, &mem.lock);
+	pthread_mutex_unlock(&mem.lock);
+}
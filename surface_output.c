@@ -17,9 +17,13 @@
  *
  */
 
+#include <math.h>
 #include "vdpau_private.h"
 #include "string.h"
 #include "vdpau_private.h"
+#include "rgba.h"
+#include "sunxi_disp.h"
+#include "yuv2rgb.h"
 
 VdpStatus vdp_output_surface_create(VdpDevice device, VdpRGBAFormat rgba_format, uint32_t width, uint32_t height, VdpOutputSurface  *surface)
 {
@@ -43,7 +47,12 @@ VdpStatus vdp_output_surface_create(VdpDevice device, VdpRGBAFormat rgba_format,
             out->rgba_format = rgba_format;
             out->contrast = 1.0;
             out->saturation = 1.0;
+            out->video_field = VDP_VIDEO_MIXER_PICTURE_STRUCTURE_FRAME;
             out->device = dev;
+
+            status = rgba_create(&out->rgba, dev, width, height, rgba_format, VDP_FALSE);
+            if (status != VDP_STATUS_OK)
+                handle_destroy(*surface);
         }
         else{
             status = VDP_STATUS_RESOURCES;
@@ -58,6 +67,16 @@ VdpStatus vdp_output_surface_destroy(VdpOutputSurface surface)
 	if (!out)
 		return VDP_STATUS_INVALID_HANDLE;
 
+	video_surface_ctx_t *vs = handle_get(out->video_surface);
+	if (vs)
+	{
+		int orphan = video_surface_unref(vs);
+		handle_release(out->video_surface);
+		if (orphan)
+			vdp_video_surface_destroy(out->video_surface);
+	}
+
+	rgba_destroy(&out->rgba);
 	memset(out, 0, sizeof(*out));
 	
         handle_release(surface);
@@ -91,9 +110,11 @@ VdpStatus vdp_output_surface_get_bits_native(VdpOutputSurface surface, VdpRect c
 	if (!out)
 		return VDP_STATUS_INVALID_HANDLE;
 
+	/* only the OSD, video is shown by the display engine and never composited */
+	VdpStatus ret = rgba_get_bits_native(&out->rgba, source_rect, destination_data, destination_pitches);
 
         handle_release(surface);
-	return VDP_STATUS_ERROR;
+	return ret;
 }
 
 VdpStatus vdp_output_surface_put_bits_native(VdpOutputSurface surface, void const *const *source_data, uint32_t const *source_pitches, VdpRect const *destination_rect)
@@ -102,11 +123,10 @@ VdpStatus vdp_output_surface_put_bits_native(VdpOutputSurface surface, void cons
 	if (!out)
 		return VDP_STATUS_INVALID_HANDLE;
 
-	VDPAU_DBG_ONCE("%s called but unimplemented!", __func__);
-
+	VdpStatus ret = rgba_put_bits_native(&out->rgba, source_data, source_pitches, destination_rect);
 
         handle_release(surface);
-	return VDP_STATUS_OK;
+	return ret;
 }
 
 VdpStatus vdp_output_surface_put_bits_indexed(VdpOutputSurface surface, VdpIndexedFormat source_indexed_format, void const *const *source_data, uint32_t const *source_pitch, VdpRect const *destination_rect, VdpColorTableFormat color_table_format, void const *color_table)
@@ -115,11 +135,10 @@ VdpStatus vdp_output_surface_put_bits_indexed(VdpOutputSurface surface, VdpIndex
 	if (!out)
 		return VDP_STATUS_INVALID_HANDLE;
 
-	VDPAU_DBG_ONCE("%s called but unimplemented!", __func__);
-
+	VdpStatus ret = rgba_put_bits_indexed(&out->rgba, source_indexed_format, source_data, source_pitch, destination_rect, color_table_format, color_table);
 
         handle_release(surface);
-	return VDP_STATUS_OK;
+	return ret;
 }
 
 VdpStatus vdp_output_surface_put_bits_y_cb_cr(VdpOutputSurface surface, VdpYCbCrFormat source_ycbcr_format, void const *const *source_data, uint32_t const *source_pitches, VdpRect const *destination_rect, VdpCSCMatrix const *csc_matrix)
@@ -141,16 +160,23 @@ VdpStatus vdp_output_surface_render_output_surface(VdpOutputSurface destination_
 	if (!out)
 		return VDP_STATUS_INVALID_HANDLE;
 
-	output_surface_ctx_t *in = handle_get(source_surface);
-	if (!in)
-		return VDP_STATUS_INVALID_HANDLE;
-
-	VDPAU_DBG_ONCE("%s called but unimplemented!", __func__);
+	output_surface_ctx_t *in = NULL;
+	if (source_surface != VDP_INVALID_HANDLE)
+	{
+		in = handle_get(source_surface);
+		if (!in)
+		{
+			handle_release(destination_surface);
+			return VDP_STATUS_INVALID_HANDLE;
+		}
+	}
 
+	VdpStatus ret = rgba_render_surface(&out->rgba, destination_rect, in ? &in->rgba : NULL, source_rect, colors, blend_state, flags);
 
         handle_release(destination_surface);
-        handle_release(source_surface);
-	return VDP_STATUS_OK;
+        if (in)
+                handle_release(source_surface);
+	return ret;
 }
 
 VdpStatus vdp_output_surface_render_bitmap_surface(VdpOutputSurface destination_surface, VdpRect const *destination_rect, VdpBitmapSurface source_surface, VdpRect const *source_rect, VdpColor const *colors, VdpOutputSurfaceRenderBlendState const *blend_state, uint32_t flags)
@@ -159,11 +185,23 @@ VdpStatus vdp_output_surface_render_bitmap_surface(VdpOutputSurface destination_
 	if (!out)
 		return VDP_STATUS_INVALID_HANDLE;
 
-	VDPAU_DBG_ONCE("%s called but unimplemented!", __func__);
+	bitmap_surface_ctx_t *in = NULL;
+	if (source_surface != VDP_INVALID_HANDLE)
+	{
+		in = handle_get(source_surface);
+		if (!in)
+		{
+			handle_release(destination_surface);
+			return VDP_STATUS_INVALID_HANDLE;
+		}
+	}
 
+	VdpStatus ret = rgba_render_surface(&out->rgba, destination_rect, in ? &in->rgba : NULL, source_rect, colors, blend_state, flags);
 
         handle_release(destination_surface);
-	return VDP_STATUS_OK;
+        if (in)
+                handle_release(source_surface);
+	return ret;
 }
 
 VdpStatus vdp_output_surface_query_capabilities(VdpDevice device, VdpRGBAFormat surface_rgba_format, VdpBool *is_supported, uint32_t *max_width, uint32_t *max_height)
@@ -193,7 +231,7 @@ VdpStatus vdp_output_surface_query_get_put_bits_native_capabilities(VdpDevice de
 	if (!dev)
 		return VDP_STATUS_INVALID_HANDLE;
 
-	*is_supported = VDP_FALSE;
+	*is_supported = (surface_rgba_format == VDP_RGBA_FORMAT_R8G8B8A8 || surface_rgba_format == VDP_RGBA_FORMAT_B8G8R8A8);
 
         handle_release(device);
 	return VDP_STATUS_OK;
@@ -208,7 +246,10 @@ VdpStatus vdp_output_surface_query_put_bits_indexed_capabilities(VdpDevice devic
 	if (!dev)
 		return VDP_STATUS_INVALID_HANDLE;
 
-	*is_supported = VDP_FALSE;
+	*is_supported = (surface_rgba_format == VDP_RGBA_FORMAT_R8G8B8A8 || surface_rgba_format == VDP_RGBA_FORMAT_B8G8R8A8) &&
+	                (bits_indexed_format == VDP_INDEXED_FORMAT_A4I4 || bits_indexed_format == VDP_INDEXED_FORMAT_I4A4 ||
+	                 bits_indexed_format == VDP_INDEXED_FORMAT_A8I8 || bits_indexed_format == VDP_INDEXED_FORMAT_I8A8) &&
+	                color_table_format == VDP_COLOR_TABLE_FORMAT_B8G8R8X8;
 
         handle_release(device);
 	return VDP_STATUS_OK;
@@ -228,3 +269,94 @@ VdpStatus vdp_output_surface_query_put_bits_y_cb_cr_capabilities(VdpDevice devic
         handle_release(device);
 	return VDP_STATUS_OK;
 }
+
+/*
+ * Rebuilds the matrix set_csc_matrix() in video_mixer.c took apart:
+ * brightness is the level of black, contrast the luma gain, hue and
+ * saturation rotate and scale the BT.601 chroma coefficients. Without an
+ * application matrix the mixer defaults apply, meaning the usual limited
+ * range BT.601.
+ */
+static void procamp_csc(output_surface_ctx_t *os, struct cedarv_csc *csc)
+{
+	static const float bt601[3][2] = { { 0.000f, 1.403f }, { -0.344f, -0.714f }, { 1.773f, 0.000f } };
+	float m[3][4];
+	int i;
+
+	if (os->brightness == 0.0f && os->contrast == 1.0f && os->saturation == 1.0f && os->hue == 0.0f)
+	{
+		cedarv_csc_default(csc);
+		return;
+	}
+
+	float uvcos = os->saturation * cosf(os->hue);
+	float uvsin = os->saturation * sinf(os->hue);
+	for (i = 0; i < 3; i++)
+	{
+		m[i][0] = os->contrast;
+		m[i][1] = bt601[i][0] * uvcos + bt601[i][1] * uvsin;
+		m[i][2] = bt601[i][0] * uvsin + bt601[i][1] * uvcos;
+		m[i][3] = os->brightness - (m[i][1] + m[i][2]) / 2;
+	}
+
+	cedarv_csc_from_matrix(csc, m);
+}
+
+/*
+ * For backends converting the video in software: the frame of os to
+ * read (a field is every other line of it), the source rect in its lines
+ * and the colour space conversion with the procamp settings. The tiled
+ * decoder output is read directly, the conversion detiles it line by line.
+ * The planes are ready for the cpu to read on return.
+ */
+void output_surface_get_video_frame(output_surface_ctx_t *os, struct cedarv_yuv_frame *frame, VdpRect *src, struct cedarv_csc *csc)
+{
+	video_surface_ctx_t *vs = os->vs;
+	video_scanout_t scanout;
+
+	video_surface_get_scanout(vs, os->video_field, &scanout);
+	video_surface_prepare_cpu_read(vs, &scanout);
+
+	memset(frame, 0, sizeof(*frame));
+	frame->y = (const uint8_t *)cedarv_getPointer(scanout.plane[0]) + scanout.offset[0];
+	frame->width = vs->width;
+	frame->height = vs->height;
+	switch (scanout.format)
+	{
+	case VDP_YCBCR_FORMAT_YUYV:
+	case VDP_YCBCR_FORMAT_UYVY:
+		frame->layout = scanout.format == VDP_YCBCR_FORMAT_YUYV ? CEDARV_YUV_YUYV : CEDARV_YUV_UYVY;
+		frame->pitch_y = scanout.pitch[0];
+		break;
+	case VDP_YCBCR_FORMAT_YV12:
+		frame->layout = CEDARV_YUV_I420;
+		frame->uv = (const uint8_t *)cedarv_getPointer(scanout.plane[1]) + scanout.offset[1];
+		frame->v = (const uint8_t *)cedarv_getPointer(scanout.plane[2]) + scanout.offset[2];
+		frame->pitch_y = scanout.pitch[0];
+		frame->pitch_uv = scanout.pitch[1];
+		break;
+	case VDP_YCBCR_FORMAT_NV12:
+		frame->uv = (const uint8_t *)cedarv_getPointer(scanout.plane[1]) + scanout.offset[1];
+		frame->pitch_y = scanout.pitch[0];
+		frame->pitch_uv = scanout.pitch[1];
+		break;
+	case INTERNAL_YCBCR_FORMAT:
+	default:
+		frame->uv = cedarv_getPointer(scanout.plane[1]);
+		frame->tiled = 1;
+		break;
+	}
+
+	*src = os->video_src_rect;
+	if (scanout.field)
+	{
+		/* every other line belongs to the other field */
+		frame->pitch_y *= 2;
+		frame->pitch_uv *= 2;
+		frame->height /= 2;
+		src->y0 /= 2;
+		src->y1 /= 2;
+	}
+
+	procamp_csc(os, csc);
+}
@@ -18,8 +18,11 @@
  */
 
 #include <string.h>
+#include <pthread.h>
 #include "vdpau_private.h"
 #include "ve.h"
+#include "veisp.h"
+#include "detile.h"
 #include "vdpau_private.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -47,48 +50,16 @@ VdpStatus vdp_video_surface_create(VdpDevice device, VdpChromaType chroma_type,
    vs->height = height;
    vs->chroma_type = chroma_type;
    
-   vs->stride_width 	= (width + 63) & ~63;
-   vs->stride_height 	= (height + 63) & ~63;
-   vs->plane_size 	= vs->stride_width * vs->stride_height;
-   cedarv_setBufferInvalid(vs->dataY);
-   cedarv_setBufferInvalid(vs->dataU);
-   cedarv_setBufferInvalid(vs->dataV);
+   cedarv_setBufferInvalid(&vs->linearY);
+   cedarv_setBufferInvalid(&vs->linearUV);
+   vs->linear_valid = 0;
    
    switch (chroma_type)
    {
    case VDP_CHROMA_TYPE_444:
-      //vs->data = cedarv_malloc(vs->plane_size * 3);
-      vs->dataY = cedarv_malloc(vs->plane_size);
-      vs->dataU = cedarv_malloc(vs->plane_size);
-      vs->dataV = cedarv_malloc(vs->plane_size);
-      if (! cedarv_isValid(vs->dataY) || ! cedarv_isValid(vs->dataU) || ! cedarv_isValid(vs->dataV))
-      {
-	  printf("vdpau video surface=%d create, failure\n", *surface);
-
-	  handle_destroy(*surface);
-          handle_release(device);
-	  return VDP_STATUS_RESOURCES;
-      }
-      break;
    case VDP_CHROMA_TYPE_422:
-      //vs->data = cedarv_malloc(vs->plane_size * 2);
-      vs->dataY = cedarv_malloc(vs->plane_size);
-      vs->dataU = cedarv_malloc(vs->plane_size/2);
-      vs->dataV = cedarv_malloc(vs->plane_size/2);
-      if (! cedarv_isValid(vs->dataY) || ! cedarv_isValid(vs->dataU) || ! cedarv_isValid(vs->dataV))
-      {
-	  printf("vdpau video surface=%d create, failure\n", *surface);
-
-	  handle_destroy(*surface);
-          handle_release(device);
-	  return VDP_STATUS_RESOURCES;
-      }
-      break;
    case VDP_CHROMA_TYPE_420:
-      //vs->data = cedarv_malloc(vs->plane_size + (vs->plane_size / 2));
-      vs->dataY = cedarv_malloc(vs->plane_size);
-      vs->dataU = cedarv_malloc(vs->plane_size/2);
-      if (! cedarv_isValid(vs->dataY) || ! cedarv_isValid(vs->dataU))
+      if (!video_surface_memory_init(vs))
       {
 	  printf("vdpau video surface=%d create, failure\n", *surface);
 
@@ -96,10 +67,9 @@ VdpStatus vdp_video_surface_create(VdpDevice device, VdpChromaType chroma_type,
           handle_release(device);
 	  return VDP_STATUS_RESOURCES;
       }
-      
       break;
    default:
-      free(vs);
+      handle_destroy(*surface);
       handle_release(device);
       return VDP_STATUS_INVALID_CHROMA_TYPE;
    }
@@ -116,16 +86,7 @@ VdpStatus vdp_video_surface_destroy(VdpVideoSurface surface)
 
 	if (vs->decoder_private_free)
 		vs->decoder_private_free(vs);
-	if( cedarv_isValid(vs->dataY) )
-	  cedarv_free(vs->dataY);
-	if( cedarv_isValid(vs->dataU) )
-	  cedarv_free(vs->dataU);
-	if (cedarv_isValid(vs->dataV) )
-	  cedarv_free(vs->dataV);
-
-        cedarv_setBufferInvalid(vs->dataY);
-        cedarv_setBufferInvalid(vs->dataU);
-        cedarv_setBufferInvalid(vs->dataV);
+	video_surface_memory_free(vs);
         
         VDPAU_DBG("vdpau video surface=%d destroyed", surface);
         
@@ -135,6 +96,136 @@ VdpStatus vdp_video_surface_destroy(VdpVideoSurface surface)
 	return VDP_STATUS_OK;
 }
 
+/*
+ * Older VE versions only write MB32 tiled frames. Let the display engine
+ * scaler produce a linear NV12 copy of the frame once per decode, so
+ * consumers which can't handle tiles don't need to detile on the CPU.
+ */
+int video_surface_get_linear(video_surface_ctx_t *vs, CEDARV_MEMORY *y, CEDARV_MEMORY *uv)
+{
+	if (vs->source_format == VDP_YCBCR_FORMAT_NV12)
+	{
+		*y = vs->dataY;
+		*uv = vs->dataU;
+		return 1;
+	}
+
+	if (vs->source_format != INTERNAL_YCBCR_FORMAT || vs->chroma_type != VDP_CHROMA_TYPE_420)
+		return 0;
+
+	if (!vs->linear_valid)
+	{
+		if (!cedarv_isValid(vs->linearY))
+		{
+			vs->linearY = cedarv_malloc(vs->width * vs->height);
+			vs->linearUV = cedarv_malloc(vs->width * vs->height / 2);
+			if (!cedarv_isValid(vs->linearY) || !cedarv_isValid(vs->linearUV))
+				goto err_free;
+		}
+
+		cedarv_disp_init();
+		if (!cedarv_disp_convertMb2Nv12(vs->width, vs->height, vs->dataY, vs->dataU, vs->linearY, vs->linearUV))
+			return 0;
+
+		/* the display engine writes behind the cpu caches */
+		cedarv_flush_cache(vs->linearY, vs->width * vs->height);
+		cedarv_flush_cache(vs->linearUV, vs->width * vs->height / 2);
+		vs->linear_valid = 1;
+	}
+
+	*y = vs->linearY;
+	*uv = vs->linearUV;
+	return 1;
+
+err_free:
+	if (cedarv_isValid(vs->linearY))
+		cedarv_free(vs->linearY);
+	if (cedarv_isValid(vs->linearUV))
+		cedarv_free(vs->linearUV);
+	cedarv_setBufferInvalid(&vs->linearY);
+	cedarv_setBufferInvalid(&vs->linearUV);
+	return 0;
+}
+
+/*
+ * Planes the display engine scans vs out of. For a single field the
+ * planes start at the first line of that field and the caller doubles the
+ * pitch, so the engine skips the lines of the other field and its scaler
+ * stretches the field back to frame height. The tiled layout can't be
+ * addressed like that, such frames are shown from the linear copy the
+ * mixer made when it rendered the field or, if there is none, as a whole
+ * frame. Nothing is converted here, this runs on the flip thread.
+ */
+void video_surface_get_scanout(video_surface_ctx_t *vs, VdpVideoMixerPictureStructure field, video_scanout_t *scanout)
+{
+	int i;
+
+	scanout->format = vs->source_format;
+	scanout->plane[0] = vs->dataY;
+	scanout->plane[1] = vs->dataU;
+	scanout->plane[2] = vs->dataV;
+	for (i = 0; i < 3; i++)
+	{
+		scanout->offset[i] = 0;
+		scanout->pitch[i] = video_surface_pitch(vs, vs->source_format, i);
+	}
+	scanout->field = field != VDP_VIDEO_MIXER_PICTURE_STRUCTURE_FRAME;
+
+	if (!scanout->field)
+		return;
+
+	switch (vs->source_format)
+	{
+	case VDP_YCBCR_FORMAT_YUYV:
+	case VDP_YCBCR_FORMAT_UYVY:
+	case VDP_YCBCR_FORMAT_YV12:
+	case VDP_YCBCR_FORMAT_NV12:
+		break;
+	case INTERNAL_YCBCR_FORMAT:
+		if (vs->linear_valid)
+		{
+			/* the display engine wrote the copy without padding */
+			scanout->format = VDP_YCBCR_FORMAT_NV12;
+			scanout->plane[0] = vs->linearY;
+			scanout->plane[1] = vs->linearUV;
+			scanout->pitch[0] = scanout->pitch[1] = vs->width;
+			scanout->pitch[2] = 0;
+			break;
+		}
+		/* fall through */
+	default:
+		scanout->field = 0;
+		return;
+	}
+
+	if (field == VDP_VIDEO_MIXER_PICTURE_STRUCTURE_BOTTOM_FIELD)
+		for (i = 0; i < 3; i++)
+			scanout->offset[i] = scanout->pitch[i];
+}
+
+/*
+ * For backends reading a scanout with the cpu: waits until the VE is
+ * done with the surface and drops stale cache lines of the planes, the VE
+ * and the display engine write behind the cpu caches.
+ */
+void video_surface_prepare_cpu_read(video_surface_ctx_t *vs, const video_scanout_t *scanout)
+{
+	int i;
+
+	video_surface_wait_decode(vs);
+
+	if (scanout->format == INTERNAL_YCBCR_FORMAT)
+	{
+		cedarv_flush_cache(scanout->plane[0], vs->plane_size);
+		cedarv_flush_cache(scanout->plane[1], vs->plane_size / 2);
+		return;
+	}
+
+	for (i = 0; i < 3; i++)
+		if (scanout->pitch[i] && cedarv_isValid(scanout->plane[i]))
+			cedarv_flush_cache(scanout->plane[i], scanout->pitch[i] * (i ? (vs->height + 1) / 2 : vs->height));
+}
+
 VdpStatus vdp_video_surface_get_parameters(VdpVideoSurface surface, VdpChromaType *chroma_type, uint32_t *width, uint32_t *height)
 {
 	video_surface_ctx_t *vid = handle_get(surface);
@@ -155,92 +246,423 @@ VdpStatus vdp_video_surface_get_parameters(VdpVideoSurface surface, VdpChromaTyp
 	return VDP_STATUS_OK;
 }
 
-VdpStatus vdp_video_surface_get_bits_y_cb_cr(VdpVideoSurface surface, VdpYCbCrFormat destination_ycbcr_format, void *const *destination_data, uint32_t const *destination_pitches)
+/*
+ * Fetches luma line y and the interleaved UV line of a 4:2:0 surface into
+ * cached memory. Whole lines are read at once, which keeps the accesses to
+ * the uncached buffers in bursts.
+ */
+static void read_line_420(video_surface_ctx_t *vs, int y, uint8_t *luma, uint8_t *uv)
 {
-	video_surface_ctx_t *vs = handle_get(surface);
-	if (!vs)
-		return VDP_STATUS_INVALID_HANDLE;
+	const uint8_t *src_y = cedarv_getPointer(vs->dataY);
+	const uint8_t *src_u = cedarv_getPointer(vs->dataU);
+	uint32_t pitch_y = video_surface_pitch(vs, vs->source_format, 0);
+	uint32_t pitch_c = video_surface_pitch(vs, vs->source_format, 1);
+	int cw = (vs->width + 1) / 2;
+	int i;
 
-        handle_release(surface);
-	return VDP_STATUS_ERROR;
+	switch (vs->source_format)
+	{
+	case INTERNAL_YCBCR_FORMAT:
+		if (luma)
+			cedarv_detile_line(luma, src_y, vs->width, y);
+		if (uv)
+			cedarv_detile_line(uv, src_u, 2 * cw, y / 2);
+		break;
+
+	case VDP_YCBCR_FORMAT_NV12:
+		if (luma)
+			memcpy(luma, src_y + y * pitch_y, vs->width);
+		if (uv)
+			memcpy(uv, src_u + (y / 2) * pitch_c, 2 * cw);
+		break;
+
+	case VDP_YCBCR_FORMAT_YV12:
+		if (luma)
+			memcpy(luma, src_y + y * pitch_y, vs->width);
+		if (uv)
+		{
+			const uint8_t *u = src_u + (y / 2) * pitch_c;
+			const uint8_t *v = (const uint8_t *)cedarv_getPointer(vs->dataV) + (y / 2) * pitch_c;
+
+			for (i = 0; i < cw; i++)
+			{
+				uv[2 * i] = u[i];
+				uv[2 * i + 1] = v[i];
+			}
+		}
+		break;
+	}
 }
 
-VdpStatus vdp_video_surface_put_bits_y_cb_cr(VdpVideoSurface surface, VdpYCbCrFormat source_ycbcr_format, void const *const *source_data, uint32_t const *source_pitches)
+/* byte positions of Y, U and V in the packed formats, per pixel pair for 4:2:2 */
+static const uint8_t *packed_layout(VdpYCbCrFormat format)
+{
+	static const uint8_t yuyv[] = { 0, 1, 3 }, uyvy[] = { 1, 0, 2 };
+	static const uint8_t yuva[] = { 0, 1, 2 }, vuya[] = { 2, 1, 0 };
+
+	switch (format)
+	{
+	case VDP_YCBCR_FORMAT_YUYV:
+		return yuyv;
+	case VDP_YCBCR_FORMAT_UYVY:
+		return uyvy;
+	case VDP_YCBCR_FORMAT_Y8U8V8A8:
+		return yuva;
+	case VDP_YCBCR_FORMAT_V8U8Y8A8:
+		return vuya;
+	default:
+		return NULL;
+	}
+}
+
+static void pack_line(uint8_t *dst, const uint8_t *luma, const uint8_t *uv, int width, VdpYCbCrFormat format)
 {
+	const uint8_t *o = packed_layout(format);
 	int i;
-	const uint8_t *src;
-        int status = VDP_STATUS_OK;
-	size_t offset = 0;
+
+	if (format == VDP_YCBCR_FORMAT_YUYV || format == VDP_YCBCR_FORMAT_UYVY)
+	{
+		for (i = 0; i < width; i += 2, dst += 4)
+		{
+			dst[o[0]] = luma[i];
+			dst[o[0] + 2] = i + 1 < width ? luma[i + 1] : luma[i];
+			dst[o[1]] = uv[i];
+			dst[o[2]] = uv[i + 1];
+		}
+		return;
+	}
+
+	for (i = 0; i < width; i++, dst += 4)
+	{
+		dst[o[0]] = luma[i];
+		dst[o[1]] = uv[2 * (i / 2)];
+		dst[o[2]] = uv[2 * (i / 2) + 1];
+		dst[3] = 0xff;
+	}
+}
+
+/* luma of one packed line, the chroma of each pixel pair is added to sum[] */
+static void unpack_line(uint8_t *luma, uint16_t *sum, const uint8_t *src, int width, VdpYCbCrFormat format)
+{
+	const uint8_t *o = packed_layout(format);
+	int i;
+
+	if (format == VDP_YCBCR_FORMAT_YUYV || format == VDP_YCBCR_FORMAT_UYVY)
+	{
+		for (i = 0; i < width; i += 2, src += 4)
+		{
+			luma[i] = src[o[0]];
+			if (i + 1 < width)
+				luma[i + 1] = src[o[0] + 2];
+			/* counts twice, like the two samples of the 4:4:4 formats */
+			sum[i] += 2 * src[o[1]];
+			sum[i + 1] += 2 * src[o[2]];
+		}
+		return;
+	}
+
+	for (i = 0; i < width; i++, src += 4)
+	{
+		luma[i] = src[o[0]];
+		sum[2 * (i / 2)] += src[o[1]];
+		sum[2 * (i / 2) + 1] += src[o[2]];
+		if (i == width - 1 && !(i & 1))
+		{
+			sum[i] += src[o[1]];
+			sum[i + 1] += src[o[2]];
+		}
+	}
+}
+
+static VdpStatus get_bits_420(video_surface_ctx_t *vs, VdpYCbCrFormat format, void *const *dst, uint32_t const *pitches)
+{
+	uint32_t pitch_y = video_surface_pitch(vs, vs->source_format, 0);
+	uint32_t pitch_c = video_surface_pitch(vs, vs->source_format, 1);
+	int cw = (vs->width + 1) / 2;
+	int ch = (vs->height + 1) / 2;
+	int y, i;
+
+	if (format != VDP_YCBCR_FORMAT_NV12 && format != VDP_YCBCR_FORMAT_YV12 && !packed_layout(format))
+		return VDP_STATUS_INVALID_Y_CB_CR_FORMAT;
+
+	/* the tiled layouts go through the threaded detilers */
+	if (vs->source_format == INTERNAL_YCBCR_FORMAT &&
+	    (format == VDP_YCBCR_FORMAT_NV12 || format == VDP_YCBCR_FORMAT_YV12))
+	{
+		uint8_t *const planes[3] = { dst[0], dst[1], format == VDP_YCBCR_FORMAT_YV12 ? dst[2] : NULL };
+		const int dst_pitch[3] = { pitches[0], pitches[1], format == VDP_YCBCR_FORMAT_YV12 ? pitches[2] : 0 };
+
+		cedarv_detile_frame(format == VDP_YCBCR_FORMAT_NV12 ? CEDARV_DETILE_NV12 : CEDARV_DETILE_YV12,
+		                    planes, dst_pitch, cedarv_getPointer(vs->dataY), cedarv_getPointer(vs->dataU),
+		                    vs->width, vs->height, 0);
+		return VDP_STATUS_OK;
+	}
+
+	if (vs->source_format == format && format == VDP_YCBCR_FORMAT_NV12)
+	{
+		cedarv_copy_plane(dst[0], pitches[0], cedarv_getPointer(vs->dataY), pitch_y, vs->width, vs->height);
+		cedarv_copy_plane(dst[1], pitches[1], cedarv_getPointer(vs->dataU), pitch_c, 2 * cw, ch);
+		return VDP_STATUS_OK;
+	}
+
+	if (vs->source_format == format && format == VDP_YCBCR_FORMAT_YV12)
+	{
+		cedarv_copy_plane(dst[0], pitches[0], cedarv_getPointer(vs->dataY), pitch_y, vs->width, vs->height);
+		cedarv_copy_plane(dst[1], pitches[1], cedarv_getPointer(vs->dataV), pitch_c, cw, ch);
+		cedarv_copy_plane(dst[2], pitches[2], cedarv_getPointer(vs->dataU), pitch_c, cw, ch);
+		return VDP_STATUS_OK;
+	}
+
+	uint8_t *uv = malloc(2 * cw);
+	if (!uv)
+		return VDP_STATUS_RESOURCES;
+
+	switch (format)
+	{
+	case VDP_YCBCR_FORMAT_NV12:
+	case VDP_YCBCR_FORMAT_YV12:
+		for (y = 0; y < vs->height; y++)
+		{
+			uint8_t *luma = (uint8_t *)dst[0] + y * pitches[0];
+			read_line_420(vs, y, luma, (y & 1) ? NULL : uv);
+			if (y & 1)
+				continue;
+
+			if (format == VDP_YCBCR_FORMAT_NV12)
+				memcpy((uint8_t *)dst[1] + (y / 2) * pitches[1], uv, 2 * cw);
+			else
+			{
+				uint8_t *v = (uint8_t *)dst[1] + (y / 2) * pitches[1];
+				uint8_t *u = (uint8_t *)dst[2] + (y / 2) * pitches[2];
+				for (i = 0; i < cw; i++)
+				{
+					u[i] = uv[2 * i];
+					v[i] = uv[2 * i + 1];
+				}
+			}
+		}
+		break;
+
+	default:
+	{
+		uint8_t *luma = malloc(vs->width);
+		if (!luma)
+		{
+			free(uv);
+			return VDP_STATUS_RESOURCES;
+		}
+
+		for (y = 0; y < vs->height; y++)
+		{
+			read_line_420(vs, y, luma, (y & 1) ? NULL : uv);
+			pack_line((uint8_t *)dst[0] + y * pitches[0], luma, uv, vs->width, format);
+		}
+
+		free(luma);
+		break;
+	}
+	}
+
+	free(uv);
+	return VDP_STATUS_OK;
+}
+
+static VdpStatus get_bits_422(video_surface_ctx_t *vs, VdpYCbCrFormat format, void *const *dst, uint32_t const *pitches)
+{
+	const uint8_t *src = cedarv_getPointer(vs->dataY);
+	uint32_t pitch = video_surface_pitch(vs, vs->source_format, 0);
+	int y, i;
+
+	if (format != VDP_YCBCR_FORMAT_YUYV && format != VDP_YCBCR_FORMAT_UYVY)
+		return VDP_STATUS_INVALID_Y_CB_CR_FORMAT;
+
+	if (vs->source_format == format)
+	{
+		cedarv_copy_plane(dst[0], pitches[0], src, pitch, 2 * vs->width, vs->height);
+		return VDP_STATUS_OK;
+	}
+
+	/* YUYV <-> UYVY only swaps the bytes of each pair */
+	for (y = 0; y < vs->height; y++)
+	{
+		const uint8_t *s = src + y * pitch;
+		uint8_t *d = (uint8_t *)dst[0] + y * pitches[0];
+
+		for (i = 0; i < 2 * vs->width; i += 2)
+		{
+			d[i] = s[i + 1];
+			d[i + 1] = s[i];
+		}
+	}
+
+	return VDP_STATUS_OK;
+}
+
+VdpStatus vdp_video_surface_get_bits_y_cb_cr(VdpVideoSurface surface, VdpYCbCrFormat destination_ycbcr_format, void *const *destination_data, uint32_t const *destination_pitches)
+{
+	VdpStatus status;
+
+	if (!destination_data || !destination_pitches)
+		return VDP_STATUS_INVALID_POINTER;
+
 	video_surface_ctx_t *vs = handle_get(surface);
 	if (!vs)
 		return VDP_STATUS_INVALID_HANDLE;
 
-	vs->source_format = source_ycbcr_format;
+	video_surface_wait_decode(vs);
+	if (!video_surface_touch(vs))
+	{
+		handle_release(surface);
+		return VDP_STATUS_RESOURCES;
+	}
 
-	switch (source_ycbcr_format)
+	switch (vs->source_format)
 	{
+	case INTERNAL_YCBCR_FORMAT:
+		if (vs->chroma_type != VDP_CHROMA_TYPE_420)
+		{
+			status = VDP_STATUS_INVALID_CHROMA_TYPE;
+			break;
+		}
+		/* the VE writes behind the cpu caches */
+		cedarv_flush_cache(vs->dataY, vs->plane_size);
+		cedarv_flush_cache(vs->dataU, vs->plane_size / 2);
+		status = get_bits_420(vs, destination_ycbcr_format, destination_data, destination_pitches);
+		break;
+
+	case VDP_YCBCR_FORMAT_NV12:
+		cedarv_flush_cache(vs->dataY, vs->plane_size);
+		cedarv_flush_cache(vs->dataU, vs->plane_size / 2);
+		/* fall through */
+	case VDP_YCBCR_FORMAT_YV12:
+		status = get_bits_420(vs, destination_ycbcr_format, destination_data, destination_pitches);
+		break;
+
 	case VDP_YCBCR_FORMAT_YUYV:
 	case VDP_YCBCR_FORMAT_UYVY:
-		if (vs->chroma_type != VDP_CHROMA_TYPE_422) {
-                   status = VDP_STATUS_INVALID_CHROMA_TYPE;
-                   break;
-                }
-		src = source_data[0];
-		for (i = 0; i < vs->height; i++) {
-			cedarv_memcpy(vs->dataY, offset, src, 2*vs->width);
-			src += source_pitches[0];
-			offset += 2*vs->width;
-		}
+		status = get_bits_422(vs, destination_ycbcr_format, destination_data, destination_pitches);
 		break;
-	case VDP_YCBCR_FORMAT_Y8U8V8A8:
-	case VDP_YCBCR_FORMAT_V8U8Y8A8:
+
+	default:
+		/* decoders and put_bits only store the formats above */
+		status = VDP_STATUS_ERROR;
 		break;
+	}
 
+        handle_release(surface);
+	return status;
+}
+
+static VdpStatus put_bits_420(video_surface_ctx_t *vs, VdpYCbCrFormat format, void const *const *src, uint32_t const *pitches)
+{
+	uint8_t *y_plane = cedarv_getPointer(vs->dataY);
+	uint8_t *u_plane = cedarv_getPointer(vs->dataU);
+	/* packed formats are stored as NV12 */
+	VdpYCbCrFormat stored = format == VDP_YCBCR_FORMAT_YV12 ? format : VDP_YCBCR_FORMAT_NV12;
+	uint32_t pitch_y = video_surface_pitch(vs, stored, 0);
+	uint32_t pitch_c = video_surface_pitch(vs, stored, 1);
+	int cw = (vs->width + 1) / 2;
+	int ch = (vs->height + 1) / 2;
+	int y, i;
+
+	switch (format)
+	{
 	case VDP_YCBCR_FORMAT_NV12:
-		if (vs->chroma_type != VDP_CHROMA_TYPE_420) {
-                   status = VDP_STATUS_INVALID_CHROMA_TYPE;
-                   break;
-                }
-		src = source_data[0];
-		for (i = 0; i < vs->height; i++) {
-			cedarv_memcpy(vs->dataY, offset, src, vs->width);
-			src += source_pitches[0];
-			offset += vs->width;
-		}
-		src = source_data[1];
-		offset = vs->plane_size;
-		for (i = 0; i < vs->height / 2; i++) {
-			cedarv_memcpy(vs->dataU, offset, src, vs->width);
-			src += source_pitches[1];
-			offset += vs->width;
-		}
+		cedarv_copy_plane(y_plane, pitch_y, src[0], pitches[0], vs->width, vs->height);
+		cedarv_copy_plane(u_plane, pitch_c, src[1], pitches[1], 2 * cw, ch);
 		break;
 
 	case VDP_YCBCR_FORMAT_YV12:
-		if (vs->chroma_type != VDP_CHROMA_TYPE_420) {
-                   status = VDP_STATUS_INVALID_CHROMA_TYPE;
-                   break;
-                }
-		src = source_data[0];
-		for (i = 0; i < vs->height; i++) {
-			cedarv_memcpy(vs->dataY, offset, src, vs->width);
-			src += source_pitches[0];
-			offset += vs->width;
-		}
-		src = source_data[2];
-		offset = 0; //vs->plane_size;
-		for (i = 0; i < vs->height / 2; i++) {
-			cedarv_memcpy(vs->dataU, offset, src, vs->width / 2);
-			src += source_pitches[1];
-			offset += vs->width / 2;
-		}
-		src = source_data[1];
-		offset = 0; //vs->plane_size + vs->plane_size / 4;
-		for (i = 0; i < vs->height / 2; i++) {
-			cedarv_memcpy(vs->dataV, offset, src, vs->width / 2);
-			src += source_pitches[2];
-			offset += vs->width / 2;
+		cedarv_copy_plane(y_plane, pitch_y, src[0], pitches[0], vs->width, vs->height);
+		cedarv_copy_plane(u_plane, pitch_c, src[2], pitches[2], cw, ch);
+		cedarv_copy_plane(cedarv_getPointer(vs->dataV), pitch_c, src[1], pitches[1], cw, ch);
+		break;
+
+	default:
+		if (!packed_layout(format))
+			return VDP_STATUS_INVALID_Y_CB_CR_FORMAT;
+
+		/* assembled in cached lines first */
+		uint8_t *luma = malloc(vs->width + 2 * cw * (1 + sizeof(uint16_t)));
+		if (!luma)
+			return VDP_STATUS_RESOURCES;
+		uint8_t *uv = luma + vs->width;
+		uint16_t *sum = (uint16_t *)(uv + 2 * cw);
+
+		for (y = 0; y < vs->height; y++)
+		{
+			if (!(y & 1))
+				memset(sum, 0, 2 * cw * sizeof(uint16_t));
+
+			unpack_line(luma, sum, (const uint8_t *)src[0] + y * pitches[0], vs->width, format);
+			cedarv_copy_plane(y_plane + y * pitch_y, 0, luma, 0, vs->width, 1);
+
+			if ((y & 1) || y == vs->height - 1)
+			{
+				int n = (y & 1) ? 4 : 2;
+				for (i = 0; i < 2 * cw; i++)
+					uv[i] = (sum[i] + n / 2) / n;
+				cedarv_copy_plane(u_plane + (y / 2) * pitch_c, 0, uv, 0, 2 * cw, 1);
+			}
 		}
+
+		free(luma);
+		format = VDP_YCBCR_FORMAT_NV12;
+		break;
+	}
+
+	cedarv_flush_cache(vs->dataY, vs->plane_size);
+	cedarv_flush_cache(vs->dataU, vs->plane_size / 2);
+	if (format == VDP_YCBCR_FORMAT_YV12)
+		cedarv_flush_cache(vs->dataV, vs->plane_size / 4);
+
+	vs->source_format = format;
+	return VDP_STATUS_OK;
+}
+
+static VdpStatus put_bits_422(video_surface_ctx_t *vs, VdpYCbCrFormat format, void const *const *src, uint32_t const *pitches)
+{
+	if (format != VDP_YCBCR_FORMAT_YUYV && format != VDP_YCBCR_FORMAT_UYVY)
+		return VDP_STATUS_INVALID_Y_CB_CR_FORMAT;
+
+	cedarv_copy_plane(cedarv_getPointer(vs->dataY), video_surface_pitch(vs, format, 0), src[0], pitches[0],
+	                  2 * vs->width, vs->height);
+	cedarv_flush_cache(vs->dataY, vs->plane_size);
+
+	vs->source_format = format;
+	return VDP_STATUS_OK;
+}
+
+VdpStatus vdp_video_surface_put_bits_y_cb_cr(VdpVideoSurface surface, VdpYCbCrFormat source_ycbcr_format, void const *const *source_data, uint32_t const *source_pitches)
+{
+	VdpStatus status;
+
+	if (!source_data || !source_pitches)
+		return VDP_STATUS_INVALID_POINTER;
+
+	video_surface_ctx_t *vs = handle_get(surface);
+	if (!vs)
+		return VDP_STATUS_INVALID_HANDLE;
+
+	video_surface_wait_decode(vs);
+	if (!video_surface_touch(vs))
+	{
+		handle_release(surface);
+		return VDP_STATUS_RESOURCES;
+	}
+	vs->linear_valid = 0;
+	video_surface_set_decoder(vs, NULL);
+
+	switch (vs->chroma_type)
+	{
+	case VDP_CHROMA_TYPE_420:
+		status = put_bits_420(vs, source_ycbcr_format, source_data, source_pitches);
+		break;
+	case VDP_CHROMA_TYPE_422:
+		status = put_bits_422(vs, source_ycbcr_format, source_data, source_pitches);
+		break;
+	default:
+		status = VDP_STATUS_INVALID_CHROMA_TYPE;
 		break;
 	}
 
@@ -274,7 +696,24 @@ VdpStatus vdp_video_surface_query_get_put_bits_y_cb_cr_capabilities(VdpDevice de
 	if (!dev)
 		return VDP_STATUS_INVALID_HANDLE;
 
-	*is_supported = VDP_FALSE;
+	switch (surface_chroma_type)
+	{
+	case VDP_CHROMA_TYPE_420:
+		*is_supported = bits_ycbcr_format == VDP_YCBCR_FORMAT_NV12 ||
+		                bits_ycbcr_format == VDP_YCBCR_FORMAT_YV12 ||
+		                bits_ycbcr_format == VDP_YCBCR_FORMAT_YUYV ||
+		                bits_ycbcr_format == VDP_YCBCR_FORMAT_UYVY ||
+		                bits_ycbcr_format == VDP_YCBCR_FORMAT_Y8U8V8A8 ||
+		                bits_ycbcr_format == VDP_YCBCR_FORMAT_V8U8Y8A8;
+		break;
+	case VDP_CHROMA_TYPE_422:
+		*is_supported = bits_ycbcr_format == VDP_YCBCR_FORMAT_YUYV ||
+		                bits_ycbcr_format == VDP_YCBCR_FORMAT_UYVY;
+		break;
+	default:
+		*is_supported = VDP_FALSE;
+		break;
+	}
 
         handle_release(device);
 	return VDP_STATUS_OK;
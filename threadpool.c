@@ -0,0 +1,173 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "threadpool.h"
+
+#define MAX_THREADS 8
+
+static struct
+{
+	pthread_mutex_t run_lock;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	pthread_t threads[MAX_THREADS];
+	int num_threads;
+	int num_workers;
+	int shutdown;
+	threadpool_fn fn;
+	void *arg;
+	int jobs;
+	int next;
+	int pending;
+} pool = { .run_lock = PTHREAD_MUTEX_INITIALIZER,
+           .lock = PTHREAD_MUTEX_INITIALIZER,
+           .work = PTHREAD_COND_INITIALIZER,
+           .done = PTHREAD_COND_INITIALIZER,
+           .num_threads = 0,
+           .num_workers = 0,
+};
+
+static void *threadpool_worker(void *unused)
+{
+	pthread_mutex_lock(&pool.lock);
+	while (1)
+	{
+		while (!pool.shutdown && pool.next >= pool.jobs)
+			pthread_cond_wait(&pool.work, &pool.lock);
+
+		if (pool.shutdown)
+			break;
+
+		int job = pool.next++;
+		threadpool_fn fn = pool.fn;
+		void *arg = pool.arg;
+
+		pthread_mutex_unlock(&pool.lock);
+		fn(arg, job);
+		pthread_mutex_lock(&pool.lock);
+
+		if (--pool.pending == 0)
+			pthread_cond_signal(&pool.done);
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	return NULL;
+}
+
+static int threadpool_default_threads(void)
+{
+	int threads = 0;
+	char *env = getenv("VDPAU_THREADS");
+
+	if (env)
+		threads = atoi(env);
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads <= 0)
+		threads = 1;
+
+	return threads > MAX_THREADS ? MAX_THREADS : threads;
+}
+
+static void threadpool_start(void)
+{
+	if (!pool.num_threads)
+		pool.num_threads = threadpool_default_threads();
+
+	pool.shutdown = 0;
+	while (pool.num_workers < pool.num_threads - 1)
+	{
+		if (pthread_create(&pool.threads[pool.num_workers], NULL, threadpool_worker, NULL))
+			break;
+		pool.num_workers++;
+	}
+}
+
+static void threadpool_stop(void)
+{
+	int i;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.shutdown = 1;
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+
+	for (i = 0; i < pool.num_workers; i++)
+		pthread_join(pool.threads[i], NULL);
+	pool.num_workers = 0;
+	pool.shutdown = 0;
+}
+
+/* must not be called from inside a job */
+void threadpool_run(threadpool_fn fn, void *arg, int jobs)
+{
+	int job;
+
+	if (jobs <= 0)
+		return;
+
+	pthread_mutex_lock(&pool.run_lock);
+
+	if (!pool.num_threads)
+		threadpool_start();
+
+	if (jobs == 1 || !pool.num_workers)
+	{
+		pthread_mutex_unlock(&pool.run_lock);
+		for (job = 0; job < jobs; job++)
+			fn(arg, job);
+		return;
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	pool.fn = fn;
+	pool.arg = arg;
+	pool.jobs = jobs;
+	pool.next = 0;
+	pool.pending = jobs;
+	pthread_cond_broadcast(&pool.work);
+
+	while (pool.next < pool.jobs)
+	{
+		job = pool.next++;
+		pthread_mutex_unlock(&pool.lock);
+		fn(arg, job);
+		pthread_mutex_lock(&pool.lock);
+		pool.pending--;
+	}
+
+	while (pool.pending > 0)
+		pthread_cond_wait(&pool.done, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+
+	pthread_mutex_unlock(&pool.run_lock);
+}
+
+int threadpool_get_threads(void)
+{
+	int threads;
+
+	pthread_mutex_lock(&pool.run_lock);
+	if (!pool.num_threads)
+		threadpool_start();
+	threads = pool.num_workers + 1;
+	pthread_mutex_unlock(&pool.run_lock);
+
+	return threads;
+}
+
+void threadpool_set_threads(int threads)
+{
+	if (threads <= 0)
+		threads = threadpool_default_threads();
+	if (threads > MAX_THREADS)
+		threads = MAX_THREADS;
+
+	pthread_mutex_lock(&pool.run_lock);
+	if (pool.num_workers)
+		threadpool_stop();
+	pool.num_threads = threads;
+	threadpool_start();
+	pthread_mutex_unlock(&pool.run_lock);
+}
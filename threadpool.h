@@ -0,0 +1,17 @@
+#ifndef _THREADPOOL_H_
+#define _THREADPOOL_H_
+
+/*
+ * Small worker pool for splitting pixel work into independent jobs.
+ * threadpool_run() calls fn(arg, job) for job = 0 .. jobs - 1 on the
+ * workers and the calling thread, and returns once all jobs are done.
+ * The number of threads defaults to the number of online cpus (max 8)
+ * and can be overridden by the VDPAU_THREADS environment variable.
+ */
+typedef void (*threadpool_fn)(void *arg, int job);
+
+void threadpool_run(threadpool_fn fn, void *arg, int jobs);
+int threadpool_get_threads(void);
+void threadpool_set_threads(int threads);
+
+#endif
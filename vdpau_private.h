@@ -64,6 +64,11 @@ typedef struct
     int screen;
     VdpPreemptionCallback *preemption_callback;
     void *preemption_callback_context;
+    int osd_enabled;
+    /* overlay planes of the display for mixer layers, 0 composites them in software */
+    int hw_layers;
+    /* render_bitmap_surface calls queued for drawing in one pass */
+    struct rgba_batch *rgba_batch;
 } device_ctx_t;
 
 typedef struct video_surface_ctx_struct
@@ -74,6 +79,10 @@ typedef struct video_surface_ctx_struct
 	uint32_t stride_height;
 	VdpChromaType chroma_type;
 	VdpYCbCrFormat source_format;
+	/* single allocation, the plane pointers below are views into it */
+	CEDARV_MEMORY data;
+	uint32_t offset_u, offset_v;
+	uint32_t memory_size;
 	CEDARV_MEMORY dataY;
 	CEDARV_MEMORY dataU;
 	CEDARV_MEMORY dataV;
@@ -82,8 +91,36 @@ typedef struct video_surface_ctx_struct
 	void *decoder_private;
 	void (*decoder_private_free)(struct video_surface_ctx_struct *surface);
         uint8_t frame_decoded;
+	/* linear NV12 copy (pitch == width) of a tiled decoded frame */
+	CEDARV_MEMORY linearY;
+	CEDARV_MEMORY linearUV;
+	uint8_t linear_valid;
+	/* set while vdp_decoder_render() writes into the surface */
+	uint8_t decoding;
+	/* idle tracking, see surface_memory.c */
+	uint64_t last_use;
+	int refs;
+	/* its owner let go of it while referenced, destroyed by the last unref */
+	uint8_t orphaned;
+	/* a dma-buf export is out, it holds one of refs */
+	uint8_t exported;
+	/* decoder which wrote the frame and may still predict from it */
+	struct decoder_ctx_struct *decoder;
+	struct video_surface_ctx_struct *next;
 } video_surface_ctx_t;
 
+typedef struct
+{
+	VdpYCbCrFormat format;
+	CEDARV_MEMORY plane[3];
+	/* byte offsets into plane[] of the first line scanned out */
+	uint32_t offset[3];
+	/* bytes per line of each plane, before doubling for a field */
+	uint32_t pitch[3];
+	/* every other line is skipped, double the pitch and halve the height */
+	int field;
+} video_scanout_t;
+
 typedef struct decoder_ctx_struct
 {
 	uint32_t width, height;
@@ -100,6 +137,11 @@ typedef struct
 {
     Drawable drawable;
     struct sunxi_disp *disp;
+    /* own connection receiving StructureNotify of drawable and its ancestors */
+    Display *event_display;
+    /* root relative position of drawable, valid until one of them moves */
+    int x, y;
+    int geometry_valid;
 } queue_target_ctx_t;
 
 typedef struct
@@ -109,19 +151,27 @@ typedef struct
 	VdpColor background;
 	device_ctx_t *device;
     VdpHandle device_hdl;
+    /* surfaces waiting for their presentation time and the thread showing them */
+    struct flip_queue *flip;
 } queue_ctx_t;
 
+#define MIXER_DEINT_SURFACES 6
+
 typedef struct
 {
 	device_ctx_t *device;
+	VdpDevice device_hdl;
 	int csc_change;
 	float brightness;
 	float contrast;
 	float saturation;
 	float hue;
+	VdpBool deinterlace_temporal;
+	VdpBool deinterlace_temporal_spatial;
+	/* progressive frames written by the deinterlacer, 0 if unused */
+	VdpVideoSurface deint_surfaces[MIXER_DEINT_SURFACES];
 } mixer_ctx_t;
 
-#ifdef DEF_LEGACYDISP2
 #define RGBA_FLAG_DIRTY (1 << 0)
 #define RGBA_FLAG_NEEDS_FLUSH (1 << 1)
 #define RGBA_FLAG_NEEDS_CLEAR (1 << 2)
@@ -132,11 +182,23 @@ typedef struct
 	VdpRGBAFormat format;
 	uint32_t width, height;
         CEDARV_MEMORY data;
+	/* cached malloc() memory instead of data, for surfaces never scanned out */
+	uint32_t *cpu_data;
+	int frequently_accessed;
 	VdpRect dirty;
+	VdpRect damage;
 	uint32_t flags;
   //	pixman_image_t *pimage;
 } rgba_surface_t;
-#endif /*DEF_LEGACYDISP2*/
+
+#define OUTPUT_MAX_LAYERS 4
+
+/* a mixer layer left for the display to put on an overlay plane */
+typedef struct
+{
+	VdpOutputSurface surface;
+	VdpRect src, dst;
+} output_layer_t;
 
 typedef struct
 {
@@ -144,18 +206,32 @@ typedef struct
 	VdpRGBAFormat rgba_format;
 	uint32_t width, height;
 	video_surface_ctx_t *vs;
+	/* handle of vs, which holds a video_surface_ref() */
+	VdpVideoSurface video_surface;
 	VdpRect video_src_rect, video_dst_rect;
+	/* a single field is shown (bob) unless this is FRAME */
+	VdpVideoMixerPictureStructure video_field;
+	output_layer_t layers[OUTPUT_MAX_LAYERS];
+	int layer_count;
+	/* presentation state, guarded by the lock of the queue it was displayed on */
+	VdpPresentationQueueStatus status;
+	VdpTime first_presentation_time;
+	int queued;
 	int csc_change;
 	float brightness;
 	float contrast;
 	float saturation;
 	float hue;
 	enum VdpauNVState vdpNvState;
-#ifdef DEF_LEGACYDISP2
         rgba_surface_t rgba;
-#endif /*DEF_LEGACYDISP2*/
 } output_surface_ctx_t;
 
+typedef struct
+{
+	rgba_surface_t rgba;
+	VdpBool frequently_accessed;
+} bitmap_surface_ctx_t;
+
 #ifndef ARRAY_SIZE
 #define ARRAY_SIZE(a) (sizeof((a)) / sizeof((a)[0]))
 #endif
@@ -203,6 +279,26 @@ void handle_destroy(VdpHandle handle);
 void handle_release(VdpHandle handle);
 enum HandleType handle_get_type(VdpHandle handle);
 
+int video_surface_get_linear(video_surface_ctx_t *vs, CEDARV_MEMORY *y, CEDARV_MEMORY *uv);
+
+void video_surface_get_scanout(video_surface_ctx_t *vs, VdpVideoMixerPictureStructure field, video_scanout_t *scanout);
+void video_surface_prepare_cpu_read(video_surface_ctx_t *vs, const video_scanout_t *scanout);
+int video_surface_memory_init(video_surface_ctx_t *vs);
+uint32_t video_surface_pitch(const video_surface_ctx_t *vs, VdpYCbCrFormat format, int plane);
+void video_surface_memory_free(video_surface_ctx_t *vs);
+int video_surface_touch(video_surface_ctx_t *vs);
+int decoder_touch_reference(VdpVideoSurface surface);
+void video_surface_ref(video_surface_ctx_t *vs);
+void video_surface_set_decoder(video_surface_ctx_t *vs, struct decoder_ctx_struct *decoder);
+void video_surface_forget_decoder(struct decoder_ctx_struct *decoder);
+int video_surface_unref(video_surface_ctx_t *vs);
+int video_surface_orphan(video_surface_ctx_t *vs);
+void video_surface_hold_export(video_surface_ctx_t *vs);
+void video_surface_release_export(video_surface_ctx_t *vs);
+void video_surface_begin_decode(video_surface_ctx_t *vs);
+void video_surface_end_decode(video_surface_ctx_t *vs);
+void video_surface_wait_decode(video_surface_ctx_t *vs);
+
 VdpStatus vdp_imp_device_create_x11(Display *display, int screen, VdpDevice *device, VdpGetProcAddress **get_proc_address);
 VdpStatus vdp_device_destroy(VdpDevice device);
 VdpStatus vdp_preemption_callback_register(VdpDevice device, VdpPreemptionCallback callback, void *context);
@@ -221,6 +317,7 @@ VdpStatus vdp_presentation_queue_destroy(VdpPresentationQueue presentation_queue
 VdpStatus vdp_presentation_queue_set_background_color(VdpPresentationQueue presentation_queue, VdpColor *const background_color);
 VdpStatus vdp_presentation_queue_get_background_color(VdpPresentationQueue presentation_queue, VdpColor *const background_color);
 VdpStatus vdp_presentation_queue_get_time(VdpPresentationQueue presentation_queue, VdpTime *current_time);
+uint64_t get_time(void);
 VdpStatus vdp_presentation_queue_display(VdpPresentationQueue presentation_queue, VdpOutputSurface surface, uint32_t clip_width, uint32_t clip_height, VdpTime earliest_presentation_time);
 VdpStatus vdp_presentation_queue_block_until_surface_idle(VdpPresentationQueue presentation_queue, VdpOutputSurface surface, VdpTime *first_presentation_time);
 VdpStatus vdp_presentation_queue_query_surface_status(VdpPresentationQueue presentation_queue, VdpOutputSurface surface, VdpPresentationQueueStatus *status, VdpTime *first_presentation_time);
@@ -17,6 +17,7 @@
  *
  */
 
+#include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
 #include <stdint.h>
@@ -32,9 +33,14 @@
 #if defined(VALGRIND_DEBUG)
 #include <valgrind/ammt_reqs.h>
 #endif
+#if USE_ION
+#include "kernel-headers/ion_sunxi.h"
+#endif
 
 #define DEVICE "/dev/cedar_dev"
+#define ION_DEVICE "/dev/ion"
 #define PAGE_OFFSET (0xc0000000) // from kernel
+#define DRAM_OFFSET (0x40000000) // the VE addresses memory relative to the DRAM base
 #define PAGE_SIZE (4096)
 
 enum IOCTL_CMD
@@ -89,6 +95,18 @@ struct memchunk_t
 	struct memchunk_t *next;
 };
 
+#if USE_ION
+struct ion_buffer_t
+{
+	ion_user_handle_t handle;
+	int fd;			/* dma-buf of the buffer, also used to map it */
+	uint32_t phys_addr;
+	int size;
+	void *virt_addr;
+	struct ion_buffer_t *next;
+};
+#endif
+
 static struct ve_dev
 {
 	int fd;
@@ -97,6 +115,10 @@ static struct ve_dev
 #if USE_UMP == 0
 	struct memchunk_t first_memchunk;
 	pthread_rwlock_t memory_lock;
+#endif
+#if USE_ION
+	int ion_fd;
+	struct ion_buffer_t *ion_buffers;
 #endif
 	pthread_mutex_t device_lock;
     int initialized;
@@ -105,6 +127,9 @@ static struct ve_dev
 } ve = { .fd = -1, 
 #if USE_UMP == 0
 	.memory_lock = PTHREAD_RWLOCK_INITIALIZER, 
+#endif
+#if USE_ION
+	.ion_fd = -1,
 #endif
         .device_lock = PTHREAD_MUTEX_INITIALIZER,
         .initialized = 0,
@@ -213,6 +238,14 @@ int cedarv_open(void)
                   printf("ump_open failed!\n");
 	          goto err;
 	     }
+#endif
+#if USE_ION
+	     ve.ion_fd = open(ION_DEVICE, O_RDWR);
+	     if (ve.ion_fd == -1)
+	     {
+		 printf("could not open %s\n", ION_DEVICE);
+		 goto err;
+	     }
 #endif
              ve.initialized = 1;
         }
@@ -250,6 +283,10 @@ void cedarv_close(void)
 	    ve.fd = -1;
 #if USE_UMP
 	    ump_close();
+#endif
+#if USE_ION
+	    close(ve.ion_fd);
+	    ve.ion_fd = -1;
 #endif
             ve.initialized = 0;
         }
@@ -260,6 +297,13 @@ int cedarv_get_version(void)
 	return ve.version;
 }
 
+/* VE engines before H3 (0x1680) can only write 32x32 macroblock tiled
+ * pictures, this also applies to the rotate/scale (extra) output. */
+int cedarv_has_linear_output(void)
+{
+	return ve.version >= 0x1680;
+}
+
 int cedarv_wait(int timeout)
 {
 	if (ve.fd == -1)
@@ -291,12 +335,72 @@ void* cedarv_get_regs()
 {
 	return ve.regs;
 }
+
+#define FREE_HOOKS 4
+
+static struct
+{
+	pthread_mutex_t lock;
+	struct
+	{
+		cedarv_free_hook hook;
+		void *arg;
+	} entry[FREE_HOOKS];
+} free_hooks = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+int cedarv_add_free_hook(cedarv_free_hook hook, void *arg)
+{
+	int i, ret = -1;
+
+	pthread_mutex_lock(&free_hooks.lock);
+	for (i = 0; i < FREE_HOOKS && ret; i++)
+	{
+		if (!free_hooks.entry[i].hook)
+		{
+			free_hooks.entry[i].hook = hook;
+			free_hooks.entry[i].arg = arg;
+			ret = 0;
+		}
+	}
+	pthread_mutex_unlock(&free_hooks.lock);
+
+	return ret;
+}
+
+void cedarv_remove_free_hook(cedarv_free_hook hook, void *arg)
+{
+	int i;
+
+	pthread_mutex_lock(&free_hooks.lock);
+	for (i = 0; i < FREE_HOOKS; i++)
+	{
+		if (free_hooks.entry[i].hook == hook && free_hooks.entry[i].arg == arg)
+			free_hooks.entry[i].hook = NULL;
+	}
+	pthread_mutex_unlock(&free_hooks.lock);
+}
+
+/* the lock also keeps hooks from being removed while they run */
+static void call_free_hooks(uintptr_t phys, size_t size)
+{
+	int i;
+
+	pthread_mutex_lock(&free_hooks.lock);
+	for (i = 0; i < FREE_HOOKS; i++)
+	{
+		if (free_hooks.entry[i].hook)
+			free_hooks.entry[i].hook(free_hooks.entry[i].arg, phys, size);
+	}
+	pthread_mutex_unlock(&free_hooks.lock);
+}
+
 #if USE_UMP
 
 CEDARV_MEMORY cedarv_malloc(int size)
 {
   CEDARV_MEMORY mem;
   mem.mem_id = ump_ref_drv_allocate (size, UMP_REF_DRV_CONSTRAINT_PHYSICALLY_LINEAR);
+  mem.offset = 0;
   if(mem.mem_id == UMP_INVALID_MEMORY_HANDLE)
   {
     printf("could not allocate ump buffer!\n");
@@ -312,46 +416,220 @@ int cedarv_isValid(CEDARV_MEMORY mem)
 
 void cedarv_free(CEDARV_MEMORY mem)
 {
+  call_free_hooks(cedarv_virt2phys(mem), cedarv_getSize(mem));
   ump_reference_release(mem.mem_id);
 }
 
 uintptr_t cedarv_virt2phys(CEDARV_MEMORY mem)
 {
-  return (uintptr_t)ump_phys_address_get(mem.mem_id);
+  return (uintptr_t)ump_phys_address_get(mem.mem_id) + mem.offset;
 }
 
 void cedarv_flush_cache(CEDARV_MEMORY mem, int len)
 {
-  ump_cpu_msync_now(mem.mem_id, UMP_MSYNC_CLEAN_AND_INVALIDATE, 0, len);
+  if (mem.offset)
+    ump_cpu_msync_now(mem.mem_id, UMP_MSYNC_CLEAN_AND_INVALIDATE, cedarv_getPointer(mem), len);
+  else
+    ump_cpu_msync_now(mem.mem_id, UMP_MSYNC_CLEAN_AND_INVALIDATE, 0, len);
 }
 void cedarv_memcpy(CEDARV_MEMORY dst, size_t offset, const void * src, size_t len)
 {
-  ump_write(dst.mem_id, offset, src, len);
+  ump_write(dst.mem_id, dst.offset + offset, src, len);
 }
 void cedarv_memset(CEDARV_MEMORY dst, unsigned char value, size_t len)
 {
-  void* mem = ump_mapped_pointer_get(dst.mem_id);
-  memset(mem, value, len);
+  memset(cedarv_getPointer(dst), value, len);
 }
 void* cedarv_getPointer(CEDARV_MEMORY mem)
 {
-  return ump_mapped_pointer_get(mem.mem_id);
+  return (char *)ump_mapped_pointer_get(mem.mem_id) + mem.offset;
 }
 
 unsigned char cedarv_byteAccess(CEDARV_MEMORY mem, size_t offset)
 {
-  char *ptr = (char*)ump_mapped_pointer_get(mem.mem_id);
+  char *ptr = (char*)cedarv_getPointer(mem);
   return ptr[offset];
 }
 
 size_t cedarv_getSize(CEDARV_MEMORY mem)
 {
-  return ump_size_get(mem.mem_id);
+  return ump_size_get(mem.mem_id) - mem.offset;
+}
+
+void cedarv_setBufferInvalid(CEDARV_MEMORY *mem)
+{
+  mem->mem_id = UMP_INVALID_MEMORY_HANDLE;
+  mem->offset = 0;
+}
+
+CEDARV_MEMORY cedarv_subBuffer(CEDARV_MEMORY mem, size_t offset)
+{
+  mem.offset += offset;
+  return mem;
+}
+
+int cedarv_export_dmabuf(CEDARV_MEMORY mem, uint32_t *offset)
+{
+  /* UMP buffers can't be turned into dma-bufs */
+  errno = ENOSYS;
+  return -1;
+}
+
+#else
+
+#if USE_ION
+
+/*
+ * Buffers come from the ION DMA/carveout heaps of the sunxi BSP kernels,
+ * each one is a dma-buf and can be shared with other devices and processes.
+ */
+void *cedarv_malloc(int size)
+{
+	if (ve.ion_fd == -1)
+		return NULL;
+
+	struct ion_buffer_t *b = calloc(1, sizeof(*b));
+	if (!b)
+		return NULL;
+
+	size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+	struct ion_allocation_data alloc =
+	{
+		.len = size,
+		.align = PAGE_SIZE,
+		.heap_id_mask = ION_HEAP_TYPE_DMA_MASK | ION_HEAP_CARVEOUT_MASK,
+		.flags = ION_FLAG_CACHED | ION_FLAG_CACHED_NEEDS_SYNC,
+	};
+	if (ioctl(ve.ion_fd, ION_IOC_ALLOC, &alloc) == -1)
+		goto err_free;
+
+	b->handle = alloc.handle;
+	b->size = size;
+
+	struct ion_fd_data map = { .handle = b->handle };
+	if (ioctl(ve.ion_fd, ION_IOC_MAP, &map) == -1)
+		goto err_ion;
+	b->fd = map.fd;
+
+	sunxi_phys_data phys = { .handle = b->handle };
+	struct ion_custom_data custom = { .cmd = ION_IOC_SUNXI_PHYS_ADDR, .arg = (unsigned long)&phys };
+	if (ioctl(ve.ion_fd, ION_IOC_CUSTOM, &custom) == -1)
+		goto err_fd;
+	b->phys_addr = phys.phys_addr - DRAM_OFFSET;
+
+	b->virt_addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, b->fd, 0);
+	if (b->virt_addr == MAP_FAILED)
+		goto err_fd;
+
+	if (pthread_rwlock_wrlock(&ve.memory_lock))
+		goto err_unmap;
+	b->next = ve.ion_buffers;
+	ve.ion_buffers = b;
+	pthread_rwlock_unlock(&ve.memory_lock);
+
+	return b->virt_addr;
+
+err_unmap:
+	munmap(b->virt_addr, size);
+err_fd:
+	close(b->fd);
+err_ion:
+	ioctl(ve.ion_fd, ION_IOC_FREE, &(struct ion_handle_data){ .handle = b->handle });
+err_free:
+	free(b);
+	return NULL;
+}
+
+void cedarv_free(void *ptr)
+{
+	if (ptr == NULL)
+		return;
+
+	call_free_hooks(cedarv_virt2phys(ptr), cedarv_getSize(ptr));
+
+	if (pthread_rwlock_wrlock(&ve.memory_lock))
+		return;
+
+	struct ion_buffer_t **p, *b = NULL;
+	for (p = &ve.ion_buffers; *p; p = &(*p)->next)
+	{
+		if ((*p)->virt_addr == ptr)
+		{
+			b = *p;
+			*p = b->next;
+			break;
+		}
+	}
+
+	pthread_rwlock_unlock(&ve.memory_lock);
+
+	if (!b)
+		return;
+
+	munmap(b->virt_addr, b->size);
+	close(b->fd);
+	ioctl(ve.ion_fd, ION_IOC_FREE, &(struct ion_handle_data){ .handle = b->handle });
+	free(b);
+}
+
+/* buffer containing ptr, the memory lock has to be held */
+static struct ion_buffer_t *ion_find(void *ptr)
+{
+	struct ion_buffer_t *b;
+	for (b = ve.ion_buffers; b != NULL; b = b->next)
+		if (ptr >= b->virt_addr && ptr < (b->virt_addr + b->size))
+			return b;
+
+	return NULL;
 }
 
-void cedarv_setBufferInvalid(CEDARV_MEMORY mem)
+uintptr_t cedarv_virt2phys(void *ptr)
 {
-  mem.mem_id = UMP_INVALID_MEMORY_HANDLE;
+	if (pthread_rwlock_rdlock(&ve.memory_lock))
+		return 0;
+
+	uintptr_t addr = 0;
+	struct ion_buffer_t *b = ion_find(ptr);
+	if (b)
+		addr = b->phys_addr + (ptr - b->virt_addr);
+
+	pthread_rwlock_unlock(&ve.memory_lock);
+	return addr;
+}
+
+int cedarv_export_dmabuf(void *mem, uint32_t *offset)
+{
+	if (pthread_rwlock_rdlock(&ve.memory_lock))
+		return -1;
+
+	int fd = -1;
+	struct ion_buffer_t *b = ion_find(mem);
+	if (b)
+	{
+		fd = fcntl(b->fd, F_DUPFD_CLOEXEC, 0);
+		if (offset)
+			*offset = mem - b->virt_addr;
+	}
+	else
+		errno = EINVAL;
+
+	pthread_rwlock_unlock(&ve.memory_lock);
+	return fd;
+}
+
+size_t cedarv_getSize(void *mem)
+{
+	if (pthread_rwlock_rdlock(&ve.memory_lock))
+		return 0;
+
+	size_t size = 0;
+	struct ion_buffer_t *b = ion_find(mem);
+	if (b)
+		size = b->size - (mem - b->virt_addr);
+
+	pthread_rwlock_unlock(&ve.memory_lock);
+	return size;
 }
 
 #else
@@ -410,10 +688,6 @@ out:
 	return addr;
 }
 
-int cedarv_isValid(void* mem)
-{
-  return mem != NULL;
-}
 void cedarv_free(void *ptr)
 {
 	if (ve.fd == -1)
@@ -422,6 +696,8 @@ void cedarv_free(void *ptr)
 	if (ptr == NULL)
 		return;
 
+	call_free_hooks(cedarv_virt2phys(ptr), cedarv_getSize(ptr));
+
 	if (pthread_rwlock_wrlock(&ve.memory_lock))
 		return;
 
@@ -453,7 +729,7 @@ void cedarv_free(void *ptr)
 	pthread_rwlock_unlock(&ve.memory_lock);
 }
 
-uint32_t cedarv_virt2phys(void *ptr)
+uintptr_t cedarv_virt2phys(void *ptr)
 {
 	if (ve.fd == -1)
 		return 0;
@@ -485,6 +761,44 @@ uint32_t cedarv_virt2phys(void *ptr)
 	return addr;
 }
 
+int cedarv_export_dmabuf(void *mem, uint32_t *offset)
+{
+	/* the reserved memory of the cedar device isn't backed by dma-bufs */
+	errno = ENOSYS;
+	return -1;
+}
+
+size_t cedarv_getSize(void *mem)
+{
+	if (ve.fd == -1)
+		return 0;
+
+	if (pthread_rwlock_rdlock(&ve.memory_lock))
+		return 0;
+
+	size_t size = 0;
+
+	struct memchunk_t *c;
+	for (c = &ve.first_memchunk; c != NULL; c = c->next)
+	{
+		if (c->virt_addr != NULL && mem >= c->virt_addr && mem < (c->virt_addr + c->size))
+		{
+			size = c->size - (mem - c->virt_addr);
+			break;
+		}
+	}
+
+	pthread_rwlock_unlock(&ve.memory_lock);
+	return size;
+}
+
+#endif
+
+int cedarv_isValid(void* mem)
+{
+  return mem != NULL;
+}
+
 void cedarv_flush_cache(void *start, int len)
 {
 	if (ve.fd == -1)
@@ -504,6 +818,11 @@ void cedarv_memcpy(void* dst, size_t offset, const void * src, size_t len)
 	memcpy((char*)dst + offset, src, len);
 }
 
+void cedarv_memset(void* dst, unsigned char value, size_t len)
+{
+	memset(dst, value, len);
+}
+
 void* cedarv_getPointer(CEDARV_MEMORY mem)
 {
   return mem;
@@ -515,9 +834,14 @@ unsigned char cedarv_byteAccess(void* mem, size_t offset)
   return ptr[offset];
 }
 
-void cedarv_setBufferInvalid(void* mem)
+void cedarv_setBufferInvalid(void** mem)
+{
+  *mem = NULL;
+}
+
+void *cedarv_subBuffer(void *mem, size_t offset)
 {
-  mem = NULL;
+  return (char *)mem + offset;
 }
 
 #endif
@@ -26,6 +26,7 @@
 int cedarv_open(void);
 void cedarv_close(void);
 int cedarv_get_version(void);
+int cedarv_has_linear_output(void);
 int cedarv_wait(int timeout);
 void *cedarv_get(int engine, uint32_t flags);
 void cedarv_put(void);
@@ -37,6 +38,7 @@ void* cedarv_get_regs();
 
   typedef struct _CEDARV_MEMORY {
       ump_handle mem_id;
+      size_t offset;	/* of a sub buffer, see cedarv_subBuffer() */
   }CEDARV_MEMORY;
 #else
   typedef void* CEDARV_MEMORY;
@@ -53,7 +55,23 @@ void cedarv_memset(CEDARV_MEMORY dst, unsigned char value, size_t len);
 void* cedarv_getPointer(CEDARV_MEMORY mem);
 size_t cedarv_getSize(CEDARV_MEMORY mem);
 unsigned char cedarv_byteAccess(CEDARV_MEMORY mem, size_t offset);
-void cedarv_setBufferInvalid(CEDARV_MEMORY mem);
+/* marks mem as not allocated, cedarv_isValid() is false afterwards */
+void cedarv_setBufferInvalid(CEDARV_MEMORY *mem);
+/* view into mem starting at offset, must not be freed on its own */
+CEDARV_MEMORY cedarv_subBuffer(CEDARV_MEMORY mem, size_t offset);
+/*
+ * new dma-buf fd of the buffer holding mem, to be closed by the caller; offset
+ * is set to the position of mem in it. -1 on errors, with errno ENOSYS if
+ * the allocator can't export at all.
+ */
+int cedarv_export_dmabuf(CEDARV_MEMORY mem, uint32_t *offset);
+/*
+ * called by cedarv_free() with the physical range of the buffer before it
+ * goes away, for users keeping mappings of it, e.g. KMS framebuffers
+ */
+typedef void (*cedarv_free_hook)(void *arg, uintptr_t phys, size_t size);
+int cedarv_add_free_hook(cedarv_free_hook hook, void *arg);
+void cedarv_remove_free_hook(cedarv_free_hook hook, void *arg);
 int cedarv_allocateEngine(int engine);
 int cedarv_freeEngine();
 int cedarv_VeReset();
@@ -8,6 +8,8 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include "ve.h"
+#include "veisp.h"
+#include "detile.h"
 #include "kernel-headers/sunxi_disp_ioctl.h"
 #include <errno.h>
 #include <string.h>
@@ -27,123 +29,239 @@ void cedarv_disp_close()
    fd = -1;
 }
 
-int cedarv_disp_convertMb2Yuv420(int width, int height, CEDARV_MEMORY y, CEDARV_MEMORY uv, CEDARV_MEMORY convY, CEDARV_MEMORY convU, CEDARV_MEMORY convV)
+static void scaler_fill_para(__disp_scaler_para_t *scaler_para, enum cedarv_scaler_mode mode, int width, int height)
+{
+   memset(scaler_para, 0, sizeof(__disp_scaler_para_t));
+
+   scaler_para->input_fb.size.width = width;
+   scaler_para->input_fb.size.height = height;
+   scaler_para->input_fb.br_swap = 0;
+   scaler_para->input_fb.cs_mode = DISP_BT601;
+   if(mode == CEDARV_SCALER_ARGB2YUV420)
+   {
+      scaler_para->input_fb.format = DISP_FORMAT_ARGB8888;
+      scaler_para->input_fb.seq = DISP_SEQ_P3210;
+      scaler_para->input_fb.mode = DISP_MOD_INTERLEAVED;
+   }
+   else
+   {
+      scaler_para->input_fb.format = DISP_FORMAT_YUV420;
+      scaler_para->input_fb.seq = DISP_SEQ_UVUV;
+      scaler_para->input_fb.mode = DISP_MOD_MB_UV_COMBINED;
+   }
+
+   scaler_para->source_regn.x = 0;
+   scaler_para->source_regn.y = 0;
+   scaler_para->source_regn.width = width;
+   scaler_para->source_regn.height = height;
+
+   scaler_para->output_fb.size.width = width;
+   scaler_para->output_fb.size.height = height;
+   scaler_para->output_fb.br_swap = 0;
+   scaler_para->output_fb.cs_mode = DISP_BT601;
+   switch(mode)
+   {
+   case CEDARV_SCALER_MB2YUV420:
+      scaler_para->output_fb.format = DISP_FORMAT_YUV420;
+      scaler_para->output_fb.seq = DISP_SEQ_P3210;
+      scaler_para->output_fb.mode = DISP_MOD_NON_MB_PLANAR;
+      break;
+   case CEDARV_SCALER_MB2NV12:
+   case CEDARV_SCALER_ARGB2YUV420:
+      scaler_para->output_fb.format = DISP_FORMAT_YUV420;
+      scaler_para->output_fb.seq = DISP_SEQ_UVUV;
+      scaler_para->output_fb.mode = DISP_MOD_NON_MB_UV_COMBINED;
+      break;
+   case CEDARV_SCALER_MB2RGB:
+      scaler_para->output_fb.format = DISP_FORMAT_RGB888;
+      scaler_para->output_fb.seq = DISP_SEQ_P3210;
+      scaler_para->output_fb.mode = DISP_MOD_INTERLEAVED;
+      break;
+   }
+}
+
+static void scaler_set_addr(__disp_scaler_para_t *scaler_para, CEDARV_MEMORY in0, CEDARV_MEMORY in1,
+                            CEDARV_MEMORY out0, CEDARV_MEMORY out1, CEDARV_MEMORY out2)
+{
+   scaler_para->input_fb.addr[0] = cedarv_virt2phys(in0);
+   scaler_para->input_fb.addr[1] = cedarv_isValid(in1) ? cedarv_virt2phys(in1) : 0;
+   scaler_para->output_fb.addr[0] = cedarv_virt2phys(out0);
+   scaler_para->output_fb.addr[1] = cedarv_isValid(out1) ? cedarv_virt2phys(out1) : 0;
+   scaler_para->output_fb.addr[2] = cedarv_isValid(out2) ? cedarv_virt2phys(out2) : 0;
+}
+
+static int scaler_convert(enum cedarv_scaler_mode mode, int width, int height, CEDARV_MEMORY in0, CEDARV_MEMORY in1,
+                          CEDARV_MEMORY out0, CEDARV_MEMORY out1, CEDARV_MEMORY out2)
 {
    unsigned long arg[4] = {0, 0, 0, 0};
    __disp_scaler_para_t scaler_para;
-   int result; 
+   int result;
    arg[1] = ioctl(fd, DISP_CMD_SCALER_REQUEST, (unsigned long) arg);
    if(arg[1] == (unsigned long)-1) return 0;
 
-   memset(&scaler_para, 0, sizeof(__disp_scaler_para_t));
-   scaler_para.input_fb.addr[0] = cedarv_virt2phys(y);
-   scaler_para.input_fb.addr[1] = cedarv_virt2phys(uv);
-   scaler_para.input_fb.size.width = width;
-   scaler_para.input_fb.size.height = height;
-   scaler_para.input_fb.format = DISP_FORMAT_YUV420;
-   scaler_para.input_fb.seq = DISP_SEQ_UVUV;
-   scaler_para.input_fb.mode = DISP_MOD_MB_UV_COMBINED;
-   scaler_para.input_fb.br_swap = 0;
-   scaler_para.input_fb.cs_mode = DISP_BT601;
-   scaler_para.source_regn.x = 0;
-   scaler_para.source_regn.y = 0;
-   scaler_para.source_regn.width = width;
-   scaler_para.source_regn.height = height;
-   scaler_para.output_fb.addr[0] = cedarv_virt2phys(convY);
-   scaler_para.output_fb.addr[1] = cedarv_virt2phys(convU);
-   scaler_para.output_fb.addr[2] = cedarv_virt2phys(convV);
-   scaler_para.output_fb.size.width = width;
-   scaler_para.output_fb.size.height = height;
-   scaler_para.output_fb.format = DISP_FORMAT_YUV420;
-   scaler_para.output_fb.seq = DISP_SEQ_P3210;
-   scaler_para.output_fb.mode = DISP_MOD_NON_MB_PLANAR;
-   scaler_para.output_fb.br_swap = 0;
-   scaler_para.output_fb.cs_mode = DISP_BT601;
+   scaler_fill_para(&scaler_para, mode, width, height);
+   scaler_set_addr(&scaler_para, in0, in1, out0, out1, out2);
 
    arg[2] = (unsigned long) &scaler_para;
    result = ioctl(fd, DISP_CMD_SCALER_EXECUTE, (unsigned long) arg);
+   ioctl(fd, DISP_CMD_SCALER_RELEASE, (unsigned long) arg);
    if(result < 0)
+   {
       printf("scaler execution failed=%d\n", errno);
-   ioctl(fd, DISP_CMD_SCALER_RELEASE, (unsigned long) arg);
+      return 0;
+   }
    return 1;
 }
 
+int cedarv_disp_convertMb2Yuv420(int width, int height, CEDARV_MEMORY y, CEDARV_MEMORY uv, CEDARV_MEMORY convY, CEDARV_MEMORY convU, CEDARV_MEMORY convV)
+{
+   return scaler_convert(CEDARV_SCALER_MB2YUV420, width, height, y, uv, convY, convU, convV);
+}
+
+int cedarv_disp_convertMb2Nv12(int width, int height, CEDARV_MEMORY y, CEDARV_MEMORY uv, CEDARV_MEMORY convY, CEDARV_MEMORY convUV)
+{
+   CEDARV_MEMORY none;
+   memset(&none, 0, sizeof(none));
+   return scaler_convert(CEDARV_SCALER_MB2NV12, width, height, y, uv, convY, convUV, none);
+}
+
 int cedarv_disp_convertARGB2Yuv420(int width, int height, CEDARV_MEMORY y, CEDARV_MEMORY convY, CEDARV_MEMORY convUV)
 {
-  unsigned long arg[4] = {0, 0, 0, 0};
-  __disp_scaler_para_t scaler_para;
-  int result; 
-  arg[1] = ioctl(fd, DISP_CMD_SCALER_REQUEST, (unsigned long) arg);
-  if(arg[1] == (unsigned long)-1) return 0;
-
-  memset(&scaler_para, 0, sizeof(__disp_scaler_para_t));
-  scaler_para.input_fb.addr[0] = cedarv_virt2phys(y);
-  scaler_para.input_fb.size.width = width;
-  scaler_para.input_fb.size.height = height;
-  scaler_para.input_fb.format = DISP_FORMAT_ARGB8888;
-  scaler_para.input_fb.seq = DISP_SEQ_P3210;
-  scaler_para.input_fb.mode = DISP_MOD_INTERLEAVED;
-  scaler_para.input_fb.br_swap = 0;
-  scaler_para.input_fb.cs_mode = DISP_BT601;
-  scaler_para.source_regn.x = 0;
-  scaler_para.source_regn.y = 0;
-  scaler_para.source_regn.width = width;
-  scaler_para.source_regn.height = height;
-  scaler_para.output_fb.addr[0] = cedarv_virt2phys(convY);
-  scaler_para.output_fb.addr[1] = cedarv_virt2phys(convUV);
-  scaler_para.output_fb.size.width = width;
-  scaler_para.output_fb.size.height = height;
-  scaler_para.output_fb.format = DISP_FORMAT_YUV420;
-  scaler_para.output_fb.seq = DISP_SEQ_UVUV;
-  scaler_para.output_fb.mode = 	DISP_MOD_NON_MB_UV_COMBINED;
-  scaler_para.output_fb.br_swap = 0;
-  scaler_para.output_fb.cs_mode = DISP_BT601;
-
-  arg[2] = (unsigned long) &scaler_para;
-  result = ioctl(fd, DISP_CMD_SCALER_EXECUTE, (unsigned long) arg);
-  if(result < 0)
-    printf("scaler execution failed=%d\n", errno);
-  ioctl(fd, DISP_CMD_SCALER_RELEASE, (unsigned long) arg);
-  return 1;
+   CEDARV_MEMORY none;
+   memset(&none, 0, sizeof(none));
+   return scaler_convert(CEDARV_SCALER_ARGB2YUV420, width, height, y, none, convY, convUV, none);
 }
 
 int cedarv_disp_convertMb2RGB(int width, int height, CEDARV_MEMORY y, CEDARV_MEMORY uv, CEDARV_MEMORY convY)
 {
-  unsigned long arg[4] = {0, 0, 0, 0};
-  __disp_scaler_para_t scaler_para;
-  int result; 
-  arg[1] = ioctl(fd, DISP_CMD_SCALER_REQUEST, (unsigned long) arg);
-  if(arg[1] == (unsigned long)-1) return 0;
-
-  memset(&scaler_para, 0, sizeof(__disp_scaler_para_t));
-  scaler_para.input_fb.addr[0] = cedarv_virt2phys(y);
-  scaler_para.input_fb.addr[1] = cedarv_virt2phys(uv);
-  scaler_para.input_fb.size.width = width;
-  scaler_para.input_fb.size.height = height;
-  scaler_para.input_fb.format = DISP_FORMAT_YUV420;
-  scaler_para.input_fb.seq = DISP_SEQ_UVUV;
-  scaler_para.input_fb.mode = DISP_MOD_MB_UV_COMBINED;
-  scaler_para.input_fb.br_swap = 0;
-  scaler_para.input_fb.cs_mode = DISP_BT601;
-  scaler_para.source_regn.x = 0;
-  scaler_para.source_regn.y = 0;
-  scaler_para.source_regn.width = width;
-  scaler_para.source_regn.height = height;
-  scaler_para.output_fb.addr[0] = cedarv_virt2phys(convY);
-  scaler_para.output_fb.size.width = width;
-  scaler_para.output_fb.size.height = height;
-  scaler_para.output_fb.format = DISP_FORMAT_RGB888;
-  scaler_para.output_fb.seq = DISP_SEQ_P3210;
-  scaler_para.output_fb.mode = DISP_MOD_INTERLEAVED;
-  scaler_para.output_fb.br_swap = 0;
-  scaler_para.output_fb.cs_mode = DISP_BT601;
-
-  arg[2] = (unsigned long) &scaler_para;
-  result = ioctl(fd, DISP_CMD_SCALER_EXECUTE, (unsigned long) arg);
-  if(result < 0)
-    printf("scaler execution failed=%d\n", errno);
-  ioctl(fd, DISP_CMD_SCALER_RELEASE, (unsigned long) arg);
-  return 1;
+   CEDARV_MEMORY none;
+   memset(&none, 0, sizeof(none));
+   return scaler_convert(CEDARV_SCALER_MB2RGB, width, height, y, uv, convY, none, none);
+}
+
+/*
+ * A scaler session keeps its scaler requested and its parameter block
+ * filled in, so only the buffer addresses change between conversions.
+ * Conversions run on a worker thread, cedarv_scaler_queue() returns
+ * immediately and cedarv_scaler_wait() collects the result.
+ */
+struct cedarv_scaler
+{
+   unsigned long arg[4];
+   __disp_scaler_para_t para;
+   pthread_t thread;
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   int busy;
+   int result;
+   int quit;
+};
+
+static void *scaler_thread(void *data)
+{
+   struct cedarv_scaler *s = data;
+
+   pthread_mutex_lock(&s->lock);
+   while(1)
+   {
+      while(!s->busy && !s->quit)
+         pthread_cond_wait(&s->cond, &s->lock);
+      if(s->quit)
+         break;
+
+      /* para isn't touched while busy, so the lock can be dropped */
+      pthread_mutex_unlock(&s->lock);
+      int result = ioctl(fd, DISP_CMD_SCALER_EXECUTE, (unsigned long) s->arg);
+      if(result < 0)
+         printf("scaler execution failed=%d\n", errno);
+      pthread_mutex_lock(&s->lock);
+
+      s->result = result >= 0;
+      s->busy = 0;
+      pthread_cond_broadcast(&s->cond);
+   }
+   pthread_mutex_unlock(&s->lock);
+
+   return NULL;
+}
+
+struct cedarv_scaler *cedarv_scaler_open(enum cedarv_scaler_mode mode, int width, int height)
+{
+   struct cedarv_scaler *s;
+
+   if(fd == -1)
+      return NULL;
+
+   s = calloc(1, sizeof(*s));
+   if(!s)
+      return NULL;
+
+   s->arg[1] = ioctl(fd, DISP_CMD_SCALER_REQUEST, (unsigned long) s->arg);
+   if(s->arg[1] == (unsigned long)-1)
+      goto err_free;
+
+   scaler_fill_para(&s->para, mode, width, height);
+   s->arg[2] = (unsigned long) &s->para;
+
+   pthread_mutex_init(&s->lock, NULL);
+   pthread_cond_init(&s->cond, NULL);
+   if(pthread_create(&s->thread, NULL, scaler_thread, s))
+      goto err_release;
+
+   return s;
+
+err_release:
+   pthread_cond_destroy(&s->cond);
+   pthread_mutex_destroy(&s->lock);
+   ioctl(fd, DISP_CMD_SCALER_RELEASE, (unsigned long) s->arg);
+err_free:
+   free(s);
+   return NULL;
+}
+
+void cedarv_scaler_close(struct cedarv_scaler *s)
+{
+   if(!s)
+      return;
+
+   pthread_mutex_lock(&s->lock);
+   while(s->busy)
+      pthread_cond_wait(&s->cond, &s->lock);
+   s->quit = 1;
+   pthread_cond_broadcast(&s->cond);
+   pthread_mutex_unlock(&s->lock);
+   pthread_join(s->thread, NULL);
+
+   ioctl(fd, DISP_CMD_SCALER_RELEASE, (unsigned long) s->arg);
+   pthread_cond_destroy(&s->cond);
+   pthread_mutex_destroy(&s->lock);
+   free(s);
+}
+
+void cedarv_scaler_queue(struct cedarv_scaler *s, CEDARV_MEMORY in0, CEDARV_MEMORY in1,
+                         CEDARV_MEMORY out0, CEDARV_MEMORY out1, CEDARV_MEMORY out2)
+{
+   pthread_mutex_lock(&s->lock);
+   while(s->busy)
+      pthread_cond_wait(&s->cond, &s->lock);
+
+   scaler_set_addr(&s->para, in0, in1, out0, out1, out2);
+   s->busy = 1;
+   pthread_cond_broadcast(&s->cond);
+   pthread_mutex_unlock(&s->lock);
+}
+
+int cedarv_scaler_wait(struct cedarv_scaler *s)
+{
+   int result;
+
+   pthread_mutex_lock(&s->lock);
+   while(s->busy)
+      pthread_cond_wait(&s->cond, &s->lock);
+   result = s->result;
+   pthread_mutex_unlock(&s->lock);
+
+   return result;
 }
 
 #if 0
@@ -299,431 +417,32 @@ void cedarv_sw_convertToNv21C(char* pSrc, char* pDst, int nWidth, int nHeight)
 
 void cedarv_sw_convertMb32420ToNv21Y(char* pSrc,char* pDst,int nWidth, int nHeight)
 {
-	int nMbWidth = 0;
-	int nMbHeight = 0;
-	int i = 0;
-	int j = 0;
-	int m = 0;
-	int k = 0;
-    int nLineStride=0;
-    int lineNum = 0;
-    int offset = 0;
-    char* ptr = NULL;
-    char *dstAsm = NULL;
-    char *srcAsm = NULL;
-    char bufferU[32];
-    int nWidthMatchFlag = 0;
-    int nCopyMbWidth = 0;
-
-    nLineStride = (nWidth + 15) &~15;
-    nMbWidth = (nWidth+31)&~31;
-    nMbWidth /= 32;
-
-    nMbHeight = (nHeight+31)&~31;
-    nMbHeight /= 32;
-    ptr = pSrc;
-
-    nWidthMatchFlag = 0;
-	nCopyMbWidth = nMbWidth-1;
-
-    if(nMbWidth*32 == nLineStride)
-    {
-    	nWidthMatchFlag = 1;
-    	nCopyMbWidth = nMbWidth;
-
-    }
-    for(i=0; i<nMbHeight; i++)
-    {
-    	for(j=0; j<nCopyMbWidth; j++)
-    	{
-    		for(m=0; m<32; m++)
-    		{
-    			if((i*32 + m) >= nHeight)
-    		  	{
-    				ptr += 32;
-    		    	continue;
-    		  	}
-    			srcAsm = ptr;
-    			lineNum = i*32 + m;           //line num
-    			offset =  lineNum*nLineStride + j*32;
-    			dstAsm = pDst+ offset;
-#ifdef __aarch64__
-			fprintf(stderr, "%s: asm volatile to be updated (%d)...\n", __func__, __LINE__);
-#else /*__aarch64__*/
-			asm volatile (
-    					        "vld1.8         {d0 - d3}, [%[srcAsm]]              \n\t"
-    					        "vst1.8         {d0 - d3}, [%[dstAsm]]              \n\t"
-    					       	: [dstAsm] "+r" (dstAsm), [srcAsm] "+r" (srcAsm)
-    					       	:  //[srcY] "r" (srcY)
-    					       	: "cc", "memory", "d0", "d1", "d2", "d3", "d4", "d5", "d6", "d16", "d17", "d18", "d19", "d20", "d21", "d22", "d23", "d24", "d28", "d29", "d30", "d31");
-#endif /*__aarch64__*/
-    			ptr += 32;
-    		}
-    	}
-
-    	if(nWidthMatchFlag == 1)
-    	{
-    		continue;
-    	}
-    	for(m=0; m<32; m++)
-    	{
-    		if((i*32 + m) >= nHeight)
-    		{
-    			ptr += 32;
-    	    	continue;
-    	   	}
-    		dstAsm = bufferU;
-    		srcAsm = ptr;
-    	 	lineNum = i*32 + m;           //line num
-    		offset =  lineNum*nLineStride + j*32;
-
-#ifdef __aarch64__
-		fprintf(stderr, "%s: asm volatile to be updated (%d)...\n", __func__, __LINE__);
-#else /*__aarch64__*/
-    	   	 asm volatile (
-    	    	      "vld1.8         {d0 - d3}, [%[srcAsm]]              \n\t"
-    	              "vst1.8         {d0 - d3}, [%[dstAsm]]              \n\t"
-    	         	    : [dstAsm] "+r" (dstAsm), [srcAsm] "+r" (srcAsm)
-    	    	     	:  //[srcY] "r" (srcY)
-    	    	    	: "cc", "memory", "d0", "d1", "d2", "d3", "d4", "d5", "d6", "d16", "d17", "d18", "d19", "d20", "d21", "d22", "d23", "d24", "d28", "d29", "d30", "d31");
-#endif /*__aarch64__*/
-    	   	ptr += 32;
-    	   	for(k=0; k<32; k++)
-    	   	{
-    	   		if((j*32+ k) >= nLineStride)
-    	   	   	{
-    	   			break;
-    	   	  	}
-    	   	 	pDst[offset+k] = bufferU[k];
-    	   	}
-    	}
-    }
+   cedarv_detile_plane((uint8_t *)pDst, (nWidth + 15) & ~15, (const uint8_t *)pSrc, nWidth, nHeight);
 }
 
-
 void cedarv_sw_convertMb32420ToNv21C(char* pSrc,char* pDst,int nPicWidth, int nPicHeight)
 {
-	int nMbWidth = 0;
-	int nMbHeight = 0;
-	int i = 0;
-	int j = 0;
-	int m = 0;
-	int k = 0;
-    int nLineStride=0;
-    int lineNum = 0;
-    int offset = 0;
-    char* ptr = NULL;
-    char *dst0Asm = NULL;
-    char *dst1Asm = NULL;
-    char *srcAsm = NULL;
-    char bufferV[16], bufferU[16];
-    int nWidth = 0;
-    int nHeight = 0;
-
-    nWidth = (nPicWidth+1)/2;
-    nHeight = (nPicHeight+1)/2;
-
-    nLineStride = (nWidth*2 + 15) &~15;
-    nMbWidth = (nWidth*2+31)&~31;
-    nMbWidth /= 32;
-
-    nMbHeight = (nHeight+31)&~31;
-    nMbHeight /= 32;
-
-
-    ptr = pSrc;
-
-    for(i=0; i<nMbHeight; i++)
-    {
-    	for(j=0; j<nMbWidth; j++)
-    	{
-    		for(m=0; m<32; m++)
-    		{
-    			if((i*32 + m) >= nHeight)
-    			{
-    				ptr += 32;
-    				continue;
-        		}
-
-    			dst0Asm = bufferU;
-    			dst1Asm = bufferV;
-    			srcAsm = ptr;
-    			lineNum = i*32 + m;           //line num
-    			offset =  lineNum*nLineStride + j*32;
-
-#ifdef __aarch64__
-			fprintf(stderr, "%s: asm volatile to be updated (%d)...\n", __func__, __LINE__);
-#else /*__aarch64__*/
-    			asm volatile(
-    					"vld2.8         {d0-d3}, [%[srcAsm]]              \n\t"
-    			    	"vst1.8         {d0,d1}, [%[dst0Asm]]              \n\t"
-    			    	"vst1.8         {d2,d3}, [%[dst1Asm]]              \n\t"
-    			    	: [dst0Asm] "+r" (dst0Asm), [dst1Asm] "+r" (dst1Asm), [srcAsm] "+r" (srcAsm)
-    			        :  //[srcY] "r" (srcY)
-    			        : "cc", "memory", "d0", "d1", "d2", "d3", "d4", "d5", "d6", "d16", "d17", "d18", "d19", "d20", "d21", "d22", "d23", "d24", "d28", "d29", "d30", "d31"
-    			     );
-#endif /*__aarch64__*/
-    			ptr += 32;
-
-
-    			for(k=0; k<16; k++)
-    			{
-    				if((j*32+ 2*k) >= nLineStride)
-    				{
-    					break;
-    				}
-    				pDst[offset+2*k]   = bufferV[k];
-    			   	pDst[offset+2*k+1] = bufferU[k];
-    			}
-    		}
-    	}
-    }
+   int nWidth = (nPicWidth + 1) / 2;
+   uint8_t *dst[3] = { NULL, (uint8_t *)pDst, NULL };
+   int pitch[3] = { 0, (nWidth * 2 + 15) & ~15, 0 };
+
+   cedarv_detile_frame(CEDARV_DETILE_NV21, dst, pitch, NULL, (const uint8_t *)pSrc, nPicWidth, nPicHeight, 0);
 }
 
 void cedarv_sw_convertMb32420ToYv12C(char* pSrc,char* pDstU, char*pDstV,int nPicWidth, int nPicHeight)
 {
-	int nMbWidth = 0;
-	int nMbHeight = 0;
-	int i = 0;
-	int j = 0;
-	int m = 0;
-	int k = 0;
-    int nLineStride=0;
-    int lineNum = 0;
-    int offset = 0;
-    char* ptr = NULL;
-    char *dst0Asm = NULL;
-    char *dst1Asm = NULL;
-    char *srcAsm = NULL;
-    int nWidth = 0;
-    int nHeight = 0;
-    char bufferV[16], bufferU[16];
-    int nWidthMatchFlag = 0;
-    int nCopyMbWidth = 0;
-
-    nWidth = (nPicWidth+1)/2;
-    nHeight = (nPicHeight+1)/2;
-
-    //nLineStride = ((nPicWidth+ 15) &~15)/2;
-    nLineStride = (nWidth+7)&~7;
-
-    nMbWidth = (nWidth*2+31)&~31;
-    nMbWidth /= 32;
-
-    nMbHeight = (nHeight+31)&~31;
-    nMbHeight /= 32;
-
-
-    ptr = pSrc;
-
-    nWidthMatchFlag = 0;
-	nCopyMbWidth = nMbWidth-1;
-
-    if(nMbWidth*16 == nLineStride)
-    {
-    	nWidthMatchFlag = 1;
-    	nCopyMbWidth = nMbWidth;
-    }
-
-    for(i=0; i<nMbHeight; i++)
-    {
-    	for(j=0; j<nCopyMbWidth; j++)
-    	{
-    		for(m=0; m<32; m++)
-    		{
-    			if((i*32 + m) >= nHeight)
-    			{
-    				ptr += 32;
-    				continue;
-        		}
-
-    			srcAsm = ptr;
-    			lineNum = i*32 + m;           //line num
-    			offset =  lineNum*nLineStride + j*16;
-    			dst0Asm = pDstU+offset;
-			dst1Asm = pDstV+offset;
-#ifdef __aarch64__
-			fprintf(stderr, "%s: asm volatile to be updated (%d)...\n", __func__, __LINE__);
-#else /*__aarch64__*/
-    			asm volatile(
-    					"vld2.8         {d0-d3}, [%[srcAsm]]              \n\t"
-    			    	"vst1.8         {d0,d1}, [%[dst0Asm]]              \n\t"
-    			    	"vst1.8         {d2,d3}, [%[dst1Asm]]              \n\t"
-    			    	: [dst0Asm] "+r" (dst0Asm), [dst1Asm] "+r" (dst1Asm), [srcAsm] "+r" (srcAsm)
-    			        :  //[srcY] "r" (srcY)
-    			        : "cc", "memory", "d0", "d1", "d2", "d3", "d4", "d5", "d6", "d16", "d17", "d18", "d19", "d20", "d21", "d22", "d23", "d24", "d28", "d29", "d30", "d31"
-    			     );
-#endif /*__aarch64__*/
-    			ptr += 32;
-    		}
-    	}
-
-    	if(nWidthMatchFlag == 1)
-    	{
-    		continue;
-    	}
-    	for(m=0; m<32; m++)
-    	{
-    		if((i*32 + m) >= nHeight)
-    		{
-    			ptr += 32;
-    			continue;
-    		}
-
-
-    	   	srcAsm = ptr;
-    	   	lineNum = i*32 + m;           //line num
-    		offset =  lineNum*nLineStride + j*16;
-    	   	dst0Asm = bufferU;
-        	dst1Asm = bufferV;
-#ifdef __aarch64__
-		fprintf(stderr, "%s: asm volatile to be updated (%d)...\n", __func__, __LINE__);
-#else /*__aarch64__*/
-    	   	asm volatile(
-    	   			"vld2.8         {d0-d3}, [%[srcAsm]]              \n\t"
-    	    		"vst1.8         {d0,d1}, [%[dst0Asm]]              \n\t"
-    	    	 	"vst1.8         {d2,d3}, [%[dst1Asm]]              \n\t"
-    	    	   	: [dst0Asm] "+r" (dst0Asm), [dst1Asm] "+r" (dst1Asm), [srcAsm] "+r" (srcAsm)
-    	            :  //[srcY] "r" (srcY)
-    	            : "cc", "memory", "d0", "d1", "d2", "d3", "d4", "d5", "d6", "d16", "d17", "d18", "d19", "d20", "d21", "d22", "d23", "d24", "d28", "d29", "d30", "d31"
-    	         );
-#endif /*__aarch64__*/
-    	   	ptr += 32;
-
-    	   	for(k=0; k<16; k++)
-    	   	{
-    	   		if((j*16+ k) >= nLineStride)
-    	   		{
-    	   			break;
-    	   		}
-    	   		pDstV[offset+k] = bufferV[k];
-    	   		pDstU[offset+k] = bufferU[k];
-    	   	}
-    	}
-    }
-}
+   int nWidth = (nPicWidth + 1) / 2;
+   uint8_t *dst[3] = { NULL, (uint8_t *)pDstU, (uint8_t *)pDstV };
+   int pitch[3] = { 0, (nWidth + 7) & ~7, (nWidth + 7) & ~7 };
 
+   cedarv_detile_frame(CEDARV_DETILE_I420, dst, pitch, NULL, (const uint8_t *)pSrc, nPicWidth, nPicHeight, 0);
+}
 
 void cedarv_sw_convertMb32422ToYv12C(char* pSrc,char* pDstU, char*pDstV,int nPicWidth, int nPicHeight)
 {
-	int nMbWidth = 0;
-	int nMbHeight = 0;
-	int i = 0;
-	int j = 0;
-	int m = 0;
-	int k = 0;
-    int nLineStride=0;
-    int lineNum = 0;
-    int offset = 0;
-    char* ptr = NULL;
-    char *dst0Asm = NULL;
-    char *dst1Asm = NULL;
-    char *srcAsm = NULL;
-
-    int nWidth = 0;
-    int nHeight = 0;
-    char bufferV[16], bufferU[16];
-    int nWidthMatchFlag = 0;
-    int nCopyMbWidth = 0;
-
-    nWidth = (nPicWidth+1)/2;
-    nHeight = (nPicHeight+1)/2;
-
-    nLineStride = (nWidth+7)&~7;
-
-    nMbWidth = (nWidth*2+31)&~31;
-    nMbWidth /= 32;
-
-    nMbHeight = (nHeight*2+31)&~31;
-    nMbHeight /= 32;
-
-    ptr = pSrc;
-
-    nWidthMatchFlag = 0;
-	nCopyMbWidth = nMbWidth-1;
-
-    if(nMbWidth*16 == nLineStride)
-    {
-    	nWidthMatchFlag = 1;
-    	nCopyMbWidth = nMbWidth;
-    }
-
-    for(i=0; i<nMbHeight; i++)
-    {
-    	for(j=0; j<nCopyMbWidth; j++)
-    	{
-    		for(m=0; m<16; m++)
-    		{
-    			if((i*16 + m) >= nHeight)
-    			{
-    				ptr += 64;
-    				continue;
-        		}
-
-    			srcAsm = ptr;
-    			lineNum = i*16 + m;           //line num
-    			offset =  lineNum*nLineStride + j*16;
-    			dst0Asm = pDstU+offset;
-    			dst1Asm = pDstV+offset;
-
-
-#ifdef __aarch64__
-			fprintf(stderr, "%s: asm volatile to be updated (%d)...\n", __func__, __LINE__);
-#else /*__aarch64__*/
-    			asm volatile(
-    					"vld2.8         {d0-d3}, [%[srcAsm]]              \n\t"
-    			    	"vst1.8         {d0,d1}, [%[dst0Asm]]              \n\t"
-    			    	"vst1.8         {d2,d3}, [%[dst1Asm]]              \n\t"
-    			    	: [dst0Asm] "+r" (dst0Asm), [dst1Asm] "+r" (dst1Asm), [srcAsm] "+r" (srcAsm)
-    			        :  //[srcY] "r" (srcY)
-    			        : "cc", "memory", "d0", "d1", "d2", "d3", "d4", "d5", "d6", "d16", "d17", "d18", "d19", "d20", "d21", "d22", "d23", "d24", "d28", "d29", "d30", "d31"
-    			     );
-#endif /*__aarch64__*/
-    			ptr += 64;
-    		}
-    	}
-
-    	if(nWidthMatchFlag==1)
-    	{
-    		continue;
-    	}
-    	for(m=0; m<16; m++)
-    	{
-    		if((i*16 + m) >= nHeight)
-    	    {
-    			ptr += 64;
-    			continue;
-    	    }
-
-    		dst0Asm = bufferU;
-    	    dst1Asm = bufferV;
-    	   	srcAsm = ptr;
-    	   	lineNum = i*16 + m;           //line num
-    		offset =  lineNum*nLineStride + j*16;
-
-#ifdef __aarch64__
-		fprintf(stderr, "%s: asm volatile to be updated (%d)...\n", __func__, __LINE__);
-#else /*__aarch64__*/
-    	   	asm volatile(
-    	    			"vld2.8         {d0-d3}, [%[srcAsm]]              \n\t"
-    	    		 	"vst1.8         {d0,d1}, [%[dst0Asm]]              \n\t"
-    	    	    	"vst1.8         {d2,d3}, [%[dst1Asm]]              \n\t"
-    	    	    	: [dst0Asm] "+r" (dst0Asm), [dst1Asm] "+r" (dst1Asm), [srcAsm] "+r" (srcAsm)
-    	    	        :  //[srcY] "r" (srcY)
-    	    	        : "cc", "memory", "d0", "d1", "d2", "d3", "d4", "d5", "d6", "d16", "d17", "d18", "d19", "d20", "d21", "d22", "d23", "d24", "d28", "d29", "d30", "d31"
-    	   		     );
-#endif /*__aarch64__*/
-    	   	ptr += 64;
-
-    	   	for(k=0; k<16; k++)
-    	    {
-    	   		if((j*16+ k) >= nLineStride)
-    	   		{
-    	   			break;
-    	   		}
-    	    	pDstV[offset+k] = bufferV[k];
-    	   	   	pDstU[offset+k] = bufferU[k];
-    		}
-    	}
-    }
+   int nWidth = (nPicWidth + 1) / 2;
+   uint8_t *dst[3] = { NULL, (uint8_t *)pDstU, (uint8_t *)pDstV };
+   int pitch[3] = { 0, (nWidth + 7) & ~7, (nWidth + 7) & ~7 };
+
+   cedarv_detile_frame(CEDARV_DETILE_I420, dst, pitch, NULL, (const uint8_t *)pSrc, nPicWidth, nPicHeight, 1);
 }
@@ -17,11 +17,29 @@ void ConvertMb32420ToYv12C(char* pSrc,char* pDst,int nPicWidth, int nPicHeight);
 void ConvertMb32420ToYv12Y(char* pSrc,char* pDst,int nWidth, int nHeight);
 #endif
 
+enum cedarv_scaler_mode
+{
+   CEDARV_SCALER_MB2YUV420,
+   CEDARV_SCALER_MB2NV12,
+   CEDARV_SCALER_ARGB2YUV420,
+   CEDARV_SCALER_MB2RGB
+};
+
+struct cedarv_scaler;
+
 void cedarv_disp_init();
 void cedarv_disp_close();
 int cedarv_disp_convertMb2Yuv420(int width, int height, CEDARV_MEMORY y, CEDARV_MEMORY uv, 
                                  CEDARV_MEMORY convY, CEDARV_MEMORY convU, CEDARV_MEMORY convV);
 int cedarv_disp_convertARGB2Yuv420(int width, int height, CEDARV_MEMORY y, CEDARV_MEMORY convY, CEDARV_MEMORY convUV);
+int cedarv_disp_convertMb2Nv12(int width, int height, CEDARV_MEMORY y, CEDARV_MEMORY uv, CEDARV_MEMORY convY, CEDARV_MEMORY convUV);
 int cedarv_disp_convertMb2RGB(int width, int height, CEDARV_MEMORY y, CEDARV_MEMORY uv, CEDARV_MEMORY convY);
 
+/* persistent, asynchronous scaler sessions; need cedarv_disp_init() */
+struct cedarv_scaler *cedarv_scaler_open(enum cedarv_scaler_mode mode, int width, int height);
+void cedarv_scaler_close(struct cedarv_scaler *s);
+void cedarv_scaler_queue(struct cedarv_scaler *s, CEDARV_MEMORY in0, CEDARV_MEMORY in1,
+                         CEDARV_MEMORY out0, CEDARV_MEMORY out1, CEDARV_MEMORY out2);
+int cedarv_scaler_wait(struct cedarv_scaler *s);
+
 #endif
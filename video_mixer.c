@@ -19,6 +19,17 @@
 
 #include <math.h>
 #include "vdpau_private.h"
+#include "deinterlace.h"
+#include "rgba.h"
+
+/*
+ * Layers go on overlay planes or are blended into the output surface,
+ * both only reach the screen through the OSD. Without it there are none.
+ */
+static uint32_t max_layers(const device_ctx_t *dev)
+{
+	return dev->osd_enabled ? OUTPUT_MAX_LAYERS : 0;
+}
 
 VdpStatus vdp_video_mixer_create(VdpDevice device, uint32_t feature_count, VdpVideoMixerFeature const *features, uint32_t parameter_count, VdpVideoMixerParameter const *parameters, void const *const *parameter_values, VdpVideoMixer *mixer)
 {
@@ -26,11 +37,21 @@ VdpStatus vdp_video_mixer_create(VdpDevice device, uint32_t feature_count, VdpVi
 	if (!dev)
 		return VDP_STATUS_INVALID_HANDLE;
 
+	uint32_t i;
+	for (i = 0; i < parameter_count; i++)
+		if (parameters[i] == VDP_VIDEO_MIXER_PARAMETER_LAYERS && parameter_values[i] &&
+		    *(uint32_t const *)parameter_values[i] > max_layers(dev))
+		{
+			handle_release(device);
+			return VDP_STATUS_INVALID_VALUE;
+		}
+
 	mixer_ctx_t *mix = handle_create(sizeof(*mix), mixer, htype_mixer);
 	if (!mix)
 		return VDP_STATUS_RESOURCES;
 
 	mix->device = dev;
+	mix->device_hdl = device;
 	mix->contrast = 1.0;
 	mix->saturation = 1.0;
         
@@ -44,35 +65,287 @@ VdpStatus vdp_video_mixer_destroy(VdpVideoMixer mixer)
 	if (!mix)
 		return VDP_STATUS_INVALID_HANDLE;
 
+	/* output surfaces may still show a deinterlaced frame, those go with their last reference */
+	int i;
+	for (i = 0; i < MIXER_DEINT_SURFACES; i++)
+	{
+		video_surface_ctx_t *vs = handle_get(mix->deint_surfaces[i]);
+		if (!vs)
+			continue;
+
+		int idle = video_surface_orphan(vs);
+		handle_release(mix->deint_surfaces[i]);
+		if (idle)
+			vdp_video_surface_destroy(mix->deint_surfaces[i]);
+	}
+
 	handle_release(mixer);
         handle_destroy(mixer);
 
 	return VDP_STATUS_OK;
 }
 
+static VdpBool feature_supported(VdpVideoMixerFeature feature)
+{
+	switch (feature)
+	{
+	case VDP_VIDEO_MIXER_FEATURE_DEINTERLACE_TEMPORAL:
+	case VDP_VIDEO_MIXER_FEATURE_DEINTERLACE_TEMPORAL_SPATIAL:
+		return VDP_TRUE;
+	default:
+		return VDP_FALSE;
+	}
+}
+
+/*
+ * A progressive surface for the deinterlacer to write to. It must not be
+ * shown by any output surface, except the destination which is about to
+ * be replaced anyway.
+ */
+static VdpVideoSurface get_deint_surface(mixer_ctx_t *mix, output_surface_ctx_t *os, video_surface_ctx_t *cur)
+{
+	int i, free_slot = -1;
+
+	for (i = 0; i < MIXER_DEINT_SURFACES; i++)
+	{
+		video_surface_ctx_t *vs = handle_get(mix->deint_surfaces[i]);
+		if (!vs)
+		{
+			if (free_slot < 0)
+				free_slot = i;
+			continue;
+		}
+
+		int idle = vs->refs == 0 || (vs->refs == 1 && os->video_surface == mix->deint_surfaces[i]);
+		int fits = vs->width == cur->width && vs->height == cur->height && vs->chroma_type == cur->chroma_type;
+		handle_release(mix->deint_surfaces[i]);
+
+		if (idle && fits)
+			return mix->deint_surfaces[i];
+
+		/* left over from a different stream */
+		if (idle && free_slot < 0)
+		{
+			vdp_video_surface_destroy(mix->deint_surfaces[i]);
+			mix->deint_surfaces[i] = 0;
+			free_slot = i;
+		}
+	}
+
+	if (free_slot < 0 ||
+	    vdp_video_surface_create(mix->device_hdl, cur->chroma_type, cur->width, cur->height,
+	                             &mix->deint_surfaces[free_slot]) != VDP_STATUS_OK)
+		return 0;
+
+	return mix->deint_surfaces[free_slot];
+}
+
+static video_surface_ctx_t *get_ref_surface(VdpVideoSurface surface, video_surface_ctx_t *cur)
+{
+	video_surface_ctx_t *vs = handle_get(surface);
+	if (!vs)
+		return NULL;
+
+	handle_release(surface);
+	if (vs->width != cur->width || vs->height != cur->height || vs->chroma_type != cur->chroma_type ||
+	    vs->source_format != cur->source_format || !cedarv_isValid(vs->data))
+		return NULL;
+
+	return vs;
+}
+
+/* returns the progressive surface, or 0 if the frame can't be deinterlaced */
+static VdpVideoSurface deinterlace(mixer_ctx_t *mix, output_surface_ctx_t *os, video_surface_ctx_t *cur,
+                                   VdpVideoMixerPictureStructure structure,
+                                   uint32_t past_count, VdpVideoSurface const *past,
+                                   uint32_t future_count, VdpVideoSurface const *future)
+{
+	int tiled = cur->source_format == INTERNAL_YCBCR_FORMAT;
+	struct cedarv_deint_frame f[4];
+	video_surface_ctx_t *ref[4] = { cur, NULL, NULL, NULL };
+	int i;
+
+	if (cur->chroma_type != VDP_CHROMA_TYPE_420 || (!tiled && cur->source_format != VDP_YCBCR_FORMAT_NV12))
+		return 0;
+
+	VdpVideoSurface surface = get_deint_surface(mix, os, cur);
+	video_surface_ctx_t *out = handle_get(surface);
+	if (!out)
+		return 0;
+
+	if (!video_surface_touch(out))
+	{
+		handle_release(surface);
+		return 0;
+	}
+
+	/* past[0] and future[0] hold the other field right before and after the current one */
+	if (past_count > 0 && past)
+		ref[1] = get_ref_surface(past[0], cur);
+	if (future_count > 0 && future)
+		ref[2] = get_ref_surface(future[0], cur);
+	if (past_count > 1 && past)
+		ref[3] = get_ref_surface(past[1], cur);
+
+	for (i = 0; i < 4; i++)
+		if (ref[i])
+		{
+			/* the VE writes behind the cpu caches */
+			video_surface_wait_decode(ref[i]);
+			cedarv_flush_cache(ref[i]->dataY, ref[i]->plane_size);
+			cedarv_flush_cache(ref[i]->dataU, ref[i]->plane_size / 2);
+			f[i].y = cedarv_getPointer(ref[i]->dataY);
+			f[i].uv = cedarv_getPointer(ref[i]->dataU);
+		}
+
+	cedarv_deinterlace(cedarv_getPointer(out->dataY), cedarv_getPointer(out->dataU), &f[0],
+	                   ref[1] ? &f[1] : NULL, ref[2] ? &f[2] : NULL, ref[3] ? &f[3] : NULL,
+	                   cur->width, cur->height, video_surface_pitch(cur, VDP_YCBCR_FORMAT_NV12, 0), tiled,
+	                   structure == VDP_VIDEO_MIXER_PICTURE_STRUCTURE_BOTTOM_FIELD,
+	                   mix->deinterlace_temporal_spatial);
+
+	cedarv_flush_cache(out->dataY, out->memory_size);
+	out->source_format = cur->source_format;
+	out->linear_valid = 0;
+
+	handle_release(surface);
+	return surface;
+}
+
+/*
+ * Layers are shown on the display's overlay planes where possible. The
+ * planes sit below the output surface's own RGBA content, so once a layer
+ * has to be blended in software all layers above it are too. Planes can't
+ * scale independently, scaled layers are blended as well.
+ */
+static VdpStatus set_layers(output_surface_ctx_t *os, uint32_t layer_count, VdpLayer const *layers)
+{
+	static const VdpOutputSurfaceRenderBlendState blend_over = {
+		.struct_version = VDP_OUTPUT_SURFACE_RENDER_BLEND_STATE_VERSION,
+		.blend_factor_source_color = VDP_OUTPUT_SURFACE_RENDER_BLEND_FACTOR_SRC_ALPHA,
+		.blend_factor_destination_color = VDP_OUTPUT_SURFACE_RENDER_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA,
+		.blend_factor_source_alpha = VDP_OUTPUT_SURFACE_RENDER_BLEND_FACTOR_ONE,
+		.blend_factor_destination_alpha = VDP_OUTPUT_SURFACE_RENDER_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA,
+		.blend_equation_color = VDP_OUTPUT_SURFACE_RENDER_BLEND_EQUATION_ADD,
+		.blend_equation_alpha = VDP_OUTPUT_SURFACE_RENDER_BLEND_EQUATION_ADD,
+	};
+	int hw_layers = os->device->hw_layers < OUTPUT_MAX_LAYERS ? os->device->hw_layers : OUTPUT_MAX_LAYERS;
+	VdpStatus ret = VDP_STATUS_OK;
+	uint32_t i;
+
+	os->layer_count = 0;
+
+	for (i = 0; i < layer_count && ret == VDP_STATUS_OK; i++)
+	{
+		if (layers[i].struct_version != VDP_LAYER_VERSION)
+			return VDP_STATUS_INVALID_STRUCT_VERSION;
+
+		output_surface_ctx_t *src = handle_get(layers[i].source_surface);
+		if (!src)
+			return VDP_STATUS_INVALID_HANDLE;
+
+		VdpRect s = { 0, 0, src->width, src->height };
+		VdpRect d = { 0, 0, os->width, os->height };
+		if (layers[i].source_rect)
+			s = *layers[i].source_rect;
+		if (layers[i].destination_rect)
+			d = *layers[i].destination_rect;
+
+		if (os->layer_count == (int)i && os->layer_count < hw_layers &&
+		    s.x1 - s.x0 == d.x1 - d.x0 && s.y1 - s.y0 == d.y1 - d.y0)
+		{
+			output_layer_t *l = &os->layers[os->layer_count++];
+			l->surface = layers[i].source_surface;
+			l->src = s;
+			l->dst = d;
+		}
+		else
+			ret = rgba_render_surface(&os->rgba, &d, &src->rgba, &s, NULL, &blend_over, 0);
+
+		handle_release(layers[i].source_surface);
+	}
+
+	return ret;
+}
+
 VdpStatus vdp_video_mixer_render(VdpVideoMixer mixer, VdpOutputSurface background_surface, VdpRect const *background_source_rect, VdpVideoMixerPictureStructure current_picture_structure, uint32_t video_surface_past_count, VdpVideoSurface const *video_surface_past, VdpVideoSurface video_surface_current, uint32_t video_surface_future_count, VdpVideoSurface const *video_surface_future, VdpRect const *video_source_rect, VdpOutputSurface destination_surface, VdpRect const *destination_rect, VdpRect const *destination_video_rect, uint32_t layer_count, VdpLayer const *layers)
 {
 	mixer_ctx_t *mix = handle_get(mixer);
 	if (!mix)
 		return VDP_STATUS_INVALID_HANDLE;
 
+	if (layer_count > max_layers(mix->device))
+	{
+		handle_release(mixer);
+		return VDP_STATUS_INVALID_VALUE;
+	}
+
 	if (background_surface != VDP_INVALID_HANDLE)
 		VDPAU_DBG_ONCE("Requested unimplemented background_surface");
 
 
-	if (current_picture_structure != VDP_VIDEO_MIXER_PICTURE_STRUCTURE_FRAME)
-		VDPAU_DBG_ONCE("Requested unimplemented picture_structure");
-
-
-
 	output_surface_ctx_t *os = handle_get(destination_surface);
 	if (!os)
 		return VDP_STATUS_INVALID_HANDLE;
 
-	os->vs = handle_get(video_surface_current);
-	if (!(os->vs))
+	video_surface_ctx_t *vs = handle_get(video_surface_current);
+	if (!vs)
 		return VDP_STATUS_INVALID_HANDLE;
 
+	if (!video_surface_touch(vs))
+	{
+		handle_release(video_surface_current);
+		handle_release(destination_surface);
+		handle_release(mixer);
+		return VDP_STATUS_RESOURCES;
+	}
+
+	/* the surface the display is going to show */
+	VdpVideoSurface shown = video_surface_current;
+	os->video_field = current_picture_structure;
+
+	if (current_picture_structure != VDP_VIDEO_MIXER_PICTURE_STRUCTURE_FRAME &&
+	    (mix->deinterlace_temporal || mix->deinterlace_temporal_spatial))
+	{
+		VdpVideoSurface deint = deinterlace(mix, os, vs, current_picture_structure,
+		                                    video_surface_past_count, video_surface_past,
+		                                    video_surface_future_count, video_surface_future);
+		if (deint)
+		{
+			shown = deint;
+			os->video_field = VDP_VIDEO_MIXER_PICTURE_STRUCTURE_FRAME;
+		}
+	}
+
+	/*
+	 * A single field of a tiled frame is shown from its linear copy. It is
+	 * made once per decoded frame here rather than by the display thread,
+	 * the second field of the frame reuses it.
+	 */
+	if (os->video_field != VDP_VIDEO_MIXER_PICTURE_STRUCTURE_FRAME && vs->source_format == INTERNAL_YCBCR_FORMAT)
+	{
+		CEDARV_MEMORY y, uv;
+		video_surface_get_linear(vs, &y, &uv);
+	}
+
+	video_surface_ctx_t *shown_vs = shown == video_surface_current ? vs : handle_get(shown);
+	if (os->video_surface != shown)
+	{
+		video_surface_ctx_t *old = handle_get(os->video_surface);
+		if (old)
+		{
+			int orphan = video_surface_unref(old);
+			handle_release(os->video_surface);
+			if (orphan)
+				vdp_video_surface_destroy(os->video_surface);
+		}
+		video_surface_ref(shown_vs);
+		os->video_surface = shown;
+	}
+	os->vs = shown_vs;
+	if (shown != video_surface_current)
+		handle_release(shown);
+
 	if (destination_video_rect)
 	{
 		os->video_dst_rect = *destination_video_rect;
@@ -81,10 +354,12 @@ VdpStatus vdp_video_mixer_render(VdpVideoMixer mixer, VdpOutputSurface backgroun
 		else
 		{
 			os->video_src_rect.x0 = os->video_src_rect.y0 = 0;
-			os->video_src_rect.x1 = os->vs->width;
-			os->video_src_rect.y1 = os->vs->height;
+			os->video_src_rect.x1 = vs->width;
+			os->video_src_rect.y1 = vs->height;
 		}
 	}
+	/* the mixer replaces the whole surface, the OSD drawn before is gone */
+	os->rgba.flags |= RGBA_FLAG_NEEDS_CLEAR;
 	os->csc_change = mix->csc_change;
 	os->brightness = mix->brightness;
 	os->contrast = mix->contrast;
@@ -92,13 +367,12 @@ VdpStatus vdp_video_mixer_render(VdpVideoMixer mixer, VdpOutputSurface backgroun
 	os->hue = mix->hue;
 	mix->csc_change = 0;
 
-	if (layer_count != 0)
-		VDPAU_DBG_ONCE("Requested unimplemented additional layers");
+	VdpStatus ret = set_layers(os, layer_count, layers);
 
         handle_release(mixer);
         handle_release(destination_surface);
         handle_release(video_surface_current);
-	return VDP_STATUS_OK;
+	return ret;
 }
 
 VdpStatus vdp_video_mixer_get_feature_support(VdpVideoMixer mixer, uint32_t feature_count, VdpVideoMixerFeature const *features, VdpBool *feature_supports)
@@ -113,8 +387,12 @@ VdpStatus vdp_video_mixer_get_feature_support(VdpVideoMixer mixer, uint32_t feat
 	if (!mix)
 		return VDP_STATUS_INVALID_HANDLE;
 
+	uint32_t i;
+	for (i = 0; i < feature_count; i++)
+		feature_supports[i] = feature_supported(features[i]);
+
         handle_release(mixer);
-	return VDP_STATUS_ERROR;
+	return VDP_STATUS_OK;
 }
 
 VdpStatus vdp_video_mixer_set_feature_enables(VdpVideoMixer mixer, uint32_t feature_count, VdpVideoMixerFeature const *features, VdpBool const *feature_enables)
@@ -129,6 +407,18 @@ VdpStatus vdp_video_mixer_set_feature_enables(VdpVideoMixer mixer, uint32_t feat
 	if (!mix)
 		return VDP_STATUS_INVALID_HANDLE;
 
+	uint32_t i;
+	for (i = 0; i < feature_count; i++)
+		switch (features[i])
+		{
+		case VDP_VIDEO_MIXER_FEATURE_DEINTERLACE_TEMPORAL:
+			mix->deinterlace_temporal = feature_enables[i];
+			break;
+		case VDP_VIDEO_MIXER_FEATURE_DEINTERLACE_TEMPORAL_SPATIAL:
+			mix->deinterlace_temporal_spatial = feature_enables[i];
+			break;
+		}
+
         handle_release(mixer);
 	return VDP_STATUS_OK;
 }
@@ -142,8 +432,23 @@ VdpStatus vdp_video_mixer_get_feature_enables(VdpVideoMixer mixer, uint32_t feat
 	if (!mix)
 		return VDP_STATUS_INVALID_HANDLE;
 
+	uint32_t i;
+	for (i = 0; i < feature_count; i++)
+		switch (features[i])
+		{
+		case VDP_VIDEO_MIXER_FEATURE_DEINTERLACE_TEMPORAL:
+			feature_enables[i] = mix->deinterlace_temporal;
+			break;
+		case VDP_VIDEO_MIXER_FEATURE_DEINTERLACE_TEMPORAL_SPATIAL:
+			feature_enables[i] = mix->deinterlace_temporal_spatial;
+			break;
+		default:
+			feature_enables[i] = VDP_FALSE;
+			break;
+		}
+
         handle_release(mixer);
-	return VDP_STATUS_ERROR;
+	return VDP_STATUS_OK;
 }
 
 static void set_csc_matrix(mixer_ctx_t *mix, const VdpCSCMatrix *matrix)
@@ -219,7 +524,7 @@ VdpStatus vdp_video_mixer_query_feature_support(VdpDevice device, VdpVideoMixerF
 	if (!dev)
 		return VDP_STATUS_INVALID_HANDLE;
 
-	*is_supported = VDP_FALSE;
+	*is_supported = feature_supported(feature);
         handle_release(device);
 	return VDP_STATUS_OK;
 }
@@ -263,12 +568,14 @@ VdpStatus vdp_video_mixer_query_parameter_value_range(VdpDevice device, VdpVideo
 	{
 	case VDP_VIDEO_MIXER_PARAMETER_LAYERS:
 		*(uint32_t *)min_value = 0;
-		*(uint32_t *)max_value = 0;
+		*(uint32_t *)max_value = max_layers(dev);
+		handle_release(device);
 		return VDP_STATUS_OK;
 	case VDP_VIDEO_MIXER_PARAMETER_VIDEO_SURFACE_HEIGHT:
 	case VDP_VIDEO_MIXER_PARAMETER_VIDEO_SURFACE_WIDTH:
 		*(uint32_t *)min_value = 0;
 		*(uint32_t *)max_value = 8192;
+		handle_release(device);
 		return VDP_STATUS_OK;
 	}
 
@@ -0,0 +1,568 @@
+#include <stdlib.h>
+#include <string.h>
+#include "detile.h"
+#include "threadpool.h"
+#include "yuv2rgb.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
+
+#define CSC_SHIFT 12
+#define CSC_ONE (1 << CSC_SHIFT)
+
+/* rows per job, smaller stripes only waste source lines at the borders */
+#define MIN_STRIPE_ROWS 16
+
+void cedarv_csc_default(struct cedarv_csc *csc)
+{
+	static const float coef[3][3] =
+	{
+		{ 1.164f,  0.000f,  1.596f },
+		{ 1.164f, -0.391f, -0.813f },
+		{ 1.164f,  2.018f,  0.000f },
+	};
+	int i;
+
+	for (i = 0; i < 3; i++)
+	{
+		csc->m[i][0] = coef[i][0] * CSC_ONE + 0.5f;
+		csc->m[i][1] = coef[i][1] * CSC_ONE + (coef[i][1] < 0 ? -0.5f : 0.5f);
+		csc->m[i][2] = coef[i][2] * CSC_ONE + (coef[i][2] < 0 ? -0.5f : 0.5f);
+		csc->m[i][3] = -(csc->m[i][0] * 16 + (csc->m[i][1] + csc->m[i][2]) * 128);
+	}
+}
+
+void cedarv_csc_from_matrix(struct cedarv_csc *csc, const float matrix[3][4])
+{
+	int i, j;
+
+	for (i = 0; i < 3; i++)
+	{
+		for (j = 0; j < 3; j++)
+		{
+			float c = matrix[i][j] * CSC_ONE;
+			csc->m[i][j] = c + (c < 0 ? -0.5f : 0.5f);
+		}
+
+		float o = matrix[i][3] * 255.0f * CSC_ONE;
+		csc->m[i][3] = o + (o < 0 ? -0.5f : 0.5f);
+	}
+}
+
+static inline uint8_t clamp8(int32_t v)
+{
+	v = (v + CSC_ONE / 2) >> CSC_SHIFT;
+	return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+static void csc_pixels(const struct cedarv_csc *csc, const uint8_t *y, const uint8_t *u, const uint8_t *v,
+                       uint8_t *dst, int count, enum cedarv_rgb_format format)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+	{
+		uint8_t r = clamp8(csc->m[0][0] * y[i] + csc->m[0][1] * u[i] + csc->m[0][2] * v[i] + csc->m[0][3]);
+		uint8_t g = clamp8(csc->m[1][0] * y[i] + csc->m[1][1] * u[i] + csc->m[1][2] * v[i] + csc->m[1][3]);
+		uint8_t b = clamp8(csc->m[2][0] * y[i] + csc->m[2][1] * u[i] + csc->m[2][2] * v[i] + csc->m[2][3]);
+
+		switch (format)
+		{
+		case CEDARV_RGB_RGB565:
+			((uint16_t *)dst)[i] = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+			break;
+		case CEDARV_RGB_RGB888:
+			dst[3 * i + 0] = b;
+			dst[3 * i + 1] = g;
+			dst[3 * i + 2] = r;
+			break;
+		case CEDARV_RGB_XRGB8888:
+			dst[4 * i + 0] = b;
+			dst[4 * i + 1] = g;
+			dst[4 * i + 2] = r;
+			dst[4 * i + 3] = 0xff;
+			break;
+		case CEDARV_RGB_Y8:
+			break;
+		}
+	}
+}
+
+#ifdef HAVE_NEON
+static inline uint8x8_t neon_csc_channel(const int32_t m[4], int32x4_t y[2], int32x4_t u[2], int32x4_t v[2])
+{
+	int32x4_t lo = vdupq_n_s32(m[3]);
+	int32x4_t hi = lo;
+
+	lo = vmlaq_n_s32(lo, y[0], m[0]);
+	hi = vmlaq_n_s32(hi, y[1], m[0]);
+	lo = vmlaq_n_s32(lo, u[0], m[1]);
+	hi = vmlaq_n_s32(hi, u[1], m[1]);
+	lo = vmlaq_n_s32(lo, v[0], m[2]);
+	hi = vmlaq_n_s32(hi, v[1], m[2]);
+
+	return vqmovn_u16(vcombine_u16(vqrshrun_n_s32(lo, CSC_SHIFT), vqrshrun_n_s32(hi, CSC_SHIFT)));
+}
+
+static inline void neon_widen(const uint8_t *src, int32x4_t out[2])
+{
+	uint16x8_t w = vmovl_u8(vld1_u8(src));
+
+	out[0] = vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(w)));
+	out[1] = vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(w)));
+}
+
+/* returns the number of pixels done, the rest is left to csc_pixels() */
+static int csc_pixels_neon(const struct cedarv_csc *csc, const uint8_t *y, const uint8_t *u, const uint8_t *v,
+                           uint8_t *dst, int count, enum cedarv_rgb_format format)
+{
+	int i;
+
+	for (i = 0; i + 8 <= count; i += 8)
+	{
+		int32x4_t yy[2], uu[2], vv[2];
+
+		neon_widen(y + i, yy);
+		neon_widen(u + i, uu);
+		neon_widen(v + i, vv);
+
+		uint8x8_t r = neon_csc_channel(csc->m[0], yy, uu, vv);
+		uint8x8_t g = neon_csc_channel(csc->m[1], yy, uu, vv);
+		uint8x8_t b = neon_csc_channel(csc->m[2], yy, uu, vv);
+
+		switch (format)
+		{
+		case CEDARV_RGB_RGB565:
+		{
+			uint16x8_t p = vshll_n_u8(r, 8);
+			p = vsriq_n_u16(p, vshll_n_u8(g, 8), 5);
+			p = vsriq_n_u16(p, vshll_n_u8(b, 8), 11);
+			vst1q_u16((uint16_t *)(dst + 2 * i), p);
+			break;
+		}
+		case CEDARV_RGB_RGB888:
+		{
+			uint8x8x3_t p = { { b, g, r } };
+			vst3_u8(dst + 3 * i, p);
+			break;
+		}
+		case CEDARV_RGB_XRGB8888:
+		{
+			uint8x8x4_t p = { { b, g, r, vdup_n_u8(0xff) } };
+			vst4_u8(dst + 4 * i, p);
+			break;
+		}
+		case CEDARV_RGB_Y8:
+			break;
+		}
+	}
+
+	return i;
+}
+#endif
+
+static const int bytes_per_pixel[] = { 2, 3, 4, 1 };
+
+static void convert_row(const struct cedarv_csc *csc, const uint8_t *y, const uint8_t *u, const uint8_t *v,
+                        uint8_t *dst, int count, enum cedarv_rgb_format format)
+{
+	int done = 0;
+
+	if (format == CEDARV_RGB_Y8)
+	{
+		memcpy(dst, y, count);
+		return;
+	}
+
+#ifdef HAVE_NEON
+	done = csc_pixels_neon(csc, y, u, v, dst, count, format);
+#endif
+	csc_pixels(csc, y + done, u + done, v + done, dst + done * bytes_per_pixel[format], count - done, format);
+}
+
+/*
+ * Tiny two entry line cache, so bilinear scaling and overlapping box
+ * regions fetch each source line only once per job.
+ */
+struct line_cache
+{
+	uint8_t *buf[2];
+	int tag[2];
+	int next;
+	const uint8_t *plane;
+	/* Cr plane of I420 chroma */
+	const uint8_t *plane_v;
+	int pitch;
+	int width;
+	int tiled;
+	enum cedarv_yuv_layout layout;
+	int chroma;
+};
+
+/* lines of other layouts are brought into the NV12 form, luma bytes or CbCr pairs */
+static void load_line(const struct line_cache *c, uint8_t *dst, int y)
+{
+	const uint8_t *src = c->plane + y * c->pitch;
+	int i, n = c->width / 2;
+
+	if (c->tiled)
+	{
+		cedarv_detile_line(dst, c->plane, c->width, y);
+		return;
+	}
+
+	switch (c->layout)
+	{
+	case CEDARV_YUV_I420:
+		if (c->chroma)
+		{
+			const uint8_t *v = c->plane_v + y * c->pitch;
+			for (i = 0; i < n; i++)
+			{
+				dst[2 * i] = src[i];
+				dst[2 * i + 1] = v[i];
+			}
+			return;
+		}
+		break;
+	case CEDARV_YUV_YUYV:
+	case CEDARV_YUV_UYVY:
+		/* Y0 Cb Y1 Cr or Cb Y0 Cr Y1 */
+		src += (c->layout == CEDARV_YUV_UYVY) ^ c->chroma;
+		for (i = 0; i < (c->chroma ? 2 * n : c->width); i++)
+			dst[i] = src[2 * i];
+		return;
+	case CEDARV_YUV_NV12:
+		break;
+	}
+
+	memcpy(dst, src, c->width);
+}
+
+static const uint8_t *get_line(struct line_cache *c, int y)
+{
+	int i;
+
+	for (i = 0; i < 2; i++)
+		if (c->tag[i] == y)
+		{
+			c->next = i ^ 1;
+			return c->buf[i];
+		}
+
+	i = c->next;
+	c->next ^= 1;
+	c->tag[i] = y;
+
+	load_line(c, c->buf[i], y);
+
+	return c->buf[i];
+}
+
+/*
+ * Horizontal maps, one entry per destination pixel. For box scaling x0/x1
+ * is the half open source range, for bilinear scaling the two neighbours
+ * and w the 8 bit weight of x1. Chroma positions count UV pairs.
+ */
+struct yuv2rgb_job
+{
+	const struct cedarv_yuv_frame *src;
+	int src_x, src_y, src_w, src_h;
+	uint8_t *dst;
+	int dst_pitch, dst_w, dst_h;
+	enum cedarv_rgb_format format;
+	enum cedarv_scale_filter filter;
+	const struct cedarv_csc *csc;
+	/* 1 for vertically subsampled (4:2:0) chroma */
+	int chroma_shift;
+	int stripes;
+	int *lx0, *lx1, *lw;
+	int *cx0, *cx1, *cw;
+};
+
+static void box_row(struct yuv2rgb_job *job, struct line_cache *luma, struct line_cache *chroma,
+                    uint32_t *acc, uint8_t *y, uint8_t *u, uint8_t *v, int oy)
+{
+	const struct cedarv_yuv_frame *src = job->src;
+	int y0 = job->src_y + oy * job->src_h / job->dst_h;
+	int y1 = job->src_y + (oy + 1) * job->src_h / job->dst_h;
+	int dw = job->dst_w;
+	int i, x, line;
+
+	if (y1 <= y0)
+		y1 = y0 + 1;
+
+	memset(acc, 0, dw * sizeof(*acc));
+	for (line = y0; line < y1; line++)
+	{
+		const uint8_t *l = get_line(luma, line);
+
+		for (i = 0; i < dw; i++)
+		{
+			uint32_t sum = 0;
+			for (x = job->lx0[i]; x < job->lx1[i]; x++)
+				sum += l[x];
+			acc[i] += sum;
+		}
+	}
+
+	for (i = 0; i < dw; i++)
+	{
+		uint32_t n = (job->lx1[i] - job->lx0[i]) * (y1 - y0);
+		y[i] = (acc[i] + n / 2) / n;
+	}
+
+	if (job->format == CEDARV_RGB_Y8)
+		return;
+
+	int cs = job->chroma_shift;
+	int ch = (src->height + cs) >> cs;
+	int cy0 = y0 >> cs;
+	int cy1 = (y1 + cs) >> cs;
+
+	if (cy1 > ch)
+		cy1 = ch;
+	if (cy1 <= cy0)
+		cy1 = cy0 + 1;
+
+	memset(acc, 0, 2 * dw * sizeof(*acc));
+	for (line = cy0; line < cy1; line++)
+	{
+		const uint8_t *l = get_line(chroma, line);
+
+		for (i = 0; i < dw; i++)
+		{
+			uint32_t su = 0, sv = 0;
+			for (x = job->cx0[i]; x < job->cx1[i]; x++)
+			{
+				su += l[2 * x];
+				sv += l[2 * x + 1];
+			}
+			acc[2 * i] += su;
+			acc[2 * i + 1] += sv;
+		}
+	}
+
+	for (i = 0; i < dw; i++)
+	{
+		uint32_t n = (job->cx1[i] - job->cx0[i]) * (cy1 - cy0);
+		u[i] = (acc[2 * i] + n / 2) / n;
+		v[i] = (acc[2 * i + 1] + n / 2) / n;
+	}
+}
+
+/* 16.16 fixed point source position of destination pixel i, clamped to [lo, hi] */
+static int64_t scale_pos(int i, int src_start, int src_size, int dst_size, int64_t lo, int64_t hi)
+{
+	int64_t p = ((((int64_t)(2 * i + 1) * src_size) << 16) / (2 * dst_size)) - 32768 + ((int64_t)src_start << 16);
+
+	return p < lo ? lo : (p > hi ? hi : p);
+}
+
+static void bilinear_row(struct yuv2rgb_job *job, struct line_cache *luma, struct line_cache *chroma,
+                         uint8_t *y, uint8_t *u, uint8_t *v, int oy)
+{
+	const struct cedarv_yuv_frame *src = job->src;
+	int last = job->src_y + job->src_h - 1;
+	int64_t p = scale_pos(oy, job->src_y, job->src_h, job->dst_h,
+	                      (int64_t)job->src_y << 16, (int64_t)last << 16);
+	int y0 = p >> 16;
+	int wy = (p >> 8) & 0xff;
+	int dw = job->dst_w;
+	int i;
+
+	const uint8_t *l0 = get_line(luma, y0);
+	const uint8_t *l1 = get_line(luma, y0 + 1 > last ? last : y0 + 1);
+
+	for (i = 0; i < dw; i++)
+	{
+		int top = l0[job->lx0[i]] * (256 - job->lw[i]) + l0[job->lx1[i]] * job->lw[i];
+		int bottom = l1[job->lx0[i]] * (256 - job->lw[i]) + l1[job->lx1[i]] * job->lw[i];
+		y[i] = (top * (256 - wy) + bottom * wy + 32768) >> 16;
+	}
+
+	if (job->format == CEDARV_RGB_Y8)
+		return;
+
+	/* 420 chroma is sited between two luma lines, 422 chroma on every one */
+	int clast = ((src->height + job->chroma_shift) >> job->chroma_shift) - 1;
+	int64_t cp = job->chroma_shift ? (p >> 1) - 16384 : p;
+
+	if (cp < 0)
+		cp = 0;
+	if (cp > (int64_t)clast << 16)
+		cp = (int64_t)clast << 16;
+
+	int cy0 = cp >> 16;
+	int cwy = (cp >> 8) & 0xff;
+
+	l0 = get_line(chroma, cy0);
+	l1 = get_line(chroma, cy0 + 1 > clast ? clast : cy0 + 1);
+
+	for (i = 0; i < dw; i++)
+	{
+		int a = 2 * job->cx0[i], b = 2 * job->cx1[i], w = job->cw[i];
+
+		int top = l0[a] * (256 - w) + l0[b] * w;
+		int bottom = l1[a] * (256 - w) + l1[b] * w;
+		u[i] = (top * (256 - cwy) + bottom * cwy + 32768) >> 16;
+
+		top = l0[a + 1] * (256 - w) + l0[b + 1] * w;
+		bottom = l1[a + 1] * (256 - w) + l1[b + 1] * w;
+		v[i] = (top * (256 - cwy) + bottom * cwy + 32768) >> 16;
+	}
+}
+
+static void yuv2rgb_stripe(void *arg, int n)
+{
+	struct yuv2rgb_job *job = arg;
+	const struct cedarv_yuv_frame *src = job->src;
+	int dw = job->dst_w;
+	int cwidth = (src->width + 1) & ~1;
+	int start = n * job->dst_h / job->stripes;
+	int end = (n + 1) * job->dst_h / job->stripes;
+	int oy;
+
+	uint8_t *mem = malloc(2 * src->width + 2 * cwidth + 3 * dw + 2 * dw * sizeof(uint32_t) + 16);
+	if (!mem)
+		return;
+
+	uint32_t *acc = (uint32_t *)mem;
+	uint8_t *y = mem + 2 * dw * sizeof(uint32_t);
+	uint8_t *u = y + dw;
+	uint8_t *v = u + dw;
+
+	int packed = src->layout == CEDARV_YUV_YUYV || src->layout == CEDARV_YUV_UYVY;
+	struct line_cache luma = { { v + dw, v + dw + src->width }, { -1, -1 }, 0,
+	                           src->y, NULL, src->pitch_y, src->width, src->tiled, src->layout, 0 };
+	struct line_cache chroma = { { v + dw + 2 * src->width, v + dw + 2 * src->width + cwidth }, { -1, -1 }, 0,
+	                             packed ? src->y : src->uv, src->v, packed ? src->pitch_y : src->pitch_uv,
+	                             cwidth, src->tiled, src->layout, 1 };
+
+	for (oy = start; oy < end; oy++)
+	{
+		if (job->filter == CEDARV_SCALE_BOX)
+			box_row(job, &luma, &chroma, acc, y, u, v, oy);
+		else
+			bilinear_row(job, &luma, &chroma, y, u, v, oy);
+
+		convert_row(job->csc, y, u, v, job->dst + oy * job->dst_pitch, dw, job->format);
+	}
+
+	free(mem);
+}
+
+static void setup_maps(struct yuv2rgb_job *job)
+{
+	int cw = (job->src->width + 1) / 2;
+	int last = job->src_x + job->src_w - 1;
+	int i;
+
+	for (i = 0; i < job->dst_w; i++)
+	{
+		if (job->filter == CEDARV_SCALE_BOX)
+		{
+			int x0 = job->src_x + i * job->src_w / job->dst_w;
+			int x1 = job->src_x + (i + 1) * job->src_w / job->dst_w;
+
+			if (x1 <= x0)
+				x1 = x0 + 1;
+			job->lx0[i] = x0;
+			job->lx1[i] = x1;
+
+			job->cx0[i] = x0 / 2;
+			job->cx1[i] = (x1 + 1) / 2 > cw ? cw : (x1 + 1) / 2;
+			if (job->cx1[i] <= job->cx0[i])
+				job->cx1[i] = job->cx0[i] + 1;
+		}
+		else
+		{
+			int64_t p = scale_pos(i, job->src_x, job->src_w, job->dst_w,
+			                      (int64_t)job->src_x << 16, (int64_t)last << 16);
+
+			job->lx0[i] = p >> 16;
+			job->lx1[i] = job->lx0[i] + 1 > last ? last : job->lx0[i] + 1;
+			job->lw[i] = (p >> 8) & 0xff;
+
+			/* chroma is co-sited with the even luma columns */
+			int64_t cp = p >> 1;
+			if (cp > (int64_t)(cw - 1) << 16)
+				cp = (int64_t)(cw - 1) << 16;
+
+			job->cx0[i] = cp >> 16;
+			job->cx1[i] = job->cx0[i] + 1 > cw - 1 ? cw - 1 : job->cx0[i] + 1;
+			job->cw[i] = (cp >> 8) & 0xff;
+		}
+	}
+}
+
+void cedarv_yuv2rgb(const struct cedarv_yuv_frame *src, int src_x, int src_y, int src_w, int src_h,
+                    uint8_t *dst, int dst_pitch, int dst_w, int dst_h,
+                    enum cedarv_rgb_format format, enum cedarv_scale_filter filter,
+                    const struct cedarv_csc *csc)
+{
+	struct cedarv_csc default_csc;
+	struct yuv2rgb_job job;
+
+	if (src_x < 0)
+	{
+		src_w += src_x;
+		src_x = 0;
+	}
+	if (src_y < 0)
+	{
+		src_h += src_y;
+		src_y = 0;
+	}
+	if (src_x + src_w > src->width)
+		src_w = src->width - src_x;
+	if (src_y + src_h > src->height)
+		src_h = src->height - src_y;
+
+	if (src_w <= 0 || src_h <= 0 || dst_w <= 0 || dst_h <= 0)
+		return;
+
+	if (!csc)
+	{
+		cedarv_csc_default(&default_csc);
+		csc = &default_csc;
+	}
+
+	int *maps = malloc(6 * dst_w * sizeof(int));
+	if (!maps)
+		return;
+
+	job.src = src;
+	job.src_x = src_x;
+	job.src_y = src_y;
+	job.src_w = src_w;
+	job.src_h = src_h;
+	job.dst = dst;
+	job.dst_pitch = dst_pitch;
+	job.dst_w = dst_w;
+	job.dst_h = dst_h;
+	job.format = format;
+	job.filter = filter;
+	job.csc = csc;
+	job.chroma_shift = src->tiled || src->layout == CEDARV_YUV_NV12 || src->layout == CEDARV_YUV_I420;
+	job.lx0 = maps;
+	job.lx1 = maps + dst_w;
+	job.lw = maps + 2 * dst_w;
+	job.cx0 = maps + 3 * dst_w;
+	job.cx1 = maps + 4 * dst_w;
+	job.cw = maps + 5 * dst_w;
+
+	setup_maps(&job);
+
+	job.stripes = dst_h / MIN_STRIPE_ROWS;
+	if (job.stripes > 4 * threadpool_get_threads())
+		job.stripes = 4 * threadpool_get_threads();
+	if (job.stripes < 1)
+		job.stripes = 1;
+
+	threadpool_run(yuv2rgb_stripe, &job, job.stripes);
+
+	free(maps);
+}
@@ -0,0 +1,76 @@
+#ifndef _YUV2RGB_H_
+#define _YUV2RGB_H_
+
+#include <stdint.h>
+
+/*
+ * Single pass software conversion of decoded frames: detiling, scaling and
+ * colour space conversion are done line by line, so every source line is
+ * fetched from (uncached) VE memory once and nothing but a few lines of
+ * scratch memory is written besides the destination.
+ *
+ * RGB formats are named like the DRM fourccs, i.e. as little endian words:
+ * XRGB8888 is B, G, R, X in memory and RGB888 is B, G, R.
+ */
+enum cedarv_rgb_format
+{
+	CEDARV_RGB_RGB565,
+	CEDARV_RGB_RGB888,
+	CEDARV_RGB_XRGB8888,
+	CEDARV_RGB_Y8,
+};
+
+enum cedarv_scale_filter
+{
+	CEDARV_SCALE_BOX,
+	CEDARV_SCALE_BILINEAR,
+};
+
+/* 3x4 matrix applied to (Y, Cb, Cr, 1) in 8 bit units, coefficients are 12 bit fixed point */
+struct cedarv_csc
+{
+	int32_t m[3][4];
+};
+
+enum cedarv_yuv_layout
+{
+	/* y and interleaved CbCr in uv, 4:2:0 */
+	CEDARV_YUV_NV12,
+	/* y, Cb in uv and Cr in v, both with pitch_uv, 4:2:0 */
+	CEDARV_YUV_I420,
+	/* packed 4:2:2 in y, uv and v are unused */
+	CEDARV_YUV_YUYV,
+	CEDARV_YUV_UYVY,
+};
+
+/* source frame, pitches are ignored for tiled (MB32) frames, which are always NV12 */
+struct cedarv_yuv_frame
+{
+	const uint8_t *y;
+	const uint8_t *uv;
+	const uint8_t *v;
+	int pitch_y;
+	int pitch_uv;
+	int width;
+	int height;
+	int tiled;
+	enum cedarv_yuv_layout layout;
+};
+
+/* BT.601 limited range */
+void cedarv_csc_default(struct cedarv_csc *csc);
+
+/* from a VDPAU style matrix which works on 0.0 .. 1.0 values */
+void cedarv_csc_from_matrix(struct cedarv_csc *csc, const float matrix[3][4]);
+
+/*
+ * Converts the src_w x src_h rectangle at src_x, src_y of the frame to
+ * dst_w x dst_h pixels. csc may be NULL for the default matrix and is not
+ * used for CEDARV_RGB_Y8, which copies plain luma.
+ */
+void cedarv_yuv2rgb(const struct cedarv_yuv_frame *src, int src_x, int src_y, int src_w, int src_h,
+                    uint8_t *dst, int dst_pitch, int dst_w, int dst_h,
+                    enum cedarv_rgb_format format, enum cedarv_scale_filter filter,
+                    const struct cedarv_csc *csc);
+
+#endif